@@ -1,14 +1,16 @@
-# Find ffmpeg/libav libraries (libavcodec, libavformat and libavutil)
+# Find ffmpeg/libav libraries (libavcodec, libavformat, libavutil, libswscale and libswresample)
 # Once done this will define
 #
-#  LIBAV_FOUND             - system has libavcodec, libavformat, libavutil
+#  LIBAV_FOUND             - system has libavcodec, libavformat, libavutil, libswscale, libswresample
 #  LIBAV_INCLUDE_DIR       - libav include directories
-#  LIBAV_LIBRARIES         - libav libraries (libavcodec, libavformat, libavutil)
+#  LIBAV_LIBRARIES         - libav libraries (libavcodec, libavformat, libavutil, libswscale, libswresample)
 #
 #  LIBAVCODEC_LIBRARY      - libavcodec library
 #  LIBAVCODEC_INCLUDE_DIR  - libavcodec include directory
 #  LIBAVFORMAT_LIBRARY     - libavformat library
 #  LIBAVUTIL_LIBRARY       - libavutil library
+#  LIBSWSCALE_LIBRARY      - libswscale library
+#  LIBSWRESAMPLE_LIBRARY   - libswresample library
 #
 #  Copyright (c) 2008 Andreas Schneider <mail@cynapses.org>
 #  Modified for other libraries by Lasse Kärkkäinen <tronic>
@@ -38,6 +40,12 @@ if(PKG_CONFIG_FOUND)
     if(NOT LIBAVUTIL_LIBRARY)
         pkg_check_modules(_LIBAV_AVUTIL libavutil)
     endif()
+    if(NOT LIBSWSCALE_LIBRARY)
+        pkg_check_modules(_LIBAV_SWSCALE libswscale)
+    endif()
+    if(NOT LIBSWRESAMPLE_LIBRARY)
+        pkg_check_modules(_LIBAV_SWRESAMPLE libswresample)
+    endif()
 endif(PKG_CONFIG_FOUND)
 
 find_path(LIBAVCODEC_INCLUDE_DIR
@@ -71,10 +79,26 @@ find_library(LIBAVUTIL_LIBRARY
         /opt/local/lib /sw/lib            #macports & fink
         )
 
+find_library(LIBSWSCALE_LIBRARY
+        NAMES swscale
+        PATHS ${_LIBAV_SWSCALE_LIBRARY_DIRS}    #pkg-config
+        /usr/lib /usr/local/lib           #system level
+        /opt/local/lib /sw/lib            #macports & fink
+        )
+
+find_library(LIBSWRESAMPLE_LIBRARY
+        NAMES swresample
+        PATHS ${_LIBAV_SWRESAMPLE_LIBRARY_DIRS} #pkg-config
+        /usr/lib /usr/local/lib           #system level
+        /opt/local/lib /sw/lib            #macports & fink
+        )
+
 find_package_handle_standard_args(LIBAV DEFAULT_MSG LIBAVCODEC_LIBRARY
         LIBAVCODEC_INCLUDE_DIR
         LIBAVFORMAT_LIBRARY
         LIBAVUTIL_LIBRARY
+        LIBSWSCALE_LIBRARY
+        LIBSWRESAMPLE_LIBRARY
         )
 set(LIBAV_INCLUDE_DIR ${LIBAVCODEC_INCLUDE_DIR}
         #TODO: add other include paths
@@ -82,6 +106,8 @@ set(LIBAV_INCLUDE_DIR ${LIBAVCODEC_INCLUDE_DIR}
 set(LIBAV_LIBRARIES ${LIBAVCODEC_LIBRARY}
         ${LIBAVFORMAT_LIBRARY}
         ${LIBAVUTIL_LIBRARY}
+        ${LIBSWSCALE_LIBRARY}
+        ${LIBSWRESAMPLE_LIBRARY}
         )
 
 mark_as_advanced(LIBAV_INCLUDE_DIR
@@ -89,4 +115,6 @@ mark_as_advanced(LIBAV_INCLUDE_DIR
         LIBAVCODEC_LIBRARY
         LIBAVCODEC_INCLUDE_DIR
         LIBAVFORMAT_LIBRARY
-        LIBAVUTIL_LIBRARY)
+        LIBAVUTIL_LIBRARY
+        LIBSWSCALE_LIBRARY
+        LIBSWRESAMPLE_LIBRARY)
@@ -0,0 +1,462 @@
+#ifndef LEARN_LIBAV_ASYNC_IO_H
+#define LEARN_LIBAV_ASYNC_IO_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "queue.h"
+
+// large, page aligned buffers: few big writes instead of one per avio flush
+#define ASYNC_IO_BUFFER_SIZE (4 * 1024 * 1024)
+#define ASYNC_IO_BUFFER_ALIGN 4096
+#define ASYNC_IO_NB_BUFFERS 8
+#define ASYNC_IO_NB_THREADS 2
+#define ASYNC_IO_AVIO_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    int64_t writes;
+    int64_t bytes;
+    // requests submitted but not completed yet
+    int64_t max_queue_depth;
+    int64_t max_bytes_in_flight;
+    // the muxer had to wait for a buffer: the disk is the bottleneck
+    int64_t buffer_stalls;
+    int64_t buffer_stall_ns;
+    // seeks that had to wait for every in-flight write
+    int64_t barriers;
+} AsyncWriteStats;
+
+// totals of every writer closed so far in this process
+AsyncWriteStats &async_write_totals() {
+    static AsyncWriteStats totals = {};
+    return totals;
+}
+
+std::mutex &async_write_totals_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+typedef struct {
+    uint8_t *data;
+    int index;
+    // file offset of data[0], bytes filled and bytes already on disk
+    int64_t offset;
+    size_t size;
+    size_t done;
+} WriteBuffer;
+
+/*
+ * Write-behind output behind a custom AVIOContext. Muxer writes are copied
+ * into large aligned buffers, full buffers are written at their file offset
+ * through io_uring (HAVE_LIBURING) or by a small pool of pwrite() threads,
+ * so the encode loop only blocks when every buffer is in flight.
+ *
+ * Seeks are write barriers: the pending buffer is submitted and every
+ * in-flight write completes before the muxer continues at the new offset,
+ * which keeps the MP4 moov/mdat size rewrites ordered after the data they
+ * patch. Reading back is not supported, movflags=faststart needs avio_open.
+ */
+class AsyncFileWriter : public CustomIO {
+public:
+    ~AsyncFileWriter() override {
+        finish();
+        if (!use_uring) {
+            pending.close();
+            for (auto &t : workers) {
+                t.join();
+            }
+        }
+#ifdef HAVE_LIBURING
+        if (use_uring) {
+            io_uring_queue_exit(&ring);
+        }
+#endif
+        for (auto &b : buffers) {
+            free(b.data);
+        }
+
+        std::lock_guard<std::mutex> lock(async_write_totals_mutex());
+        AsyncWriteStats &totals = async_write_totals();
+        totals.writes += stats.writes;
+        totals.bytes += stats.bytes;
+        totals.max_queue_depth = std::max(totals.max_queue_depth, stats.max_queue_depth);
+        totals.max_bytes_in_flight = std::max(totals.max_bytes_in_flight, stats.max_bytes_in_flight);
+        totals.buffer_stalls += stats.buffer_stalls;
+        totals.buffer_stall_ns += stats.buffer_stall_ns;
+        totals.barriers += stats.barriers;
+    }
+
+    int open_file(const char *name) {
+        filename = name;
+        buffers.resize(ASYNC_IO_NB_BUFFERS);
+        for (int i = 0; i < ASYNC_IO_NB_BUFFERS; i++) {
+            buffers[i] = {};
+            buffers[i].index = i;
+            buffers[i].data = (uint8_t*) aligned_alloc(ASYNC_IO_BUFFER_ALIGN, ASYNC_IO_BUFFER_SIZE);
+            if (!buffers[i].data) {
+                return AVERROR(ENOMEM);
+            }
+        }
+
+        fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return AVERROR(errno);
+        }
+
+#ifdef HAVE_LIBURING
+        // io_uring may be missing or blocked (old kernel, seccomp), the threads always work
+        use_uring = io_uring_queue_init(ASYNC_IO_NB_BUFFERS, &ring, 0) == 0;
+        if (use_uring) {
+            struct iovec iovecs[ASYNC_IO_NB_BUFFERS];
+            for (int i = 0; i < ASYNC_IO_NB_BUFFERS; i++) {
+                iovecs[i].iov_base = buffers[i].data;
+                iovecs[i].iov_len = ASYNC_IO_BUFFER_SIZE;
+                free_buffers.push_back(&buffers[i]);
+            }
+            fixed_buffers = io_uring_register_buffers(&ring, iovecs, ASYNC_IO_NB_BUFFERS) == 0;
+            debug("async output %s: io_uring, %s buffers", name, fixed_buffers ? "registered" : "unregistered");
+            return 0;
+        }
+#endif
+        for (auto &b : buffers) {
+            idle.push(&b);
+        }
+        for (int i = 0; i < ASYNC_IO_NB_THREADS; i++) {
+            workers.emplace_back(&AsyncFileWriter::write_worker, this);
+        }
+        debug("async output %s: %d writer threads", name, ASYNC_IO_NB_THREADS);
+        return 0;
+    }
+
+    // writes the pending buffer, waits for every write and closes the file
+    int finish() override {
+        if (fd < 0) {
+            return error;
+        }
+        submit_current();
+        drain();
+        if (close(fd) < 0 && error == 0) {
+            error = AVERROR(errno);
+        }
+        fd = -1;
+        if (error < 0) {
+            logging("[ERROR] async write to %s failed: %s", filename.c_str(), av_err2string(error.load()).c_str());
+        }
+        return error;
+    }
+
+    int write(const uint8_t *buf, int buf_size) {
+        if (error < 0) {
+            return error;
+        }
+        if (fd < 0) {
+            return AVERROR(EBADF);
+        }
+        if (current && pos != current->offset + (int64_t) current->size) {
+            submit_current();
+        }
+
+        int left = buf_size;
+        while (left > 0) {
+            if (!current) {
+                current = acquire_buffer();
+                if (!current) {
+                    return error;
+                }
+                current->offset = pos;
+                current->size = 0;
+                current->done = 0;
+            }
+            size_t n = std::min<size_t>(left, ASYNC_IO_BUFFER_SIZE - current->size);
+            memcpy(current->data + current->size, buf, n);
+            current->size += n;
+            buf += n;
+            left -= n;
+            pos += n;
+            end = std::max(end, pos);
+            if (current->size == ASYNC_IO_BUFFER_SIZE) {
+                submit_current();
+            }
+        }
+        return error < 0 ? error.load() : buf_size;
+    }
+
+    int64_t seek(int64_t offset, int whence) {
+        switch (whence & ~AVSEEK_FORCE) {
+            case AVSEEK_SIZE:
+                return end;
+            case SEEK_SET:
+                break;
+            case SEEK_CUR:
+                offset += pos;
+                break;
+            case SEEK_END:
+                offset += end;
+                break;
+            default:
+                return AVERROR(EINVAL);
+        }
+        if (offset < 0) {
+            return AVERROR(EINVAL);
+        }
+        if (offset != pos) {
+            submit_current();
+            drain();
+            stats.barriers++;
+            pos = offset;
+        }
+        return error < 0 ? (int64_t) error.load() : pos;
+    }
+
+private:
+    void submit_current() {
+        if (!current) {
+            return;
+        }
+        WriteBuffer *b = current;
+        current = NULL;
+        if (b->size == 0) {
+            release_buffer(b);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight++;
+            bytes_in_flight += b->size;
+            stats.writes++;
+            stats.max_queue_depth = std::max(stats.max_queue_depth, in_flight);
+            stats.max_bytes_in_flight = std::max(stats.max_bytes_in_flight, bytes_in_flight);
+        }
+#ifdef HAVE_LIBURING
+        if (use_uring) {
+            uring_submit(b);
+            return;
+        }
+#endif
+        pending.push(b);
+    }
+
+    void complete(WriteBuffer *b, int rc) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (rc < 0 && error == 0) {
+                error = rc;
+            }
+            in_flight--;
+            bytes_in_flight -= b->size;
+            stats.bytes += b->done;
+        }
+        done.notify_all();
+        release_buffer(b);
+    }
+
+    WriteBuffer *acquire_buffer() {
+        WriteBuffer *b = NULL;
+#ifdef HAVE_LIBURING
+        if (use_uring) {
+            if (free_buffers.empty()) {
+                auto start = std::chrono::steady_clock::now();
+                while (free_buffers.empty() && uring_reap() == 0) {
+                }
+                stats.buffer_stalls++;
+                stats.buffer_stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            }
+            if (!free_buffers.empty()) {
+                b = free_buffers.back();
+                free_buffers.pop_back();
+            }
+            return b;
+        }
+#endif
+        QueueStats before = idle.get_stats();
+        if (!idle.pop(b)) {
+            return NULL;
+        }
+        QueueStats after = idle.get_stats();
+        stats.buffer_stalls += after.empty_stalls - before.empty_stalls;
+        stats.buffer_stall_ns += after.empty_stall_ns - before.empty_stall_ns;
+        return b;
+    }
+
+    void release_buffer(WriteBuffer *b) {
+#ifdef HAVE_LIBURING
+        if (use_uring) {
+            free_buffers.push_back(b);
+            return;
+        }
+#endif
+        idle.push(b);
+    }
+
+    // waits for every submitted write
+    void drain() {
+#ifdef HAVE_LIBURING
+        if (use_uring) {
+            while (in_flight > 0 && uring_reap() == 0) {
+            }
+            return;
+        }
+#endif
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return in_flight == 0; });
+    }
+
+    void write_worker() {
+        WriteBuffer *b = NULL;
+        while (pending.pop(b)) {
+            int rc = 0;
+            while (b->done < b->size) {
+                ssize_t n = pwrite(fd, b->data + b->done, b->size - b->done, b->offset + b->done);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    rc = n < 0 ? AVERROR(errno) : AVERROR(EIO);
+                    break;
+                }
+                b->done += n;
+            }
+            complete(b, rc);
+        }
+    }
+
+#ifdef HAVE_LIBURING
+    void uring_submit(WriteBuffer *b) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (!sqe) {
+            // one sqe per buffer, the ring can only run out if the kernel rounded its size down
+            uring_reap();
+            sqe = io_uring_get_sqe(&ring);
+        }
+        if (!sqe) {
+            complete(b, AVERROR(EBUSY));
+            return;
+        }
+        if (fixed_buffers) {
+            io_uring_prep_write_fixed(sqe, fd, b->data + b->done, b->size - b->done, b->offset + b->done, b->index);
+        } else {
+            io_uring_prep_write(sqe, fd, b->data + b->done, b->size - b->done, b->offset + b->done);
+        }
+        io_uring_sqe_set_data(sqe, b);
+        int rc = io_uring_submit(&ring);
+        if (rc < 0) {
+            complete(b, rc);
+        }
+    }
+
+    // waits for one completion, resubmitting the rest of a short write
+    int uring_reap() {
+        struct io_uring_cqe *cqe = NULL;
+        int rc = io_uring_wait_cqe(&ring, &cqe);
+        if (rc == -EINTR) {
+            return 0;
+        }
+        if (rc < 0) {
+            if (error == 0) {
+                error = rc;
+            }
+            return rc;
+        }
+        WriteBuffer *b = (WriteBuffer*) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        if (res > 0) {
+            b->done += res;
+            if (b->done < b->size) {
+                uring_submit(b);
+                return 0;
+            }
+            complete(b, 0);
+        } else {
+            complete(b, res < 0 ? res : AVERROR(EIO));
+        }
+        return 0;
+    }
+
+    struct io_uring ring;
+    bool fixed_buffers = false;
+    std::vector<WriteBuffer*> free_buffers;
+#endif
+
+    std::string filename;
+    int fd = -1;
+    std::vector<WriteBuffer> buffers;
+    WriteBuffer *current = NULL;
+    int64_t pos = 0;
+    int64_t end = 0;
+
+    bool use_uring = false;
+    BoundedQueue<WriteBuffer*> pending{ASYNC_IO_NB_BUFFERS};
+    BoundedQueue<WriteBuffer*> idle{ASYNC_IO_NB_BUFFERS};
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable done;
+    // first failed write, reported by every later write, seek and at close
+    std::atomic<int> error{0};
+    int64_t in_flight = 0;
+    int64_t bytes_in_flight = 0;
+    AsyncWriteStats stats = {};
+};
+
+int async_write_packet(void *opaque, uint8_t *buf, int buf_size) {
+    return ((AsyncFileWriter*) opaque)->write(buf, buf_size);
+}
+
+int64_t async_seek(void *opaque, int64_t offset, int whence) {
+    return ((AsyncFileWriter*) opaque)->seek(offset, whence);
+}
+
+// opens filename for writing through an AsyncFileWriter, the caller flags its context AVFMT_FLAG_CUSTOM_IO
+int open_async_output(const char *filename, AVIOContext **pb) {
+    AsyncFileWriter *writer = new AsyncFileWriter();
+    int rc = writer->open_file(filename);
+    if (rc < 0) {
+        logging("[ERROR] failed to open %s: %s", filename, av_err2string(rc).c_str());
+        delete writer;
+        return rc;
+    }
+
+    uint8_t *buffer = (uint8_t*) av_malloc(ASYNC_IO_AVIO_BUFFER_SIZE);
+    *pb = buffer ? avio_alloc_context(buffer, ASYNC_IO_AVIO_BUFFER_SIZE, 1, writer, NULL, async_write_packet, async_seek) : NULL;
+    if (!*pb) {
+        av_free(buffer);
+        delete writer;
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+void print_async_write_stats(AsyncWriteStats stats) {
+    logging("[INFO] async output: %lld writes, %.1f MB, max queue depth %lld, max %.1f MB in flight, "
+            "buffer stalls %lld (%.1f ms), seek barriers %lld",
+            stats.writes, stats.bytes / 1e6, stats.max_queue_depth, stats.max_bytes_in_flight / 1e6,
+            stats.buffer_stalls, stats.buffer_stall_ns / 1e6, stats.barriers);
+}
+
+#endif //LEARN_LIBAV_ASYNC_IO_H
@@ -0,0 +1,311 @@
+#ifndef LEARN_LIBAV_AUDIO_STAGE_H
+#define LEARN_LIBAV_AUDIO_STAGE_H
+
+#include <algorithm>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/audio_fifo.h>
+    #include <libavutil/buffer.h>
+    #include <libavutil/channel_layout.h>
+    #include <libavutil/samplefmt.h>
+    #include <libswresample/swresample.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+
+// frame size used for encoders that accept any, e.g. pcm
+#define AUDIO_STAGE_DEFAULT_FRAME_SIZE 1024
+// encoder frames the FIFO holds before it has to grow
+#define AUDIO_STAGE_FIFO_FRAMES 8
+// resampler output room allocated up front, enough for any common decoder frame
+#define AUDIO_STAGE_SCRATCH_SAMPLES 8192
+// audio encoders keep at most a frame or two queued
+#define AUDIO_STAGE_POOL_SIZE 4
+
+typedef struct {
+    int64_t frames_in;
+    int64_t frames_out;
+    int64_t samples_out;
+    // silence appended to the last frame for encoders that need whole frames
+    int64_t padded_samples;
+    int64_t ns;
+    bool resampled;
+} AudioStageStats;
+
+/*
+ * Sits between the audio decoder and encoder. Decoded frames of any size,
+ * sample format, rate and channel layout go in, frames of exactly the
+ * encoder's frame_size in its format come out.
+ *
+ * libswresample converts into a scratch buffer allocated once, the samples
+ * queue in an AVAudioFifo sized for several encoder frames and output
+ * frames are cut from it into buffers of an AVBufferPool, so steady state
+ * allocates nothing. Inputs already in the encoder's format skip the
+ * resampler. Timestamps count samples from the first input frame, or from
+ * the origin given to align() so a resumed run cuts the same frames.
+ *
+ * At EOF send NULL: the resampler's delayed samples are drained and the
+ * remainder comes out as one short frame, padded with silence when the
+ * encoder only takes full frames.
+ */
+class AudioStage {
+public:
+    ~AudioStage() {
+        swr_free(&swr);
+        if (fifo) {
+            av_audio_fifo_free(fifo);
+        }
+        av_freep(&scratch[0]);
+        av_buffer_pool_uninit(&pool);
+    }
+
+    int open(AVCodecContext *encoder_ctx) {
+        out_format = encoder_ctx->sample_fmt;
+        out_rate = encoder_ctx->sample_rate;
+        out_channels = encoder_ctx->channels;
+        out_layout = encoder_ctx->channel_layout ? encoder_ctx->channel_layout : av_get_default_channel_layout(out_channels);
+        out_time_base = encoder_ctx->time_base;
+        frame_size = encoder_ctx->frame_size > 0 ? encoder_ctx->frame_size : AUDIO_STAGE_DEFAULT_FRAME_SIZE;
+        int caps = encoder_ctx->codec->capabilities;
+        pad_last = !(caps & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE));
+        if (av_sample_fmt_is_planar(out_format) && out_channels > AV_NUM_DATA_POINTERS) {
+            logging("[ERROR] audio stage supports up to %d planar channels", AV_NUM_DATA_POINTERS);
+            return -1;
+        }
+
+        frame.reset(av_frame_alloc());
+        fifo = av_audio_fifo_alloc(out_format, out_channels, AUDIO_STAGE_FIFO_FRAMES * frame_size);
+        if (!frame || !fifo || grow_scratch(AUDIO_STAGE_SCRATCH_SAMPLES) < 0) {
+            return AVERROR(ENOMEM);
+        }
+        buffer_size = av_samples_get_buffer_size(NULL, out_channels, frame_size, out_format, 0);
+        pool = buffer_size > 0 ? av_buffer_pool_init(buffer_size, NULL) : NULL;
+        if (!pool || prime_buffer_pool(pool, AUDIO_STAGE_POOL_SIZE) < 0) {
+            return AVERROR(ENOMEM);
+        }
+        return 0;
+    }
+
+    // input timestamps are in time_base, NULL drains the stage
+    int send_frame(const AVFrame *input, AVRational time_base) {
+        int64_t start = metrics_now_ns();
+        int rc = 0;
+        if (!input) {
+            draining = true;
+            if (swr) {
+                rc = convert(NULL, 0);
+            }
+        } else {
+            if (next_pts == AV_NOPTS_VALUE) {
+                next_pts = input->pts != AV_NOPTS_VALUE ? av_rescale_q(input->pts, time_base, out_time_base) : 0;
+                start_on_grid();
+            }
+            if (!configured || input_changed(input)) {
+                rc = configure(input);
+            }
+            if (rc >= 0) {
+                rc = swr ? convert((const uint8_t**) input->extended_data, input->nb_samples)
+                         : write_fifo((void**) input->extended_data, input->nb_samples);
+            }
+            if (rc >= 0 && skip_samples > 0) {
+                int drained = std::min<int64_t>(skip_samples, av_audio_fifo_size(fifo));
+                av_audio_fifo_drain(fifo, drained);
+                skip_samples -= drained;
+            }
+            stats.frames_in++;
+        }
+        stats.ns += metrics_now_ns() - start;
+        return rc;
+    }
+
+    /*
+     * 0 and a frame that stays valid until the next call, AVERROR(EAGAIN)
+     * when a whole frame is not buffered yet, AVERROR_EOF once drained.
+     */
+    int receive_frame(AVFrame **output) {
+        int available = av_audio_fifo_size(fifo);
+        int nb_samples = frame_size;
+        if (available < frame_size) {
+            if (!draining) {
+                return AVERROR(EAGAIN);
+            }
+            if (available == 0) {
+                return AVERROR_EOF;
+            }
+            nb_samples = available;
+        }
+
+        int64_t start = metrics_now_ns();
+        av_frame_unref(frame.get());
+        frame->buf[0] = av_buffer_pool_get(pool);
+        if (!frame->buf[0]) {
+            return AVERROR(ENOMEM);
+        }
+        av_samples_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, out_channels, frame_size, out_format, 0);
+        if (av_audio_fifo_read(fifo, (void**) frame->data, nb_samples) < nb_samples) {
+            return AVERROR(EIO);
+        }
+        if (nb_samples < frame_size && pad_last) {
+            av_samples_set_silence(frame->data, nb_samples, frame_size - nb_samples, out_channels, out_format);
+            stats.padded_samples += frame_size - nb_samples;
+            nb_samples = frame_size;
+        }
+        frame->nb_samples = nb_samples;
+        frame->format = out_format;
+        frame->channels = out_channels;
+        frame->channel_layout = out_layout;
+        frame->sample_rate = out_rate;
+        frame->pts = next_pts;
+        next_pts += nb_samples;
+
+        stats.frames_out++;
+        stats.samples_out += nb_samples;
+        stats.ns += metrics_now_ns() - start;
+        *output = frame.get();
+        return 0;
+    }
+
+    /*
+     * Output frames start at origin plus a whole number of frames, in the
+     * encoder's time base; samples before the first such start are dropped.
+     * Call before the first frame.
+     */
+    void align(int64_t origin) {
+        align_origin = origin;
+    }
+
+    // timestamp of the first output frame, AV_NOPTS_VALUE before any input
+    int64_t origin() const {
+        return first_pts;
+    }
+
+    AudioStageStats get_stats() const {
+        return stats;
+    }
+
+private:
+    void start_on_grid() {
+        first_pts = next_pts;
+        if (align_origin == AV_NOPTS_VALUE) {
+            return;
+        }
+        // the first grid point at or after the first sample
+        int64_t behind = align_origin - next_pts;
+        int64_t frames = behind >= 0 ? -(behind / frame_size) : (-behind + frame_size - 1) / frame_size;
+        int64_t start = align_origin + frames * frame_size;
+        skip_samples = start - next_pts;
+        next_pts = start;
+        first_pts = align_origin;
+    }
+
+    static int64_t layout_of(const AVFrame *f) {
+        return f->channel_layout ? f->channel_layout : av_get_default_channel_layout(f->channels);
+    }
+
+    bool input_changed(const AVFrame *input) {
+        return input->format != in_format || input->sample_rate != in_rate || layout_of(input) != in_layout;
+    }
+
+    // a mid stream change keeps the samples already queued, the old resampler's delay is lost
+    int configure(const AVFrame *input) {
+        if (configured) {
+            logging("[INFO] audio input changed to %s %d Hz %d channels",
+                    av_get_sample_fmt_name((enum AVSampleFormat) input->format), input->sample_rate, input->channels);
+        }
+        in_format = input->format;
+        in_rate = input->sample_rate;
+        in_layout = layout_of(input);
+        configured = true;
+        if (in_format == out_format && in_rate == out_rate && in_layout == out_layout) {
+            swr_free(&swr);
+            return 0;
+        }
+
+        swr = swr_alloc_set_opts(swr, out_layout, out_format, out_rate,
+                                 in_layout, (enum AVSampleFormat) in_format, in_rate, 0, NULL);
+        int rc = swr ? swr_init(swr) : AVERROR(ENOMEM);
+        if (rc < 0) {
+            logging("[ERROR] failed to init the resampler: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        stats.resampled = true;
+        return 0;
+    }
+
+    int grow_scratch(int nb_samples) {
+        av_freep(&scratch[0]);
+        int rc = av_samples_alloc(scratch, NULL, out_channels, nb_samples, out_format, 0);
+        if (rc < 0) {
+            scratch_capacity = 0;
+            return rc;
+        }
+        scratch_capacity = nb_samples;
+        return 0;
+    }
+
+    // NULL input flushes the samples the resampler's filter still holds
+    int convert(const uint8_t **data, int nb_samples) {
+        int needed = swr_get_out_samples(swr, nb_samples);
+        if (needed > scratch_capacity) {
+            debug("growing resampler output to %d samples", needed);
+            if (grow_scratch(needed) < 0) {
+                return AVERROR(ENOMEM);
+            }
+        }
+        int converted = swr_convert(swr, scratch, scratch_capacity, data, nb_samples);
+        if (converted < 0) {
+            logging("[ERROR] failed to resample audio: %s", av_err2string(converted).c_str());
+            return converted;
+        }
+        return write_fifo((void**) scratch, converted);
+    }
+
+    int write_fifo(void **data, int nb_samples) {
+        if (nb_samples > 0 && av_audio_fifo_write(fifo, data, nb_samples) < nb_samples) {
+            return AVERROR(ENOMEM);
+        }
+        return 0;
+    }
+
+    enum AVSampleFormat out_format = AV_SAMPLE_FMT_NONE;
+    int out_rate = 0;
+    int out_channels = 0;
+    int64_t out_layout = 0;
+    AVRational out_time_base = {1, 1};
+    int frame_size = 0;
+    bool pad_last = false;
+
+    bool configured = false;
+    int in_format = AV_SAMPLE_FMT_NONE;
+    int in_rate = 0;
+    int64_t in_layout = 0;
+
+    SwrContext *swr = NULL;
+    AVAudioFifo *fifo = NULL;
+    uint8_t *scratch[AV_NUM_DATA_POINTERS] = {};
+    int scratch_capacity = 0;
+    AVBufferPool *pool = NULL;
+    int buffer_size = 0;
+    FramePtr frame;
+    int64_t next_pts = AV_NOPTS_VALUE;
+    int64_t first_pts = AV_NOPTS_VALUE;
+    int64_t align_origin = AV_NOPTS_VALUE;
+    // input samples still to drop to reach the grid
+    int64_t skip_samples = 0;
+    bool draining = false;
+    AudioStageStats stats = {};
+};
+
+void print_audio_stage_stats(const char *name, AudioStageStats stats) {
+    logging("[INFO] %s: %lld audio frames in, %lld frames (%lld samples, %lld padded) out%s, %.3f ms per frame",
+            name, (long long) stats.frames_in, (long long) stats.frames_out, (long long) stats.samples_out,
+            (long long) stats.padded_samples, stats.resampled ? " resampled" : "",
+            stats.frames_in ? stats.ns / 1e6 / stats.frames_in : 0.0);
+}
+
+#endif //LEARN_LIBAV_AUDIO_STAGE_H
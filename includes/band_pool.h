@@ -0,0 +1,104 @@
+#ifndef LEARN_LIBAV_BAND_POOL_H
+#define LEARN_LIBAV_BAND_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define BAND_MAX_THREADS 8
+// bands smaller than this cost more in synchronisation than they save
+#define BAND_MIN_HEIGHT 64
+
+// bands a frame of height rows is cut into on at most threads threads
+int band_count(int threads, int height) {
+    return std::max(1, std::min({threads, BAND_MAX_THREADS, height / BAND_MIN_HEIGHT}));
+}
+
+/*
+ * Persistent worker threads for a frame cut into horizontal bands, shared
+ * by the scaler and the quality measurement. run() wakes one worker per
+ * band from the second on, works on the first band itself and returns once
+ * every band is done, so the job may use per frame state set up by the
+ * caller without further locking. The threads sleep between frames.
+ */
+class BandPool {
+public:
+    BandPool() = default;
+    BandPool(const BandPool &) = delete;
+    BandPool &operator=(const BandPool &) = delete;
+
+    ~BandPool() {
+        stop();
+    }
+
+    void start(int nb_bands, std::function<void(int)> band_job) {
+        job = std::move(band_job);
+        for (int i = 1; i < nb_bands; i++) {
+            workers.emplace_back(&BandPool::worker, this, i);
+        }
+    }
+
+    void run() {
+        if (!workers.empty()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                pending = workers.size();
+                generation++;
+            }
+            start_cv.notify_all();
+        }
+        job(0);
+        if (!workers.empty()) {
+            std::unique_lock<std::mutex> guard(lock);
+            done_cv.wait(guard, [this] { return pending == 0; });
+        }
+    }
+
+    // joins the workers, call before freeing what the job uses
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        start_cv.notify_all();
+        for (auto &t : workers) {
+            t.join();
+        }
+        workers.clear();
+    }
+
+private:
+    void worker(int index) {
+        int64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                start_cv.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            job(index);
+            std::lock_guard<std::mutex> guard(lock);
+            if (--pending == 0) {
+                done_cv.notify_one();
+            }
+        }
+    }
+
+    std::function<void(int)> job;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    int64_t generation = 0;
+    int pending = 0;
+    bool stopping = false;
+};
+
+#endif //LEARN_LIBAV_BAND_POOL_H
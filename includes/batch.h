@@ -0,0 +1,130 @@
+#ifndef LEARN_LIBAV_BATCH_H
+#define LEARN_LIBAV_BATCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+#include "presets.h"
+#include "streaming.h"
+#include "transcode.h"
+
+/*
+ * Batch mode: a manifest lists one job per line as
+ *
+ *     <input> <output> <preset>
+ *
+ * separated by whitespace, blank lines and lines starting with '#' are
+ * ignored. Jobs run in-process on a pool of worker threads, one job per
+ * worker at a time.
+ */
+typedef struct {
+    int line;
+    std::string input;
+    std::string output;
+    std::string preset;
+    TranscodeStats stats;
+    int rc;
+} BatchJob;
+
+int read_manifest(const char *path, std::vector<BatchJob> &jobs) {
+    std::ifstream manifest(path);
+    if (!manifest) {
+        logging("[ERROR] failed to open manifest %s", path);
+        return -1;
+    }
+
+    std::string line;
+    int line_number = 0;
+    while (std::getline(manifest, line)) {
+        line_number++;
+        std::istringstream fields(line);
+        BatchJob job = {};
+        job.line = line_number;
+        if (!(fields >> job.input) || job.input[0] == '#') {
+            continue;
+        }
+        if (!(fields >> job.output >> job.preset)) {
+            logging("[ERROR] %s:%d: expected <input> <output> <preset>", path, line_number);
+            return -1;
+        }
+        jobs.push_back(job);
+    }
+    return 0;
+}
+
+void run_batch_job(BatchJob *job, bool use_pipeline, const PresetOverrides &overrides) {
+    StreamingParams sp;
+    if (find_preset(job->preset.c_str(), &sp)) {
+        job->rc = -1;
+        return;
+    }
+    apply_overrides(overrides, &sp);
+    job->rc = transcode_file(job->input.c_str(), job->output.c_str(), sp, use_pipeline, &job->stats);
+}
+
+// every job gets the same overrides on top of its own preset
+int run_batch(const char *manifest, int nb_workers, bool use_pipeline, const PresetOverrides &overrides) {
+    std::vector<BatchJob> jobs;
+    if (read_manifest(manifest, jobs)) {
+        return -1;
+    }
+    if (jobs.empty()) {
+        logging("[INFO] manifest %s has no jobs", manifest);
+        return 0;
+    }
+
+    if (nb_workers <= 0) {
+        nb_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    nb_workers = std::min<int>(nb_workers, jobs.size());
+    logging("[INFO] running %d jobs on %d workers", (int) jobs.size(), nb_workers);
+    thread_budget().set_jobs(nb_workers);
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> next_job{0};
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nb_workers; i++) {
+        workers.emplace_back([&] {
+            size_t index;
+            while ((index = next_job++) < jobs.size()) {
+                BatchJob *job = &jobs[index];
+                run_batch_job(job, use_pipeline, overrides);
+                if (job->rc) {
+                    logging("[ERROR] job %s:%d failed: %s -> %s (%s)",
+                            manifest, job->line, job->input.c_str(), job->output.c_str(), job->preset.c_str());
+                } else {
+                    print_transcode_stats(job->output.c_str(), job->stats);
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    TranscodeStats total = {};
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int failed = 0;
+    for (auto &job : jobs) {
+        if (job.rc) {
+            failed++;
+            continue;
+        }
+        total.frames += job.stats.frames;
+        total.input_bytes += job.stats.input_bytes;
+        total.output_bytes += job.stats.output_bytes;
+    }
+
+    logging("[INFO] batch finished: %d succeeded, %d failed", (int) jobs.size() - failed, failed);
+    print_transcode_stats("batch total", total);
+    return failed ? -1 : 0;
+}
+
+#endif //LEARN_LIBAV_BATCH_H
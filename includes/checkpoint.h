@@ -0,0 +1,450 @@
+#ifndef LEARN_LIBAV_CHECKPOINT_H
+#define LEARN_LIBAV_CHECKPOINT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+}
+
+#include "audio_stage.h"
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "metrics.h"
+#include "packet_index.h"
+
+#define CHECKPOINT_MAGIC "learn-libav-checkpoint"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_SUFFIX ".ckpt"
+// media time between checkpoints, each one waits for the next video keyframe
+#define CHECKPOINT_INTERVAL_DEFAULT 10.0
+// decoding starts this far before the resume point so the audio encoder is warm when its packets are kept
+#define CHECKPOINT_PREROLL_US 1000000
+
+typedef struct {
+    bool enabled;
+    double interval_seconds;
+} CheckpointOptions;
+
+CheckpointOptions &checkpoint_options() {
+    static CheckpointOptions options = {false, CHECKPOINT_INTERVAL_DEFAULT};
+    return options;
+}
+
+typedef struct {
+    int64_t checkpoints;
+    // time spent flushing the muxer and writing checkpoint files
+    int64_t ns;
+    int64_t committed_bytes;
+    bool resumed;
+    double resumed_seconds;
+    // decoded video frames before the resume point
+    int64_t skipped_frames;
+    // packets produced again that the output already had
+    int64_t skipped_packets;
+} CheckpointStats;
+
+// what a run needs to continue the output after the last checkpoint
+typedef struct {
+    int64_t source_size;
+    int64_t source_mtime_ns;
+    // output bytes written before the keyframe
+    int64_t bytes;
+    // pts of the video keyframe the output continues with, in the output stream's time base
+    int64_t video_pts;
+    int64_t video_packets;
+    // the shift applied to every output timestamp, in AV_TIME_BASE
+    int64_t ts_offset;
+    // first audio stage timestamp, AV_NOPTS_VALUE for copied audio
+    int64_t audio_origin;
+    std::vector<int> codec_ids;
+    // last dts written per output stream
+    std::vector<int64_t> last_dts;
+} CheckpointState;
+
+std::string checkpoint_path(const char *output) {
+    return std::string(output) + CHECKPOINT_SUFFIX;
+}
+
+int store_checkpoint(const std::string &path, const CheckpointState &state) {
+    std::ostringstream out;
+    out << CHECKPOINT_MAGIC << " " << CHECKPOINT_VERSION << "\n";
+    out << "source " << state.source_size << " " << state.source_mtime_ns << "\n";
+    out << "output " << state.bytes << " " << state.video_pts << " " << state.video_packets << " "
+        << state.ts_offset << " " << state.audio_origin << " " << state.last_dts.size() << "\n";
+    for (size_t i = 0; i < state.last_dts.size(); i++) {
+        out << "stream " << i << " " << state.codec_ids[i] << " " << state.last_dts[i] << "\n";
+    }
+    std::string text = out.str();
+    return write_file_atomic(path, text.data(), text.size());
+}
+
+// 0 when the file holds a checkpoint, -1 when it is missing or unreadable
+int load_checkpoint(const std::string &path, CheckpointState *state) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return -1;
+    }
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        text.append(buf, n);
+    }
+    fclose(f);
+
+    std::istringstream in(text);
+    std::string word;
+    int version = 0;
+    size_t nb_streams = 0;
+    if (!(in >> word) || word != CHECKPOINT_MAGIC || !(in >> version) || version != CHECKPOINT_VERSION ||
+        !(in >> word >> state->source_size >> state->source_mtime_ns) || word != "source" ||
+        !(in >> word >> state->bytes >> state->video_pts >> state->video_packets >> state->ts_offset
+              >> state->audio_origin >> nb_streams) || word != "output") {
+        return -1;
+    }
+    state->codec_ids.assign(nb_streams, AV_CODEC_ID_NONE);
+    state->last_dts.assign(nb_streams, AV_NOPTS_VALUE);
+    for (size_t i = 0; i < nb_streams; i++) {
+        size_t index;
+        if (!(in >> word >> index >> state->codec_ids[i] >> state->last_dts[i]) || word != "stream" || index != i) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * GOP granular checkpoints of a long transcode. Every interval of media
+ * time, at the next video keyframe packet and before it is muxed, the
+ * muxer's interleaving queue and buffered PES payloads are flushed, so
+ * everything handed to it so far is in the file; the byte count, the
+ * keyframe's pts and the last dts of every stream go to <output>.ckpt.
+ *
+ * A run that finds a checkpoint for the same source truncates the output
+ * to the committed bytes and appends. The input is seeked to a keyframe
+ * a little before the resume point: decoded video before the keyframe is
+ * dropped so the fresh encoder starts a GOP exactly where the old one did,
+ * the audio stage cuts frames on the first run's grid and packets the
+ * output already has are dropped by dts. The encoder's own keyframe
+ * numbering restarts there as it did in the first run, so both outputs
+ * carry the same timestamps.
+ *
+ * Only MPEG-TS can be cut and continued like this, other containers write
+ * an index or header at the end and are left without checkpoints.
+ */
+class Checkpointer {
+public:
+    /*
+     * Before the output is opened. 0 and the output's pb is set up when
+     * resuming, 1 when the format can not be checkpointed.
+     */
+    int open(const char *input, const char *output, AVFormatContext *output_avfc, int video_index,
+             bool encoded_video, AudioStage *audio) {
+        if (strcmp(output_avfc->oformat->name, "mpegts") != 0) {
+            logging("[WARN] checkpoints need an MPEG-TS output, %s is written without", output);
+            return 1;
+        }
+        avfc = output_avfc;
+        video = video_index;
+        audio_stage = audio;
+        path = checkpoint_path(output);
+        gated.assign(avfc->nb_streams, true);
+        gated[video] = !encoded_video;
+        last_dts.assign(avfc->nb_streams, AV_NOPTS_VALUE);
+        resume_dts.assign(avfc->nb_streams, AV_NOPTS_VALUE);
+        if (source_identity(input, &current.source_size, &current.source_mtime_ns) < 0) {
+            logging("[ERROR] failed to stat %s", input);
+            return -1;
+        }
+        for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+            current.codec_ids.push_back(avfc->streams[i]->codecpar->codec_id);
+        }
+        current.ts_offset = 0;
+        current.audio_origin = AV_NOPTS_VALUE;
+
+        // the first packets' shift is decided here and kept in the checkpoint, not by the muxer
+        avfc->avoid_negative_ts = AVFMT_AVOID_NEG_TS_DISABLED;
+
+        CheckpointState saved;
+        if (load_checkpoint(path, &saved) < 0) {
+            return 0;
+        }
+        if (!resumable(output, saved)) {
+            remove(path.c_str());
+            return 0;
+        }
+        return resume(output, saved);
+    }
+
+    // after the output header, seeks the input to a keyframe before the resume point
+    int seek_input(AVFormatContext *input, int input_video_index) {
+        if (!stats.resumed) {
+            return 0;
+        }
+        AVRational video_tb = avfc->streams[video]->time_base;
+        int64_t target = av_rescale_q(current.video_pts, video_tb, AV_TIME_BASE_Q);
+        for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+            if (gated[i] && resume_dts[i] != AV_NOPTS_VALUE) {
+                target = std::min(target, av_rescale_q(resume_dts[i], avfc->streams[i]->time_base, AV_TIME_BASE_Q));
+            }
+        }
+        target -= CHECKPOINT_PREROLL_US;
+        AVRational input_tb = input->streams[input_video_index]->time_base;
+        int rc = av_seek_frame(input, input_video_index, av_rescale_q(target, AV_TIME_BASE_Q, input_tb), AVSEEK_FLAG_BACKWARD);
+        if (rc < 0) {
+            logging("[ERROR] failed to seek the input to resume: %s", av_err2string(rc).c_str());
+            return -1;
+        }
+        stats.resumed_seconds = current.video_pts * av_q2d(video_tb);
+        logging("[INFO] resuming %s at %.3fs after %lld bytes", avfc->url, stats.resumed_seconds, (long long) current.bytes);
+        return 0;
+    }
+
+    // true for decoded video the output already has, pts in time_base
+    bool before_resume(int64_t pts, AVRational time_base) {
+        if (!stats.resumed || pts == AV_NOPTS_VALUE ||
+            av_rescale_q(pts, time_base, avfc->streams[video]->time_base) >= current.video_pts) {
+            return false;
+        }
+        stats.skipped_frames++;
+        return true;
+    }
+
+    int write(AVPacket *pkt) {
+        int i = pkt->stream_index;
+        if (gated[i] && resume_dts[i] != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE && pkt->dts <= resume_dts[i]) {
+            stats.skipped_packets++;
+            av_packet_unref(pkt);
+            return 0;
+        }
+        AVStream *st = avfc->streams[i];
+        if (!shift_decided && pkt->dts != AV_NOPTS_VALUE) {
+            // what the muxer's avoid_negative_ts would do, kept so a resumed run shifts the same
+            shift_decided = true;
+            if (pkt->dts < 0) {
+                current.ts_offset = av_rescale_q_rnd(-pkt->dts, st->time_base, AV_TIME_BASE_Q, AV_ROUND_UP);
+                avfc->output_ts_offset = current.ts_offset;
+            }
+        }
+        if (i == video && (pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE) {
+            if (next_pts == AV_NOPTS_VALUE) {
+                next_pts = pkt->pts + interval(st->time_base);
+            } else if (pkt->pts >= next_pts && commit(pkt->pts) < 0) {
+                return -1;
+            }
+        }
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            last_dts[i] = pkt->dts;
+        }
+        if (i == video) {
+            video_packets++;
+        }
+        return metrics_write_frame(avfc, pkt);
+    }
+
+    // after the trailer, the output is complete and needs no checkpoint
+    void finish() {
+        if (remove(path.c_str()) < 0 && errno != ENOENT) {
+            logging("[WARN] failed to remove %s", path.c_str());
+        }
+    }
+
+    // video packets of the output before the resume point
+    int64_t committed_video_packets() const {
+        return stats.resumed ? current.video_packets : 0;
+    }
+
+    CheckpointStats get_stats() const {
+        return stats;
+    }
+
+private:
+    static int64_t interval(AVRational time_base) {
+        return av_rescale_q((int64_t) (checkpoint_options().interval_seconds * AV_TIME_BASE), AV_TIME_BASE_Q, time_base);
+    }
+
+    bool resumable(const char *output, const CheckpointState &saved) {
+        int64_t size, mtime_ns;
+        if (saved.source_size != current.source_size || saved.source_mtime_ns != current.source_mtime_ns) {
+            logging("[WARN] %s is from another source, starting over", path.c_str());
+            return false;
+        }
+        if (saved.codec_ids != current.codec_ids) {
+            logging("[WARN] %s is from other output streams, starting over", path.c_str());
+            return false;
+        }
+        if (source_identity(output, &size, &mtime_ns) < 0 || size < saved.bytes) {
+            logging("[WARN] %s is shorter than its checkpoint, starting over", output);
+            return false;
+        }
+        return true;
+    }
+
+    int resume(const char *output, const CheckpointState &saved) {
+        if (truncate(output, saved.bytes) < 0) {
+            logging("[ERROR] failed to truncate %s to %lld bytes", output, (long long) saved.bytes);
+            return -1;
+        }
+        AVDictionary *options = NULL;
+        av_dict_set(&options, "truncate", "0", 0);
+        int rc = avio_open2(&avfc->pb, output, AVIO_FLAG_WRITE, NULL, &options);
+        av_dict_free(&options);
+        if (rc >= 0) {
+            rc = avio_seek(avfc->pb, saved.bytes, SEEK_SET);
+        }
+        if (rc < 0) {
+            logging("[ERROR] failed to reopen %s: %s", output, av_err2string(rc).c_str());
+            return -1;
+        }
+        // continuity counters restart, players are told so instead of seeing lost packets
+        av_opt_set(avfc->priv_data, "mpegts_flags", "+initial_discontinuity", 0);
+
+        current = saved;
+        resume_dts = saved.last_dts;
+        last_dts = saved.last_dts;
+        video_packets = saved.video_packets;
+        avfc->output_ts_offset = saved.ts_offset;
+        shift_decided = true;
+        if (audio_stage && saved.audio_origin != AV_NOPTS_VALUE) {
+            audio_stage->align(saved.audio_origin);
+        }
+        stats.resumed = true;
+        stats.committed_bytes = saved.bytes;
+        return 0;
+    }
+
+    int commit(int64_t pts) {
+        int64_t start = metrics_now_ns();
+        // the interleaving queue, then the payloads the TS muxer buffers per stream
+        int rc = av_interleaved_write_frame(avfc, NULL);
+        if (rc >= 0) {
+            rc = av_write_frame(avfc, NULL);
+        }
+        if (rc < 0) {
+            logging("[ERROR] failed to flush the muxer for a checkpoint: %s", av_err2string(rc).c_str());
+            return -1;
+        }
+        avio_flush(avfc->pb);
+        if (avfc->pb->error < 0) {
+            logging("[ERROR] failed to write %s: %s", avfc->url, av_err2string(avfc->pb->error).c_str());
+            return -1;
+        }
+        current.bytes = avio_tell(avfc->pb);
+        current.video_pts = pts;
+        current.video_packets = video_packets;
+        current.last_dts = last_dts;
+        if (audio_stage) {
+            current.audio_origin = audio_stage->origin();
+        }
+        if (store_checkpoint(path, current) < 0) {
+            return -1;
+        }
+        next_pts = pts + interval(avfc->streams[video]->time_base);
+        stats.checkpoints++;
+        stats.committed_bytes = current.bytes;
+        stats.ns += metrics_now_ns() - start;
+        debug("checkpoint at pts %lld, %lld bytes", (long long) pts, (long long) current.bytes);
+        return 0;
+    }
+
+    AVFormatContext *avfc = NULL;
+    int video = 0;
+    AudioStage *audio_stage = NULL;
+    std::string path;
+    CheckpointState current = {};
+    // streams whose packets are dropped up to resume_dts, all but encoded video
+    std::vector<bool> gated;
+    std::vector<int64_t> resume_dts;
+    std::vector<int64_t> last_dts;
+    int64_t video_packets = 0;
+    // a resumed run checkpoints on the same keyframes as the first one
+    int64_t next_pts = AV_NOPTS_VALUE;
+    bool shift_decided = false;
+    CheckpointStats stats = {};
+};
+
+int checkpoint_packet_sink(void *opaque, AVPacket *pkt) {
+    return ((Checkpointer*) opaque)->write(pkt);
+}
+
+void print_checkpoint_stats(const char *name, CheckpointStats stats) {
+    if (stats.resumed) {
+        logging("[INFO] %s: resumed at %.3fs, skipped %lld decoded frames and %lld packets already written",
+                name, stats.resumed_seconds, (long long) stats.skipped_frames, (long long) stats.skipped_packets);
+    }
+    logging("[INFO] %s: %lld checkpoints, %lld bytes committed, %.3f ms per checkpoint",
+            name, (long long) stats.checkpoints, (long long) stats.committed_bytes,
+            stats.checkpoints ? stats.ns / 1e6 / stats.checkpoints : 0.0);
+}
+
+// pts and dts of every packet per stream, in file order
+int read_timestamps(const char *filename, std::vector<std::vector<std::pair<int64_t, int64_t>>> *streams) {
+    AVFormatContext *raw = NULL;
+    if (avformat_open_input(&raw, filename, NULL, NULL) < 0) {
+        logging("[ERROR] could not open %s", filename);
+        return -1;
+    }
+    FormatContextPtr avfc(raw);
+    if (avformat_find_stream_info(avfc.get(), NULL) < 0) {
+        logging("[ERROR] could not get the stream info of %s", filename);
+        return -1;
+    }
+    streams->assign(avfc->nb_streams, {});
+    PacketPtr pkt(av_packet_alloc());
+    if (!pkt) {
+        return AVERROR(ENOMEM);
+    }
+    while (av_read_frame(avfc.get(), pkt.get()) >= 0) {
+        (*streams)[pkt->stream_index].push_back({pkt->pts, pkt->dts});
+        av_packet_unref(pkt.get());
+    }
+    return 0;
+}
+
+/*
+ * Compares the packet timestamps of two files stream by stream, e.g. a
+ * resumed output and an uninterrupted one. 0 when they are the same.
+ */
+int compare_timestamps(const char *a, const char *b) {
+    std::vector<std::vector<std::pair<int64_t, int64_t>>> ta, tb;
+    if (read_timestamps(a, &ta) < 0 || read_timestamps(b, &tb) < 0) {
+        return -1;
+    }
+    if (ta.size() != tb.size()) {
+        logging("[ERROR] %s has %zu streams, %s has %zu", a, ta.size(), b, tb.size());
+        return -1;
+    }
+    int64_t packets = 0;
+    for (size_t s = 0; s < ta.size(); s++) {
+        size_t n = std::min(ta[s].size(), tb[s].size());
+        for (size_t i = 0; i < n; i++) {
+            if (ta[s][i] != tb[s][i]) {
+                logging("[ERROR] stream %zu packet %zu: pts/dts %lld/%lld in %s, %lld/%lld in %s", s, i,
+                        (long long) ta[s][i].first, (long long) ta[s][i].second, a,
+                        (long long) tb[s][i].first, (long long) tb[s][i].second, b);
+                return -1;
+            }
+        }
+        if (ta[s].size() != tb[s].size()) {
+            logging("[ERROR] stream %zu has %zu packets in %s, %zu in %s", s, ta[s].size(), a, tb[s].size(), b);
+            return -1;
+        }
+        packets += n;
+    }
+    logging("[INFO] timestamps match: %lld packets in %zu streams", (long long) packets, ta.size());
+    return 0;
+}
+
+#endif //LEARN_LIBAV_CHECKPOINT_H
@@ -0,0 +1,492 @@
+#ifndef LEARN_LIBAV_CHUNKED_H
+#define LEARN_LIBAV_CHUNKED_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "handles.h"
+#include "log.h"
+#include "packet_index.h"
+#include "pool.h"
+#include "streaming.h"
+
+// intermediate container for the encoded chunks, it accepts every codec the presets produce
+#define CHUNK_FORMAT "matroska"
+
+/*
+ * GOP parallel transcoding: the input is split at video keyframes into
+ * chunks that are decoded and encoded by independent workers, each with its
+ * own StreamingContext. The encoded chunks are then stitched into the final
+ * output together with the audio, which is cheap enough to handle serially.
+ */
+typedef struct {
+    int index;
+    // first keyframe of the chunk, in the source video stream time base
+    int64_t start_pts;
+    // first keyframe of the next chunk, AV_NOPTS_VALUE for the last chunk
+    int64_t end_pts;
+    std::string filename;
+    int64_t frames;
+    int rc;
+    // dts of the chunk file's first packet, derived when the demuxer leaves it unset, in the file's time base
+    int64_t first_dts;
+    // the chunk encoder's decode delay, start_pts minus first_dts, in AV_TIME_BASE
+    int64_t dts_delay;
+} Chunk;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// demux only pass collecting the pts of every video keyframe, <filename>.idx spares the pass
+int scan_keyframes(const char *filename, std::vector<int64_t> &keyframes) {
+    debug("calling scan_keyframes");
+    std::unique_ptr<PacketIndex> index = load_packet_index(filename);
+    if (index && index->best_video_stream() >= 0) {
+        keyframes = index->keyframes(index->best_video_stream());
+        debug("found %d keyframes in the index", (int) keyframes.size());
+        return keyframes.empty() ? -1 : 0;
+    }
+
+    FormatContextPtr avfc;
+    if (open_media(filename, avfc)) {
+        return -1;
+    }
+
+    int video_index = av_find_best_stream(avfc.get(), AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (video_index < 0) {
+        logging("[ERROR] %s has no video stream", filename);
+        return -1;
+    }
+    for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+        if ((int) i != video_index) {
+            avfc->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    PooledPacket packet(packet_pool().acquire());
+    while (av_read_frame(avfc.get(), packet.get()) >= 0) {
+        if (packet->stream_index == video_index && (packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE) {
+            keyframes.push_back(packet->pts);
+        }
+        av_packet_unref(packet.get());
+    }
+
+    std::sort(keyframes.begin(), keyframes.end());
+    keyframes.erase(std::unique(keyframes.begin(), keyframes.end()), keyframes.end());
+    debug("found %d keyframes", (int) keyframes.size());
+    return keyframes.empty() ? -1 : 0;
+}
+
+// picks the keyframes closest to evenly spaced split points
+std::vector<Chunk> plan_chunks(const std::vector<int64_t> &keyframes, int nb_chunks, const std::string &output) {
+    std::vector<int64_t> starts;
+    starts.push_back(keyframes.front());
+
+    int64_t first = keyframes.front();
+    int64_t last = keyframes.back();
+    for (int i = 1; i < nb_chunks; i++) {
+        int64_t target = first + (last - first) * i / nb_chunks;
+        auto it = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+        if (it != keyframes.begin() && (it == keyframes.end() || target - *(it - 1) < *it - target)) {
+            --it;
+        }
+        if (it != keyframes.end() && *it > starts.back()) {
+            starts.push_back(*it);
+        }
+    }
+
+    std::vector<Chunk> chunks;
+    for (size_t i = 0; i < starts.size(); i++) {
+        Chunk chunk = {};
+        chunk.index = i;
+        chunk.start_pts = starts[i];
+        chunk.end_pts = i + 1 < starts.size() ? starts[i + 1] : AV_NOPTS_VALUE;
+        chunk.filename = output + ".chunk" + std::to_string(i) + ".mkv";
+        chunks.push_back(chunk);
+    }
+    return chunks;
+}
+
+int encode_chunk_frames(StreamingContext *decoder, StreamingContext *encoder, Chunk *chunk, AVPacket *packet, AVFrame *frame) {
+    int rc = avcodec_send_packet(decoder->video_avcc.get(), packet);
+    if (rc < 0) {
+        logging("[ERROR] Error while sending packet to decoder: %s", av_err2string(rc).c_str());
+        return rc;
+    }
+
+    while (true) {
+        rc = avcodec_receive_frame(decoder->video_avcc.get(), frame);
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            return 0;
+        } else if (rc < 0) {
+            logging("[ERROR] Error while receiving frame from decoder: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+
+        // frames that belong to the neighbouring chunks are decoded only as references
+        int64_t pts = frame->best_effort_timestamp;
+        bool inside = pts >= chunk->start_pts && (chunk->end_pts == AV_NOPTS_VALUE || pts < chunk->end_pts);
+        if (inside) {
+            frame->pts = pts;
+            if (encode_video(decoder, encoder, frame)) {
+                av_frame_unref(frame);
+                return -1;
+            }
+            chunk->frames++;
+        }
+        av_frame_unref(frame);
+    }
+}
+
+int encode_chunk(const char *input, Chunk *chunk, StreamingParams sp, const PacketIndex *index) {
+    debug("encoding chunk %d: pts [%lld, %lld)", chunk->index, chunk->start_pts, chunk->end_pts);
+    StreamingContext decoder;
+    decoder.filename = (char*) input;
+    if (open_media(input, decoder.avfc) || prepare_decoder(&decoder)) {
+        return -1;
+    }
+
+    StreamingContext encoder;
+    encoder.filename = (char*) chunk->filename.c_str();
+    AVFormatContext *output_format_context = NULL;
+    avformat_alloc_output_context2(&output_format_context, NULL, CHUNK_FORMAT, encoder.filename);
+    encoder.avfc.reset(output_format_context);
+    if (!encoder.avfc) {
+        logging("[ERROR] could not allocate memory for chunk output format");
+        return -1;
+    }
+
+    AVRational input_framerate = av_guess_frame_rate(decoder.avfc.get(), decoder.video_avs, NULL);
+    if (prepare_video_encoder(&encoder, decoder.video_avcc.get(), input_framerate, sp)) {
+        return -1;
+    }
+
+    // muxer options are meant for the final output, not for the intermediate chunks
+    StreamingParams chunk_sp = sp;
+    chunk_sp.muxer_opt_key = NULL;
+    chunk_sp.muxer_opt_value = NULL;
+    if (open_output(&encoder, chunk_sp)) {
+        return -1;
+    }
+
+    int rc = index ? index_seek(decoder.avfc.get(), index, decoder.video_index, chunk->start_pts)
+                   : av_seek_frame(decoder.avfc.get(), decoder.video_index, chunk->start_pts, AVSEEK_FLAG_BACKWARD);
+    if (rc < 0) {
+        logging("[ERROR] failed to seek to chunk %d: %s", chunk->index, av_err2string(rc).c_str());
+        return -1;
+    }
+
+    PooledPacket packet(packet_pool().acquire());
+    PooledFrame frame(frame_pool().acquire());
+    bool reached_end = false;
+    while (av_read_frame(decoder.avfc.get(), packet.get()) >= 0) {
+        if (packet->stream_index != decoder.video_index) {
+            av_packet_unref(packet.get());
+            continue;
+        }
+        // the next chunk's keyframe is still decoded, leading frames of an open GOP may need it
+        if (chunk->end_pts != AV_NOPTS_VALUE && packet->pts != AV_NOPTS_VALUE && packet->pts >= chunk->end_pts) {
+            if (reached_end) {
+                av_packet_unref(packet.get());
+                break;
+            }
+            reached_end = true;
+        }
+        rc = encode_chunk_frames(&decoder, &encoder, chunk, packet.get(), frame.get());
+        av_packet_unref(packet.get());
+        if (rc < 0) {
+            return -1;
+        }
+    }
+
+    if (encode_chunk_frames(&decoder, &encoder, chunk, NULL, frame.get()) < 0) {
+        return -1;
+    }
+    if (encode_video(&decoder, &encoder, NULL)) {
+        return -1;
+    }
+    av_write_trailer(encoder.avfc.get());
+    debug("finished chunk %d: %lld frames", chunk->index, chunk->frames);
+    return 0;
+}
+
+// how the dts of one chunk file's packets map onto the stitched video
+typedef struct {
+    // added to every dts of the chunk, in its time base
+    int64_t shift;
+    // the dts a packet without one gets
+    int64_t next_dts;
+    // frame duration for packets without one, in the chunk's time base
+    int64_t duration;
+} ChunkTiming;
+
+int64_t chunk_frame_duration(AVStream *st, AVRational frame_rate) {
+    return frame_rate.num > 0 ? std::max<int64_t>(1, av_rescale_q(1, av_inv_q(frame_rate), st->time_base)) : 1;
+}
+
+/*
+ * Matroska stores no dts, the demuxer derives it from the buffered pts and
+ * leaves the first packets of a stream with B-frames without one. Those
+ * packets are spaced a frame apart before the first known dts.
+ */
+int probe_chunk_delay(Chunk *chunk, AVRational source_tb, AVRational frame_rate) {
+    FormatContextPtr avfc;
+    if (open_media(chunk->filename.c_str(), avfc)) {
+        return -1;
+    }
+    AVStream *st = avfc->streams[0];
+    int64_t duration = chunk_frame_duration(st, frame_rate);
+    PooledPacket pkt(packet_pool().acquire());
+    int64_t leading = 0;
+    while (av_read_frame(avfc.get(), pkt.get()) >= 0) {
+        int64_t dts = pkt->dts;
+        int64_t packet_duration = pkt->duration > 0 ? pkt->duration : duration;
+        av_packet_unref(pkt.get());
+        if (dts != AV_NOPTS_VALUE) {
+            chunk->first_dts = dts - leading * packet_duration;
+            chunk->dts_delay = av_rescale_q(chunk->start_pts, source_tb, AV_TIME_BASE_Q) -
+                               av_rescale_q(chunk->first_dts, st->time_base, AV_TIME_BASE_Q);
+            debug("chunk %d: first dts %lld, decode delay %lld us", chunk->index, chunk->first_dts, chunk->dts_delay);
+            return 0;
+        }
+        leading++;
+    }
+    logging("[ERROR] chunk %d has no timestamps", chunk->index);
+    return -1;
+}
+
+void start_chunk_timing(const Chunk &chunk, AVStream *st, int64_t max_delay, AVRational frame_rate, ChunkTiming *timing) {
+    timing->shift = -av_rescale_q(max_delay - chunk.dts_delay, AV_TIME_BASE_Q, st->time_base);
+    timing->next_dts = chunk.first_dts;
+    timing->duration = chunk_frame_duration(st, frame_rate);
+}
+
+// reads the next video packet with its stitched dts, moving on to the following chunk file at EOF
+bool read_chunk_packet(std::vector<Chunk> &chunks, size_t *current, FormatContextPtr &chunk_input, int64_t max_delay,
+                       AVRational frame_rate, ChunkTiming *timing, AVPacket *pkt) {
+    while (true) {
+        if (av_read_frame(chunk_input.get(), pkt) >= 0) {
+            if (pkt->pts == AV_NOPTS_VALUE && pkt->dts == AV_NOPTS_VALUE) {
+                logging("[WARN] skipping a packet without timestamps in chunk %d", chunks[*current].index);
+                av_packet_unref(pkt);
+                continue;
+            }
+            if (pkt->dts == AV_NOPTS_VALUE) {
+                pkt->dts = timing->next_dts;
+            }
+            timing->next_dts = pkt->dts + (pkt->duration > 0 ? pkt->duration : timing->duration);
+            pkt->dts += timing->shift;
+            return true;
+        }
+        if (++*current >= chunks.size()) {
+            return false;
+        }
+        chunk_input.reset();
+        if (open_media(chunks[*current].filename.c_str(), chunk_input)) {
+            return false;
+        }
+        start_chunk_timing(chunks[*current], chunk_input->streams[0], max_delay, frame_rate, timing);
+    }
+}
+
+bool read_audio_packet(StreamingContext *decoder, AVPacket *pkt) {
+    while (av_read_frame(decoder->avfc.get(), pkt) >= 0) {
+        if (pkt->stream_index == decoder->audio_index) {
+            return true;
+        }
+        av_packet_unref(pkt);
+    }
+    return false;
+}
+
+/*
+ * Chunk encoders may settle on different decode delays, so every chunk's
+ * dts are moved to the largest one: dts only move earlier, never past
+ * their pts, and the first dts of a chunk stays after the last dts of the
+ * one before. Presentation timestamps are kept as encoded; a dts that
+ * still does not increase is an error rather than being nudged.
+ */
+int stitch_chunks(const char *input, const char *output, std::vector<Chunk> &chunks, StreamingParams sp) {
+    debug("calling stitch_chunks");
+    StreamingContext decoder;
+    decoder.filename = (char*) input;
+    if (open_media(input, decoder.avfc) || prepare_decoder(&decoder)) {
+        return -1;
+    }
+    AVRational frame_rate = av_guess_frame_rate(decoder.avfc.get(), decoder.video_avs, NULL);
+    int64_t max_delay = 0;
+    for (auto &chunk : chunks) {
+        if (probe_chunk_delay(&chunk, decoder.video_avs->time_base, frame_rate)) {
+            return -1;
+        }
+        max_delay = std::max(max_delay, chunk.dts_delay);
+    }
+    // video comes from the chunk files, only the audio is read from the source
+    if (decoder.video_avs) {
+        decoder.video_avs->discard = AVDISCARD_ALL;
+    }
+
+    size_t current = 0;
+    FormatContextPtr chunk_input;
+    if (open_media(chunks[current].filename.c_str(), chunk_input)) {
+        return -1;
+    }
+
+    StreamingContext encoder;
+    encoder.filename = (char*) output;
+    if (alloc_output(&encoder)) {
+        return -1;
+    }
+    prepare_copy(encoder.avfc.get(), &encoder.video_avs, chunk_input->streams[0]->codecpar);
+    if (decoder.audio_avs) {
+        if (!sp.copy_audio) {
+            if (prepare_audio_encoder(&encoder, decoder.audio_avcc->sample_rate, sp)) {
+                return -1;
+            }
+        } else {
+            prepare_copy(encoder.avfc.get(), &encoder.audio_avs, decoder.audio_avs->codecpar);
+        }
+    }
+    if (open_output(&encoder, sp)) {
+        return -1;
+    }
+
+    PooledPacket video(packet_pool().acquire());
+    PooledPacket audio(packet_pool().acquire());
+    PooledFrame frame(frame_pool().acquire());
+    ChunkTiming timing;
+    start_chunk_timing(chunks[current], chunk_input->streams[0], max_delay, frame_rate, &timing);
+    bool have_video = read_chunk_packet(chunks, &current, chunk_input, max_delay, frame_rate, &timing, video.get());
+    bool have_audio = decoder.audio_avs && read_audio_packet(&decoder, audio.get());
+    int64_t last_dts = AV_NOPTS_VALUE;
+
+    while (have_video || have_audio) {
+        AVRational chunk_tb = chunk_input->streams[0]->time_base;
+        // audio without timestamps goes out as soon as it is read
+        int64_t audio_ts = have_audio ? (audio->dts != AV_NOPTS_VALUE ? audio->dts : audio->pts) : AV_NOPTS_VALUE;
+        bool take_video = have_video && (!have_audio || (audio_ts != AV_NOPTS_VALUE &&
+            av_compare_ts(video->dts, chunk_tb, audio_ts, decoder.audio_avs->time_base) <= 0));
+
+        if (take_video) {
+            video->stream_index = encoder.video_avs->index;
+            video->pos = -1;
+            av_packet_rescale_ts(video.get(), chunk_tb, encoder.video_avs->time_base);
+            if (last_dts != AV_NOPTS_VALUE && video->dts <= last_dts) {
+                logging("[ERROR] stitched video dts %lld does not increase after %lld in chunk %d",
+                        video->dts, last_dts, chunks[current].index);
+                return -1;
+            }
+            last_dts = video->dts;
+            if (write_packet(&encoder, video.get()) < 0) {
+                logging("[ERROR] failed to write stitched video packet");
+                return -1;
+            }
+            have_video = read_chunk_packet(chunks, &current, chunk_input, max_delay, frame_rate, &timing, video.get());
+        } else {
+            if (!sp.copy_audio) {
+                if (transcode_audio(&decoder, &encoder, audio.get(), frame.get())) {
+                    return -1;
+                }
+                av_packet_unref(audio.get());
+            } else {
+                audio->stream_index = encoder.audio_avs->index;
+                av_packet_rescale_ts(audio.get(), decoder.audio_avs->time_base, encoder.audio_avs->time_base);
+                if (write_packet(&encoder, audio.get()) < 0) {
+                    logging("[ERROR] error while copying stream packet");
+                    return -1;
+                }
+            }
+            have_audio = read_audio_packet(&decoder, audio.get());
+        }
+    }
+
+    if (!sp.copy_audio && decoder.audio_avs) {
+        if (transcode_audio(&decoder, &encoder, NULL, frame.get()) || encode_audio(&decoder, &encoder, NULL)) {
+            return -1;
+        }
+    }
+
+    av_write_trailer(encoder.avfc.get());
+    return 0;
+}
+
+int transcode_chunked(const char *input, const char *output, StreamingParams sp, int nb_chunks) {
+    if (sp.copy_video) {
+        logging("[ERROR] chunked mode re-encodes the video, it can not be combined with copy_video");
+        return -1;
+    }
+    if (sp.measure_quality) {
+        // every chunk would be measured on its own, into a temporary file's report
+        logging("[WARN] quality is not measured in chunked mode");
+        sp.measure_quality = 0;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int64_t> keyframes;
+    if (scan_keyframes(input, keyframes)) {
+        logging("[ERROR] failed to find keyframes in %s", input);
+        return -1;
+    }
+    std::vector<Chunk> chunks = plan_chunks(keyframes, nb_chunks, output);
+    double scan_seconds = seconds_since(start);
+    // shared read-only by the workers for their initial seek
+    std::unique_ptr<PacketIndex> packet_index = load_packet_index(input);
+
+    int nb_workers = std::min<int>(chunks.size(), std::max(1u, std::thread::hardware_concurrency()));
+    logging("[INFO] transcoding %s in %d chunks on %d workers", input, (int) chunks.size(), nb_workers);
+    thread_budget().set_jobs(nb_workers);
+
+    start = std::chrono::steady_clock::now();
+    std::atomic<size_t> next_chunk{0};
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nb_workers; i++) {
+        workers.emplace_back([&] {
+            size_t index;
+            while ((index = next_chunk++) < chunks.size()) {
+                chunks[index].rc = encode_chunk(input, &chunks[index], sp, packet_index.get());
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    double encode_seconds = seconds_since(start);
+    thread_budget().set_jobs(1);
+
+    int rc = 0;
+    int64_t frames = 0;
+    for (auto &chunk : chunks) {
+        if (chunk.rc) {
+            logging("[ERROR] chunk %d failed", chunk.index);
+            rc = -1;
+        }
+        frames += chunk.frames;
+    }
+
+    start = std::chrono::steady_clock::now();
+    if (rc == 0) {
+        rc = stitch_chunks(input, output, chunks, sp);
+    }
+    double stitch_seconds = seconds_since(start);
+
+    for (auto &chunk : chunks) {
+        remove(chunk.filename.c_str());
+    }
+
+    logging("[INFO] chunked transcode: %lld frames, scan %.2fs, encode %.2fs (%.1f fps), stitch %.2fs",
+            frames, scan_seconds, encode_seconds, encode_seconds > 0 ? frames / encode_seconds : 0.0, stitch_seconds);
+    return rc;
+}
+
+#endif //LEARN_LIBAV_CHUNKED_H
@@ -0,0 +1,161 @@
+#ifndef LEARN_LIBAV_DEDUP_H
+#define LEARN_LIBAV_DEDUP_H
+
+#include <algorithm>
+
+extern "C" {
+    #include <libavutil/frame.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+}
+
+#include "handles.h"
+#include "log.h"
+#include "metrics.h"
+#include "scaler.h"
+#include "scene_detect.h"
+
+// mean absolute difference per pixel every block may have for a frame to count as a repeat
+#define DEDUP_THRESHOLD_DEFAULT 1.0
+// blocks compared one by one, a moving cursor must not vanish in a whole plane average
+#define DEDUP_BLOCK_SIZE 32
+
+typedef struct {
+    int64_t frames;
+    int64_t dropped;
+    // repeats at the end of the input, the last one is encoded so the video lasts as long as before
+    int64_t tail_frames;
+    int64_t ns;
+    // frames that went to the encoder and the time spent encoding them
+    int64_t encoded;
+    int64_t encode_ns;
+    const char *kernel;
+} DedupStats;
+
+/*
+ * Drops decoded video frames that repeat the last frame kept, before they
+ * are scaled or encoded. Screen recordings and slideshows hold the same
+ * picture for seconds; the encoder would spend a frame's worth of work on
+ * each copy to produce skip blocks.
+ *
+ * Every plane is compared in 32x32 blocks with the SAD kernel of
+ * scene_detect.h and a frame is a repeat only when no block differs by
+ * more than threshold per pixel on average, 0 asks for identical frames.
+ * Comparing against the last kept frame rather than the previous one lets
+ * slow fades through. Kept frames keep their timestamps, so the last kept
+ * frame is shown until the next one and audio stays in sync; at the end of
+ * the input the last dropped frame is encoded after all, so the video does
+ * not end early. Frames the scene detector turned into keyframes are never
+ * dropped.
+ */
+class FrameDeduplicator {
+public:
+    void open(double max_difference) {
+        threshold = max_difference;
+        stats.kernel = sad_kernel().name;
+        last_kept.reset(av_frame_alloc());
+        last_dropped.reset(av_frame_alloc());
+    }
+
+    // true when the frame repeats the last kept one and should not be encoded, keep forces false
+    bool duplicate(const AVFrame *frame, bool keep) {
+        if (flushing) {
+            return false;
+        }
+        int64_t start = metrics_now_ns();
+        stats.frames++;
+        bool repeat = !keep && last_kept->data[0] && comparable(frame) && planes_match(frame, last_kept.get());
+        av_frame_unref(repeat ? last_dropped.get() : last_kept.get());
+        if (av_frame_ref(repeat ? last_dropped.get() : last_kept.get(), frame) < 0) {
+            repeat = false;
+        }
+        if (repeat) {
+            stats.dropped++;
+        } else {
+            av_frame_unref(last_dropped.get());
+        }
+        stats.ns += metrics_now_ns() - start;
+        return repeat;
+    }
+
+    // the last dropped frame when the input ended on repeats, owned by the caller; NULL otherwise
+    AVFrame *take_tail() {
+        if (!last_dropped || !last_dropped->data[0]) {
+            return NULL;
+        }
+        stats.dropped--;
+        stats.tail_frames++;
+        flushing = true;
+        return last_dropped.release();
+    }
+
+    // frames is 0 for the encoder's drain at the end
+    void add_encode_ns(int64_t ns, int frames) {
+        stats.encoded += frames;
+        stats.encode_ns += ns;
+    }
+
+    DedupStats get_stats() const {
+        return stats;
+    }
+
+private:
+    // 8 bit planes only, anything else is always encoded
+    bool comparable(const AVFrame *frame) {
+        if (frame->width != last_kept->width || frame->height != last_kept->height || frame->format != last_kept->format) {
+            return false;
+        }
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) frame->format);
+        bool ok = desc && !(desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM));
+        for (int c = 0; ok && c < desc->nb_components; c++) {
+            ok = desc->comp[c].depth == 8;
+        }
+        if (!ok && !warned) {
+            logging("[WARN] duplicate frames are only detected in 8 bit formats, %s frames are all encoded",
+                    av_get_pix_fmt_name((enum AVPixelFormat) frame->format));
+            warned = true;
+        }
+        return ok;
+    }
+
+    bool planes_match(const AVFrame *a, const AVFrame *b) {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) a->format);
+        sad_plane_fn sad = sad_kernel().sad;
+        int nb_planes = av_pix_fmt_count_planes((enum AVPixelFormat) a->format);
+        for (int p = 0; p < nb_planes; p++) {
+            int bytes = av_image_get_linesize((enum AVPixelFormat) a->format, a->width, p);
+            int rows = plane_rows(desc, p, a->height);
+            for (int y = 0; y < rows; y += DEDUP_BLOCK_SIZE) {
+                int h = std::min(DEDUP_BLOCK_SIZE, rows - y);
+                const uint8_t *ra = a->data[p] + (int64_t) y * a->linesize[p];
+                const uint8_t *rb = b->data[p] + (int64_t) y * b->linesize[p];
+                for (int x = 0; x < bytes; x += DEDUP_BLOCK_SIZE) {
+                    int w = std::min(DEDUP_BLOCK_SIZE, bytes - x);
+                    if (sad(ra + x, a->linesize[p], rb + x, b->linesize[p], w, h, 1) > threshold * w * h) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    double threshold = DEDUP_THRESHOLD_DEFAULT;
+    FramePtr last_kept;
+    FramePtr last_dropped;
+    bool warned = false;
+    // the tail frame passes through
+    bool flushing = false;
+    DedupStats stats = {};
+};
+
+void print_dedup_stats(const char *name, DedupStats stats) {
+    double encode_ms = stats.encoded ? stats.encode_ns / 1e6 / stats.encoded : 0.0;
+    logging("[INFO] %s: dropped %lld of %lld video frames as repeats (%lld kept to end the video), "
+            "about %.2fs of encoding saved at %.3f ms per encoded frame, %.3f ms per frame comparing (%s)",
+            name, (long long) stats.dropped, (long long) stats.frames, (long long) stats.tail_frames,
+            stats.dropped * encode_ms / 1e3, encode_ms, stats.frames ? stats.ns / 1e6 / stats.frames : 0.0,
+            stats.kernel);
+}
+
+#endif //LEARN_LIBAV_DEDUP_H
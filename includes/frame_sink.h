@@ -0,0 +1,549 @@
+#ifndef LEARN_LIBAV_FRAME_SINK_H
+#define LEARN_LIBAV_FRAME_SINK_H
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+    #include <libswscale/swscale.h>
+}
+
+#include "async_io.h"
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "queue.h"
+
+// frames waiting for an image encoder, a slow pool makes the decoder wait
+#define IMAGE_QUEUE_SIZE 16
+#define RAW_INDEX_MAGIC "LAVRAWI1"
+
+enum FrameDumpFormat {
+    FRAME_DUMP_NONE,
+    // one P5 file per frame, the luma plane only
+    FRAME_DUMP_PGM,
+    // one YUV4MPEG2 stream, any format is converted to the nearest planar YUV
+    FRAME_DUMP_Y4M,
+    // planes packed back to back in the frame's own format, located by <file>.idx
+    FRAME_DUMP_RAW,
+};
+
+enum ImageFormat {
+    IMAGE_NONE,
+    IMAGE_JPEG,
+    IMAGE_PNG,
+};
+
+typedef struct {
+    enum FrameDumpFormat dump;
+    std::string filename;
+    // y4m header rate, the decoder's framerate when known
+    AVRational frame_rate;
+    enum ImageFormat images;
+    // every Nth frame becomes an image
+    int image_every;
+    int image_workers;
+    std::string image_prefix;
+} FrameSinkOptions;
+
+// one per frame in <file>.idx after the 8 byte magic, little endian like the host
+typedef struct {
+    int64_t offset;
+    int64_t size;
+    int64_t pts;
+    int32_t width;
+    int32_t height;
+    int32_t format;
+    int32_t reserved;
+} RawFrameIndexEntry;
+
+typedef struct {
+    int64_t frames;
+    int64_t bytes;
+    int64_t converted;
+    int64_t images;
+    // time the decoding thread spent inside FrameSink::write
+    int64_t write_ns;
+} FrameSinkStats;
+
+int parse_frame_dump_format(const char *name, enum FrameDumpFormat *dump) {
+    if (strcmp(name, "y4m") == 0) {
+        *dump = FRAME_DUMP_Y4M;
+    } else if (strcmp(name, "raw") == 0) {
+        *dump = FRAME_DUMP_RAW;
+    } else if (strcmp(name, "pgm") == 0) {
+        *dump = FRAME_DUMP_PGM;
+    } else {
+        logging("[ERROR] unknown dump format %s, expected y4m, raw or pgm", name);
+        return -1;
+    }
+    return 0;
+}
+
+int parse_image_format(const char *name, enum ImageFormat *images) {
+    if (strcmp(name, "jpeg") == 0 || strcmp(name, "jpg") == 0) {
+        *images = IMAGE_JPEG;
+    } else if (strcmp(name, "png") == 0) {
+        *images = IMAGE_PNG;
+    } else {
+        logging("[ERROR] unknown image format %s, expected jpeg or png", name);
+        return -1;
+    }
+    return 0;
+}
+
+// the y4m colourspace tag of a planar YUV format, NULL when it needs converting first
+const char *y4m_colourspace(enum AVPixelFormat format) {
+    switch (format) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+            return "420jpeg";
+        case AV_PIX_FMT_YUV422P:
+        case AV_PIX_FMT_YUVJ422P:
+            return "422";
+        case AV_PIX_FMT_YUV444P:
+        case AV_PIX_FMT_YUVJ444P:
+            return "444";
+        case AV_PIX_FMT_GRAY8:
+            return "mono";
+        case AV_PIX_FMT_YUV420P10LE:
+            return "420p10";
+        case AV_PIX_FMT_YUV422P10LE:
+            return "422p10";
+        case AV_PIX_FMT_YUV444P10LE:
+            return "444p10";
+        default:
+            return NULL;
+    }
+}
+
+// NV12, P010, RGB and friends go to the planar YUV format with the same subsampling and depth class
+enum AVPixelFormat y4m_target_format(enum AVPixelFormat format) {
+    if (y4m_colourspace(format)) {
+        return format;
+    }
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (!desc) {
+        return AV_PIX_FMT_YUV420P;
+    }
+    bool deep = desc->comp[0].depth > 8;
+    if (desc->nb_components == 1) {
+        return AV_PIX_FMT_GRAY8;
+    }
+    if ((desc->flags & AV_PIX_FMT_FLAG_RGB) || desc->log2_chroma_w == 0) {
+        return deep ? AV_PIX_FMT_YUV444P10LE : AV_PIX_FMT_YUV444P;
+    }
+    if (desc->log2_chroma_h == 0) {
+        return deep ? AV_PIX_FMT_YUV422P10LE : AV_PIX_FMT_YUV422P;
+    }
+    return deep ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P;
+}
+
+/*
+ * Encodes every image_every-th frame to <prefix>-N.jpg or .png on a pool
+ * of threads. submit() only takes a reference to the decoded frame, the
+ * conversion, the encode and the file write happen on the workers, each
+ * with its own encoder and scaler.
+ */
+class ImageEncoderPool {
+public:
+    typedef struct {
+        int64_t number;
+        AVFrame *frame;
+    } Task;
+
+    ImageEncoderPool(enum ImageFormat format, const std::string &prefix, int nb_workers)
+            : format(format), prefix(prefix), tasks(IMAGE_QUEUE_SIZE) {
+        for (int i = 0; i < nb_workers; i++) {
+            workers.emplace_back(&ImageEncoderPool::work, this);
+        }
+    }
+
+    ~ImageEncoderPool() {
+        finish();
+        Task task;
+        while (tasks.pop(task)) {
+            av_frame_free(&task.frame);
+        }
+    }
+
+    int submit(AVFrame *frame, int64_t number) {
+        AVFrame *ref = av_frame_clone(frame);
+        if (!ref) {
+            return AVERROR(ENOMEM);
+        }
+        if (!tasks.push({number, ref})) {
+            av_frame_free(&ref);
+            return -1;
+        }
+        return 0;
+    }
+
+    // encodes what is queued and stops the workers
+    void finish() {
+        tasks.close();
+        for (auto &t : workers) {
+            t.join();
+        }
+        workers.clear();
+    }
+
+    int64_t get_encoded() {
+        return encoded;
+    }
+
+private:
+    void work() {
+        CodecContextPtr avcc;
+        struct SwsContext *sws = NULL;
+        FramePtr converted(av_frame_alloc());
+        PacketPtr packet(av_packet_alloc());
+        Task task;
+        while (tasks.pop(task)) {
+            FramePtr frame(task.frame);
+            if (!converted || !packet) {
+                continue;
+            }
+            if (!avcc || avcc->width != frame->width || avcc->height != frame->height) {
+                avcc.reset(open_encoder(frame.get()));
+                if (!avcc) {
+                    continue;
+                }
+                av_frame_unref(converted.get());
+                converted->format = avcc->pix_fmt;
+                converted->width = avcc->width;
+                converted->height = avcc->height;
+                if (av_frame_get_buffer(converted.get(), 0) < 0) {
+                    avcc.reset();
+                    continue;
+                }
+            }
+
+            sws = sws_getCachedContext(sws, frame->width, frame->height, (enum AVPixelFormat) frame->format,
+                                       avcc->width, avcc->height, avcc->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+            if (!sws || av_frame_make_writable(converted.get()) < 0 || sws_scale(sws, frame->data, frame->linesize, 0, frame->height,
+                                  converted->data, converted->linesize) < 0) {
+                logging("[ERROR] failed to convert frame %lld for its image", (long long) task.number);
+                continue;
+            }
+            converted->pts = task.number;
+            if (avcodec_send_frame(avcc.get(), converted.get()) < 0 ||
+                    avcodec_receive_packet(avcc.get(), packet.get()) < 0) {
+                logging("[ERROR] failed to encode image of frame %lld", (long long) task.number);
+                avcc.reset();
+                continue;
+            }
+            write_image(task.number, packet.get());
+            av_packet_unref(packet.get());
+        }
+        sws_freeContext(sws);
+    }
+
+    AVCodecContext *open_encoder(AVFrame *frame) {
+        AVCodec *codec = avcodec_find_encoder(format == IMAGE_PNG ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG);
+        AVCodecContext *avcc = codec ? avcodec_alloc_context3(codec) : NULL;
+        if (!avcc) {
+            logging("[ERROR] no %s encoder", format == IMAGE_PNG ? "png" : "jpeg");
+            return NULL;
+        }
+        avcc->width = frame->width;
+        avcc->height = frame->height;
+        avcc->time_base = AVRational{1, 25};
+        avcc->thread_count = 1;
+        if (format == IMAGE_PNG) {
+            avcc->pix_fmt = AV_PIX_FMT_RGB24;
+        } else {
+            avcc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+            avcc->flags |= AV_CODEC_FLAG_QSCALE;
+            avcc->global_quality = 3 * FF_QP2LAMBDA;
+        }
+        if (avcodec_open2(avcc, codec, NULL) < 0) {
+            logging("[ERROR] failed to open the %s encoder", codec->name);
+            avcodec_free_context(&avcc);
+        }
+        return avcc;
+    }
+
+    void write_image(int64_t number, AVPacket *packet) {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s-%lld.%s", prefix.c_str(), (long long) number,
+                 format == IMAGE_PNG ? "png" : "jpg");
+        FILE *f = fopen(filename, "wb");
+        if (!f || fwrite(packet->data, 1, packet->size, f) != (size_t) packet->size) {
+            logging("[ERROR] failed to write %s", filename);
+        } else {
+            encoded++;
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+
+    enum ImageFormat format;
+    std::string prefix;
+    BoundedQueue<Task> tasks;
+    std::vector<std::thread> workers;
+    std::atomic<int64_t> encoded{0};
+};
+
+/*
+ * Where decoded frames go. Y4M and raw dumps are one packed stream written
+ * through an AsyncFileWriter, so a frame costs a few memcpys into 4 MiB
+ * aligned buffers and the syscalls happen on another thread, instead of a
+ * fopen and one fwrite per row. Images are handed to an ImageEncoderPool.
+ */
+class FrameSink {
+public:
+    ~FrameSink() {
+        close();
+    }
+
+    int open(const FrameSinkOptions &opts) {
+        options = opts;
+        if (options.dump == FRAME_DUMP_Y4M || options.dump == FRAME_DUMP_RAW) {
+            writer.reset(new AsyncFileWriter());
+            int rc = writer->open_file(options.filename.c_str());
+            if (rc < 0) {
+                logging("[ERROR] failed to open %s: %s", options.filename.c_str(), av_err2string(rc).c_str());
+                writer.reset();
+                return rc;
+            }
+        }
+        if (options.dump == FRAME_DUMP_RAW) {
+            std::string index_name = options.filename + ".idx";
+            index = fopen(index_name.c_str(), "wb");
+            if (!index || fwrite(RAW_INDEX_MAGIC, 1, 8, index) != 8) {
+                logging("[ERROR] failed to open %s", index_name.c_str());
+                return -1;
+            }
+        }
+        if (options.images != IMAGE_NONE) {
+            int nb_workers = options.image_workers > 0 ? options.image_workers
+                                                       : std::max(1u, std::thread::hardware_concurrency() / 2);
+            images.reset(new ImageEncoderPool(options.images, options.image_prefix, nb_workers));
+        }
+        return 0;
+    }
+
+    int write(AVFrame *frame) {
+        auto start = std::chrono::steady_clock::now();
+        int rc = 0;
+        stats.frames++;
+        switch (options.dump) {
+            case FRAME_DUMP_PGM:
+                rc = write_pgm(frame);
+                break;
+            case FRAME_DUMP_Y4M:
+                rc = write_y4m(frame);
+                break;
+            case FRAME_DUMP_RAW:
+                rc = write_raw(frame);
+                break;
+            default:
+                break;
+        }
+        if (rc >= 0 && images && (stats.frames - 1) % std::max(1, options.image_every) == 0) {
+            rc = images->submit(frame, stats.frames);
+        }
+        stats.write_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        return rc;
+    }
+
+    // waits for the writer and the image encoders and logs what was written
+    void close() {
+        if (closed) {
+            return;
+        }
+        closed = true;
+        if (images) {
+            images->finish();
+            stats.images = images->get_encoded();
+            images.reset();
+        }
+        writer.reset();
+        if (index) {
+            fclose(index);
+            index = NULL;
+        }
+        sws_freeContext(sws);
+        sws = NULL;
+        if (stats.frames) {
+            logging("[INFO] frame sink: %lld frames, %.1f MB, %lld converted, %lld images, %.2f ms per frame in write",
+                    (long long) stats.frames, stats.bytes / 1e6, (long long) stats.converted,
+                    (long long) stats.images, stats.write_ns / 1e6 / stats.frames);
+        }
+    }
+
+private:
+    int write_pgm(AVFrame *frame) {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s-%lld.pgm", "frame", (long long) stats.frames);
+        save_grey_frame(frame->data[0], frame->linesize[0], frame->width, frame->height, filename);
+        stats.bytes += (int64_t) frame->width * frame->height;
+        return 0;
+    }
+
+    // the planes row by row, whole planes at once when they have no padding
+    int write_planes(AVFrame *frame) {
+        enum AVPixelFormat format = (enum AVPixelFormat) frame->format;
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+        int row_bytes[4] = {0};
+        if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) ||
+                av_image_fill_linesizes(row_bytes, format, frame->width) < 0) {
+            logging("[ERROR] can not dump frames in %s", desc ? desc->name : "an unknown format");
+            return -1;
+        }
+        int64_t written = 0;
+        for (int p = 0; p < av_pix_fmt_count_planes(format); p++) {
+            bool chroma = (p == 1 || p == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+            int rows = chroma ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+            int rc;
+            if (frame->linesize[p] == row_bytes[p]) {
+                rc = writer->write(frame->data[p], row_bytes[p] * rows);
+            } else {
+                rc = 0;
+                for (int y = 0; y < rows && rc >= 0; y++) {
+                    rc = writer->write(frame->data[p] + (int64_t) y * frame->linesize[p], row_bytes[p]);
+                }
+            }
+            if (rc < 0) {
+                logging("[ERROR] failed to write %s: %s", options.filename.c_str(), av_err2string(rc).c_str());
+                return rc;
+            }
+            written += (int64_t) row_bytes[p] * rows;
+        }
+        stats.bytes += written;
+        return written;
+    }
+
+    AVFrame *convert(AVFrame *frame) {
+        if (!converted) {
+            converted.reset(av_frame_alloc());
+            converted->format = y4m_format;
+            converted->width = y4m_width;
+            converted->height = y4m_height;
+            if (av_frame_get_buffer(converted.get(), 0) < 0) {
+                converted.reset();
+                return NULL;
+            }
+        }
+        sws = sws_getCachedContext(sws, frame->width, frame->height, (enum AVPixelFormat) frame->format,
+                                   y4m_width, y4m_height, y4m_format, SWS_BILINEAR, NULL, NULL, NULL);
+        if (!sws || sws_scale(sws, frame->data, frame->linesize, 0, frame->height,
+                              converted->data, converted->linesize) < 0) {
+            return NULL;
+        }
+        stats.converted++;
+        return converted.get();
+    }
+
+    int write_y4m(AVFrame *frame) {
+        if (y4m_width == 0) {
+            // the first frame fixes the stream geometry, later changes are scaled to it
+            y4m_width = frame->width;
+            y4m_height = frame->height;
+            y4m_format = y4m_target_format((enum AVPixelFormat) frame->format);
+            AVRational rate = options.frame_rate.num > 0 ? options.frame_rate : AVRational{25, 1};
+            AVRational sar = frame->sample_aspect_ratio.num > 0 ? frame->sample_aspect_ratio : AVRational{1, 1};
+            char header[256];
+            int n = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A%d:%d C%s\n",
+                             y4m_width, y4m_height, rate.num, rate.den, sar.num, sar.den, y4m_colourspace(y4m_format));
+            if (writer->write((const uint8_t*) header, n) < 0) {
+                return -1;
+            }
+            stats.bytes += n;
+        }
+
+        AVFrame *out = frame;
+        if (frame->format != y4m_format || frame->width != y4m_width || frame->height != y4m_height) {
+            out = convert(frame);
+            if (!out) {
+                logging("[ERROR] failed to convert frame %lld to %s", (long long) stats.frames,
+                        av_get_pix_fmt_name(y4m_format));
+                return -1;
+            }
+        }
+        if (writer->write((const uint8_t*) "FRAME\n", 6) < 0) {
+            return -1;
+        }
+        stats.bytes += 6;
+        return write_planes(out) < 0 ? -1 : 0;
+    }
+
+    int write_raw(AVFrame *frame) {
+        RawFrameIndexEntry entry = {};
+        entry.offset = stats.bytes;
+        entry.pts = frame->best_effort_timestamp;
+        entry.width = frame->width;
+        entry.height = frame->height;
+        entry.format = frame->format;
+        int64_t size = write_planes(frame);
+        if (size < 0) {
+            return -1;
+        }
+        entry.size = size;
+        if (fwrite(&entry, sizeof(entry), 1, index) != 1) {
+            logging("[ERROR] failed to write the index of %s", options.filename.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    FrameSinkOptions options = {};
+    std::unique_ptr<AsyncFileWriter> writer;
+    FILE *index = NULL;
+    std::unique_ptr<ImageEncoderPool> images;
+    struct SwsContext *sws = NULL;
+    FramePtr converted;
+    int y4m_width = 0;
+    int y4m_height = 0;
+    enum AVPixelFormat y4m_format = AV_PIX_FMT_NONE;
+    bool closed = false;
+    FrameSinkStats stats = {};
+};
+
+int Decode(AVCodecContext *pCodecContext, AVPacket *pPacket, AVFrame *pFrame, FrameSink *sink = NULL) {
+    int response = 0;
+    response = avcodec_send_packet(pCodecContext, pPacket);
+    if (response < 0) {
+        logging("[ERROR] failed to sending packet to decoder: %s", av_err2string(response).c_str());
+        return response;
+    }
+    while (response >= 0) {
+        response = avcodec_receive_frame(pCodecContext, pFrame);
+        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+            break;
+        } else if (response < 0) {
+            logging("[ERROR] failed to receive frame from decode: %s", av_err2string(response).c_str());
+            return response;
+        }
+
+        if (response >= 0) {
+            log_pkt(
+                pPacket ? pPacket->stream_index : -1,
+                pFrame->pts,
+                "Frame %d (type=%c, size=%d bytes, format=%d) key_frame %d [DTS %d]",
+                pCodecContext->frame_number,
+                av_get_picture_type_char(pFrame->pict_type),
+                pFrame->pkt_size,
+                pFrame->format,
+                pFrame->key_frame,
+                pFrame->coded_picture_number
+            );
+
+            if (sink && sink->write(pFrame) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+#endif //LEARN_LIBAV_FRAME_SINK_H
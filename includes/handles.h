@@ -0,0 +1,116 @@
+#ifndef LEARN_LIBAV_HANDLES_H
+#define LEARN_LIBAV_HANDLES_H
+
+#include <memory>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+/*
+ * Base of the objects behind our own AVIOContexts. A format context flagged
+ * AVFMT_FLAG_CUSTOM_IO always carries one as pb->opaque, which is how the
+ * generic close path below knows how to tear it down.
+ */
+struct CustomIO {
+    virtual ~CustomIO() {}
+    // completes everything written so far, the first error of the output or 0; logs that error once
+    virtual int finish() {
+        return 0;
+    }
+};
+
+void free_custom_io(AVIOContext **pb) {
+    if (!*pb) {
+        return;
+    }
+    if ((*pb)->write_flag) {
+        avio_flush(*pb);
+    }
+    ((CustomIO*) (*pb)->opaque)->finish();
+    delete (CustomIO*) (*pb)->opaque;
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+// closes an input or output format context, including its pb
+void close_format_context(AVFormatContext **ctx) {
+    if (!*ctx) {
+        return;
+    }
+    AVIOContext *custom_pb = ((*ctx)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*ctx)->pb : NULL;
+    if ((*ctx)->iformat) {
+        avformat_close_input(ctx);
+    } else {
+        if ((*ctx)->oformat && !((*ctx)->oformat->flags & AVFMT_NOFILE) && !custom_pb) {
+            avio_closep(&(*ctx)->pb);
+        }
+        avformat_free_context(*ctx);
+        *ctx = NULL;
+    }
+    free_custom_io(&custom_pb);
+}
+
+/*
+ * After av_write_trailer: flushes the output's pb and waits for a custom
+ * pb to complete its writes, so a failure behind the muxer fails the run
+ * instead of only being logged when the context is closed.
+ */
+int finish_output_io(AVFormatContext *ctx) {
+    if ((ctx->oformat->flags & AVFMT_NOFILE) || !ctx->pb) {
+        return 0;
+    }
+    avio_flush(ctx->pb);
+    int rc = ctx->pb->error;
+    if (ctx->flags & AVFMT_FLAG_CUSTOM_IO) {
+        int finished = ((CustomIO*) ctx->pb->opaque)->finish();
+        if (rc >= 0) {
+            rc = finished;
+        }
+    }
+    return rc;
+}
+
+/*
+ * unique_ptr style owners for the libav objects, so early returns on error
+ * paths can no longer leak them.
+ */
+
+struct FormatContextDeleter {
+    void operator()(AVFormatContext *ctx) const {
+        close_format_context(&ctx);
+    }
+};
+
+struct CodecContextDeleter {
+    void operator()(AVCodecContext *ctx) const {
+        avcodec_free_context(&ctx);
+    }
+};
+
+struct PacketDeleter {
+    void operator()(AVPacket *pkt) const {
+        av_packet_free(&pkt);
+    }
+};
+
+struct FrameDeleter {
+    void operator()(AVFrame *frame) const {
+        av_frame_free(&frame);
+    }
+};
+
+struct BSFContextDeleter {
+    void operator()(AVBSFContext *ctx) const {
+        av_bsf_free(&ctx);
+    }
+};
+
+typedef std::unique_ptr<AVFormatContext, FormatContextDeleter> FormatContextPtr;
+typedef std::unique_ptr<AVCodecContext, CodecContextDeleter> CodecContextPtr;
+typedef std::unique_ptr<AVPacket, PacketDeleter> PacketPtr;
+typedef std::unique_ptr<AVFrame, FrameDeleter> FramePtr;
+typedef std::unique_ptr<AVBSFContext, BSFContextDeleter> BSFContextPtr;
+
+#endif //LEARN_LIBAV_HANDLES_H
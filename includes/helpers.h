@@ -1,7 +1,14 @@
 #ifndef LEARN_LIBAV_HELPERS_H
 #define LEARN_LIBAV_HELPERS_H
 
+#include <atomic>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
 
 extern "C" {
     #include <libavcodec/avcodec.h>
@@ -19,61 +26,46 @@ void DumpAVFormat(AVFormatContext *pCtx) {
 }
 
 void save_grey_frame(unsigned char* buff, int wrap, int xsize, int ysize, char* filename) {
-    FILE *f;
-    f = fopen(filename, "w");
-
-    // header of file pgm
-    fprintf(f, "P5\n%d %d\n%d\n", xsize, ysize, 255);
-
+    // header of file pgm, then the rows packed so the file is written with one fwrite
+    char header[64];
+    int header_size = snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", xsize, ysize, 255);
+    std::vector<unsigned char> image(header_size + (size_t) xsize * ysize);
+    memcpy(image.data(), header, header_size);
     for (int i=0; i < ysize; i++) {
-        fwrite(buff + i * wrap, 1, xsize, f);
+        memcpy(image.data() + header_size + (size_t) i * xsize, buff + i * wrap, xsize);
     }
 
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        logging("[ERROR] failed to open %s", filename);
+        return;
+    }
+    fwrite(image.data(), 1, image.size(), f);
     fclose(f);
 }
 
-av_always_inline std::string av_err2string(int errnum) {
-    char str[AV_ERROR_MAX_STRING_SIZE];
-    return av_make_error_string(str, AV_ERROR_MAX_STRING_SIZE, errnum);
-}
-
-int Decode(AVCodecContext *pCodecContext, AVPacket *pPacket, AVFrame *pFrame) {
-    int response = 0;
-    response = avcodec_send_packet(pCodecContext, pPacket);
-    if (response < 0) {
-        logging("[ERROR] failed to sending packet to decoder: %s", av_err2string(response).c_str());
-        return response;
+// tmp file + rename, readers never see a half written file; tmp names are unique so writers never clash
+int write_file_atomic(const std::string &path, const void *data, size_t size) {
+    static std::atomic<int> counter{0};
+    std::string tmp = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        logging("[ERROR] failed to open %s", tmp.c_str());
+        return -1;
     }
-    while (response >= 0) {
-        response = avcodec_receive_frame(pCodecContext, pFrame);
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
-            break;
-        } else if (response < 0) {
-            logging("[ERROR] failed to receive frame from decode: %s", av_err2string(response).c_str());
-            return response;
-        }
-
-        if (response >= 0) {
-            logging(
-                "Frame %d (type=%c, size=%d bytes, format=%d) pts %d key_frame %d [DTS %d]",
-                pCodecContext->frame_number,
-                av_get_picture_type_char(pFrame->pict_type),
-                pFrame->pkt_size,
-                pFrame->format,
-                pFrame->pts,
-                pFrame->key_frame,
-                pFrame->coded_picture_number
-            );
-
-            char frame_filename[1024];
-            snprintf(frame_filename, sizeof(frame_filename), "%s-%d.pgm", "frame", pCodecContext->frame_number);
-            if (pFrame->format != AV_PIX_FMT_YUV420P) {
-                logging("Warning: format of frame is not AV_PIX_FMT_YUV420P");
-            }
-            save_grey_frame(pFrame->data[0], pFrame->linesize[0], pFrame->width, pFrame->height, frame_filename);
-        }
+    bool ok = fwrite(data, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        logging("[ERROR] failed to write %s", path.c_str());
+        remove(tmp.c_str());
+        return -1;
     }
     return 0;
 }
 
+av_always_inline std::string av_err2string(int errnum) {
+    char str[AV_ERROR_MAX_STRING_SIZE];
+    return av_make_error_string(str, AV_ERROR_MAX_STRING_SIZE, errnum);
+}
+
 #endif //LEARN_LIBAV_HELPERS_H
@@ -0,0 +1,46 @@
+#ifndef LEARN_LIBAV_INPUT_H
+#define LEARN_LIBAV_INPUT_H
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "handles.h"
+#include "log.h"
+#include "mmap_io.h"
+
+// process wide choices on how inputs are opened, set once from the command line
+typedef struct {
+    bool use_mmap;
+    // tight probesize and analyzeduration, see probe_cache.h
+    bool fast_probe;
+    // directory of cached probe results, NULL probes every open
+    const char *probe_cache_dir;
+} InputOptions;
+
+InputOptions &input_options() {
+    static InputOptions options = {};
+    return options;
+}
+
+// bytes and microseconds of input a fast probe may look at, options set by the caller win
+#define FAST_PROBE_SIZE (128 * 1024)
+#define FAST_PROBE_DURATION_US 250000
+
+// avformat_open_input honouring input_options(), close the result with close_format_context
+int open_input(const char *filename, AVFormatContext **avfc, AVDictionary **opts) {
+    AVDictionary *local_opts = NULL;
+    if (!opts) {
+        opts = &local_opts;
+    }
+    if (input_options().fast_probe) {
+        av_dict_set_int(opts, "probesize", FAST_PROBE_SIZE, AV_DICT_DONT_OVERWRITE);
+        av_dict_set_int(opts, "analyzeduration", FAST_PROBE_DURATION_US, AV_DICT_DONT_OVERWRITE);
+    }
+    int rc = input_options().use_mmap ? open_mmap_input(filename, avfc, opts)
+                                      : avformat_open_input(avfc, filename, NULL, opts);
+    av_dict_free(&local_opts);
+    return rc;
+}
+
+#endif //LEARN_LIBAV_INPUT_H
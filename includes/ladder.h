@@ -0,0 +1,291 @@
+#ifndef LEARN_LIBAV_LADDER_H
+#define LEARN_LIBAV_LADDER_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "log.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "queue.h"
+#include "streaming.h"
+
+/*
+ * ABR ladder: the source is demuxed and decoded once and every decoded
+ * frame is fanned out to several renditions. Each rendition owns its
+ * StreamingContext, output file and encoder thread. Renditions receive new
+ * references to the decoder's frame buffers, the pixels are never copied.
+ */
+typedef struct {
+    // exactly one of frame and packet is set, packet is a copied audio packet
+    AVFrame *frame;
+    AVPacket *packet;
+    enum AVMediaType type;
+} LadderItem;
+
+typedef struct {
+    std::string output;
+    int64_t video_bit_rate;
+    // 0 keeps the source size
+    int width;
+    int height;
+} RenditionSpec;
+
+typedef struct Rendition {
+    RenditionSpec spec;
+    StreamingContext encoder;
+    BoundedQueue<LadderItem> queue{PIPELINE_FRAME_QUEUE_SIZE};
+    double seconds = 0;
+    int rc = 0;
+} Rendition;
+
+// parses <output>[:<bit rate>[:<width>x<height>]], the bit rate accepts k and M suffixes
+int parse_rendition(const char *arg, RenditionSpec *spec) {
+    std::string value(arg);
+    spec->video_bit_rate = 0;
+    spec->width = 0;
+    spec->height = 0;
+    size_t colon = value.rfind(':');
+    if (colon != std::string::npos && value.find('x', colon) != std::string::npos) {
+        char trailing;
+        if (sscanf(value.c_str() + colon + 1, "%dx%d%c", &spec->width, &spec->height, &trailing) != 2 ||
+                spec->width < 0 || spec->height < 0 || (spec->width | spec->height) & 1) {
+            logging("[ERROR] invalid rendition size in %s, expected even <width>x<height>", arg);
+            return -1;
+        }
+        value.resize(colon);
+        colon = value.rfind(':');
+    }
+    spec->output = value.substr(0, colon);
+    if (colon == std::string::npos) {
+        return 0;
+    }
+
+    char *end = NULL;
+    double bit_rate = strtod(value.c_str() + colon + 1, &end);
+    if (*end == 'k' || *end == 'K') {
+        bit_rate *= 1000;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        bit_rate *= 1000 * 1000;
+        end++;
+    }
+    if (*end != '\0' || bit_rate <= 0) {
+        logging("[ERROR] invalid rendition %s, expected <output>[:<bit rate>[:<width>x<height>]]", arg);
+        return -1;
+    }
+    spec->video_bit_rate = bit_rate;
+    return 0;
+}
+
+void release_ladder_item(LadderItem *item) {
+    release_frame(&item->frame);
+    release_packet(&item->packet);
+}
+
+void close_renditions(std::vector<std::unique_ptr<Rendition>> &renditions) {
+    for (auto &r : renditions) {
+        r->queue.close();
+    }
+}
+
+// hands every rendition its own reference to the frame
+int fan_out_frame(std::vector<std::unique_ptr<Rendition>> &renditions, AVFrame *frame, enum AVMediaType type) {
+    for (auto &r : renditions) {
+        LadderItem item = {NULL, NULL, type};
+        item.frame = frame_pool().acquire();
+        if (!item.frame || av_frame_ref(item.frame, frame) < 0) {
+            release_ladder_item(&item);
+            return AVERROR(ENOMEM);
+        }
+        if (!r->queue.push(item)) {
+            release_ladder_item(&item);
+            return AVERROR_EXIT;
+        }
+    }
+    return 0;
+}
+
+int fan_out_packet(std::vector<std::unique_ptr<Rendition>> &renditions, AVPacket *packet) {
+    for (auto &r : renditions) {
+        LadderItem item = {NULL, NULL, AVMEDIA_TYPE_AUDIO};
+        item.packet = packet_pool().acquire();
+        if (!item.packet || av_packet_ref(item.packet, packet) < 0) {
+            release_ladder_item(&item);
+            return AVERROR(ENOMEM);
+        }
+        if (!r->queue.push(item)) {
+            release_ladder_item(&item);
+            return AVERROR_EXIT;
+        }
+    }
+    return 0;
+}
+
+int ladder_decode(AVCodecContext *avcc, AVPacket *packet, AVFrame *frame, enum AVMediaType type,
+                  std::vector<std::unique_ptr<Rendition>> &renditions) {
+    int64_t start = metrics_clock();
+    int rc = avcodec_send_packet(avcc, packet);
+    metrics_record(METRICS_STAGE_SEND_PACKET, type, start);
+    if (rc < 0) {
+        logging("[ERROR] Error while sending packet to decoder: %s", av_err2string(rc).c_str());
+        return rc;
+    }
+
+    while (true) {
+        start = metrics_clock();
+        rc = avcodec_receive_frame(avcc, frame);
+        metrics_record(METRICS_STAGE_RECEIVE_FRAME, type, start);
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            return 0;
+        } else if (rc < 0) {
+            logging("[ERROR] Error while receiving frame from decoder: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        metrics_add(METRICS_FRAMES_DECODED, type, 1);
+
+        rc = fan_out_frame(renditions, frame, type);
+        av_frame_unref(frame);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+}
+
+void rendition_stage(StreamingContext *decoder, Rendition *r) {
+    auto start = std::chrono::steady_clock::now();
+    StreamingContext *encoder = &r->encoder;
+    LadderItem item;
+    while (r->queue.pop(item)) {
+        if (r->rc == 0) {
+            if (item.packet) {
+                item.packet->stream_index = encoder->audio_avs->index;
+                r->rc = remux(item.packet, encoder->avfc.get(), decoder->audio_avs->time_base, encoder->audio_avs->time_base);
+            } else if (item.type == AVMEDIA_TYPE_VIDEO) {
+                r->rc = encode_video(decoder, encoder, item.frame);
+            } else {
+                r->rc = encode_audio(decoder, encoder, item.frame);
+            }
+            if (r->rc) {
+                logging("[ERROR] rendition %s failed, dropping its remaining input", r->spec.output.c_str());
+            }
+        }
+        release_ladder_item(&item);
+    }
+
+    if (r->rc == 0) {
+        r->rc = encode_video(decoder, encoder, NULL);
+    }
+    if (r->rc == 0 && encoder->audio_stage) {
+        r->rc = encode_audio(decoder, encoder, NULL);
+    }
+    if (r->rc == 0) {
+        av_write_trailer(encoder->avfc.get());
+    }
+    r->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int run_ladder(const char *input, std::vector<RenditionSpec> &specs, StreamingParams sp) {
+    if (sp.copy_video) {
+        logging("[ERROR] the ladder re-encodes the video, it can not be combined with copy_video");
+        return -1;
+    }
+
+    StreamingContext decoder;
+    decoder.filename = (char*) input;
+    if (open_media(input, decoder.avfc) || prepare_decoder(&decoder)) {
+        return -1;
+    }
+    // the decoder took a single job's share, the renditions split the encoder part between them
+    thread_budget().set_jobs(specs.size());
+
+    std::vector<std::unique_ptr<Rendition>> renditions;
+    for (auto &spec : specs) {
+        std::unique_ptr<Rendition> r(new Rendition());
+        r->spec = spec;
+        r->encoder.filename = (char*) r->spec.output.c_str();
+        StreamingParams rendition_sp = sp;
+        rendition_sp.video_bit_rate = spec.video_bit_rate;
+        rendition_sp.width = spec.width;
+        rendition_sp.height = spec.height;
+        if (prepare_encoders(&decoder, &r->encoder, rendition_sp) || open_output(&r->encoder, rendition_sp)) {
+            logging("[ERROR] failed to prepare rendition %s", spec.output.c_str());
+            return -1;
+        }
+        renditions.push_back(std::move(r));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto &r : renditions) {
+        threads.emplace_back(rendition_stage, &decoder, r.get());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    PooledPacket packet(packet_pool().acquire());
+    PooledFrame frame(frame_pool().acquire());
+    int rc = 0;
+    int64_t decoded_packets = 0;
+    while (rc >= 0 && metrics_read_frame(decoder.avfc.get(), packet.get()) >= 0) {
+        if (packet->stream_index == decoder.video_index) {
+            rc = ladder_decode(decoder.video_avcc.get(), packet.get(), frame.get(), AVMEDIA_TYPE_VIDEO, renditions);
+            decoded_packets++;
+        } else if (packet->stream_index == decoder.audio_index && decoder.audio_avs) {
+            if (sp.copy_audio) {
+                rc = fan_out_packet(renditions, packet.get());
+            } else {
+                rc = ladder_decode(decoder.audio_avcc.get(), packet.get(), frame.get(), AVMEDIA_TYPE_AUDIO, renditions);
+            }
+        }
+        av_packet_unref(packet.get());
+    }
+    if (rc >= 0) {
+        rc = ladder_decode(decoder.video_avcc.get(), NULL, frame.get(), AVMEDIA_TYPE_VIDEO, renditions);
+    }
+    if (rc >= 0 && !sp.copy_audio && decoder.audio_avs) {
+        rc = ladder_decode(decoder.audio_avcc.get(), NULL, frame.get(), AVMEDIA_TYPE_AUDIO, renditions);
+    }
+    double decode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    close_renditions(renditions);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    logging("[INFO] ladder: decoded %lld video packets once in %.2fs for %d renditions",
+            decoded_packets, decode_seconds, (int) renditions.size());
+    for (auto &r : renditions) {
+        if (r->rc) {
+            rc = -1;
+        }
+        logging("[INFO] rendition %s (%dx%d, %lld bit/s): %lld frames in %.2fs%s",
+                r->spec.output.c_str(), r->encoder.video_avcc->width, r->encoder.video_avcc->height,
+                r->encoder.video_avcc->bit_rate, r->encoder.video_frames, r->seconds, r->rc ? " FAILED" : "");
+        if (r->encoder.scaler) {
+            print_scaler_stats(r->spec.output.c_str(), r->encoder.scaler->get_stats());
+        }
+        if (r->encoder.scene_detector) {
+            print_scene_detect_stats(r->spec.output.c_str(), r->encoder.scene_detector->get_stats());
+        }
+        if (r->encoder.dedup) {
+            print_dedup_stats(r->spec.output.c_str(), r->encoder.dedup->get_stats());
+        }
+        if (r->encoder.quality) {
+            print_quality_stats(r->spec.output.c_str(), r->encoder.quality->get_stats());
+        }
+        if (r->encoder.audio_stage) {
+            print_audio_stage_stats(r->spec.output.c_str(), r->encoder.audio_stage->get_stats());
+        }
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+#endif //LEARN_LIBAV_LADDER_H
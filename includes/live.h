@@ -0,0 +1,202 @@
+#ifndef LEARN_LIBAV_LIVE_H
+#define LEARN_LIBAV_LIVE_H
+
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "metrics.h"
+
+// bytes the demuxer may read while probing a live input
+#define LIVE_PROBE_SIZE (512 * 1024)
+// output timestamps are matched to input ones within this many microseconds
+#define LIVE_MATCH_US 5000
+
+/*
+ * Live mode: the input is a pipe, FIFO or socket that produces media in
+ * real time, so nothing may wait for data that is not there yet. Probing
+ * is bounded, encoders run without lookahead or B-frames, every packet is
+ * written and flushed as soon as it is encoded, and the time each video
+ * frame spent between av_read_frame and the muxer is measured.
+ */
+typedef struct {
+    bool enabled;
+    // how much of the input avformat_find_stream_info may look at
+    int probe_ms;
+    // demuxer for inputs that can not be probed reliably, e.g. mpegts on a pipe
+    const char *input_format;
+    int latency_budget_ms;
+} LiveOptions;
+
+LiveOptions &live_options() {
+    static LiveOptions options = {false, 500, NULL, 200};
+    return options;
+}
+
+// "-" is stdin, anything else goes to the libav protocols (FIFO paths, pipe:N, tcp://...)
+int open_live_input(const char *filename, FormatContextPtr &avfc) {
+    LiveOptions &options = live_options();
+    const char *url = strcmp(filename, "-") == 0 ? "pipe:0" : filename;
+    AVInputFormat *format = NULL;
+    if (options.input_format) {
+        format = av_find_input_format(options.input_format);
+        if (!format) {
+            logging("[ERROR] unknown input format %s", options.input_format);
+            return -1;
+        }
+    }
+
+    AVDictionary *opts = NULL;
+    av_dict_set_int(&opts, "probesize", LIVE_PROBE_SIZE, 0);
+    av_dict_set_int(&opts, "analyzeduration", (int64_t) options.probe_ms * 1000, 0);
+    // packets read while probing are dropped instead of replayed, so the transcode starts at the live edge
+    av_dict_set(&opts, "fflags", "nobuffer", 0);
+
+    auto start = std::chrono::steady_clock::now();
+    AVFormatContext *ctx = NULL;
+    int rc = avformat_open_input(&ctx, url, format, &opts);
+    av_dict_free(&opts);
+    if (rc < 0) {
+        logging("[ERROR] failed to open live input %s: %s", url, av_err2string(rc).c_str());
+        return -1;
+    }
+    avfc.reset(ctx);
+
+    rc = avformat_find_stream_info(ctx, NULL);
+    if (rc < 0) {
+        logging("[ERROR] failed to get stream info of %s: %s", url, av_err2string(rc).c_str());
+        return -1;
+    }
+    logging("[INFO] live input %s (%s) probed in %.0f ms", url, ctx->iformat->name,
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    return 0;
+}
+
+// frame threading holds thread_count frames back, slices do not
+void apply_live_decoder_settings(AVCodecContext *avcc) {
+    avcc->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    avcc->thread_type = FF_THREAD_SLICE;
+}
+
+/*
+ * Zero latency encoding: no lookahead, no B-frames (a frame is never held
+ * back for a later one) and a VBV of a fifth of a second so rate control
+ * can not smooth over seconds of frames. Called before avcodec_open2.
+ */
+void apply_live_encoder_settings(AVCodecContext *avcc, AVCodec *codec) {
+    avcc->max_b_frames = 0;
+    avcc->thread_type = FF_THREAD_SLICE;
+    if (avcc->bit_rate > 0) {
+        avcc->rc_buffer_size = (int) (avcc->bit_rate / 5);
+    }
+    if (strcmp(codec->name, "libx264") == 0 || strcmp(codec->name, "libx265") == 0) {
+        av_opt_set(avcc->priv_data, "preset", "veryfast", 0);
+        av_opt_set(avcc->priv_data, "tune", "zerolatency", 0);
+    } else if (strcmp(codec->name, "libvpx-vp9") == 0 || strcmp(codec->name, "libvpx") == 0) {
+        av_opt_set(avcc->priv_data, "deadline", "realtime", 0);
+        av_opt_set_int(avcc->priv_data, "cpu-used", 8, 0);
+        av_opt_set_int(avcc->priv_data, "lag-in-frames", 0, 0);
+        av_opt_set_int(avcc->priv_data, "row-mt", 1, 0);
+    }
+}
+
+/*
+ * Per video frame latency. The wall clock time of every video packet read
+ * is kept by its timestamp until the packet with the same timestamp leaves
+ * the muxer. "Behind the media clock" also counts how late the input
+ * delivered the frame, measured from the first one.
+ */
+class LiveLatency {
+public:
+    void packet_read(AVFormatContext *avfc, AVPacket *pkt) {
+        AVStream *stream = avfc->streams[pkt->stream_index];
+        if (stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO || pkt->pts == AV_NOPTS_VALUE) {
+            return;
+        }
+        int64_t now = metrics_now_ns();
+        int64_t us = av_rescale_q(pkt->pts, stream->time_base, AV_TIME_BASE_Q);
+        std::lock_guard<std::mutex> guard(lock);
+        if (first_read_ns < 0) {
+            first_read_ns = now;
+            first_pts_us = us;
+        }
+        arrivals[us] = now;
+    }
+
+    void packet_written(int64_t pts_us) {
+        int64_t now = metrics_now_ns();
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = arrivals.lower_bound(pts_us - LIVE_MATCH_US);
+        if (it == arrivals.end() || it->first > pts_us + LIVE_MATCH_US) {
+            unmatched++;
+            return;
+        }
+        read_to_write.record(now - it->second);
+        media_lag.record(now - first_read_ns - (pts_us - first_pts_us) * 1000);
+        // without B-frames anything older was dropped on the way
+        arrivals.erase(arrivals.begin(), ++it);
+    }
+
+    void print_stats(int budget_ms) {
+        int64_t frames = read_to_write.get_count();
+        if (frames == 0) {
+            return;
+        }
+        int64_t budget_ns = (int64_t) budget_ms * 1000000;
+        logging("[INFO] live latency over %lld frames: read to write p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms; "
+                "behind media clock p50 %.1f ms, p99 %.1f ms; %lld frames over %d ms, %lld unmatched",
+                (long long) frames, read_to_write.quantile_ns(0.5) / 1e6, read_to_write.quantile_ns(0.9) / 1e6,
+                read_to_write.quantile_ns(0.99) / 1e6, read_to_write.get_max_ns() / 1e6,
+                media_lag.quantile_ns(0.5) / 1e6, media_lag.quantile_ns(0.99) / 1e6,
+                (long long) (frames - read_to_write.count_below(budget_ns)), budget_ms, (long long) unmatched);
+        if (read_to_write.quantile_ns(0.99) > budget_ns) {
+            logging("[WARN] live latency p99 %.1f ms is over the %d ms budget", read_to_write.quantile_ns(0.99) / 1e6, budget_ms);
+        }
+    }
+
+private:
+    std::mutex lock;
+    // input pts in microseconds -> steady clock ns when it was read
+    std::map<int64_t, int64_t> arrivals;
+    int64_t first_read_ns = -1;
+    int64_t first_pts_us = 0;
+    int64_t unmatched = 0;
+    LatencyHistogram read_to_write;
+    LatencyHistogram media_lag;
+};
+
+LiveLatency &live_latency() {
+    static LiveLatency latency;
+    return latency;
+}
+
+// input hook, right after av_read_frame
+void live_packet_read(AVFormatContext *avfc, AVPacket *pkt) {
+    if (live_options().enabled) {
+        live_latency().packet_read(avfc, pkt);
+    }
+}
+
+// av_write_frame instead of waiting for the other streams to interleave, every packet is flushed
+int live_write_frame(AVFormatContext *avfc, AVPacket *pkt) {
+    AVStream *stream = avfc->streams[pkt->stream_index];
+    bool video = stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && pkt->pts != AV_NOPTS_VALUE;
+    int64_t pts_us = video ? av_rescale_q(pkt->pts, stream->time_base, AV_TIME_BASE_Q) : 0;
+    int rc = metrics_write_frame(avfc, pkt, false);
+    if (rc >= 0 && video) {
+        live_latency().packet_written(pts_us);
+    }
+    return rc;
+}
+
+#endif //LEARN_LIBAV_LIVE_H
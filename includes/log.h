@@ -1,29 +1,186 @@
 #ifndef LEARN_LIBAV_LOG_H
 #define LEARN_LIBAV_LOG_H
 
-#define DEBUG true
-
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-static void logging(const char *fmt, ...) {
-    if (!DEBUG) return;
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stdout, fmt, args);
-    va_end(args);
-    fprintf(stdout, "\n");
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// compile time log level, set with cmake -DLOG_LEVEL=error|warn|info|debug
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// must be a power of two
+#define LOG_RING_SIZE 4096
+#define LOG_MESSAGE_SIZE 256
+#define LOG_NO_PTS INT64_MIN
+
+typedef struct {
+    std::atomic<uint64_t> sequence;
+    int level;
+    int64_t timestamp_ns;
+    // -1 and LOG_NO_PTS when the record is not about a packet or frame
+    int stream_index;
+    int64_t pts;
+    char message[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+/*
+ * Bounded lock-free multi-producer ring (Vyukov's sequence numbered slots)
+ * drained by one background thread. Callers only format the message into
+ * a slot, stdout is written by the drain thread. When the ring is full info
+ * and debug records are dropped and counted instead of blocking the caller.
+ */
+class LogRing {
+public:
+    LogRing() : start(std::chrono::steady_clock::now()), colour(isatty(fileno(stdout))) {
+        for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+            records[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        drainer = std::thread(&LogRing::drain, this);
+    }
+
+    ~LogRing() {
+        stopping = true;
+        drainer.join();
+    }
+
+    void write(int level, int stream_index, int64_t pts, const char *fmt, va_list args) {
+        uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        LogRecord *r;
+        while (true) {
+            r = &records[pos & (LOG_RING_SIZE - 1)];
+            int64_t diff = (int64_t) r->sequence.load(std::memory_order_acquire) - (int64_t) pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                if (level > LOG_LEVEL_WARN) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                // errors and warnings wait for the drain thread instead of getting lost
+                std::this_thread::yield();
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        r->level = level;
+        r->timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        r->stream_index = stream_index;
+        r->pts = pts;
+        vsnprintf(r->message, LOG_MESSAGE_SIZE, fmt, args);
+        r->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+private:
+    void drain() {
+        uint64_t pos = 0;
+        while (true) {
+            LogRecord *r = &records[pos & (LOG_RING_SIZE - 1)];
+            if (r->sequence.load(std::memory_order_acquire) == pos + 1) {
+                print(r);
+                r->sequence.store(pos + LOG_RING_SIZE, std::memory_order_release);
+                pos++;
+                continue;
+            }
+
+            int64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+            if (lost) {
+                fprintf(stdout, "[WARN] log ring full, dropped %lld records\n", (long long) lost);
+            }
+            fflush(stdout);
+            if (stopping) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    void print(LogRecord *r) {
+        fprintf(stdout, "[%10.6f] ", r->timestamp_ns / 1e9);
+        if (r->level == LOG_LEVEL_DEBUG) {
+            fprintf(stdout, colour ? "\033[1;33m[DEBUG] " : "[DEBUG] ");
+        }
+        if (r->stream_index >= 0) {
+            fprintf(stdout, "[stream %d", r->stream_index);
+            if (r->pts != LOG_NO_PTS) {
+                fprintf(stdout, " pts %lld", (long long) r->pts);
+            }
+            fprintf(stdout, "] ");
+        }
+        fputs(r->message, stdout);
+        fputs(colour && r->level == LOG_LEVEL_DEBUG ? "\033[0m\n" : "\n", stdout);
+    }
+
+    LogRecord records[LOG_RING_SIZE];
+    std::atomic<uint64_t> enqueue_pos{0};
+    std::atomic<int64_t> dropped{0};
+    std::atomic<bool> stopping{false};
+    std::chrono::steady_clock::time_point start;
+    bool colour;
+    std::thread drainer;
+};
+
+static LogRing &log_ring() {
+    static LogRing ring;
+    return ring;
 }
 
-static void debug(const char *fmt, ...) {
+static void log_write(int level, int stream_index, int64_t pts, const char *fmt, ...) {
     va_list args;
-    fprintf(stdout, "\033[1;33m[DEBUG] ");
     va_start(args, fmt);
-    vfprintf(stdout, fmt, args);
+    log_ring().write(level, stream_index, pts, fmt, args);
     va_end(args);
-    fprintf(stdout, "\033[0m");
-    fprintf(stdout, "\n");
 }
 
+// the level of a logging() call comes from its "[ERROR]" / "[WARN]" tag, untagged messages are info
+constexpr int log_level_of(const char *fmt) {
+    const char *error = "[ERROR]";
+    const char *warn = "[WARN]";
+    int i = 0;
+    while (error[i] && fmt[i] == error[i]) {
+        i++;
+    }
+    if (!error[i]) {
+        return LOG_LEVEL_ERROR;
+    }
+    i = 0;
+    while (warn[i] && fmt[i] == warn[i]) {
+        i++;
+    }
+    return warn[i] ? LOG_LEVEL_INFO : LOG_LEVEL_WARN;
+}
+
+/*
+ * Calls above LOG_LEVEL are discarded at compile time, their arguments are
+ * never evaluated. The *_pkt variants tag the record with a stream index
+ * and pts.
+ */
+#define LOG_AT(level, stream_index, pts, fmt, ...) \
+    do { \
+        if constexpr ((level) <= LOG_LEVEL) { \
+            log_write((level), (stream_index), (pts), fmt __VA_OPT__(,) __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define logging(fmt, ...) LOG_AT(log_level_of(fmt), -1, LOG_NO_PTS, fmt __VA_OPT__(,) __VA_ARGS__)
+#define log_pkt(stream_index, pts, fmt, ...) LOG_AT(log_level_of(fmt), stream_index, pts, fmt __VA_OPT__(,) __VA_ARGS__)
+#define debug(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, -1, LOG_NO_PTS, fmt __VA_OPT__(,) __VA_ARGS__)
+#define debug_pkt(stream_index, pts, fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, stream_index, pts, fmt __VA_OPT__(,) __VA_ARGS__)
+
 #endif //LEARN_LIBAV_LOG_H
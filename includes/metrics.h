@@ -0,0 +1,412 @@
+#ifndef LEARN_LIBAV_METRICS_H
+#define LEARN_LIBAV_METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <stdio.h>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "helpers.h"
+#include "log.h"
+
+// log-linear buckets: 16 linear sub-buckets per power of two, up to 2^40 ns (~18 minutes)
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_MAGNITUDE 40
+#define METRICS_NB_BUCKETS ((METRICS_MAX_MAGNITUDE - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_INTERVAL_MS 1000
+
+enum MetricsStage {
+    METRICS_STAGE_DEMUX,
+    METRICS_STAGE_SEND_PACKET,
+    METRICS_STAGE_RECEIVE_FRAME,
+    METRICS_STAGE_SEND_FRAME,
+    METRICS_STAGE_RECEIVE_PACKET,
+    METRICS_STAGE_MUX,
+    METRICS_NB_STAGES
+};
+
+enum MetricsCounter {
+    METRICS_PACKETS_IN,
+    METRICS_BYTES_IN,
+    METRICS_FRAMES_DECODED,
+    METRICS_FRAMES_ENCODED,
+    METRICS_PACKETS_OUT,
+    METRICS_BYTES_OUT,
+    METRICS_NB_COUNTERS
+};
+
+enum MetricsStream {
+    METRICS_STREAM_VIDEO,
+    METRICS_STREAM_AUDIO,
+    METRICS_NB_STREAMS
+};
+
+const char *metrics_stage_names[METRICS_NB_STAGES] = {
+    "demux", "send_packet", "receive_frame", "send_frame", "receive_packet", "mux",
+};
+const char *metrics_counter_names[METRICS_NB_COUNTERS] = {
+    "packets_in", "bytes_in", "frames_decoded", "frames_encoded", "packets_out", "bytes_out",
+};
+const char *metrics_stream_names[METRICS_NB_STREAMS] = {"video", "audio"};
+
+/*
+ * HDR style latency histogram: relative error stays under 1/16 over the
+ * whole range with a fixed array of counters. Recording is a handful of
+ * relaxed atomic increments, so stages on different threads can share one.
+ */
+class LatencyHistogram {
+public:
+    void record(int64_t ns) {
+        if (ns < 0) {
+            ns = 0;
+        }
+        buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        int64_t seen = max_ns.load(std::memory_order_relaxed);
+        while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    int64_t get_count() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    int64_t get_sum_ns() const {
+        return sum_ns.load(std::memory_order_relaxed);
+    }
+
+    int64_t get_max_ns() const {
+        return max_ns.load(std::memory_order_relaxed);
+    }
+
+    // upper bound of the bucket holding the q-th quantile
+    int64_t quantile_ns(double q) const {
+        int64_t total = get_count();
+        if (total == 0) {
+            return 0;
+        }
+        int64_t rank = (int64_t) (q * total + 0.5);
+        int64_t seen = 0;
+        for (int i = 0; i < METRICS_NB_BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank && seen > 0) {
+                return std::min<int64_t>(bucket_upper(i), get_max_ns());
+            }
+        }
+        return get_max_ns();
+    }
+
+    // number of samples below limit_ns, at bucket granularity
+    int64_t count_below(int64_t limit_ns) const {
+        int64_t seen = 0;
+        for (int i = 0; i < METRICS_NB_BUCKETS && bucket_upper(i) <= limit_ns; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+        }
+        return seen;
+    }
+
+private:
+    static int bucket_index(int64_t v) {
+        if (v < METRICS_SUB_BUCKETS) {
+            return (int) v;
+        }
+        int magnitude = 63 - __builtin_clzll((uint64_t) v);
+        if (magnitude > METRICS_MAX_MAGNITUDE) {
+            return METRICS_NB_BUCKETS - 1;
+        }
+        int sub = (v >> (magnitude - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+        return (magnitude - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+    }
+
+    // exclusive upper bound of bucket i
+    static int64_t bucket_upper(int i) {
+        if (i < METRICS_SUB_BUCKETS) {
+            return i + 1;
+        }
+        int magnitude = i / METRICS_SUB_BUCKETS + METRICS_SUB_BUCKET_BITS - 1;
+        int sub = i % METRICS_SUB_BUCKETS;
+        return (int64_t) (METRICS_SUB_BUCKETS + sub + 1) << (magnitude - METRICS_SUB_BUCKET_BITS);
+    }
+
+    std::atomic<int64_t> buckets[METRICS_NB_BUCKETS] = {};
+    std::atomic<int64_t> count{0};
+    std::atomic<int64_t> sum_ns{0};
+    std::atomic<int64_t> max_ns{0};
+};
+
+typedef struct Metrics {
+    LatencyHistogram latency[METRICS_NB_STAGES][METRICS_NB_STREAMS];
+    std::atomic<int64_t> counters[METRICS_NB_STREAMS][METRICS_NB_COUNTERS] = {};
+    // furthest muxed timestamp, drives the speed gauge
+    std::atomic<int64_t> media_time_us{0};
+
+    std::string prom_path;
+    std::string json_path;
+    std::chrono::steady_clock::time_point start;
+    double fps = 0;
+    double speed = 0;
+
+    std::thread reporter;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+} Metrics;
+
+// NULL unless metrics were requested on the command line, every hook checks it first
+Metrics *&metrics() {
+    static Metrics *instance = NULL;
+    return instance;
+}
+
+int64_t metrics_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// start timestamp for metrics_record, 0 when metrics are off so no clock is read
+int64_t metrics_clock() {
+    return metrics() ? metrics_now_ns() : 0;
+}
+
+int metrics_stream(enum AVMediaType type) {
+    switch (type) {
+        case AVMEDIA_TYPE_VIDEO:
+            return METRICS_STREAM_VIDEO;
+        case AVMEDIA_TYPE_AUDIO:
+            return METRICS_STREAM_AUDIO;
+        default:
+            return -1;
+    }
+}
+
+void metrics_record(enum MetricsStage stage, enum AVMediaType type, int64_t start_ns) {
+    Metrics *m = metrics();
+    int stream = metrics_stream(type);
+    if (!m || stream < 0) {
+        return;
+    }
+    m->latency[stage][stream].record(metrics_now_ns() - start_ns);
+}
+
+void metrics_add(enum MetricsCounter counter, enum AVMediaType type, int64_t value) {
+    Metrics *m = metrics();
+    int stream = metrics_stream(type);
+    if (!m || stream < 0) {
+        return;
+    }
+    m->counters[stream][counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+// av_read_frame plus the demux latency and input counters
+int metrics_read_frame(AVFormatContext *avfc, AVPacket *pkt) {
+    if (!metrics()) {
+        return av_read_frame(avfc, pkt);
+    }
+    int64_t start = metrics_now_ns();
+    int rc = av_read_frame(avfc, pkt);
+    if (rc >= 0) {
+        enum AVMediaType type = avfc->streams[pkt->stream_index]->codecpar->codec_type;
+        metrics_record(METRICS_STAGE_DEMUX, type, start);
+        metrics_add(METRICS_PACKETS_IN, type, 1);
+        metrics_add(METRICS_BYTES_IN, type, pkt->size);
+    }
+    return rc;
+}
+
+// with interleave off the packet goes straight to the muxer, either way pkt is left blank
+int muxer_write_frame(AVFormatContext *avfc, AVPacket *pkt, bool interleave) {
+    if (interleave) {
+        return av_interleaved_write_frame(avfc, pkt);
+    }
+    int rc = av_write_frame(avfc, pkt);
+    av_packet_unref(pkt);
+    return rc;
+}
+
+// av_interleaved_write_frame plus the mux latency, output counters and media progress
+int metrics_write_frame(AVFormatContext *avfc, AVPacket *pkt, bool interleave = true) {
+    Metrics *m = metrics();
+    if (!m) {
+        return muxer_write_frame(avfc, pkt, interleave);
+    }
+    AVStream *stream = avfc->streams[pkt->stream_index];
+    enum AVMediaType type = stream->codecpar->codec_type;
+    int size = pkt->size;
+    int64_t end_pts = pkt->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : pkt->pts + pkt->duration;
+
+    int64_t start = metrics_now_ns();
+    int rc = muxer_write_frame(avfc, pkt, interleave);
+    metrics_record(METRICS_STAGE_MUX, type, start);
+    if (rc < 0) {
+        return rc;
+    }
+
+    metrics_add(METRICS_PACKETS_OUT, type, 1);
+    metrics_add(METRICS_BYTES_OUT, type, size);
+    if (end_pts != AV_NOPTS_VALUE) {
+        int64_t us = av_rescale_q(end_pts, stream->time_base, AV_TIME_BASE_Q);
+        int64_t seen = m->media_time_us.load(std::memory_order_relaxed);
+        while (us > seen && !m->media_time_us.compare_exchange_weak(seen, us, std::memory_order_relaxed)) {
+        }
+    }
+    return rc;
+}
+
+// renders into memory and goes through write_file_atomic(), a scraper never sees a half written file
+void metrics_write_file(const std::string &path, void (*write)(Metrics*, FILE*), Metrics *m) {
+    char *data = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&data, &size);
+    if (!f) {
+        logging("[ERROR] failed to render %s", path.c_str());
+        return;
+    }
+    write(m, f);
+    if (fclose(f) == 0) {
+        write_file_atomic(path, data, size);
+    } else {
+        logging("[ERROR] failed to render %s", path.c_str());
+    }
+    free(data);
+}
+
+void metrics_write_prometheus(Metrics *m, FILE *f) {
+    // coarse cumulative buckets derived from the fine grained histogram
+    static const double le[] = {1e-6, 4e-6, 16e-6, 64e-6, 256e-6, 1e-3, 4e-3, 16e-3, 64e-3, 256e-3, 1, 4};
+
+    fprintf(f, "# HELP learn_libav_stage_latency_seconds Time spent in one libav call per stage.\n");
+    fprintf(f, "# TYPE learn_libav_stage_latency_seconds histogram\n");
+    for (int stage = 0; stage < METRICS_NB_STAGES; stage++) {
+        for (int stream = 0; stream < METRICS_NB_STREAMS; stream++) {
+            LatencyHistogram &h = m->latency[stage][stream];
+            if (h.get_count() == 0) {
+                continue;
+            }
+            const char *labels[2] = {metrics_stage_names[stage], metrics_stream_names[stream]};
+            for (double limit : le) {
+                fprintf(f, "learn_libav_stage_latency_seconds_bucket{stage=\"%s\",stream=\"%s\",le=\"%g\"} %lld\n",
+                        labels[0], labels[1], limit, (long long) h.count_below((int64_t) (limit * 1e9)));
+            }
+            fprintf(f, "learn_libav_stage_latency_seconds_bucket{stage=\"%s\",stream=\"%s\",le=\"+Inf\"} %lld\n",
+                    labels[0], labels[1], (long long) h.get_count());
+            fprintf(f, "learn_libav_stage_latency_seconds_sum{stage=\"%s\",stream=\"%s\"} %.9f\n",
+                    labels[0], labels[1], h.get_sum_ns() / 1e9);
+            fprintf(f, "learn_libav_stage_latency_seconds_count{stage=\"%s\",stream=\"%s\"} %lld\n",
+                    labels[0], labels[1], (long long) h.get_count());
+        }
+    }
+
+    for (int counter = 0; counter < METRICS_NB_COUNTERS; counter++) {
+        fprintf(f, "# TYPE learn_libav_%s_total counter\n", metrics_counter_names[counter]);
+        for (int stream = 0; stream < METRICS_NB_STREAMS; stream++) {
+            fprintf(f, "learn_libav_%s_total{stream=\"%s\"} %lld\n", metrics_counter_names[counter],
+                    metrics_stream_names[stream], (long long) m->counters[stream][counter].load());
+        }
+    }
+
+    fprintf(f, "# TYPE learn_libav_fps gauge\nlearn_libav_fps %.3f\n", m->fps);
+    fprintf(f, "# TYPE learn_libav_speed gauge\nlearn_libav_speed %.3f\n", m->speed);
+    fprintf(f, "# TYPE learn_libav_media_seconds gauge\nlearn_libav_media_seconds %.3f\n", m->media_time_us / 1e6);
+}
+
+void metrics_write_json(Metrics *m, FILE *f) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m->start).count();
+    int64_t frames = m->counters[METRICS_STREAM_VIDEO][METRICS_FRAMES_ENCODED];
+    fprintf(f, "{\n  \"seconds\": %.3f,\n  \"fps\": %.3f,\n  \"speed\": %.3f,\n  \"streams\": {",
+            seconds, seconds > 0 ? frames / seconds : 0.0, seconds > 0 ? m->media_time_us / 1e6 / seconds : 0.0);
+    for (int stream = 0; stream < METRICS_NB_STREAMS; stream++) {
+        fprintf(f, "%s\n    \"%s\": {\n      \"counters\": {", stream ? "," : "", metrics_stream_names[stream]);
+        for (int counter = 0; counter < METRICS_NB_COUNTERS; counter++) {
+            fprintf(f, "%s\"%s\": %lld", counter ? ", " : "", metrics_counter_names[counter],
+                    (long long) m->counters[stream][counter].load());
+        }
+        fprintf(f, "},\n      \"stages\": {");
+        bool first = true;
+        for (int stage = 0; stage < METRICS_NB_STAGES; stage++) {
+            LatencyHistogram &h = m->latency[stage][stream];
+            if (h.get_count() == 0) {
+                continue;
+            }
+            fprintf(f, "%s\n        \"%s\": {\"count\": %lld, \"total_ms\": %.3f, \"mean_us\": %.3f, "
+                       "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+                    first ? "" : ",", metrics_stage_names[stage], (long long) h.get_count(), h.get_sum_ns() / 1e6,
+                    h.get_sum_ns() / 1e3 / h.get_count(), h.quantile_ns(0.5) / 1e3, h.quantile_ns(0.9) / 1e3,
+                    h.quantile_ns(0.99) / 1e3, h.get_max_ns() / 1e3);
+            first = false;
+        }
+        fprintf(f, "%s}\n    }", first ? "" : "\n      ");
+    }
+    fprintf(f, "\n  }\n}\n");
+}
+
+// updates the fps/speed gauges once per interval and republishes the prometheus file
+void metrics_reporter(Metrics *m) {
+    auto last = m->start;
+    int64_t last_frames = 0;
+    int64_t last_media_us = 0;
+    std::unique_lock<std::mutex> lock(m->mutex);
+    while (!m->wake.wait_for(lock, std::chrono::milliseconds(METRICS_INTERVAL_MS), [m] { return m->stopping; })) {
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - last).count();
+        int64_t frames = m->counters[METRICS_STREAM_VIDEO][METRICS_FRAMES_ENCODED];
+        int64_t media_us = m->media_time_us;
+        m->fps = (frames - last_frames) / seconds;
+        m->speed = (media_us - last_media_us) / 1e6 / seconds;
+        last = now;
+        last_frames = frames;
+        last_media_us = media_us;
+
+        logging("[INFO] progress: %lld frames, %.1f fps, time %.2fs, speed %.2fx",
+                (long long) frames, m->fps, media_us / 1e6, m->speed);
+        if (!m->prom_path.empty()) {
+            metrics_write_file(m->prom_path, metrics_write_prometheus, m);
+        }
+    }
+}
+
+void start_metrics(const char *prom_path, const char *json_path) {
+    Metrics *m = new Metrics();
+    m->prom_path = prom_path ? prom_path : "";
+    m->json_path = json_path ? json_path : "";
+    m->start = std::chrono::steady_clock::now();
+    m->reporter = std::thread(metrics_reporter, m);
+    metrics() = m;
+}
+
+// writes the final prometheus file and the JSON summary, call once every worker has stopped
+void stop_metrics() {
+    Metrics *m = metrics();
+    if (!m) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m->mutex);
+        m->stopping = true;
+    }
+    m->wake.notify_all();
+    m->reporter.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m->start).count();
+    m->fps = seconds > 0 ? m->counters[METRICS_STREAM_VIDEO][METRICS_FRAMES_ENCODED] / seconds : 0;
+    m->speed = seconds > 0 ? m->media_time_us / 1e6 / seconds : 0;
+    if (!m->prom_path.empty()) {
+        metrics_write_file(m->prom_path, metrics_write_prometheus, m);
+    }
+    if (!m->json_path.empty()) {
+        metrics_write_file(m->json_path, metrics_write_json, m);
+    }
+    metrics() = NULL;
+    delete m;
+}
+
+#endif //LEARN_LIBAV_METRICS_H
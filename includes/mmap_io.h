@@ -0,0 +1,220 @@
+#ifndef LEARN_LIBAV_MMAP_IO_H
+#define LEARN_LIBAV_MMAP_IO_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+
+#define MMAP_IO_BUFFER_SIZE (256 * 1024)
+// how far ahead of the read position the kernel is asked to fault pages in
+#define MMAP_IO_READAHEAD (16 * 1024 * 1024)
+
+/*
+ * Read-only file mapping behind a custom AVIOContext. Reads are served
+ * straight from the page cache mapping: no read() syscall per chunk and no
+ * copy through a kernel buffer, only the copy into libavformat's buffer.
+ */
+class MmapInput : public CustomIO {
+public:
+    ~MmapInput() override {
+        if (data && data != MAP_FAILED) {
+            munmap(data, size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int open_file(const char *filename) {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            return AVERROR(errno);
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            return AVERROR(errno);
+        }
+        size = st.st_size;
+        if (size == 0) {
+            return AVERROR_INVALIDDATA;
+        }
+        data = (uint8_t*) mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+            return AVERROR(errno);
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+        prefetch();
+        return 0;
+    }
+
+    int read(uint8_t *buf, int buf_size) {
+        int64_t left = size - pos;
+        if (left <= 0) {
+            return AVERROR_EOF;
+        }
+        int n = (int) std::min<int64_t>(buf_size, left);
+        memcpy(buf, data + pos, n);
+        pos += n;
+        if (pos >= prefetched_until - MMAP_IO_READAHEAD / 2) {
+            prefetch();
+        }
+        return n;
+    }
+
+    int64_t seek(int64_t offset, int whence) {
+        switch (whence & ~AVSEEK_FORCE) {
+            case AVSEEK_SIZE:
+                return size;
+            case SEEK_SET:
+                break;
+            case SEEK_CUR:
+                offset += pos;
+                break;
+            case SEEK_END:
+                offset += size;
+                break;
+            default:
+                return AVERROR(EINVAL);
+        }
+        if (offset < 0 || offset > size) {
+            return AVERROR(EINVAL);
+        }
+        if (offset < pos || offset > prefetched_until) {
+            // random access, the sequential readahead window is useless from here
+            prefetched_until = offset;
+        }
+        pos = offset;
+        prefetch();
+        return pos;
+    }
+
+private:
+    void prefetch() {
+        long page = sysconf(_SC_PAGESIZE);
+        int64_t begin = std::max(pos, prefetched_until) / page * page;
+        int64_t end = std::min<int64_t>(size, pos + MMAP_IO_READAHEAD);
+        if (end > begin) {
+            madvise(data + begin, end - begin, MADV_WILLNEED);
+            prefetched_until = end;
+        }
+    }
+
+    int fd = -1;
+    uint8_t *data = NULL;
+    int64_t size = 0;
+    int64_t pos = 0;
+    int64_t prefetched_until = 0;
+};
+
+int mmap_read_packet(void *opaque, uint8_t *buf, int buf_size) {
+    return ((MmapInput*) opaque)->read(buf, buf_size);
+}
+
+int64_t mmap_seek(void *opaque, int64_t offset, int whence) {
+    return ((MmapInput*) opaque)->seek(offset, whence);
+}
+
+/*
+ * Opens filename through a MmapInput, *avfc may be preallocated to carry
+ * options. Like avformat_open_input, a preallocated context is freed and
+ * *avfc set to NULL on failure.
+ */
+int open_mmap_input(const char *filename, AVFormatContext **avfc, AVDictionary **opts) {
+    MmapInput *input = new MmapInput();
+    int rc = input->open_file(filename);
+    if (rc < 0) {
+        logging("[ERROR] failed to map %s: %s", filename, av_err2string(rc).c_str());
+        delete input;
+        avformat_free_context(*avfc);
+        *avfc = NULL;
+        return rc;
+    }
+
+    uint8_t *buffer = (uint8_t*) av_malloc(MMAP_IO_BUFFER_SIZE);
+    AVIOContext *pb = buffer ? avio_alloc_context(buffer, MMAP_IO_BUFFER_SIZE, 0, input, mmap_read_packet, NULL, mmap_seek) : NULL;
+    if (!pb) {
+        av_free(buffer);
+        delete input;
+        avformat_free_context(*avfc);
+        *avfc = NULL;
+        return AVERROR(ENOMEM);
+    }
+
+    if (!*avfc) {
+        *avfc = avformat_alloc_context();
+    }
+    if (!*avfc) {
+        free_custom_io(&pb);
+        return AVERROR(ENOMEM);
+    }
+    (*avfc)->pb = pb;
+    (*avfc)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // avformat_open_input frees the context on failure but leaves a custom pb alone
+    rc = avformat_open_input(avfc, filename, NULL, opts);
+    if (rc < 0) {
+        free_custom_io(&pb);
+    }
+    return rc;
+}
+
+/*
+ * Demuxes a whole file through the default file protocol and through the
+ * mmap input, alternating so both see the same page cache state, and
+ * reports the best throughput of each.
+ */
+int benchmark_input_io(const char *filename, int rounds) {
+    double best[2] = {0, 0};
+    const char *names[2] = {"file protocol", "mmap"};
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        return -1;
+    }
+
+    for (int round = 0; round < rounds; round++) {
+        for (int use_mmap = 0; use_mmap < 2; use_mmap++) {
+            auto start = std::chrono::steady_clock::now();
+            AVFormatContext *avfc = NULL;
+            int rc = use_mmap ? open_mmap_input(filename, &avfc, NULL) : avformat_open_input(&avfc, filename, NULL, NULL);
+            if (rc < 0) {
+                logging("[ERROR] failed to open %s: %s", filename, av_err2string(rc).c_str());
+                av_packet_free(&packet);
+                return -1;
+            }
+
+            int64_t bytes = 0;
+            while (av_read_frame(avfc, packet) >= 0) {
+                bytes += packet->size;
+                av_packet_unref(packet);
+            }
+            close_format_context(&avfc);
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double mb_per_second = bytes / seconds / 1e6;
+            logging("[INFO] round %d %-13s: %lld bytes in %.3fs, %.1f MB/s", round, names[use_mmap], bytes, seconds, mb_per_second);
+            best[use_mmap] = std::max(best[use_mmap], mb_per_second);
+        }
+    }
+    av_packet_free(&packet);
+
+    logging("[INFO] best demux throughput: file protocol %.1f MB/s, mmap %.1f MB/s (%.2fx)",
+            best[0], best[1], best[0] > 0 ? best[1] / best[0] : 0.0);
+    return 0;
+}
+
+#endif //LEARN_LIBAV_MMAP_IO_H
@@ -0,0 +1,245 @@
+#ifndef LEARN_LIBAV_MULTI_OUTPUT_H
+#define LEARN_LIBAV_MULTI_OUTPUT_H
+
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "output.h"
+
+/*
+ * One output of a single pass remux. Every input packet is referenced, not
+ * copied, into each output, which has its own stream mapping, bitstream
+ * filters and timestamp rescaling.
+ */
+typedef struct {
+    std::string filename;
+    // muxer short name, empty to guess it from the filename
+    std::string format;
+    bool fragmented;
+    FormatContextPtr avfc;
+    // input stream index -> output stream index, -1 when the stream is dropped
+    std::vector<int> stream_map;
+    // per input stream, NULL when packets go to the muxer unchanged
+    std::vector<BSFContextPtr> bsfs;
+    PacketPtr packet;
+    int64_t packets;
+    int64_t bytes;
+} RemuxOutput;
+
+// [format:]filename, format is a muxer name or ts, mkv, fmp4
+int parse_output_spec(const char *spec, RemuxOutput *output) {
+    const char *colon = strchr(spec, ':');
+    output->filename = spec;
+    if (colon) {
+        std::string format(spec, colon - spec);
+        if (format == "ts") {
+            format = "mpegts";
+        } else if (format == "mkv") {
+            format = "matroska";
+        } else if (format == "fmp4") {
+            format = "mp4";
+            output->fragmented = true;
+        }
+        if (av_guess_format(format.c_str(), NULL, NULL)) {
+            output->format = format;
+            output->filename = colon + 1;
+        }
+    }
+    if (output->filename.empty()) {
+        logging("[ERROR] output spec %s has no filename", spec);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Filters a stream needs to go from the input container into this output:
+ * length prefixed H.264/HEVC (MP4, MKV) has to become Annex B in MPEG-TS,
+ * ADTS AAC (MPEG-TS) has to lose its headers everywhere else.
+ */
+const char *remux_bsf_name(AVFormatContext *output, AVCodecParameters *par) {
+    bool to_ts = strcmp(output->oformat->name, "mpegts") == 0;
+    // avcC / hvcC extradata starts with version 1, Annex B with a start code
+    bool length_prefixed = par->extradata_size > 0 && par->extradata[0] == 1;
+    if (to_ts && length_prefixed && par->codec_id == AV_CODEC_ID_H264) {
+        return "h264_mp4toannexb";
+    }
+    if (to_ts && length_prefixed && par->codec_id == AV_CODEC_ID_HEVC) {
+        return "hevc_mp4toannexb";
+    }
+    if (!to_ts && par->codec_id == AV_CODEC_ID_AAC && par->extradata_size == 0) {
+        return "aac_adtstoasc";
+    }
+    return NULL;
+}
+
+int add_remux_stream(RemuxOutput *output, AVStream *in_stream) {
+    AVCodecParameters *par = in_stream->codecpar;
+    AVStream *out_stream = avformat_new_stream(output->avfc.get(), NULL);
+    if (!out_stream) {
+        logging("[ERROR] failed to allocating output stream");
+        return AVERROR(ENOMEM);
+    }
+
+    BSFContextPtr bsf;
+    const char *bsf_name = remux_bsf_name(output->avfc.get(), par);
+    if (bsf_name) {
+        const AVBitStreamFilter *filter = av_bsf_get_by_name(bsf_name);
+        AVBSFContext *ctx = NULL;
+        if (!filter || av_bsf_alloc(filter, &ctx) < 0) {
+            logging("[ERROR] bitstream filter %s is not available", bsf_name);
+            return AVERROR_BSF_NOT_FOUND;
+        }
+        bsf.reset(ctx);
+        ctx->time_base_in = in_stream->time_base;
+        int rc = avcodec_parameters_copy(ctx->par_in, par);
+        if (rc < 0 || (rc = av_bsf_init(ctx)) < 0) {
+            logging("[ERROR] failed to init %s for %s: %s", bsf_name, output->filename.c_str(), av_err2string(rc).c_str());
+            return rc;
+        }
+        par = ctx->par_out;
+        debug("%s: stream %d through %s", output->filename.c_str(), in_stream->index, bsf_name);
+    }
+
+    int rc = avcodec_parameters_copy(out_stream->codecpar, par);
+    if (rc < 0) {
+        logging("[ERROR] failed to copy parameter from input stream");
+        return rc;
+    }
+    // the input container's tag may mean nothing (or something else) in this one
+    out_stream->codecpar->codec_tag = 0;
+    out_stream->time_base = bsf ? bsf->time_base_out : in_stream->time_base;
+    output->stream_map[in_stream->index] = out_stream->index;
+    output->bsfs[in_stream->index] = std::move(bsf);
+    return 0;
+}
+
+int open_remux_output(RemuxOutput *output, AVFormatContext *input) {
+    AVFormatContext *ctx = NULL;
+    if (output->format.empty() && is_segment_target(output->filename.c_str())) {
+        output->format = "mp4";
+    }
+    avformat_alloc_output_context2(&ctx, NULL, output->format.empty() ? NULL : output->format.c_str(),
+                                   output->filename.c_str());
+    if (!ctx) {
+        logging("[ERROR] Could not create output context for %s", output->filename.c_str());
+        return AVERROR_UNKNOWN;
+    }
+    output->avfc.reset(ctx);
+    output->packet.reset(av_packet_alloc());
+    if (!output->packet) {
+        return AVERROR(ENOMEM);
+    }
+
+    output->stream_map.assign(input->nb_streams, -1);
+    output->bsfs.resize(input->nb_streams);
+    for (unsigned int i = 0; i < input->nb_streams; i++) {
+        AVMediaType type = input->streams[i]->codecpar->codec_type;
+        if (type != AVMEDIA_TYPE_AUDIO && type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_SUBTITLE) {
+            continue;
+        }
+        int rc = add_remux_stream(output, input->streams[i]);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+
+    int rc = open_output_io(ctx, output->filename.c_str());
+    if (rc < 0) {
+        logging("[ERROR] Could not open output file '%s'", output->filename.c_str());
+        return rc;
+    }
+    AVDictionary *opts = NULL;
+    if (output->fragmented) {
+        av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    rc = avformat_write_header(ctx, &opts);
+    av_dict_free(&opts);
+    if (rc < 0) {
+        logging("[ERROR] Error occurred when writing header of %s: %s", output->filename.c_str(), av_err2string(rc).c_str());
+        return rc;
+    }
+    debug("wrote headers: %s", output->filename.c_str());
+    return 0;
+}
+
+int write_remux_packet(RemuxOutput *output, AVPacket *pkt, AVRational time_base, int out_index) {
+    AVStream *out_stream = output->avfc->streams[out_index];
+    pkt->stream_index = out_index;
+    pkt->pts = av_rescale_q_rnd(pkt->pts, time_base, out_stream->time_base,
+                                static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+    pkt->dts = av_rescale_q_rnd(pkt->dts, time_base, out_stream->time_base,
+                                static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+    pkt->duration = av_rescale_q(pkt->duration, time_base, out_stream->time_base);
+    pkt->pos = -1;
+    output->packets++;
+    output->bytes += pkt->size;
+    // the muxer takes over the reference
+    int rc = av_interleaved_write_frame(output->avfc.get(), pkt);
+    if (rc < 0) {
+        logging("[ERROR] Error muxing packet into %s: %s", output->filename.c_str(), av_err2string(rc).c_str());
+    }
+    return rc;
+}
+
+// pkt is NULL to drain the stream's bitstream filter at the end
+int remux_to_output(RemuxOutput *output, AVFormatContext *input, int in_index, AVPacket *pkt) {
+    int out_index = output->stream_map[in_index];
+    if (out_index < 0) {
+        return 0;
+    }
+    AVBSFContext *bsf = output->bsfs[in_index].get();
+    if (!pkt && !bsf) {
+        return 0;
+    }
+
+    AVPacket *ref = output->packet.get();
+    if (pkt) {
+        int rc = av_packet_ref(ref, pkt);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    if (!bsf) {
+        return write_remux_packet(output, ref, input->streams[in_index]->time_base, out_index);
+    }
+
+    int rc = av_bsf_send_packet(bsf, pkt ? ref : NULL);
+    if (rc < 0) {
+        av_packet_unref(ref);
+        logging("[ERROR] failed to filter packet for %s: %s", output->filename.c_str(), av_err2string(rc).c_str());
+        return rc;
+    }
+    while ((rc = av_bsf_receive_packet(bsf, ref)) >= 0) {
+        rc = write_remux_packet(output, ref, bsf->time_base_out, out_index);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return rc == AVERROR(EAGAIN) || rc == AVERROR_EOF ? 0 : rc;
+}
+
+int finish_remux_output(RemuxOutput *output, AVFormatContext *input) {
+    for (unsigned int i = 0; i < input->nb_streams; i++) {
+        int rc = remux_to_output(output, input, i, NULL);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    int rc = av_write_trailer(output->avfc.get());
+    if (rc < 0) {
+        return rc;
+    }
+    debug("wrote trailer: %s", output->filename.c_str());
+    return finish_output_io(output->avfc.get());
+}
+
+#endif //LEARN_LIBAV_MULTI_OUTPUT_H
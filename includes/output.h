@@ -0,0 +1,41 @@
+#ifndef LEARN_LIBAV_OUTPUT_H
+#define LEARN_LIBAV_OUTPUT_H
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "async_io.h"
+#include "handles.h"
+#include "log.h"
+#include "segmenter.h"
+
+// process wide choices on how outputs are written, set once from the command line
+typedef struct {
+    bool use_async_io;
+} OutputOptions;
+
+OutputOptions &output_options() {
+    static OutputOptions options = {};
+    return options;
+}
+
+// opens avfc->pb for filename honouring output_options(), close with close_format_context
+int open_output_io(AVFormatContext *avfc, const char *filename) {
+    if (avfc->oformat->flags & AVFMT_NOFILE) {
+        return 0;
+    }
+    if (is_segment_target(filename)) {
+        return open_segment_output(avfc, filename);
+    }
+    if (output_options().use_async_io) {
+        int rc = open_async_output(filename, &avfc->pb);
+        if (rc >= 0) {
+            avfc->flags |= AVFMT_FLAG_CUSTOM_IO;
+        }
+        return rc;
+    }
+    return avio_open(&avfc->pb, filename, AVIO_FLAG_WRITE);
+}
+
+#endif //LEARN_LIBAV_OUTPUT_H
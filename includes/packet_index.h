@@ -0,0 +1,366 @@
+#ifndef LEARN_LIBAV_PACKET_INDEX_H
+#define LEARN_LIBAV_PACKET_INDEX_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "input.h"
+#include "log.h"
+
+#define PACKET_INDEX_MAGIC "LAVPIDX1"
+#define PACKET_INDEX_VERSION 2
+#define PACKET_INDEX_SUFFIX ".idx"
+
+/*
+ * <input>.idx layout, all fields in host byte order and naturally aligned
+ * so the file is used in place through mmap:
+ *
+ *   PacketIndexHeader
+ *   PacketIndexStream[nb_streams]
+ *   PacketIndexEntry[nb_entries], grouped by stream, in demux order
+ *   int64_t[sum of nb_keyframes], grouped by stream: the stream's entry
+ *       number of every keyframe, sorted by pts, so seeks bisect them
+ *
+ * The size and mtime of the source are recorded, an index whose source
+ * changed is ignored.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_streams;
+    int64_t source_size;
+    int64_t source_mtime_ns;
+    int64_t nb_entries;
+} PacketIndexHeader;
+
+typedef struct {
+    int32_t codec_type;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    int32_t reserved;
+    int64_t first_entry;
+    int64_t nb_entries;
+    int64_t nb_keyframes;
+} PacketIndexStream;
+
+typedef struct {
+    int64_t pts;
+    int64_t dts;
+    int64_t pos;
+    int32_t size;
+    int32_t flags;
+} PacketIndexEntry;
+
+std::string packet_index_path(const char *filename) {
+    return std::string(filename) + PACKET_INDEX_SUFFIX;
+}
+
+int source_identity(const char *filename, int64_t *size, int64_t *mtime_ns) {
+    struct stat st;
+    if (stat(filename, &st) < 0) {
+        return -1;
+    }
+    *size = st.st_size;
+    *mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/*
+ * Read-only view of an index file. Nothing is parsed or copied on load,
+ * lookups read the mapped entries in place.
+ */
+class PacketIndex {
+public:
+    ~PacketIndex() {
+        if (data) {
+            munmap(data, size);
+        }
+    }
+
+    int map(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(PacketIndexHeader)) {
+            close(fd);
+            return -1;
+        }
+        size = st.st_size;
+        void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return -1;
+        }
+        data = (uint8_t*) mapped;
+
+        const PacketIndexHeader *h = header();
+        if (memcmp(h->magic, PACKET_INDEX_MAGIC, 8) == 0 && h->version != PACKET_INDEX_VERSION) {
+            logging("[WARN] %s is a version %u packet index, run index_media again", path, h->version);
+            return -1;
+        }
+        size_t expected = sizeof(PacketIndexHeader) + (size_t) h->nb_streams * sizeof(PacketIndexStream);
+        bool valid = memcmp(h->magic, PACKET_INDEX_MAGIC, 8) == 0 && h->version == PACKET_INDEX_VERSION &&
+                     h->nb_entries >= 0 && expected <= size;
+        int64_t nb_keyframes = 0;
+        for (uint32_t i = 0; valid && i < h->nb_streams; i++) {
+            const PacketIndexStream *s = stream(i);
+            valid = s->first_entry >= 0 && s->nb_entries >= 0 && s->first_entry + s->nb_entries <= h->nb_entries &&
+                    s->nb_keyframes >= 0 && s->nb_keyframes <= s->nb_entries;
+            first_keyframe.push_back(nb_keyframes);
+            nb_keyframes += valid ? s->nb_keyframes : 0;
+        }
+        if (!valid || expected + h->nb_entries * sizeof(PacketIndexEntry) + nb_keyframes * sizeof(int64_t) != size) {
+            logging("[WARN] %s is not a valid packet index", path);
+            return -1;
+        }
+        return 0;
+    }
+
+    const PacketIndexHeader *header() const {
+        return (const PacketIndexHeader*) data;
+    }
+
+    int nb_streams() const {
+        return header()->nb_streams;
+    }
+
+    // NULL for a stream the index does not have, e.g. one that appeared after it was built
+    const PacketIndexStream *stream(int index) const {
+        if (index < 0 || index >= nb_streams()) {
+            return NULL;
+        }
+        return (const PacketIndexStream*) (data + sizeof(PacketIndexHeader)) + index;
+    }
+
+    // the entries of an existing stream
+    const PacketIndexEntry *entries(int index) const {
+        return all_entries() + stream(index)->first_entry;
+    }
+
+    // entry numbers of the keyframes of an existing stream, in pts order
+    const int64_t *keyframe_entries(int index) const {
+        const int64_t *all = (const int64_t*) (all_entries() + header()->nb_entries);
+        return all + first_keyframe[index];
+    }
+
+    AVRational time_base(int index) const {
+        return AVRational{stream(index)->time_base_num, stream(index)->time_base_den};
+    }
+
+    // the video stream with the most packets, -1 when there is none
+    int best_video_stream() const {
+        int best = -1;
+        for (int i = 0; i < nb_streams(); i++) {
+            if (stream(i)->codec_type == AVMEDIA_TYPE_VIDEO &&
+                    (best < 0 || stream(i)->nb_entries > stream(best)->nb_entries)) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // sorted, distinct pts of the keyframes of a stream
+    std::vector<int64_t> keyframes(int index) const {
+        std::vector<int64_t> pts;
+        if (!stream(index)) {
+            return pts;
+        }
+        const PacketIndexEntry *e = entries(index);
+        const int64_t *keys = keyframe_entries(index);
+        for (int64_t i = 0; i < stream(index)->nb_keyframes; i++) {
+            int64_t key_pts = e[keys[i]].pts;
+            if (key_pts != AV_NOPTS_VALUE && (pts.empty() || pts.back() != key_pts)) {
+                pts.push_back(key_pts);
+            }
+        }
+        return pts;
+    }
+
+    /*
+     * Last keyframe at or before pts, the first keyframe when pts is before
+     * all of them, NULL when the stream has none. A binary search over the
+     * stream's keyframe table.
+     */
+    const PacketIndexEntry *keyframe_before(int index, int64_t pts) const {
+        if (!stream(index)) {
+            return NULL;
+        }
+        const PacketIndexEntry *e = entries(index);
+        const int64_t *keys = keyframe_entries(index);
+        const int64_t *end = keys + stream(index)->nb_keyframes;
+        // keyframes without pts sort first as AV_NOPTS_VALUE and are never returned
+        const int64_t *first = std::partition_point(keys, end, [e](int64_t entry) {
+            return e[entry].pts == AV_NOPTS_VALUE;
+        });
+        if (first == end) {
+            return NULL;
+        }
+        const int64_t *after = std::partition_point(first, end, [e, pts](int64_t entry) {
+            return e[entry].pts <= pts;
+        });
+        return &e[after == first ? *first : *(after - 1)];
+    }
+
+private:
+    const PacketIndexEntry *all_entries() const {
+        return (const PacketIndexEntry*) (data + sizeof(PacketIndexHeader) + nb_streams() * sizeof(PacketIndexStream));
+    }
+
+    uint8_t *data = NULL;
+    size_t size = 0;
+    // offset of every stream's part of the keyframe table
+    std::vector<int64_t> first_keyframe;
+};
+
+// maps <filename>.idx when it exists and still describes filename, NULL otherwise
+std::unique_ptr<PacketIndex> load_packet_index(const char *filename) {
+    std::string path = packet_index_path(filename);
+    int64_t size, mtime_ns;
+    if (access(path.c_str(), R_OK) != 0 || source_identity(filename, &size, &mtime_ns) < 0) {
+        return NULL;
+    }
+    std::unique_ptr<PacketIndex> index(new PacketIndex());
+    if (index->map(path.c_str()) < 0) {
+        return NULL;
+    }
+    if (index->header()->source_size != size || index->header()->source_mtime_ns != mtime_ns) {
+        logging("[WARN] %s is older than its source, ignoring it", path.c_str());
+        return NULL;
+    }
+    debug("loaded %s: %lld packets in %d streams", path.c_str(), (long long) index->header()->nb_entries, index->nb_streams());
+    return index;
+}
+
+/*
+ * Seeks the demuxer straight to the keyframe before pts. Formats that have
+ * to bisect the file to seek by time (MPEG-TS/PS) get a byte seek to the
+ * recorded position, the others a seek to the exact keyframe timestamp.
+ */
+int index_seek(AVFormatContext *avfc, const PacketIndex *index, int stream_index, int64_t pts) {
+    const PacketIndexEntry *key = index->keyframe_before(stream_index, pts);
+    if (!key) {
+        // a stream the index has no keyframes for is seeked the usual way
+        return av_seek_frame(avfc, stream_index, pts, AVSEEK_FLAG_BACKWARD);
+    }
+    if ((avfc->iformat->flags & AVFMT_TS_DISCONT) && !(avfc->iformat->flags & AVFMT_NO_BYTE_SEEK) && key->pos >= 0) {
+        return av_seek_frame(avfc, stream_index, key->pos, AVSEEK_FLAG_BYTE);
+    }
+    return av_seek_frame(avfc, stream_index, key->pts, AVSEEK_FLAG_BACKWARD);
+}
+
+typedef struct {
+    int64_t packets;
+    int64_t keyframes;
+    int64_t bytes;
+    double seconds;
+} PacketIndexStats;
+
+// lays the whole index out in memory and replaces path with it in one write_file_atomic()
+int write_packet_index(const char *path, PacketIndexHeader &header, std::vector<PacketIndexStream> &streams,
+                       std::vector<std::vector<PacketIndexEntry>> &entries, std::vector<std::vector<int64_t>> &keyframes) {
+    std::vector<uint8_t> buffer;
+    auto append = [&](const void *data, size_t size) {
+        buffer.insert(buffer.end(), (const uint8_t*) data, (const uint8_t*) data + size);
+    };
+    append(&header, sizeof(header));
+    append(streams.data(), streams.size() * sizeof(PacketIndexStream));
+    for (auto &stream_entries : entries) {
+        append(stream_entries.data(), stream_entries.size() * sizeof(PacketIndexEntry));
+    }
+    for (auto &stream_keyframes : keyframes) {
+        append(stream_keyframes.data(), stream_keyframes.size() * sizeof(int64_t));
+    }
+    return write_file_atomic(path, buffer.data(), buffer.size());
+}
+
+/*
+ * One demux-only pass over filename, nothing is decoded and stream info
+ * is not probed. Every packet's pts, dts, byte position, size and flags go
+ * into <filename>.idx.
+ */
+int build_packet_index(const char *filename, PacketIndexStats *stats) {
+    auto start = std::chrono::steady_clock::now();
+    PacketIndexHeader header = {};
+    memcpy(header.magic, PACKET_INDEX_MAGIC, 8);
+    header.version = PACKET_INDEX_VERSION;
+    if (source_identity(filename, &header.source_size, &header.source_mtime_ns) < 0) {
+        logging("[ERROR] can not stat %s", filename);
+        return -1;
+    }
+
+    AVFormatContext *ctx = NULL;
+    int rc = open_input(filename, &ctx, NULL);
+    if (rc < 0) {
+        logging("[ERROR] can not open input file: %s, %s", filename, av_err2string(rc).c_str());
+        return -1;
+    }
+    FormatContextPtr avfc(ctx);
+    PacketPtr packet(av_packet_alloc());
+    if (!packet) {
+        return -1;
+    }
+
+    std::vector<std::vector<PacketIndexEntry>> entries;
+    while (av_read_frame(avfc.get(), packet.get()) >= 0) {
+        // streams can appear mid-file in MPEG-TS
+        if (packet->stream_index >= (int) entries.size()) {
+            entries.resize(avfc->nb_streams);
+        }
+        PacketIndexEntry e = {packet->pts, packet->dts, packet->pos, packet->size, packet->flags};
+        entries[packet->stream_index].push_back(e);
+        stats->bytes += packet->size;
+        av_packet_unref(packet.get());
+    }
+    entries.resize(avfc->nb_streams);
+
+    std::vector<PacketIndexStream> streams;
+    std::vector<std::vector<int64_t>> keyframes(avfc->nb_streams);
+    for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+        PacketIndexStream s = {};
+        s.codec_type = avfc->streams[i]->codecpar->codec_type;
+        s.time_base_num = avfc->streams[i]->time_base.num;
+        s.time_base_den = avfc->streams[i]->time_base.den;
+        s.first_entry = header.nb_entries;
+        s.nb_entries = entries[i].size();
+        for (int64_t j = 0; j < s.nb_entries; j++) {
+            if (entries[i][j].flags & AV_PKT_FLAG_KEY) {
+                keyframes[i].push_back(j);
+            }
+        }
+        // AV_NOPTS_VALUE is the smallest int64_t, keyframes without pts go first
+        std::stable_sort(keyframes[i].begin(), keyframes[i].end(), [&](int64_t a, int64_t b) {
+            return entries[i][a].pts < entries[i][b].pts;
+        });
+        s.nb_keyframes = keyframes[i].size();
+        header.nb_entries += s.nb_entries;
+        stats->packets += s.nb_entries;
+        stats->keyframes += s.nb_keyframes;
+        streams.push_back(s);
+    }
+    header.nb_streams = streams.size();
+
+    rc = write_packet_index(packet_index_path(filename).c_str(), header, streams, entries, keyframes);
+    stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return rc;
+}
+
+#endif //LEARN_LIBAV_PACKET_INDEX_H
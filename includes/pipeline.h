@@ -0,0 +1,314 @@
+#ifndef LEARN_LIBAV_PIPELINE_H
+#define LEARN_LIBAV_PIPELINE_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "queue.h"
+#include "streaming.h"
+
+#define PIPELINE_PACKET_QUEUE_SIZE 64
+#define PIPELINE_FRAME_QUEUE_SIZE 8
+
+/*
+ * Staged transcoding: demux, per stream decode, per stream encode and mux
+ * each run on their own thread. Stages hand refcounted packets and frames
+ * to each other through bounded queues, so a slow stage applies back
+ * pressure instead of letting memory grow.
+ */
+typedef struct Pipeline {
+    StreamingContext *decoder;
+    StreamingContext *encoder;
+    StreamingParams sp;
+
+    BoundedQueue<AVPacket*> video_packets{PIPELINE_PACKET_QUEUE_SIZE};
+    BoundedQueue<AVPacket*> audio_packets{PIPELINE_PACKET_QUEUE_SIZE};
+    BoundedQueue<AVFrame*> video_frames{PIPELINE_FRAME_QUEUE_SIZE};
+    BoundedQueue<AVFrame*> audio_frames{PIPELINE_FRAME_QUEUE_SIZE};
+    BoundedQueue<AVPacket*> mux_packets{PIPELINE_PACKET_QUEUE_SIZE};
+
+    // stages that still feed mux_packets, the last one to finish closes it
+    std::atomic<int> mux_producers{0};
+    std::atomic<bool> failed{false};
+} Pipeline;
+
+void pipeline_abort(Pipeline *p) {
+    p->failed = true;
+    p->video_packets.close();
+    p->audio_packets.close();
+    p->video_frames.close();
+    p->audio_frames.close();
+    p->mux_packets.close();
+}
+
+void pipeline_release_mux(Pipeline *p) {
+    if (--p->mux_producers == 0) {
+        p->mux_packets.close();
+    }
+}
+
+AVPacket *pipeline_move_packet(AVPacket *src) {
+    AVPacket *pkt = packet_pool().acquire();
+    if (pkt) {
+        av_packet_move_ref(pkt, src);
+    }
+    return pkt;
+}
+
+AVFrame *pipeline_move_frame(AVFrame *src) {
+    AVFrame *frame = frame_pool().acquire();
+    if (frame) {
+        av_frame_move_ref(frame, src);
+    }
+    return frame;
+}
+
+int pipeline_packet_sink(void *opaque, AVPacket *pkt) {
+    Pipeline *p = (Pipeline*) opaque;
+    AVPacket *queued = pipeline_move_packet(pkt);
+    if (!queued) {
+        return AVERROR(ENOMEM);
+    }
+    if (!p->mux_packets.push(queued)) {
+        release_packet(&queued);
+        return AVERROR_EXIT;
+    }
+    return 0;
+}
+
+void demux_stage(Pipeline *p) {
+    StreamingContext *decoder = p->decoder;
+    StreamingContext *encoder = p->encoder;
+
+    PooledPacket input_packet(packet_pool().acquire());
+    if (!input_packet) {
+        logging("[ERROR] failed to allocated memory for AVPacket");
+        pipeline_abort(p);
+    }
+
+    while (!p->failed && metrics_read_frame(decoder->avfc.get(), input_packet.get()) >= 0) {
+        live_packet_read(decoder->avfc.get(), input_packet.get());
+        BoundedQueue<AVPacket*> *queue = NULL;
+        auto codec_type = decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type;
+        if (codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (p->sp.copy_video) {
+                av_packet_rescale_ts(input_packet.get(), decoder->video_avs->time_base, encoder->video_avs->time_base);
+                input_packet->stream_index = encoder->video_avs->index;
+                encoder->video_frames++;
+                queue = &p->mux_packets;
+            } else {
+                queue = &p->video_packets;
+            }
+        } else if (codec_type == AVMEDIA_TYPE_AUDIO) {
+            if (p->sp.copy_audio) {
+                av_packet_rescale_ts(input_packet.get(), decoder->audio_avs->time_base, encoder->audio_avs->time_base);
+                input_packet->stream_index = encoder->audio_avs->index;
+                queue = &p->mux_packets;
+            } else {
+                queue = &p->audio_packets;
+            }
+        } else {
+            av_packet_unref(input_packet.get());
+            continue;
+        }
+
+        AVPacket *pkt = pipeline_move_packet(input_packet.get());
+        if (!pkt) {
+            logging("[ERROR] failed to allocated memory for AVPacket");
+            pipeline_abort(p);
+            break;
+        }
+        if (!queue->push(pkt)) {
+            release_packet(&pkt);
+            break;
+        }
+    }
+
+    p->video_packets.close();
+    p->audio_packets.close();
+    pipeline_release_mux(p);
+}
+
+int pipeline_receive_frames(Pipeline *p, AVCodecContext *avcc, AVFrame *frame, BoundedQueue<AVFrame*> *out) {
+    while (true) {
+        int64_t start = metrics_clock();
+        int rc = avcodec_receive_frame(avcc, frame);
+        metrics_record(METRICS_STAGE_RECEIVE_FRAME, avcc->codec_type, start);
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            return 0;
+        } else if (rc < 0) {
+            logging("[ERROR] Error while receiving frame from decoder: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        metrics_add(METRICS_FRAMES_DECODED, avcc->codec_type, 1);
+
+        AVFrame *queued = pipeline_move_frame(frame);
+        if (!queued) {
+            return AVERROR(ENOMEM);
+        }
+        if (!out->push(queued)) {
+            release_frame(&queued);
+            return AVERROR_EXIT;
+        }
+    }
+}
+
+void decode_stage(Pipeline *p, AVCodecContext *avcc, BoundedQueue<AVPacket*> *in, BoundedQueue<AVFrame*> *out) {
+    PooledFrame frame(frame_pool().acquire());
+    if (!frame) {
+        logging("[ERROR] failed to allocated memory for AVFrame");
+        pipeline_abort(p);
+    }
+
+    AVPacket *packet = NULL;
+    while (!p->failed) {
+        // a closed and drained input queue means EOF: send NULL to flush the decoder
+        bool got_packet = in->pop(packet);
+        int64_t start = metrics_clock();
+        int rc = avcodec_send_packet(avcc, got_packet ? packet : NULL);
+        metrics_record(METRICS_STAGE_SEND_PACKET, avcc->codec_type, start);
+        if (got_packet) {
+            release_packet(&packet);
+        }
+        if (rc < 0) {
+            logging("[ERROR] Error while sending packet to decoder: %s", av_err2string(rc).c_str());
+            pipeline_abort(p);
+            break;
+        }
+
+        rc = pipeline_receive_frames(p, avcc, frame.get(), out);
+        if (rc < 0) {
+            if (rc != AVERROR_EXIT) {
+                pipeline_abort(p);
+            }
+            break;
+        }
+        if (!got_packet) {
+            break;
+        }
+    }
+
+    out->close();
+}
+
+void encode_stage(Pipeline *p, BoundedQueue<AVFrame*> *in, int (*encode)(StreamingContext*, StreamingContext*, AVFrame*), bool flush) {
+    AVFrame *frame = NULL;
+    while (in->pop(frame)) {
+        int rc = encode(p->decoder, p->encoder, frame);
+        release_frame(&frame);
+        if (rc) {
+            logging("[ERROR] failed to encode frame");
+            pipeline_abort(p);
+            break;
+        }
+    }
+
+    if (flush && !p->failed && encode(p->decoder, p->encoder, NULL)) {
+        logging("[ERROR] failed to flush encoder");
+        pipeline_abort(p);
+    }
+    pipeline_release_mux(p);
+}
+
+void mux_stage(Pipeline *p) {
+    AVPacket *pkt = NULL;
+    while (p->mux_packets.pop(pkt)) {
+        int rc = mux_packet(p->encoder->avfc.get(), pkt);
+        release_packet(&pkt);
+        if (rc < 0) {
+            logging("[ERROR] Error while muxing packet: %s", av_err2string(rc).c_str());
+            pipeline_abort(p);
+            break;
+        }
+    }
+}
+
+void print_queue_stats(const char *name, QueueStats stats) {
+    logging("[INFO] queue %-14s pushed %6lld, max depth %3lld, full stalls %6lld (%8.1f ms), empty stalls %6lld (%8.1f ms)",
+            name, stats.pushed, stats.max_depth,
+            stats.full_stalls, stats.full_stall_ns / 1e6,
+            stats.empty_stalls, stats.empty_stall_ns / 1e6);
+}
+
+void print_pipeline_stats(Pipeline *p) {
+    struct {
+        const char *queue;
+        const char *consumer;
+        QueueStats stats;
+    } queues[] = {
+        {"video packets", "video decode", p->video_packets.get_stats()},
+        {"audio packets", "audio decode", p->audio_packets.get_stats()},
+        {"video frames", "video encode", p->video_frames.get_stats()},
+        {"audio frames", "audio encode", p->audio_frames.get_stats()},
+        {"mux packets", "mux", p->mux_packets.get_stats()},
+    };
+
+    // a queue that keeps running full means its consumer cannot keep up
+    const char *bottleneck = "demux";
+    int64_t worst_full_stall_ns = 0;
+    for (auto &q : queues) {
+        print_queue_stats(q.queue, q.stats);
+        if (q.stats.full_stall_ns > worst_full_stall_ns) {
+            worst_full_stall_ns = q.stats.full_stall_ns;
+            bottleneck = q.consumer;
+        }
+    }
+    logging("[INFO] pipeline bottleneck: %s", bottleneck);
+}
+
+template <typename T, typename F>
+void release_queue(BoundedQueue<T> *queue, F release) {
+    queue->drain([&](T &item) { release(&item); });
+}
+
+int run_pipeline(StreamingContext *decoder, StreamingContext *encoder, StreamingParams sp) {
+    debug("calling run_pipeline");
+    Pipeline p;
+    p.decoder = decoder;
+    p.encoder = encoder;
+    p.sp = sp;
+    p.mux_producers = 1 + !sp.copy_video + !sp.copy_audio;
+
+    encoder->packet_sink = pipeline_packet_sink;
+    encoder->packet_sink_opaque = &p;
+
+    std::vector<std::thread> threads;
+    threads.emplace_back(demux_stage, &p);
+    if (!sp.copy_video) {
+        threads.emplace_back(decode_stage, &p, decoder->video_avcc.get(), &p.video_packets, &p.video_frames);
+        threads.emplace_back(encode_stage, &p, &p.video_frames, encode_video, true);
+    }
+    if (!sp.copy_audio) {
+        threads.emplace_back(decode_stage, &p, decoder->audio_avcc.get(), &p.audio_packets, &p.audio_frames);
+        threads.emplace_back(encode_stage, &p, &p.audio_frames, encode_audio, true);
+    }
+    threads.emplace_back(mux_stage, &p);
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    encoder->packet_sink = NULL;
+    encoder->packet_sink_opaque = NULL;
+
+    release_queue(&p.video_packets, release_packet);
+    release_queue(&p.audio_packets, release_packet);
+    release_queue(&p.mux_packets, release_packet);
+    release_queue(&p.video_frames, release_frame);
+    release_queue(&p.audio_frames, release_frame);
+
+    print_pipeline_stats(&p);
+    debug("finished run_pipeline");
+    return p.failed ? -1 : 0;
+}
+
+#endif //LEARN_LIBAV_PIPELINE_H
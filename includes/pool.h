@@ -0,0 +1,163 @@
+#ifndef LEARN_LIBAV_POOL_H
+#define LEARN_LIBAV_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/buffer.h>
+}
+
+#include "log.h"
+
+#define POOL_MAX_IDLE 256
+
+typedef struct {
+    int64_t allocations;
+    // acquire() served from the free list instead of calling the allocator
+    int64_t reuses;
+    int64_t in_use;
+    int64_t in_use_high_water;
+    int64_t idle_high_water;
+} PoolStats;
+
+/*
+ * Recycling pool for AVPacket/AVFrame shells. release() drops the references
+ * the object holds and keeps the shell for the next acquire(), so the hot
+ * loop stops going through the allocator for every packet and frame.
+ * Thread safe, the pipeline stages acquire and release from different threads.
+ */
+template <typename T, T *(*Alloc)(), void (*Free)(T **), void (*Reset)(T *)>
+class ObjectPool {
+public:
+    explicit ObjectPool(size_t max_idle = POOL_MAX_IDLE) : max_idle(max_idle), stats() {}
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    ~ObjectPool() {
+        for (T *obj : idle) {
+            Free(&obj);
+        }
+    }
+
+    T *acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        T *obj = NULL;
+        if (!idle.empty()) {
+            obj = idle.back();
+            idle.pop_back();
+            stats.reuses++;
+        } else {
+            lock.unlock();
+            obj = Alloc();
+            lock.lock();
+            if (!obj) {
+                return NULL;
+            }
+            stats.allocations++;
+        }
+        if (++stats.in_use > stats.in_use_high_water) {
+            stats.in_use_high_water = stats.in_use;
+        }
+        return obj;
+    }
+
+    void release(T *obj) {
+        if (!obj) {
+            return;
+        }
+        Reset(obj);
+        std::unique_lock<std::mutex> lock(mutex);
+        stats.in_use--;
+        if (idle.size() >= max_idle) {
+            lock.unlock();
+            Free(&obj);
+            return;
+        }
+        idle.push_back(obj);
+        if ((int64_t) idle.size() > stats.idle_high_water) {
+            stats.idle_high_water = idle.size();
+        }
+    }
+
+    PoolStats get_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+private:
+    size_t max_idle;
+    std::vector<T*> idle;
+    std::mutex mutex;
+    PoolStats stats;
+};
+
+typedef ObjectPool<AVPacket, av_packet_alloc, av_packet_free, av_packet_unref> PacketPool;
+typedef ObjectPool<AVFrame, av_frame_alloc, av_frame_free, av_frame_unref> FramePool;
+
+PacketPool &packet_pool() {
+    static PacketPool pool;
+    return pool;
+}
+
+FramePool &frame_pool() {
+    static FramePool pool;
+    return pool;
+}
+
+// owners that hand the object back to its pool instead of freeing it
+struct PooledPacketRelease {
+    void operator()(AVPacket *pkt) const {
+        packet_pool().release(pkt);
+    }
+};
+
+struct PooledFrameRelease {
+    void operator()(AVFrame *frame) const {
+        frame_pool().release(frame);
+    }
+};
+
+typedef std::unique_ptr<AVPacket, PooledPacketRelease> PooledPacket;
+typedef std::unique_ptr<AVFrame, PooledFrameRelease> PooledFrame;
+
+void release_packet(AVPacket **pkt) {
+    packet_pool().release(*pkt);
+    *pkt = NULL;
+}
+
+void release_frame(AVFrame **frame) {
+    frame_pool().release(*frame);
+    *frame = NULL;
+}
+
+/*
+ * Takes n buffers out of an AVBufferPool at once and hands them back, so
+ * the pool allocates them now instead of on the first frames that need them.
+ */
+int prime_buffer_pool(AVBufferPool *pool, int n) {
+    std::vector<AVBufferRef*> primed;
+    int rc = 0;
+    for (int i = 0; i < n; i++) {
+        AVBufferRef *buf = av_buffer_pool_get(pool);
+        if (!buf) {
+            rc = AVERROR(ENOMEM);
+            break;
+        }
+        primed.push_back(buf);
+    }
+    for (auto &buf : primed) {
+        av_buffer_unref(&buf);
+    }
+    return rc;
+}
+
+void print_pool_stats(const char *name, PoolStats stats) {
+    logging("[INFO] %s pool: allocations %lld, allocations avoided %lld, in use high water %lld, idle high water %lld",
+            name, stats.allocations, stats.reuses, stats.in_use_high_water, stats.idle_high_water);
+}
+
+#endif //LEARN_LIBAV_POOL_H
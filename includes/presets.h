@@ -0,0 +1,121 @@
+#ifndef LEARN_LIBAV_PRESETS_H
+#define LEARN_LIBAV_PRESETS_H
+
+#include <cstring>
+
+#include "log.h"
+#include "streaming.h"
+
+// every name find_preset() accepts, NULL terminated
+const char *preset_names[] = {"h265", "h264", "h264-fmp4", "h264-ts", "vp9", NULL};
+
+int find_preset(const char *name, StreamingParams *sp) {
+    *sp = StreamingParams();
+
+    if (strcmp(name, "h265") == 0) {
+        /*
+         * H264 -> H265
+         * Audio -> remuxed (untouched)
+         * MP4 - MP4
+         */
+        sp->copy_audio = 1;
+        sp->copy_video = 0;
+        sp->video_codec = (char*) "libx265";
+        sp->codec_priv_key = (char*) "x265-params";
+        sp->codec_priv_value = (char*) "keyint=60:min-keyint=60:scenecut=0";
+        sp->output_extension = (char*) ".mp4";
+    } else if (strcmp(name, "h264") == 0) {
+        /*
+         * H264 -> H264 (fixed gop)
+         * Audio -> remuxed (untouched)
+         * MP4 - MP4
+         */
+        sp->copy_audio = 1;
+        sp->copy_video = 0;
+        sp->video_codec = (char*) "libx264";
+        sp->codec_priv_key = (char*) "x264-params";
+        sp->codec_priv_value = (char*) "keyint=60:min-keyint=60:scenecut=0:force-cfr=1";
+        sp->output_extension = (char*) ".mp4";
+    } else if (strcmp(name, "h264-fmp4") == 0) {
+        /*
+         * H264 -> H264 (fixed gop)
+         * Audio -> remuxed (untouched)
+         * MP4 - fragmented MP4
+         */
+        sp->copy_audio = 1;
+        sp->copy_video = 0;
+        sp->video_codec = (char*) "libx264";
+        sp->codec_priv_key = (char*) "x264-params";
+        sp->codec_priv_value = (char*) "keyint=60:min-keyint=60:scenecut=0:force-cfr=1";
+        sp->muxer_opt_key = (char*) "movflags";
+        sp->muxer_opt_value = (char*) "frag_keyframe+empty_moov+delay_moov+default_base_moof";
+        sp->output_extension = (char*) ".mp4";
+    } else if (strcmp(name, "h264-ts") == 0) {
+        /*
+         * H264 -> H264 (fixed gop)
+         * Audio -> AAC
+         * MP4 - MPEG-TS
+         */
+        sp->copy_audio = 0;
+        sp->copy_video = 0;
+        sp->video_codec = (char*) "libx264";
+        sp->codec_priv_key = (char*) "x264-params";
+        sp->codec_priv_value = (char*) "keyint=60:min-keyint=60:scenecut=0:force-cfr=1";
+        sp->audio_codec = (char*) "aac";
+        sp->output_extension = (char*) ".ts";
+    } else if (strcmp(name, "vp9") == 0) {
+        /*
+         * H264 -> VP9
+         * Audio -> Vorbis
+         * MP4 - WebM
+         */
+        sp->copy_audio = 0;
+        sp->copy_video = 0;
+        sp->video_codec = (char*) "libvpx-vp9";
+        sp->audio_codec = (char*) "libvorbis";
+        sp->output_extension = (char*) ".webm";
+    } else {
+        logging("[ERROR] unknown preset: %s", name);
+        return -1;
+    }
+
+    // fixed GOPs from the encoder's own keyint, --keyint and --scene-threshold add forced keyframes on top
+    debug("using preset %s", name);
+    return 0;
+}
+
+// command line settings applied on top of whichever preset a transcode uses
+typedef struct {
+    int width;
+    int height;
+    char *pix_fmt;
+    int scale_threads;
+    // -1 keeps the preset's
+    int keyint;
+    double scene_threshold;
+    char measure_quality;
+    char drop_duplicates;
+    double duplicate_threshold;
+} PresetOverrides;
+
+PresetOverrides default_overrides() {
+    return {0, 0, NULL, 0, -1, -1, 0, 0, DEDUP_THRESHOLD_DEFAULT};
+}
+
+void apply_overrides(const PresetOverrides &overrides, StreamingParams *sp) {
+    sp->width = overrides.width;
+    sp->height = overrides.height;
+    sp->pix_fmt = overrides.pix_fmt;
+    sp->scale_threads = overrides.scale_threads;
+    if (overrides.keyint >= 0) {
+        sp->keyint = overrides.keyint;
+    }
+    if (overrides.scene_threshold >= 0) {
+        sp->scene_threshold = overrides.scene_threshold;
+    }
+    sp->measure_quality = overrides.measure_quality;
+    sp->drop_duplicates = overrides.drop_duplicates;
+    sp->duplicate_threshold = overrides.duplicate_threshold;
+}
+
+#endif //LEARN_LIBAV_PRESETS_H
@@ -0,0 +1,433 @@
+#ifndef LEARN_LIBAV_PROBE_CACHE_H
+#define LEARN_LIBAV_PROBE_CACHE_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "input.h"
+#include "log.h"
+#include "metrics.h"
+#include "packet_index.h"
+
+#define PROBE_CACHE_MAGIC "learn-libav-probe"
+#define PROBE_CACHE_VERSION 1
+// bytes at the start of the file hashed into the cache key
+#define PROBE_HASH_BYTES (64 * 1024)
+// avformat_find_stream_info defaults, for the second try after an incomplete fast probe
+#define PROBE_DEFAULT_SIZE 5000000
+
+/*
+ * Probe results cached across runs. avformat_open_input only reads the
+ * container header; avformat_find_stream_info then reads and decodes
+ * packets until every stream's parameters are known, which for a short
+ * clip or a metadata only call is most of the run. A cache entry keeps
+ * what that pass fills in (codec parameters, frame rates, timings and
+ * extradata) so a repeat open of the same file restores them and skips the
+ * pass. Entries are keyed by the real path and checked against the file's
+ * size, mtime and a hash of its first 64 KiB, and against the streams the
+ * demuxer found; any mismatch falls back to probing.
+ */
+typedef struct {
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t header_hash;
+} ProbeKey;
+
+typedef struct {
+    int64_t probes;
+    int64_t probe_ns;
+    int64_t hits;
+    int64_t hit_ns;
+    int64_t stores;
+    // fast probes that left a stream incomplete and ran again with the defaults
+    int64_t retries;
+} ProbeStats;
+
+std::mutex probe_stats_lock;
+ProbeStats probe_stats_total = {};
+
+uint64_t fnv1a(const uint8_t *data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int probe_key(const char *filename, ProbeKey *key, std::string *path) {
+    char resolved[PATH_MAX];
+    if (!realpath(filename, resolved) || source_identity(resolved, &key->size, &key->mtime_ns) < 0) {
+        return -1;
+    }
+    FILE *f = fopen(resolved, "rb");
+    if (!f) {
+        return -1;
+    }
+    std::vector<uint8_t> head(PROBE_HASH_BYTES);
+    size_t n = fread(head.data(), 1, head.size(), f);
+    fclose(f);
+    key->header_hash = fnv1a(head.data(), n);
+    *path = resolved;
+    return 0;
+}
+
+std::string probe_cache_path(const std::string &source) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.probe",
+             (unsigned long long) fnv1a((const uint8_t*) source.data(), source.size()));
+    return std::string(input_options().probe_cache_dir) + "/" + name;
+}
+
+// the fields of a stream find_stream_info may fill in, in file order
+enum {
+    PROBE_TYPE, PROBE_CODEC_ID, PROBE_FORMAT, PROBE_WIDTH, PROBE_HEIGHT, PROBE_SAR_NUM, PROBE_SAR_DEN,
+    PROBE_SAMPLE_RATE, PROBE_CHANNELS, PROBE_CHANNEL_LAYOUT, PROBE_PROFILE, PROBE_LEVEL, PROBE_BIT_RATE,
+    PROBE_FIELD_ORDER, PROBE_COLOR_RANGE, PROBE_COLOR_PRIMARIES, PROBE_COLOR_TRC, PROBE_COLOR_SPACE,
+    PROBE_CHROMA_LOCATION, PROBE_VIDEO_DELAY, PROBE_FRAME_SIZE, PROBE_BITS_RAW, PROBE_BITS_CODED,
+    PROBE_BLOCK_ALIGN, PROBE_INITIAL_PADDING, PROBE_AVG_RATE_NUM, PROBE_AVG_RATE_DEN, PROBE_R_RATE_NUM,
+    PROBE_R_RATE_DEN, PROBE_START_TIME, PROBE_DURATION, PROBE_NB_FRAMES, PROBE_NB_FIELDS,
+};
+
+void get_probe_fields(const AVStream *st, int64_t *v) {
+    const AVCodecParameters *par = st->codecpar;
+    v[PROBE_TYPE] = par->codec_type;
+    v[PROBE_CODEC_ID] = par->codec_id;
+    v[PROBE_FORMAT] = par->format;
+    v[PROBE_WIDTH] = par->width;
+    v[PROBE_HEIGHT] = par->height;
+    v[PROBE_SAR_NUM] = par->sample_aspect_ratio.num;
+    v[PROBE_SAR_DEN] = par->sample_aspect_ratio.den;
+    v[PROBE_SAMPLE_RATE] = par->sample_rate;
+    v[PROBE_CHANNELS] = par->channels;
+    v[PROBE_CHANNEL_LAYOUT] = (int64_t) par->channel_layout;
+    v[PROBE_PROFILE] = par->profile;
+    v[PROBE_LEVEL] = par->level;
+    v[PROBE_BIT_RATE] = par->bit_rate;
+    v[PROBE_FIELD_ORDER] = par->field_order;
+    v[PROBE_COLOR_RANGE] = par->color_range;
+    v[PROBE_COLOR_PRIMARIES] = par->color_primaries;
+    v[PROBE_COLOR_TRC] = par->color_trc;
+    v[PROBE_COLOR_SPACE] = par->color_space;
+    v[PROBE_CHROMA_LOCATION] = par->chroma_location;
+    v[PROBE_VIDEO_DELAY] = par->video_delay;
+    v[PROBE_FRAME_SIZE] = par->frame_size;
+    v[PROBE_BITS_RAW] = par->bits_per_raw_sample;
+    v[PROBE_BITS_CODED] = par->bits_per_coded_sample;
+    v[PROBE_BLOCK_ALIGN] = par->block_align;
+    v[PROBE_INITIAL_PADDING] = par->initial_padding;
+    v[PROBE_AVG_RATE_NUM] = st->avg_frame_rate.num;
+    v[PROBE_AVG_RATE_DEN] = st->avg_frame_rate.den;
+    v[PROBE_R_RATE_NUM] = st->r_frame_rate.num;
+    v[PROBE_R_RATE_DEN] = st->r_frame_rate.den;
+    v[PROBE_START_TIME] = st->start_time;
+    v[PROBE_DURATION] = st->duration;
+    v[PROBE_NB_FRAMES] = st->nb_frames;
+}
+
+void set_probe_fields(AVStream *st, const int64_t *v) {
+    AVCodecParameters *par = st->codecpar;
+    par->codec_type = (enum AVMediaType) v[PROBE_TYPE];
+    par->codec_id = (enum AVCodecID) v[PROBE_CODEC_ID];
+    par->format = v[PROBE_FORMAT];
+    par->width = v[PROBE_WIDTH];
+    par->height = v[PROBE_HEIGHT];
+    par->sample_aspect_ratio = (AVRational) {(int) v[PROBE_SAR_NUM], (int) v[PROBE_SAR_DEN]};
+    par->sample_rate = v[PROBE_SAMPLE_RATE];
+    par->channels = v[PROBE_CHANNELS];
+    par->channel_layout = (uint64_t) v[PROBE_CHANNEL_LAYOUT];
+    par->profile = v[PROBE_PROFILE];
+    par->level = v[PROBE_LEVEL];
+    par->bit_rate = v[PROBE_BIT_RATE];
+    par->field_order = (enum AVFieldOrder) v[PROBE_FIELD_ORDER];
+    par->color_range = (enum AVColorRange) v[PROBE_COLOR_RANGE];
+    par->color_primaries = (enum AVColorPrimaries) v[PROBE_COLOR_PRIMARIES];
+    par->color_trc = (enum AVColorTransferCharacteristic) v[PROBE_COLOR_TRC];
+    par->color_space = (enum AVColorSpace) v[PROBE_COLOR_SPACE];
+    par->chroma_location = (enum AVChromaLocation) v[PROBE_CHROMA_LOCATION];
+    par->video_delay = v[PROBE_VIDEO_DELAY];
+    par->frame_size = v[PROBE_FRAME_SIZE];
+    par->bits_per_raw_sample = v[PROBE_BITS_RAW];
+    par->bits_per_coded_sample = v[PROBE_BITS_CODED];
+    par->block_align = v[PROBE_BLOCK_ALIGN];
+    par->initial_padding = v[PROBE_INITIAL_PADDING];
+    st->avg_frame_rate = (AVRational) {(int) v[PROBE_AVG_RATE_NUM], (int) v[PROBE_AVG_RATE_DEN]};
+    st->r_frame_rate = (AVRational) {(int) v[PROBE_R_RATE_NUM], (int) v[PROBE_R_RATE_DEN]};
+    st->start_time = v[PROBE_START_TIME];
+    st->duration = v[PROBE_DURATION];
+    st->nb_frames = v[PROBE_NB_FRAMES];
+}
+
+int store_probe_cache(const std::string &path, const ProbeKey &key, AVFormatContext *avfc) {
+    std::ostringstream out;
+    out << PROBE_CACHE_MAGIC << " " << PROBE_CACHE_VERSION << "\n";
+    out << "source " << key.size << " " << key.mtime_ns << " " << key.header_hash << "\n";
+    out << "format " << avfc->nb_streams << " " << avfc->start_time << " " << avfc->duration << " " << avfc->bit_rate << "\n";
+    for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+        AVStream *st = avfc->streams[i];
+        int64_t v[PROBE_NB_FIELDS];
+        get_probe_fields(st, v);
+        out << "stream " << i;
+        for (int f = 0; f < PROBE_NB_FIELDS; f++) {
+            out << " " << v[f];
+        }
+        out << " ";
+        if (st->codecpar->extradata_size > 0) {
+            char hex[3];
+            for (int b = 0; b < st->codecpar->extradata_size; b++) {
+                snprintf(hex, sizeof(hex), "%02x", st->codecpar->extradata[b]);
+                out << hex;
+            }
+        } else {
+            out << "-";
+        }
+        out << "\n";
+    }
+    std::string text = out.str();
+    return write_file_atomic(path, text.data(), text.size());
+}
+
+int parse_extradata(const std::string &hex, AVCodecParameters *par) {
+    if (hex == "-" || par->extradata_size > 0) {
+        return 0;
+    }
+    int size = hex.size() / 2;
+    uint8_t *data = (uint8_t*) av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!data) {
+        return AVERROR(ENOMEM);
+    }
+    for (int i = 0; i < size; i++) {
+        data[i] = (uint8_t) strtol(hex.substr(2 * i, 2).c_str(), NULL, 16);
+    }
+    par->extradata = data;
+    par->extradata_size = size;
+    return 0;
+}
+
+// 0 when the entry matched and was applied, -1 to probe
+int load_probe_cache(const std::string &path, const ProbeKey &key, AVFormatContext *avfc) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return -1;
+    }
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        text.append(buf, n);
+    }
+    fclose(f);
+
+    std::istringstream in(text);
+    std::string word;
+    int version = 0;
+    ProbeKey cached = {};
+    unsigned int nb_streams = 0;
+    int64_t start_time, duration, bit_rate;
+    if (!(in >> word) || word != PROBE_CACHE_MAGIC || !(in >> version) || version != PROBE_CACHE_VERSION ||
+        !(in >> word >> cached.size >> cached.mtime_ns >> cached.header_hash) || word != "source" ||
+        !(in >> word >> nb_streams >> start_time >> duration >> bit_rate) || word != "format") {
+        debug("ignoring unreadable probe cache %s", path.c_str());
+        return -1;
+    }
+    if (cached.size != key.size || cached.mtime_ns != key.mtime_ns || cached.header_hash != key.header_hash ||
+        nb_streams != avfc->nb_streams) {
+        debug("probe cache %s is stale", path.c_str());
+        return -1;
+    }
+
+    // parse every stream before touching the context, a bad entry leaves it as the demuxer set it
+    std::vector<std::vector<int64_t>> fields(nb_streams, std::vector<int64_t>(PROBE_NB_FIELDS));
+    std::vector<std::string> extradata(nb_streams);
+    for (unsigned int i = 0; i < nb_streams; i++) {
+        unsigned int index;
+        if (!(in >> word >> index) || word != "stream" || index != i) {
+            return -1;
+        }
+        for (int v = 0; v < PROBE_NB_FIELDS; v++) {
+            if (!(in >> fields[i][v])) {
+                return -1;
+            }
+        }
+        if (!(in >> extradata[i])) {
+            return -1;
+        }
+        AVCodecParameters *par = avfc->streams[i]->codecpar;
+        if (par->codec_type != fields[i][PROBE_TYPE] ||
+            (par->codec_id != AV_CODEC_ID_NONE && par->codec_id != fields[i][PROBE_CODEC_ID])) {
+            debug("probe cache %s does not match stream %d", path.c_str(), i);
+            return -1;
+        }
+    }
+
+    for (unsigned int i = 0; i < nb_streams; i++) {
+        set_probe_fields(avfc->streams[i], fields[i].data());
+        if (parse_extradata(extradata[i], avfc->streams[i]->codecpar) < 0) {
+            return -1;
+        }
+    }
+    avfc->start_time = start_time;
+    avfc->duration = duration;
+    avfc->bit_rate = bit_rate;
+    return 0;
+}
+
+// a fast probe can stop before a stream's parameters are known
+bool probe_incomplete(AVFormatContext *avfc) {
+    for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+        AVCodecParameters *par = avfc->streams[i]->codecpar;
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && (par->width <= 0 || par->height <= 0 || par->format < 0)) {
+            return true;
+        }
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO && (par->sample_rate <= 0 || par->channels <= 0 || par->format < 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * avformat_find_stream_info through the cache, called right after
+ * open_input. Fast probing relies on the limits open_input set and probes
+ * again with the defaults when they were too tight.
+ */
+int probe_stream_info(AVFormatContext *avfc, const char *filename) {
+    int64_t start = metrics_now_ns();
+    ProbeKey key = {};
+    std::string source;
+    bool cached = input_options().probe_cache_dir && probe_key(filename, &key, &source) == 0;
+    std::string path = cached ? probe_cache_path(source) : "";
+    if (cached && load_probe_cache(path, key, avfc) == 0) {
+        std::lock_guard<std::mutex> guard(probe_stats_lock);
+        probe_stats_total.hits++;
+        probe_stats_total.hit_ns += metrics_now_ns() - start;
+        return 0;
+    }
+
+    int rc = avformat_find_stream_info(avfc, NULL);
+    bool retried = false;
+    if (rc >= 0 && input_options().fast_probe && probe_incomplete(avfc)) {
+        debug("fast probe of %s left a stream incomplete, probing with the defaults", filename);
+        avfc->probesize = PROBE_DEFAULT_SIZE;
+        avfc->max_analyze_duration = 0;
+        rc = avformat_find_stream_info(avfc, NULL);
+        retried = true;
+    }
+    if (rc < 0) {
+        return rc;
+    }
+    bool stored = cached && !probe_incomplete(avfc) && store_probe_cache(path, key, avfc) == 0;
+
+    std::lock_guard<std::mutex> guard(probe_stats_lock);
+    probe_stats_total.probes++;
+    probe_stats_total.probe_ns += metrics_now_ns() - start;
+    probe_stats_total.retries += retried;
+    probe_stats_total.stores += stored;
+    return 0;
+}
+
+ProbeStats probe_stats() {
+    std::lock_guard<std::mutex> guard(probe_stats_lock);
+    return probe_stats_total;
+}
+
+void print_probe_stats(ProbeStats stats) {
+    if (stats.probes + stats.hits == 0) {
+        return;
+    }
+    logging("[INFO] stream info: %lld probed (%.2f ms each, %lld stored, %lld fast probes retried), "
+            "%lld from the probe cache (%.2f ms each)",
+            (long long) stats.probes, stats.probes ? stats.probe_ns / 1e6 / stats.probes : 0.0,
+            (long long) stats.stores, (long long) stats.retries,
+            (long long) stats.hits, stats.hits ? stats.hit_ns / 1e6 / stats.hits : 0.0);
+}
+
+// open_input and probe_stream_info, the time to a usable context
+int64_t timed_open(const char *filename) {
+    int64_t start = metrics_now_ns();
+    AVFormatContext *avfc = NULL;
+    if (open_input(filename, &avfc, NULL) < 0) {
+        return -1;
+    }
+    int rc = probe_stream_info(avfc, filename);
+    close_format_context(&avfc);
+    return rc < 0 ? -1 : metrics_now_ns() - start;
+}
+
+/*
+ * Startup time of one input with the default probe, the fast probe and a
+ * probe cache hit, best of rounds each. Without --probe-cache the cache
+ * goes to a temporary directory that is removed afterwards.
+ */
+int benchmark_probe(const char *filename, int rounds) {
+    InputOptions saved = input_options();
+    std::string dir;
+    if (!saved.probe_cache_dir) {
+        char tmpl[] = "/tmp/learn-libav-probe-XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            logging("[ERROR] failed to create a temporary probe cache");
+            return -1;
+        }
+        dir = tmpl;
+    }
+    struct {
+        const char *name;
+        bool fast;
+        bool cache;
+    } modes[] = {{"default probe", false, false}, {"fast probe", true, false}, {"probe cache", false, true}};
+
+    int rc = 0;
+    for (auto &mode : modes) {
+        input_options().fast_probe = mode.fast;
+        input_options().probe_cache_dir = mode.cache ? (saved.probe_cache_dir ? saved.probe_cache_dir : dir.c_str()) : NULL;
+        if (mode.cache && timed_open(filename) < 0) {
+            // the first open fills the cache
+            rc = -1;
+            break;
+        }
+        int64_t best = -1;
+        for (int i = 0; i < rounds; i++) {
+            int64_t ns = timed_open(filename);
+            if (ns < 0) {
+                rc = -1;
+                break;
+            }
+            best = best < 0 ? ns : std::min(best, ns);
+        }
+        if (rc < 0) {
+            break;
+        }
+        logging("[INFO] %-14s %8.2f ms to open and probe %s", mode.name, best / 1e6, filename);
+    }
+    input_options() = saved;
+
+    if (!dir.empty()) {
+        std::string entry;
+        ProbeKey key;
+        if (probe_key(filename, &key, &entry) == 0) {
+            input_options().probe_cache_dir = dir.c_str();
+            remove(probe_cache_path(entry).c_str());
+            input_options() = saved;
+        }
+        rmdir(dir.c_str());
+    }
+    if (rc < 0) {
+        logging("[ERROR] failed to open %s", filename);
+    }
+    return rc;
+}
+
+#endif //LEARN_LIBAV_PROBE_CACHE_H
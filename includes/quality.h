@@ -0,0 +1,541 @@
+#ifndef LEARN_LIBAV_QUALITY_H
+#define LEARN_LIBAV_QUALITY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+}
+
+#include "band_pool.h"
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "metrics.h"
+#include "scaler.h"
+#include "scene_detect.h"
+#include "thread_budget.h"
+
+#define QUALITY_MAX_PLANES 3
+// SSIM is computed on luma blocks of this size without overlap, tiles start on block rows
+#define QUALITY_SSIM_BLOCK 8
+// PSNR reported for identical planes instead of infinity
+#define QUALITY_MAX_PSNR 100.0
+
+typedef struct {
+    uint32_t sa;
+    uint32_t sb;
+    uint32_t saa;
+    uint32_t sbb;
+    uint32_t sab;
+} SsimSums;
+
+/*
+ * Sum of squared differences of two 8 bit planes, and the SSIM sums of a
+ * row of 8x8 blocks. Same run time dispatch as the SAD of scene_detect.h:
+ * SSE2 or AVX2 through target attributes, plain C as the fallback.
+ */
+typedef uint64_t (*sse_plane_fn)(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+typedef void (*ssim_row_fn)(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int blocks, SsimSums *out);
+
+typedef struct {
+    const char *name;
+    sse_plane_fn sse;
+    ssim_row_fn ssim_row;
+} QualityKernel;
+
+uint64_t sse_plane_c(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *ra = a + (int64_t) y * a_stride;
+        const uint8_t *rb = b + (int64_t) y * b_stride;
+        uint32_t row = 0;
+        for (int x = 0; x < width; x++) {
+            int d = ra[x] - rb[x];
+            row += d * d;
+        }
+        sum += row;
+    }
+    return sum;
+}
+
+void ssim_row_c(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int blocks, SsimSums *out) {
+    for (int i = 0; i < blocks; i++) {
+        SsimSums s = {};
+        for (int y = 0; y < QUALITY_SSIM_BLOCK; y++) {
+            const uint8_t *ra = a + (int64_t) y * a_stride + i * QUALITY_SSIM_BLOCK;
+            const uint8_t *rb = b + (int64_t) y * b_stride + i * QUALITY_SSIM_BLOCK;
+            for (int x = 0; x < QUALITY_SSIM_BLOCK; x++) {
+                s.sa += ra[x];
+                s.sb += rb[x];
+                s.saa += ra[x] * ra[x];
+                s.sbb += rb[x] * rb[x];
+                s.sab += ra[x] * rb[x];
+            }
+        }
+        out[i] = s;
+    }
+}
+
+#ifdef SCENE_DETECT_X86
+__attribute__((target("sse2")))
+uint32_t hsum_epi32_sse2(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t) _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2")))
+uint64_t sse_plane_sse2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+    const __m128i zero = _mm_setzero_si128();
+    int vector_width = width & ~15;
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *ra = a + (int64_t) y * a_stride;
+        const uint8_t *rb = b + (int64_t) y * b_stride;
+        __m128i acc = _mm_setzero_si128();
+        for (int x = 0; x < vector_width; x += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i*) (ra + x));
+            __m128i vb = _mm_loadu_si128((const __m128i*) (rb + x));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        uint32_t row = hsum_epi32_sse2(acc);
+        for (int x = vector_width; x < width; x++) {
+            int d = ra[x] - rb[x];
+            row += d * d;
+        }
+        sum += row;
+    }
+    return sum;
+}
+
+__attribute__((target("sse2")))
+void ssim_row_sse2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int blocks, SsimSums *out) {
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < blocks; i++) {
+        __m128i sa = zero, sb = zero, saa = zero, sbb = zero, sab = zero;
+        for (int y = 0; y < QUALITY_SSIM_BLOCK; y++) {
+            __m128i ra = _mm_loadl_epi64((const __m128i*) (a + (int64_t) y * a_stride + i * QUALITY_SSIM_BLOCK));
+            __m128i rb = _mm_loadl_epi64((const __m128i*) (b + (int64_t) y * b_stride + i * QUALITY_SSIM_BLOCK));
+            sa = _mm_add_epi64(sa, _mm_sad_epu8(ra, zero));
+            sb = _mm_add_epi64(sb, _mm_sad_epu8(rb, zero));
+            __m128i va = _mm_unpacklo_epi8(ra, zero);
+            __m128i vb = _mm_unpacklo_epi8(rb, zero);
+            saa = _mm_add_epi32(saa, _mm_madd_epi16(va, va));
+            sbb = _mm_add_epi32(sbb, _mm_madd_epi16(vb, vb));
+            sab = _mm_add_epi32(sab, _mm_madd_epi16(va, vb));
+        }
+        out[i].sa = (uint32_t) _mm_cvtsi128_si32(sa);
+        out[i].sb = (uint32_t) _mm_cvtsi128_si32(sb);
+        out[i].saa = hsum_epi32_sse2(saa);
+        out[i].sbb = hsum_epi32_sse2(sbb);
+        out[i].sab = hsum_epi32_sse2(sab);
+    }
+}
+
+__attribute__((target("avx2")))
+uint64_t sse_plane_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+    int vector_width = width & ~31;
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *ra = a + (int64_t) y * a_stride;
+        const uint8_t *rb = b + (int64_t) y * b_stride;
+        __m256i acc = _mm256_setzero_si256();
+        for (int x = 0; x < vector_width; x += 32) {
+            __m256i lo = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (ra + x))),
+                                          _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (rb + x))));
+            __m256i hi = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (ra + x + 16))),
+                                          _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (rb + x + 16))));
+            acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+        }
+        __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        uint32_t row = hsum_epi32_sse2(half);
+        for (int x = vector_width; x < width; x++) {
+            int d = ra[x] - rb[x];
+            row += d * d;
+        }
+        sum += row;
+    }
+    return sum;
+}
+
+// two blocks per iteration, one in each 128 bit half
+__attribute__((target("avx2")))
+void ssim_row_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int blocks, SsimSums *out) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    int i = 0;
+    for (; i + 2 <= blocks; i += 2) {
+        __m256i sa = _mm256_setzero_si256(), sb = sa, saa = sa, sbb = sa, sab = sa;
+        for (int y = 0; y < QUALITY_SSIM_BLOCK; y++) {
+            __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (a + (int64_t) y * a_stride + i * QUALITY_SSIM_BLOCK)));
+            __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (b + (int64_t) y * b_stride + i * QUALITY_SSIM_BLOCK)));
+            sa = _mm256_add_epi32(sa, _mm256_madd_epi16(va, ones));
+            sb = _mm256_add_epi32(sb, _mm256_madd_epi16(vb, ones));
+            saa = _mm256_add_epi32(saa, _mm256_madd_epi16(va, va));
+            sbb = _mm256_add_epi32(sbb, _mm256_madd_epi16(vb, vb));
+            sab = _mm256_add_epi32(sab, _mm256_madd_epi16(va, vb));
+        }
+        for (int half = 0; half < 2; half++) {
+            SsimSums &s = out[i + half];
+            s.sa = hsum_epi32_sse2(half ? _mm256_extracti128_si256(sa, 1) : _mm256_castsi256_si128(sa));
+            s.sb = hsum_epi32_sse2(half ? _mm256_extracti128_si256(sb, 1) : _mm256_castsi256_si128(sb));
+            s.saa = hsum_epi32_sse2(half ? _mm256_extracti128_si256(saa, 1) : _mm256_castsi256_si128(saa));
+            s.sbb = hsum_epi32_sse2(half ? _mm256_extracti128_si256(sbb, 1) : _mm256_castsi256_si128(sbb));
+            s.sab = hsum_epi32_sse2(half ? _mm256_extracti128_si256(sab, 1) : _mm256_castsi256_si128(sab));
+        }
+    }
+    if (i < blocks) {
+        ssim_row_sse2(a + i * QUALITY_SSIM_BLOCK, a_stride, b + i * QUALITY_SSIM_BLOCK, b_stride, blocks - i, out + i);
+    }
+}
+#endif
+
+QualityKernel select_quality_kernel() {
+#ifdef SCENE_DETECT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", sse_plane_avx2, ssim_row_avx2};
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return {"sse2", sse_plane_sse2, ssim_row_sse2};
+    }
+#endif
+    return {"c", sse_plane_c, ssim_row_c};
+}
+
+const QualityKernel &quality_kernel() {
+    static QualityKernel kernel = select_quality_kernel();
+    return kernel;
+}
+
+double ssim_block(const SsimSums &s) {
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    const double n = QUALITY_SSIM_BLOCK * QUALITY_SSIM_BLOCK;
+    double mu_a = s.sa / n, mu_b = s.sb / n;
+    double var_a = s.saa / n - mu_a * mu_a;
+    double var_b = s.sbb / n - mu_b * mu_b;
+    double cov = s.sab / n - mu_a * mu_b;
+    return ((2 * mu_a * mu_b + c1) * (2 * cov + c2)) / ((mu_a * mu_a + mu_b * mu_b + c1) * (var_a + var_b + c2));
+}
+
+double psnr_from_sse(uint64_t sse, int64_t samples) {
+    if (samples <= 0) {
+        return 0;
+    }
+    if (sse == 0) {
+        return QUALITY_MAX_PSNR;
+    }
+    return std::min(QUALITY_MAX_PSNR, 10 * log10(255.0 * 255.0 * samples / sse));
+}
+
+typedef struct {
+    int64_t frames;
+    // source frames the reconstruction never produced, e.g. dropped by the encoder
+    int64_t unmatched;
+    int nb_planes;
+    const char *plane_names[QUALITY_MAX_PLANES];
+    uint64_t sse[QUALITY_MAX_PLANES];
+    int64_t samples[QUALITY_MAX_PLANES];
+    double min_psnr;
+    double ssim_sum;
+    double min_ssim;
+    // reconstruction decoding and comparison
+    int64_t decode_ns;
+    int64_t compare_ns;
+    int threads;
+    const char *kernel;
+} QualityStats;
+
+/*
+ * Measures the video encoder's output while it is produced. Every frame
+ * sent to the encoder is held by reference, every packet that comes out is
+ * also decoded by a reconstruction decoder and each reconstructed frame is
+ * compared with the source frame of the same pts: PSNR per plane from the
+ * sum of squared errors, SSIM on luma from 8x8 blocks without overlap (close
+ * to, not the same as, the overlapping windows of ffmpeg's ssim filter).
+ *
+ * The comparison is cut into horizontal tiles on whole SSIM block rows that
+ * run on a BandPool, like the scaler's bands. Only 8 bit YUV formats are
+ * measured. Per frame scores go to an optional CSV file, the aggregate to
+ * get_stats().
+ */
+class QualityStage {
+public:
+    ~QualityStage() {
+        band_pool.stop();
+        if (log_file) {
+            fclose(log_file);
+        }
+    }
+
+    // encoder is open, its stream parameters filled in; log_path may be NULL
+    int open(AVCodecContext *encoder, const AVCodecParameters *par, const char *log_path) {
+        format = encoder->pix_fmt;
+        width = encoder->width;
+        height = encoder->height;
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+        nb_planes = av_pix_fmt_count_planes(format);
+        if (!desc || !has_8bit_luma_plane(format) || nb_planes > QUALITY_MAX_PLANES) {
+            logging("[WARN] quality is only measured for 8 bit YUV, not for %s", av_get_pix_fmt_name(format));
+            return 1;
+        }
+        for (int c = 0; c < desc->nb_components; c++) {
+            if (desc->comp[c].depth != 8) {
+                logging("[WARN] quality is only measured for 8 bit YUV, not for %s", av_get_pix_fmt_name(format));
+                return 1;
+            }
+        }
+
+        static const char *yuv_names[QUALITY_MAX_PLANES] = {"Y", "U", "V"};
+        const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+        if (!codec) {
+            logging("[WARN] no decoder for %s, quality is not measured", avcodec_get_name(par->codec_id));
+            return 1;
+        }
+        recon.reset(avcodec_alloc_context3(codec));
+        if (!recon || avcodec_parameters_to_context(recon.get(), par) < 0) {
+            return AVERROR(ENOMEM);
+        }
+        assign_codec_threads(recon.get(), codec, THREAD_ROLE_DECODER, THREAD_WEIGHT_DECODER, &decoder_threads);
+        int rc = avcodec_open2(recon.get(), codec, NULL);
+        if (rc < 0) {
+            logging("[ERROR] failed to open the reconstruction decoder: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        frame.reset(av_frame_alloc());
+        if (!frame) {
+            return AVERROR(ENOMEM);
+        }
+
+        for (int p = 0; p < nb_planes; p++) {
+            plane_bytes[p] = av_image_get_linesize(format, width, p);
+            plane_height[p] = plane_rows(desc, p, height);
+            stats.samples[p] = 0;
+            stats.plane_names[p] = nb_planes == 2 ? (p ? "UV" : "Y") : yuv_names[p];
+        }
+        stats.nb_planes = nb_planes;
+        stats.min_psnr = QUALITY_MAX_PSNR;
+        stats.min_ssim = 1;
+        stats.kernel = quality_kernel().name;
+
+        tile_threads = thread_budget().lease(THREAD_ROLE_QUALITY, THREAD_WEIGHT_QUALITY);
+        int nb_tiles = band_count(tile_threads.threads(), height);
+        int block_rows = height / QUALITY_SSIM_BLOCK;
+        for (int i = 0; i < nb_tiles; i++) {
+            int y0 = block_rows * i / nb_tiles * QUALITY_SSIM_BLOCK;
+            int y1 = i == nb_tiles - 1 ? height : block_rows * (i + 1) / nb_tiles * QUALITY_SSIM_BLOCK;
+            tiles.push_back({y0, y1});
+        }
+        stats.threads = tiles.size();
+        band_pool.start(tiles.size(), [this](int index) { compare_tile(index); });
+
+        if (log_path) {
+            log_file = fopen(log_path, "w");
+            if (!log_file) {
+                logging("[ERROR] failed to open %s", log_path);
+                return -1;
+            }
+            fprintf(log_file, "frame,pts");
+            for (int p = 0; p < nb_planes; p++) {
+                fprintf(log_file, ",psnr_%s", stats.plane_names[p]);
+            }
+            fprintf(log_file, ",psnr,ssim\n");
+        }
+        return 0;
+    }
+
+    // the frame as the encoder gets it
+    int add_source(const AVFrame *source) {
+        if (source->pts == AV_NOPTS_VALUE) {
+            return 0;
+        }
+        FramePtr held(av_frame_alloc());
+        if (!held || av_frame_ref(held.get(), source) < 0) {
+            return AVERROR(ENOMEM);
+        }
+        sources[source->pts] = std::move(held);
+        return 0;
+    }
+
+    // an encoded packet, before its timestamps leave the source's time base; NULL drains
+    int add_packet(const AVPacket *pkt) {
+        int64_t start = metrics_now_ns();
+        int rc = avcodec_send_packet(recon.get(), pkt);
+        if (rc < 0 && rc != AVERROR_EOF) {
+            logging("[ERROR] failed to decode the reconstruction: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        while ((rc = avcodec_receive_frame(recon.get(), frame.get())) >= 0) {
+            stats.decode_ns += metrics_now_ns() - start;
+            compare(frame.get());
+            av_frame_unref(frame.get());
+            start = metrics_now_ns();
+        }
+        stats.decode_ns += metrics_now_ns() - start;
+        if (!pkt) {
+            stats.unmatched += sources.size();
+            sources.clear();
+        }
+        return rc == AVERROR(EAGAIN) || rc == AVERROR_EOF ? 0 : rc;
+    }
+
+    QualityStats get_stats() const {
+        return stats;
+    }
+
+private:
+    typedef struct {
+        int y0;
+        int y1;
+    } Tile;
+
+    typedef struct {
+        uint64_t sse[QUALITY_MAX_PLANES];
+        double ssim_sum;
+        int64_t ssim_blocks;
+    } TileResult;
+
+    void compare(const AVFrame *reconstructed) {
+        int64_t pts = reconstructed->pts != AV_NOPTS_VALUE ? reconstructed->pts : reconstructed->best_effort_timestamp;
+        // frames come back in presentation order, older sources were never reconstructed
+        auto it = sources.lower_bound(pts);
+        stats.unmatched += std::distance(sources.begin(), it);
+        sources.erase(sources.begin(), it);
+        if (it == sources.end() || it->first != pts) {
+            return;
+        }
+        FramePtr source = std::move(it->second);
+        sources.erase(it);
+        if (reconstructed->width != width || reconstructed->height != height || reconstructed->format != format) {
+            stats.unmatched++;
+            return;
+        }
+
+        int64_t start = metrics_now_ns();
+        job_a = source.get();
+        job_b = reconstructed;
+        results.assign(tiles.size(), TileResult());
+        band_pool.run();
+
+        uint64_t sse[QUALITY_MAX_PLANES] = {};
+        uint64_t sse_total = 0;
+        int64_t samples_total = 0;
+        double ssim_sum = 0;
+        int64_t ssim_blocks = 0;
+        for (auto &r : results) {
+            for (int p = 0; p < nb_planes; p++) {
+                sse[p] += r.sse[p];
+            }
+            ssim_sum += r.ssim_sum;
+            ssim_blocks += r.ssim_blocks;
+        }
+        double psnr[QUALITY_MAX_PLANES];
+        for (int p = 0; p < nb_planes; p++) {
+            int64_t samples = (int64_t) plane_bytes[p] * plane_height[p];
+            psnr[p] = psnr_from_sse(sse[p], samples);
+            stats.sse[p] += sse[p];
+            stats.samples[p] += samples;
+            sse_total += sse[p];
+            samples_total += samples;
+        }
+        double frame_psnr = psnr_from_sse(sse_total, samples_total);
+        double frame_ssim = ssim_blocks ? ssim_sum / ssim_blocks : 1;
+        stats.frames++;
+        stats.min_psnr = std::min(stats.min_psnr, frame_psnr);
+        stats.ssim_sum += frame_ssim;
+        stats.min_ssim = std::min(stats.min_ssim, frame_ssim);
+        stats.compare_ns += metrics_now_ns() - start;
+
+        if (log_file) {
+            fprintf(log_file, "%lld,%lld", (long long) stats.frames - 1, (long long) pts);
+            for (int p = 0; p < nb_planes; p++) {
+                fprintf(log_file, ",%.3f", psnr[p]);
+            }
+            fprintf(log_file, ",%.3f,%.5f\n", frame_psnr, frame_ssim);
+        }
+        debug("quality of pts %lld: PSNR %.2f dB, SSIM %.4f", (long long) pts, frame_psnr, frame_ssim);
+    }
+
+    void compare_tile(int index) {
+        const QualityKernel &kernel = quality_kernel();
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+        Tile t = tiles[index];
+        TileResult &r = results[index];
+        for (int p = 0; p < nb_planes; p++) {
+            int y0 = plane_rows(desc, p, t.y0);
+            int y1 = plane_rows(desc, p, t.y1);
+            r.sse[p] = kernel.sse(job_a->data[p] + (int64_t) y0 * job_a->linesize[p], job_a->linesize[p],
+                                  job_b->data[p] + (int64_t) y0 * job_b->linesize[p], job_b->linesize[p],
+                                  plane_bytes[p], y1 - y0);
+        }
+
+        int blocks = width / QUALITY_SSIM_BLOCK;
+        std::vector<SsimSums> &sums = tile_sums[index];
+        sums.resize(blocks);
+        for (int y = t.y0; y + QUALITY_SSIM_BLOCK <= t.y1; y += QUALITY_SSIM_BLOCK) {
+            kernel.ssim_row(job_a->data[0] + (int64_t) y * job_a->linesize[0], job_a->linesize[0],
+                            job_b->data[0] + (int64_t) y * job_b->linesize[0], job_b->linesize[0], blocks, sums.data());
+            for (int i = 0; i < blocks; i++) {
+                r.ssim_sum += ssim_block(sums[i]);
+            }
+            r.ssim_blocks += blocks;
+        }
+    }
+
+    // declared first so the threads go back to the budget after the decoder is closed
+    ThreadLease decoder_threads;
+    ThreadLease tile_threads;
+    CodecContextPtr recon;
+    FramePtr frame;
+    enum AVPixelFormat format = AV_PIX_FMT_NONE;
+    int width = 0;
+    int height = 0;
+    int nb_planes = 0;
+    int plane_bytes[QUALITY_MAX_PLANES] = {};
+    int plane_height[QUALITY_MAX_PLANES] = {};
+    // source frames by pts, waiting for their reconstruction
+    std::map<int64_t, FramePtr> sources;
+    FILE *log_file = NULL;
+    QualityStats stats = {};
+
+    std::vector<Tile> tiles;
+    std::vector<TileResult> results;
+    std::vector<SsimSums> tile_sums[BAND_MAX_THREADS];
+    const AVFrame *job_a = NULL;
+    const AVFrame *job_b = NULL;
+    BandPool band_pool;
+};
+
+void print_quality_stats(const char *name, QualityStats stats) {
+    if (stats.frames == 0) {
+        logging("[INFO] %s: no frames measured (%lld unmatched)", name, (long long) stats.unmatched);
+        return;
+    }
+    std::string planes;
+    uint64_t sse_total = 0;
+    int64_t samples_total = 0;
+    for (int p = 0; p < stats.nb_planes; p++) {
+        char part[32];
+        snprintf(part, sizeof(part), " %s %.2f", stats.plane_names[p], psnr_from_sse(stats.sse[p], stats.samples[p]));
+        planes += part;
+        sse_total += stats.sse[p];
+        samples_total += stats.samples[p];
+    }
+    logging("[INFO] %s: PSNR%s average %.2f min %.2f dB, SSIM average %.4f min %.4f over %lld frames (%lld unmatched)",
+            name, planes.c_str(), psnr_from_sse(sse_total, samples_total), stats.min_psnr,
+            stats.ssim_sum / stats.frames, stats.min_ssim, (long long) stats.frames, (long long) stats.unmatched);
+    logging("[INFO] %s: quality stage (%s) %.3f ms per frame decoding, %.3f ms comparing on %d threads", name,
+            stats.kernel, stats.decode_ns / 1e6 / stats.frames, stats.compare_ns / 1e6 / stats.frames, stats.threads);
+}
+
+#endif //LEARN_LIBAV_QUALITY_H
@@ -0,0 +1,115 @@
+#ifndef LEARN_LIBAV_QUEUE_H
+#define LEARN_LIBAV_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+typedef struct {
+    int64_t pushed;
+    int64_t max_depth;
+    // producer blocked because the queue was full: the consumer is the bottleneck
+    int64_t full_stalls;
+    int64_t full_stall_ns;
+    // consumer blocked because the queue was empty: the producer is the bottleneck
+    int64_t empty_stalls;
+    int64_t empty_stall_ns;
+} QueueStats;
+
+/*
+ * Bounded blocking queue connecting two pipeline stages.
+ *
+ * push() blocks while the queue is full and pop() blocks while it is empty,
+ * every blocking wait is counted so a run can tell which side was starved.
+ * close() wakes everybody up: further pushes fail and pop() drains what is
+ * left before reporting the end of the stream.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false), stats() {}
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (items.size() >= capacity && !closed) {
+            auto start = std::chrono::steady_clock::now();
+            not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+            stats.full_stalls++;
+            stats.full_stall_ns += elapsed_ns(start);
+        }
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        stats.pushed++;
+        if ((int64_t) items.size() > stats.max_depth) {
+            stats.max_depth = items.size();
+        }
+        lock.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    // returns false once the queue is closed and drained
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (items.empty() && !closed) {
+            auto start = std::chrono::steady_clock::now();
+            not_empty.wait(lock, [this] { return !items.empty() || closed; });
+            stats.empty_stalls++;
+            stats.empty_stall_ns += elapsed_ns(start);
+        }
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+    // hands back whatever is still queued, used to release items after an abort
+    template <typename F>
+    void drain(F release) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &item : items) {
+            release(item);
+        }
+        items.clear();
+    }
+
+    QueueStats get_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+private:
+    static int64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    QueueStats stats;
+};
+
+#endif //LEARN_LIBAV_QUEUE_H
@@ -0,0 +1,224 @@
+#ifndef LEARN_LIBAV_SCALER_H
+#define LEARN_LIBAV_SCALER_H
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/buffer.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+    #include <libswscale/swscale.h>
+}
+
+#include "band_pool.h"
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+
+// plane and line alignment of the pooled frames, wide enough for every SIMD path of swscale
+#define SCALER_ALIGN 64
+// destination buffers allocated up front, the encoder holds a few while they are in flight
+#define SCALER_POOL_SIZE 8
+// no SWS_ACCURATE_RND or SWS_BITEXACT, both turn off SIMD paths of swscale
+#define SCALER_FLAGS SWS_BICUBIC
+
+typedef struct {
+    int width;
+    int height;
+    enum AVPixelFormat format;
+} ScalerFormat;
+
+typedef struct {
+    int64_t frames;
+    int64_t ns;
+    int threads;
+} ScalerStats;
+
+/*
+ * Same height and chroma subsampling height: no vertical filter, every
+ * output row depends only on its own source row, so bands of the frame
+ * convert exactly like the whole frame.
+ */
+bool scaler_rows_independent(ScalerFormat src, ScalerFormat dst) {
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src.format);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst.format);
+    return src.height == dst.height && src_desc && dst_desc && src_desc->log2_chroma_h == dst_desc->log2_chroma_h;
+}
+
+// pixel rows of plane p covered by luma rows [0, y)
+int plane_rows(const AVPixFmtDescriptor *desc, int plane, int y) {
+    return plane == 1 || plane == 2 ? AV_CEIL_RSHIFT(y, desc->log2_chroma_h) : y;
+}
+
+/*
+ * Converts decoded frames to the size and pixel format of an encoder.
+ *
+ * When no plane changes height, every output row only depends on the same
+ * source row, so the frame is cut into horizontal bands, each band has its
+ * own SwsContext fed the matching source rows and runs on a BandPool
+ * thread; the result is identical to one context. A vertical scale
+ * (including a change of chroma subsampling) filters across rows, separate
+ * contexts would clamp their filters at the band edges and show seams, so
+ * it runs on one context and one thread.
+ *
+ * Destination frames come from an AVBufferPool sized for the output format,
+ * so steady state conversion allocates nothing. The returned frame stays
+ * valid until the next convert() call, the buffer itself until the encoder
+ * drops its reference.
+ */
+class VideoScaler {
+public:
+    ~VideoScaler() {
+        band_pool.stop();
+        for (auto ctx : contexts) {
+            sws_freeContext(ctx);
+        }
+        av_buffer_pool_uninit(&pool);
+    }
+
+    int open(ScalerFormat src_format, ScalerFormat dst_format, int nb_threads) {
+        src = src_format;
+        dst = dst_format;
+        frame.reset(av_frame_alloc());
+        buffer_size = av_image_get_buffer_size(dst.format, dst.width, dst.height, SCALER_ALIGN);
+        if (!frame || buffer_size < 0) {
+            logging("[ERROR] can not convert to %dx%d %s", dst.width, dst.height, av_get_pix_fmt_name(dst.format));
+            return -1;
+        }
+        pool = av_buffer_pool_init(buffer_size, NULL);
+        if (!pool || prime_buffer_pool(pool, SCALER_POOL_SIZE) < 0) {
+            return AVERROR(ENOMEM);
+        }
+
+        nb_bands = scaler_rows_independent(src, dst) ? band_count(nb_threads, dst.height) : 1;
+        if (init_bands() < 0) {
+            return -1;
+        }
+        stats.threads = nb_bands;
+        band_pool.start(nb_bands, [this](int index) { scale_band(index); });
+        logging("[INFO] scaling %dx%d %s -> %dx%d %s on %d threads", src.width, src.height,
+                av_get_pix_fmt_name(src.format), dst.width, dst.height, av_get_pix_fmt_name(dst.format), stats.threads);
+        return 0;
+    }
+
+    // NULL on failure
+    AVFrame *convert(const AVFrame *input) {
+        if (input->width != src.width || input->height != src.height || input->format != src.format) {
+            logging("[ERROR] scaler input changed from %dx%d %s to %dx%d %s", src.width, src.height,
+                    av_get_pix_fmt_name(src.format), input->width, input->height,
+                    av_get_pix_fmt_name((enum AVPixelFormat) input->format));
+            return NULL;
+        }
+        int64_t start = metrics_now_ns();
+        av_frame_unref(frame.get());
+        frame->buf[0] = av_buffer_pool_get(pool);
+        if (!frame->buf[0]) {
+            return NULL;
+        }
+        av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, dst.format, dst.width, dst.height,
+                             SCALER_ALIGN);
+        frame->width = dst.width;
+        frame->height = dst.height;
+        frame->format = dst.format;
+        if (av_frame_copy_props(frame.get(), input) < 0) {
+            return NULL;
+        }
+
+        job_src = input;
+        // a band that failed on an earlier frame says nothing about this one
+        failed = false;
+        band_pool.run();
+        job_src = NULL;
+
+        stats.frames++;
+        stats.ns += metrics_now_ns() - start;
+        return failed ? NULL : frame.get();
+    }
+
+    ScalerStats get_stats() const {
+        return stats;
+    }
+
+private:
+    // band edges on whole chroma rows of both formats
+    int init_bands() {
+        const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src.format);
+        const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst.format);
+        int src_align = 1 << src_desc->log2_chroma_h;
+        int dst_align = 1 << dst_desc->log2_chroma_h;
+        int prev_src = 0, prev_dst = 0;
+        for (int i = 1; i <= nb_bands; i++) {
+            int dst_y = i == nb_bands ? dst.height : (int) ((int64_t) dst.height * i / nb_bands) / dst_align * dst_align;
+            int src_y = i == nb_bands ? src.height : (int) ((int64_t) dst_y * src.height / dst.height) / src_align * src_align;
+            if (dst_y <= prev_dst || src_y <= prev_src) {
+                continue;
+            }
+            bands.push_back({prev_src, src_y - prev_src, prev_dst, dst_y - prev_dst});
+            prev_src = src_y;
+            prev_dst = dst_y;
+        }
+        nb_bands = bands.size();
+        for (auto &b : bands) {
+            SwsContext *ctx = sws_getContext(src.width, b.src_height, src.format, dst.width, b.dst_height, dst.format,
+                                             SCALER_FLAGS, NULL, NULL, NULL);
+            if (!ctx) {
+                logging("[ERROR] failed to init the scaler");
+                return -1;
+            }
+            contexts.push_back(ctx);
+        }
+        return 0;
+    }
+
+    void scale_band(int index) {
+        Band &b = bands[index];
+        const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src.format);
+        const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst.format);
+        const uint8_t *src_data[4] = {};
+        uint8_t *dst_data[4] = {};
+        for (int p = 0; p < 4; p++) {
+            if (job_src->data[p]) {
+                src_data[p] = job_src->data[p] + (ptrdiff_t) plane_rows(src_desc, p, b.src_y) * job_src->linesize[p];
+            }
+            if (frame->data[p]) {
+                dst_data[p] = frame->data[p] + (ptrdiff_t) plane_rows(dst_desc, p, b.dst_y) * frame->linesize[p];
+            }
+        }
+        if (sws_scale(contexts[index], src_data, job_src->linesize, 0, b.src_height, dst_data, frame->linesize) != b.dst_height) {
+            failed = true;
+        }
+    }
+
+    typedef struct {
+        int src_y;
+        int src_height;
+        int dst_y;
+        int dst_height;
+    } Band;
+
+    ScalerFormat src = {};
+    ScalerFormat dst = {};
+    std::vector<Band> bands;
+    std::vector<SwsContext*> contexts;
+    int nb_bands = 1;
+    AVBufferPool *pool = NULL;
+    int buffer_size = 0;
+    FramePtr frame;
+    ScalerStats stats = {};
+    std::atomic<bool> failed{false};
+
+    const AVFrame *job_src = NULL;
+    BandPool band_pool;
+};
+
+void print_scaler_stats(const char *name, ScalerStats stats) {
+    logging("[INFO] %s: converted %lld frames on %d threads, %.3f ms per frame", name, (long long) stats.frames,
+            stats.threads, stats.frames ? stats.ns / 1e6 / stats.frames : 0.0);
+}
+
+#endif //LEARN_LIBAV_SCALER_H
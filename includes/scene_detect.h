@@ -0,0 +1,322 @@
+#ifndef LEARN_LIBAV_SCENE_DETECT_H
+#define LEARN_LIBAV_SCENE_DETECT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCENE_DETECT_X86 1
+#endif
+
+extern "C" {
+    #include <libavutil/frame.h>
+    #include <libavutil/pixdesc.h>
+}
+
+#include "handles.h"
+#include "log.h"
+#include "metrics.h"
+
+// histogram distance a cut also needs, motion without new content moves pixels, not the histogram
+#define SCENE_MIN_HISTOGRAM_DISTANCE 0.2
+// frames after a keyframe in which cuts are ignored, a flash or fast pan would start tiny GOPs
+#define SCENE_MIN_GAP_FRAMES 12
+// the luma difference looks at every second row, the histogram at every eighth row and column
+#define SCENE_SAD_ROW_STEP 2
+#define SCENE_HISTOGRAM_STEP 8
+#define SCENE_HISTOGRAM_BINS 64
+
+/*
+ * Sum of absolute differences of two 8 bit planes. The vector versions do
+ * 16 or 32 pixels per psadbw and finish each row in scalar code, the plain
+ * C one is the fallback and the reference. select_sad_kernel picks the
+ * widest the CPU supports at run time, the build needs no -m flags.
+ */
+typedef uint64_t (*sad_plane_fn)(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,
+                                 int width, int height, int row_step);
+
+typedef struct {
+    const char *name;
+    sad_plane_fn sad;
+} SadKernel;
+
+uint64_t sad_plane_c(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height, int row_step) {
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y += row_step) {
+        const uint8_t *ra = a + (int64_t) y * a_stride;
+        const uint8_t *rb = b + (int64_t) y * b_stride;
+        uint32_t row = 0;
+        for (int x = 0; x < width; x++) {
+            row += abs(ra[x] - rb[x]);
+        }
+        sum += row;
+    }
+    return sum;
+}
+
+#ifdef SCENE_DETECT_X86
+__attribute__((target("sse2")))
+uint64_t sad_plane_sse2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height, int row_step) {
+    __m128i acc = _mm_setzero_si128();
+    uint64_t tail = 0;
+    int vector_width = width & ~15;
+    for (int y = 0; y < height; y += row_step) {
+        const uint8_t *ra = a + (int64_t) y * a_stride;
+        const uint8_t *rb = b + (int64_t) y * b_stride;
+        for (int x = 0; x < vector_width; x += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i*) (ra + x));
+            __m128i vb = _mm_loadu_si128((const __m128i*) (rb + x));
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+        }
+        for (int x = vector_width; x < width; x++) {
+            tail += abs(ra[x] - rb[x]);
+        }
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*) lanes, acc);
+    return lanes[0] + lanes[1] + tail;
+}
+
+__attribute__((target("avx2")))
+uint64_t sad_plane_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height, int row_step) {
+    __m256i acc = _mm256_setzero_si256();
+    uint64_t tail = 0;
+    int vector_width = width & ~31;
+    for (int y = 0; y < height; y += row_step) {
+        const uint8_t *ra = a + (int64_t) y * a_stride;
+        const uint8_t *rb = b + (int64_t) y * b_stride;
+        for (int x = 0; x < vector_width; x += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i*) (ra + x));
+            __m256i vb = _mm256_loadu_si256((const __m256i*) (rb + x));
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+        }
+        for (int x = vector_width; x < width; x++) {
+            tail += abs(ra[x] - rb[x]);
+        }
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*) lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail;
+}
+#endif
+
+SadKernel select_sad_kernel() {
+#ifdef SCENE_DETECT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", sad_plane_avx2};
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return {"sse2", sad_plane_sse2};
+    }
+#endif
+    return {"c", sad_plane_c};
+}
+
+// picked once per process
+const SadKernel &sad_kernel() {
+    static SadKernel kernel = select_sad_kernel();
+    return kernel;
+}
+
+// 8 bit luma in a plane of its own, everything YUV and NV12 style formats decode to
+bool has_8bit_luma_plane(enum AVPixelFormat format) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    return desc && !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) &&
+           desc->comp[0].plane == 0 && desc->comp[0].depth == 8 && desc->comp[0].step == 1;
+}
+
+// four partial histograms, so runs of equal pixels do not wait on the same counter
+void luma_histogram(const AVFrame *frame, uint32_t *hist) {
+    uint32_t partial[4][SCENE_HISTOGRAM_BINS] = {};
+    int last = frame->width - 4 * SCENE_HISTOGRAM_STEP;
+    for (int y = 0; y < frame->height; y += SCENE_HISTOGRAM_STEP) {
+        const uint8_t *row = frame->data[0] + (int64_t) y * frame->linesize[0];
+        int x = 0;
+        for (; x <= last; x += 4 * SCENE_HISTOGRAM_STEP) {
+            partial[0][row[x] >> 2]++;
+            partial[1][row[x + SCENE_HISTOGRAM_STEP] >> 2]++;
+            partial[2][row[x + 2 * SCENE_HISTOGRAM_STEP] >> 2]++;
+            partial[3][row[x + 3 * SCENE_HISTOGRAM_STEP] >> 2]++;
+        }
+        for (; x < frame->width; x += SCENE_HISTOGRAM_STEP) {
+            partial[0][row[x] >> 2]++;
+        }
+    }
+    for (int i = 0; i < SCENE_HISTOGRAM_BINS; i++) {
+        hist[i] = partial[0][i] + partial[1][i] + partial[2][i] + partial[3][i];
+    }
+}
+
+typedef struct {
+    // score a cut needs, 0 only places keyframes on the interval and the segment boundaries
+    double threshold;
+    // longest GOP in frames, 0 leaves it to the encoder
+    int keyint;
+    // keyframe on the first frame at or after every multiple of this from the first frame, 0 for none
+    double boundary_seconds;
+} SceneDetectOptions;
+
+typedef struct {
+    int64_t frames;
+    int64_t analyzed;
+    int64_t scene_keyframes;
+    int64_t interval_keyframes;
+    int64_t boundary_keyframes;
+    // cuts over the threshold ignored for following a keyframe too closely
+    int64_t suppressed;
+    int64_t ns;
+    // time spent in the encoder calls of the same frames, what the detector's cost compares against
+    int64_t encode_ns;
+    const char *kernel;
+} SceneDetectStats;
+
+/*
+ * Decides which decoded frames the video encoder has to code as
+ * keyframes. Each frame's luma is compared with the previous frame's: the
+ * mean absolute difference and its change from the previous pair give
+ * the score of ffmpeg's scene detection (min(mafd, |mafd - prev_mafd|) /
+ * 100), a coarse luma histogram confirms that the content changed and not
+ * only moved. Cuts become keyframes unless one was placed in the last
+ * SCENE_MIN_GAP_FRAMES frames. Keyframes are also forced every keyint
+ * frames and at segment boundaries, so segmented outputs keep their
+ * segment durations whatever the scene cuts do.
+ *
+ * The previous frame is kept by reference, nothing is copied. Frames
+ * without an 8 bit luma plane only get the interval and boundary
+ * keyframes.
+ */
+class SceneDetector {
+public:
+    void open(SceneDetectOptions opts) {
+        options = opts;
+        stats.kernel = sad_kernel().name;
+        previous.reset(av_frame_alloc());
+    }
+
+    // AV_PICTURE_TYPE_I when the frame has to start a GOP, AV_PICTURE_TYPE_NONE leaves it to the encoder
+    enum AVPictureType frame_type(const AVFrame *frame, AVRational time_base) {
+        int64_t start = metrics_now_ns();
+        stats.frames++;
+        int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+        double seconds = pts != AV_NOPTS_VALUE ? pts * av_q2d(time_base) : 0;
+        bool first = stats.frames == 1;
+        if (first) {
+            next_boundary = seconds + options.boundary_seconds;
+        }
+
+        double score = 0;
+        if (options.threshold > 0) {
+            score = scene_score(frame);
+            remember(frame);
+        }
+
+        enum AVPictureType type = AV_PICTURE_TYPE_NONE;
+        since_keyframe++;
+        if (first) {
+            // encoders open with a keyframe anyway
+            since_keyframe = 0;
+        } else if (options.boundary_seconds > 0 && seconds >= next_boundary - 1e-6) {
+            type = AV_PICTURE_TYPE_I;
+            stats.boundary_keyframes++;
+            while (next_boundary <= seconds + 1e-6) {
+                next_boundary += options.boundary_seconds;
+            }
+        } else if (options.keyint > 0 && since_keyframe >= options.keyint) {
+            type = AV_PICTURE_TYPE_I;
+            stats.interval_keyframes++;
+        } else if (score >= options.threshold && options.threshold > 0) {
+            if (since_keyframe >= SCENE_MIN_GAP_FRAMES) {
+                type = AV_PICTURE_TYPE_I;
+                stats.scene_keyframes++;
+                debug("scene cut at %.3fs, score %.3f", seconds, score);
+            } else {
+                stats.suppressed++;
+            }
+        }
+        if (type == AV_PICTURE_TYPE_I) {
+            since_keyframe = 0;
+        }
+        stats.ns += metrics_now_ns() - start;
+        return type;
+    }
+
+    void add_encode_ns(int64_t ns) {
+        stats.encode_ns += ns;
+    }
+
+    SceneDetectStats get_stats() const {
+        return stats;
+    }
+
+private:
+    double scene_score(const AVFrame *frame) {
+        if (!has_8bit_luma_plane((enum AVPixelFormat) frame->format)) {
+            if (!warned) {
+                logging("[WARN] scene detection needs 8 bit luma, %s frames only get interval keyframes",
+                        av_get_pix_fmt_name((enum AVPixelFormat) frame->format));
+                warned = true;
+            }
+            return 0;
+        }
+        if (!previous->data[0] || previous->width != frame->width || previous->height != frame->height ||
+            previous->format != frame->format) {
+            luma_histogram(frame, histogram);
+            return 0;
+        }
+        stats.analyzed++;
+
+        uint64_t sad = sad_kernel().sad(frame->data[0], frame->linesize[0], previous->data[0], previous->linesize[0],
+                                        frame->width, frame->height, SCENE_SAD_ROW_STEP);
+        int64_t rows = (frame->height + SCENE_SAD_ROW_STEP - 1) / SCENE_SAD_ROW_STEP;
+        double mafd = (double) sad / (rows * frame->width);
+        double diff = fabs(mafd - previous_mafd);
+        previous_mafd = mafd;
+
+        uint32_t current[SCENE_HISTOGRAM_BINS];
+        luma_histogram(frame, current);
+        uint64_t moved = 0, total = 0;
+        for (int i = 0; i < SCENE_HISTOGRAM_BINS; i++) {
+            moved += abs((int) current[i] - (int) histogram[i]);
+            total += current[i];
+        }
+        memcpy(histogram, current, sizeof(histogram));
+        double distance = total ? moved / (2.0 * total) : 0;
+
+        if (distance < SCENE_MIN_HISTOGRAM_DISTANCE) {
+            return 0;
+        }
+        return std::clamp(std::min(mafd, diff) / 100.0, 0.0, 1.0);
+    }
+
+    void remember(const AVFrame *frame) {
+        av_frame_unref(previous.get());
+        if (has_8bit_luma_plane((enum AVPixelFormat) frame->format) && av_frame_ref(previous.get(), frame) < 0) {
+            av_frame_unref(previous.get());
+        }
+    }
+
+    SceneDetectOptions options = {};
+    FramePtr previous;
+    uint32_t histogram[SCENE_HISTOGRAM_BINS] = {};
+    double previous_mafd = 0;
+    int since_keyframe = 0;
+    double next_boundary = 0;
+    bool warned = false;
+    SceneDetectStats stats = {};
+};
+
+void print_scene_detect_stats(const char *name, SceneDetectStats stats) {
+    logging("[INFO] %s: keyframes placed at %lld scene cuts (%lld too close to the last keyframe), "
+            "%lld on the interval, %lld at segment boundaries",
+            name, (long long) stats.scene_keyframes, (long long) stats.suppressed,
+            (long long) stats.interval_keyframes, (long long) stats.boundary_keyframes);
+    logging("[INFO] %s: scene detection (%s) %.3f ms per frame, %.2f%% of the encoder's time", name, stats.kernel,
+            stats.frames ? stats.ns / 1e6 / stats.frames : 0.0, stats.encode_ns ? 100.0 * stats.ns / stats.encode_ns : 0.0);
+}
+
+#endif //LEARN_LIBAV_SCENE_DETECT_H
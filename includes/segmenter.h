@@ -0,0 +1,731 @@
+#ifndef LEARN_LIBAV_SEGMENTER_H
+#define LEARN_LIBAV_SEGMENTER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "metrics.h"
+
+#define SEGMENT_AVIO_BUFFER_SIZE (64 * 1024)
+#define SEGMENT_FILE_BUFFER_SIZE (1024 * 1024)
+// segments at the live edge whose LL-HLS parts stay in the playlist
+#define SEGMENT_PART_WINDOW 3
+#define SEGMENT_INIT_NAME "init.mp4"
+
+/*
+ * Segmented output. An output named <dir>/<name>.m3u8 or <dir>/<name>.mpd
+ * is muxed as fragmented MP4 into a custom AVIOContext, which splits the
+ * byte stream at its top level boxes: ftyp + moov become init.mp4, every
+ * moof + mdat pair is a fragment. Fragments are grouped into keyframe
+ * aligned segments of at least segment_seconds, with part_seconds set every
+ * fragment is also published as an LL-HLS partial segment (a byte range of
+ * the segment being written). Playlists are rewritten atomically whenever
+ * something is published. Nothing is read back from disk.
+ */
+typedef struct {
+    double segment_seconds;
+    // 0 disables LL-HLS parts
+    double part_seconds;
+    // write the HLS and the DASH playlist whichever one was named
+    bool both_playlists;
+} SegmentOptions;
+
+SegmentOptions &segment_options() {
+    static SegmentOptions options = {4, 0, false};
+    return options;
+}
+
+bool is_segment_target(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    return dot && (strcmp(dot, ".m3u8") == 0 || strcmp(dot, ".mpd") == 0);
+}
+
+typedef struct {
+    uint32_t track_id;
+    uint32_t timescale;
+    uint32_t handler;
+    uint32_t default_duration;
+} SegmentTrack;
+
+// one moof + mdat, times in the timescale of the main track
+typedef struct {
+    int64_t offset;
+    int64_t size;
+    int64_t start;
+    int64_t duration;
+    bool independent;
+} SegmentPart;
+
+typedef struct {
+    int number;
+    std::string name;
+    int64_t start;
+    int64_t duration;
+    int64_t size;
+    std::vector<SegmentPart> parts;
+} Segment;
+
+uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+uint64_t read_be64(const uint8_t *p) {
+    return ((uint64_t) read_be32(p) << 32) | read_be32(p + 4);
+}
+
+constexpr uint32_t box_type(const char *name) {
+    return ((uint32_t) name[0] << 24) | ((uint32_t) name[1] << 16) | ((uint32_t) name[2] << 8) | (uint32_t) name[3];
+}
+
+// steps through the child boxes in [*p, end), false when there are no more
+bool next_box(const uint8_t **p, const uint8_t *end, uint32_t *type, const uint8_t **body, const uint8_t **body_end) {
+    if (end - *p < 8) {
+        return false;
+    }
+    uint64_t size = read_be32(*p);
+    *type = read_be32(*p + 4);
+    int header = 8;
+    if (size == 1) {
+        if (end - *p < 16) {
+            return false;
+        }
+        size = read_be64(*p + 8);
+        header = 16;
+    } else if (size == 0) {
+        size = end - *p;
+    }
+    if (size < (uint64_t) header || size > (uint64_t) (end - *p)) {
+        return false;
+    }
+    *body = *p + header;
+    *body_end = *p + size;
+    *p += size;
+    return true;
+}
+
+SegmentTrack *find_track(std::vector<SegmentTrack> &tracks, uint32_t track_id) {
+    for (auto &t : tracks) {
+        if (t.track_id == track_id) {
+            return &t;
+        }
+    }
+    return NULL;
+}
+
+// track ids, timescales, handlers and trex defaults from the moov of the init segment
+void parse_moov(const uint8_t *p, const uint8_t *end, std::vector<SegmentTrack> &tracks) {
+    uint32_t type;
+    const uint8_t *body, *body_end;
+    while (next_box(&p, end, &type, &body, &body_end)) {
+        if (type == box_type("trak")) {
+            SegmentTrack track = {};
+            const uint8_t *q = body;
+            uint32_t t;
+            const uint8_t *b, *be;
+            while (next_box(&q, body_end, &t, &b, &be)) {
+                if (t == box_type("tkhd") && be - b >= 24) {
+                    track.track_id = read_be32(b + (b[0] == 1 ? 20 : 12));
+                } else if (t == box_type("mdia")) {
+                    const uint8_t *r = b;
+                    uint32_t u;
+                    const uint8_t *c, *ce;
+                    while (next_box(&r, be, &u, &c, &ce)) {
+                        if (u == box_type("mdhd") && ce - c >= 24) {
+                            track.timescale = read_be32(c + (c[0] == 1 ? 20 : 12));
+                        } else if (u == box_type("hdlr") && ce - c >= 12) {
+                            track.handler = read_be32(c + 8);
+                        }
+                    }
+                }
+            }
+            tracks.push_back(track);
+        } else if (type == box_type("mvex")) {
+            const uint8_t *q = body;
+            uint32_t t;
+            const uint8_t *b, *be;
+            while (next_box(&q, body_end, &t, &b, &be)) {
+                SegmentTrack *track = t == box_type("trex") && be - b >= 16 ? find_track(tracks, read_be32(b + 4)) : NULL;
+                if (track) {
+                    track->default_duration = read_be32(b + 12);
+                }
+            }
+        }
+    }
+}
+
+// decode time and duration of track_id's samples in a moof, false when the track is not in it
+bool parse_moof(const uint8_t *p, const uint8_t *end, SegmentTrack *track, int64_t *start, int64_t *duration) {
+    uint32_t type;
+    const uint8_t *body, *body_end;
+    while (next_box(&p, end, &type, &body, &body_end)) {
+        if (type != box_type("traf")) {
+            continue;
+        }
+        bool found = false;
+        uint32_t default_duration = track->default_duration;
+        *duration = 0;
+        const uint8_t *q = body;
+        uint32_t t;
+        const uint8_t *b, *be;
+        while (next_box(&q, body_end, &t, &b, &be)) {
+            if (t == box_type("tfhd") && be - b >= 8) {
+                if (read_be32(b + 4) != track->track_id) {
+                    break;
+                }
+                found = true;
+                uint32_t flags = read_be32(b) & 0xffffff;
+                const uint8_t *f = b + 8;
+                f += flags & 0x01 ? 8 : 0;
+                f += flags & 0x02 ? 4 : 0;
+                if ((flags & 0x08) && be - f >= 4) {
+                    default_duration = read_be32(f);
+                }
+            } else if (t == box_type("tfdt") && be - b >= 8) {
+                *start = b[0] == 1 ? (int64_t) read_be64(b + 4) : read_be32(b + 4);
+            } else if (t == box_type("trun") && be - b >= 8) {
+                uint32_t flags = read_be32(b) & 0xffffff;
+                uint32_t count = read_be32(b + 4);
+                const uint8_t *s = b + 8;
+                s += flags & 0x01 ? 4 : 0;
+                s += flags & 0x04 ? 4 : 0;
+                if (!(flags & 0x100)) {
+                    *duration += (int64_t) count * default_duration;
+                    continue;
+                }
+                int stride = 4 * (1 + !!(flags & 0x200) + !!(flags & 0x400) + !!(flags & 0x800));
+                for (uint32_t i = 0; i < count && be - s >= 4; i++, s += stride) {
+                    *duration += read_be32(s);
+                }
+            }
+        }
+        if (found) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// RFC 6381 codecs value for the playlists, as far as the parameters tell
+std::string codec_string(AVCodecParameters *par) {
+    char value[32];
+    const uint8_t *e = par->extradata;
+    switch (par->codec_id) {
+        case AV_CODEC_ID_H264:
+            if (par->extradata_size >= 4 && e[0] == 1) {
+                snprintf(value, sizeof(value), "avc1.%02x%02x%02x", e[1], e[2], e[3]);
+                return value;
+            }
+            // Annex B: profile, constraints and level follow the SPS NAL header
+            for (int i = 0; i + 7 < par->extradata_size; i++) {
+                if (e[i] == 0 && e[i + 1] == 0 && e[i + 2] == 1 && (e[i + 3] & 0x1f) == 7) {
+                    snprintf(value, sizeof(value), "avc1.%02x%02x%02x", e[i + 4], e[i + 5], e[i + 6]);
+                    return value;
+                }
+            }
+            return "avc1";
+        case AV_CODEC_ID_HEVC:
+            return "hvc1";
+        case AV_CODEC_ID_VP9:
+            return "vp09.00.10.08";
+        case AV_CODEC_ID_AAC:
+            snprintf(value, sizeof(value), "mp4a.40.%d", par->extradata_size > 0 && (e[0] >> 3) ? e[0] >> 3 : 2);
+            return value;
+        default:
+            return avcodec_get_name(par->codec_id);
+    }
+}
+
+// xs:dateTime in UTC with milliseconds, as the MPD wants its wall clock times
+std::string utc_date_time(std::chrono::system_clock::time_point t) {
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+    time_t secs = ms / 1000;
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    char buf[64];
+    size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, sizeof(buf) - n, ".%03dZ", (int) (ms % 1000));
+    return buf;
+}
+
+class SegmentWriter : public CustomIO {
+public:
+    ~SegmentWriter() override {
+        finish();
+        print_stats();
+    }
+
+    // closes the last segment and writes the final playlists
+    int finish() override {
+        if (done) {
+            return error;
+        }
+        finish_segment();
+        done = true;
+        publish();
+        if (error < 0) {
+            logging("[ERROR] segmenter %s failed: %s", dir.c_str(), av_err2string(error).c_str());
+        }
+        return error;
+    }
+
+    int open_dir(const char *target, AVFormatContext *avfc) {
+        std::string path(target);
+        size_t slash = path.rfind('/');
+        dir = slash == std::string::npos ? "." : path.substr(0, slash);
+        std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+        mkdir(dir.c_str(), 0755);
+        bool hls = name.size() > 5 && name.compare(name.size() - 5, 5, ".m3u8") == 0;
+        if (hls || options.both_playlists) {
+            hls_name = hls ? name : "index.m3u8";
+        }
+        if (!hls || options.both_playlists) {
+            dash_name = hls ? "manifest.mpd" : name;
+        }
+
+        for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+            AVCodecParameters *par = avfc->streams[i]->codecpar;
+            codecs += (codecs.empty() ? "" : ",") + codec_string(par);
+            if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+                width = par->width;
+                height = par->height;
+            }
+        }
+        started = std::chrono::steady_clock::now();
+        return 0;
+    }
+
+    // the byte stream of the muxer, marker tells whether the next fragment starts with a keyframe
+    int write(const uint8_t *buf, int buf_size, enum AVIODataMarkerType marker) {
+        if (marker == AVIO_DATA_MARKER_SYNC_POINT || marker == AVIO_DATA_MARKER_BOUNDARY_POINT) {
+            next_independent = marker == AVIO_DATA_MARKER_SYNC_POINT;
+        }
+        const uint8_t *p = buf;
+        const uint8_t *end = buf + buf_size;
+        while (p < end && error == 0) {
+            if (box_left == 0) {
+                // top level box header, 8 bytes or 16 with a 64 bit size
+                size_t want = header_have >= 8 && read_be32(header) == 1 ? 16 : 8;
+                size_t n = std::min<size_t>(want - header_have, end - p);
+                memcpy(header + header_have, p, n);
+                header_have += n;
+                p += n;
+                if (header_have == 8 && read_be32(header) == 1) {
+                    continue;
+                }
+                if (header_have == want) {
+                    begin_box();
+                }
+                continue;
+            }
+            size_t n = std::min<int64_t>(box_left, end - p);
+            box_body(p, n);
+            p += n;
+            box_left -= n;
+            if (box_left == 0) {
+                end_box();
+            }
+        }
+        return error < 0 ? error : buf_size;
+    }
+
+    SegmentOptions options = segment_options();
+
+private:
+    void begin_box() {
+        uint64_t size = read_be32(header);
+        current_type = read_be32(header + 4);
+        if (size == 1) {
+            size = read_be64(header + 8);
+        } else if (size == 0) {
+            // runs to the end of the stream, only a non fragmented mdat does that
+            size = INT64_MAX;
+        }
+        box_left = size - header_have;
+        box_data.assign(header, header + header_have);
+        header_have = 0;
+
+        if (current_type == box_type("mdat")) {
+            if (!segment_file) {
+                logging("[ERROR] %s: media data outside a fragment, the output must be fragmented MP4", dir.c_str());
+                error = AVERROR(EINVAL);
+                return;
+            }
+            write_segment(box_data.data(), box_data.size());
+            box_data.clear();
+        }
+        if (box_left == 0) {
+            end_box();
+        }
+    }
+
+    void box_body(const uint8_t *p, size_t n) {
+        if (current_type == box_type("mdat")) {
+            write_segment(p, n);
+        } else {
+            box_data.insert(box_data.end(), p, p + n);
+        }
+    }
+
+    void end_box() {
+        if (current_type == box_type("ftyp") || current_type == box_type("moov")) {
+            init.insert(init.end(), box_data.begin(), box_data.end());
+            if (current_type == box_type("moov")) {
+                parse_moov(box_data.data() + 8, box_data.data() + box_data.size(), tracks);
+                pick_main_track();
+                if (write_file_atomic(dir + "/" + SEGMENT_INIT_NAME, init.data(), init.size()) < 0) {
+                    error = AVERROR(EIO);
+                }
+            }
+        } else if (current_type == box_type("moof")) {
+            begin_fragment();
+        } else if (current_type == box_type("mdat")) {
+            end_fragment();
+        } else if (current_type != box_type("mfra")) {
+            // styp, sidx, free: part of whatever is being written
+            if (segment_file) {
+                write_segment(box_data.data(), box_data.size());
+            } else {
+                init.insert(init.end(), box_data.begin(), box_data.end());
+            }
+        }
+        box_data.clear();
+    }
+
+    // video drives the segment boundaries, audio only files use their first track
+    void pick_main_track() {
+        main_track = tracks.empty() ? SegmentTrack{1, 90000, 0, 0} : tracks[0];
+        for (auto &t : tracks) {
+            if (t.handler == box_type("vide")) {
+                main_track = t;
+                break;
+            }
+        }
+        if (main_track.timescale == 0) {
+            main_track.timescale = 90000;
+        }
+    }
+
+    void begin_fragment() {
+        fragment_arrived = std::chrono::steady_clock::now();
+        int64_t start = segment_end, duration = 0;
+        if (!parse_moof(box_data.data() + 8, box_data.data() + box_data.size(), &main_track, &start, &duration)) {
+            // the main track has no samples in this fragment
+            start = segment_end;
+        }
+        bool independent = next_independent;
+        next_independent = false;
+        if (first_start == AV_NOPTS_VALUE) {
+            first_start = start;
+            first_fragment_wallclock = std::chrono::system_clock::now();
+        }
+
+        int64_t target = (int64_t) (options.segment_seconds * main_track.timescale);
+        if (!segment_file || (independent && current.duration >= target)) {
+            finish_segment();
+            open_segment(start);
+        }
+        part = {current.size, 0, start, duration, independent};
+        write_segment(box_data.data(), box_data.size());
+    }
+
+    void end_fragment() {
+        if (!segment_file) {
+            return;
+        }
+        part.size = current.size - part.offset;
+        current.duration += part.duration;
+        segment_end = part.start + part.duration;
+        current.parts.push_back(part);
+        fflush(segment_file);
+        if (options.part_seconds > 0) {
+            publish();
+            record_latency(segment_end);
+        }
+    }
+
+    void open_segment(int64_t start) {
+        current = {};
+        current.number = segments.size() + 1;
+        char name[64];
+        snprintf(name, sizeof(name), "seg-%05d.m4s", current.number);
+        current.name = name;
+        current.start = start;
+        std::string path = dir + "/" + current.name;
+        segment_file = fopen(path.c_str(), "wb");
+        if (!segment_file) {
+            logging("[ERROR] failed to open %s", path.c_str());
+            error = AVERROR(errno);
+            return;
+        }
+        setvbuf(segment_file, NULL, _IOFBF, SEGMENT_FILE_BUFFER_SIZE);
+    }
+
+    void finish_segment() {
+        if (!segment_file) {
+            return;
+        }
+        if (fclose(segment_file) != 0 && error == 0) {
+            error = AVERROR(EIO);
+        }
+        segment_file = NULL;
+        if (current.parts.empty()) {
+            return;
+        }
+        total_bytes += current.size;
+        segments.push_back(current);
+        publish();
+        if (options.part_seconds <= 0) {
+            record_latency(current.start + current.duration);
+        }
+    }
+
+    void write_segment(const uint8_t *data, size_t size) {
+        if (!segment_file || fwrite(data, 1, size, segment_file) != size) {
+            if (error == 0) {
+                error = AVERROR(EIO);
+            }
+            return;
+        }
+        current.size += size;
+    }
+
+    double seconds(int64_t ts) const {
+        return (double) ts / main_track.timescale;
+    }
+
+    /*
+     * How far the newly published media trails the media clock: zero for a
+     * real time source means the segment went out the moment its last frame
+     * was due. Faster than real time inputs are counted apart.
+     */
+    void record_latency(int64_t media_end) {
+        auto now = std::chrono::steady_clock::now();
+        int64_t wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - started).count();
+        int64_t media_ns = av_rescale(media_end - first_start, 1000000000, main_track.timescale);
+        if (wall_ns >= media_ns) {
+            publish_lag.record(wall_ns - media_ns);
+        } else {
+            ahead_of_real_time++;
+        }
+        flush_to_publish.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - fragment_arrived).count());
+    }
+
+    // a playlist that can not be written fails the output like a segment write
+    void publish() {
+        bool ok = true;
+        if (!hls_name.empty()) {
+            std::string m3u8 = hls_playlist();
+            ok = write_file_atomic(dir + "/" + hls_name, m3u8.data(), m3u8.size()) == 0;
+        }
+        if (!dash_name.empty() && !segments.empty()) {
+            std::string mpd = dash_manifest();
+            ok = write_file_atomic(dir + "/" + dash_name, mpd.data(), mpd.size()) == 0 && ok;
+        }
+        if (!ok && error == 0) {
+            error = AVERROR(EIO);
+        }
+    }
+
+    void append_parts(std::string &out, const Segment &segment) {
+        char line[256];
+        for (auto &p : segment.parts) {
+            snprintf(line, sizeof(line), "#EXT-X-PART:DURATION=%.5f,URI=\"%s\",BYTERANGE=\"%lld@%lld\"%s\n",
+                     seconds(p.duration), segment.name.c_str(), (long long) p.size, (long long) p.offset,
+                     p.independent ? ",INDEPENDENT=YES" : "");
+            out += line;
+        }
+    }
+
+    // completed segments are only formatted once, the live edge is rebuilt on every publish
+    std::string hls_playlist() {
+        bool ll = options.part_seconds > 0;
+        size_t window_start = segments.size();
+        if (ll && !done) {
+            window_start = segments.size() > SEGMENT_PART_WINDOW ? segments.size() - SEGMENT_PART_WINDOW : 0;
+        }
+        char line[256];
+        while (hls_formatted < window_start) {
+            Segment &s = segments[hls_formatted++];
+            snprintf(line, sizeof(line), "#EXTINF:%.5f,\n%s\n", seconds(s.duration), s.name.c_str());
+            hls_history += line;
+        }
+
+        double max_duration = options.segment_seconds;
+        for (auto &s : segments) {
+            max_duration = std::max(max_duration, seconds(s.duration));
+        }
+        std::string out = "#EXTM3U\n";
+        snprintf(line, sizeof(line), "#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n", ll ? 9 : 7, (int) ceil(max_duration));
+        out += line;
+        if (ll) {
+            // no CAN-BLOCK-RELOAD, the files are served as they are and nothing answers _HLS_msn/_HLS_part
+            snprintf(line, sizeof(line), "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n"
+                     "#EXT-X-PART-INF:PART-TARGET=%.3f\n", 3 * options.part_seconds, options.part_seconds);
+            out += line;
+        }
+        out += "#EXT-X-MEDIA-SEQUENCE:1\n#EXT-X-MAP:URI=\"" SEGMENT_INIT_NAME "\"\n";
+        out += hls_history;
+        for (size_t i = hls_formatted; i < segments.size(); i++) {
+            append_parts(out, segments[i]);
+            snprintf(line, sizeof(line), "#EXTINF:%.5f,\n%s\n", seconds(segments[i].duration), segments[i].name.c_str());
+            out += line;
+        }
+        if (done) {
+            out += "#EXT-X-ENDLIST\n";
+        } else if (ll && segment_file) {
+            append_parts(out, current);
+        }
+        return out;
+    }
+
+    std::string dash_manifest() {
+        char buf[512];
+        int64_t end = segments.back().start + segments.back().duration;
+        std::string out = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+        if (done) {
+            snprintf(buf, sizeof(buf), "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+                     "type=\"static\" mediaPresentationDuration=\"PT%.3fS\" minBufferTime=\"PT%.1fS\">\n",
+                     seconds(end - segments.front().start), options.segment_seconds);
+        } else {
+            // media time first_start went out at the first fragment's wall clock time, so t maps to the live edge
+            auto availability_start = first_fragment_wallclock - std::chrono::microseconds(
+                    av_rescale(first_start, 1000000, main_track.timescale));
+            snprintf(buf, sizeof(buf), "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+                     "type=\"dynamic\" availabilityStartTime=\"%s\" publishTime=\"%s\" minimumUpdatePeriod=\"PT%.1fS\" "
+                     "minBufferTime=\"PT%.1fS\">\n", utc_date_time(availability_start).c_str(),
+                     utc_date_time(std::chrono::system_clock::now()).c_str(), options.segment_seconds, options.segment_seconds);
+        }
+        out += buf;
+        int64_t bandwidth = seconds(end - segments.front().start) > 0 ? total_bytes * 8 / seconds(end - segments.front().start) : 0;
+        snprintf(buf, sizeof(buf), "  <Period id=\"0\" start=\"PT0S\">\n    <AdaptationSet segmentAlignment=\"true\">\n"
+                 "      <Representation id=\"0\" mimeType=\"%s\" codecs=\"%s\" bandwidth=\"%lld\"",
+                 width ? "video/mp4" : "audio/mp4", codecs.c_str(), (long long) bandwidth);
+        out += buf;
+        if (width) {
+            snprintf(buf, sizeof(buf), " width=\"%d\" height=\"%d\"", width, height);
+            out += buf;
+        }
+        snprintf(buf, sizeof(buf), ">\n        <SegmentTemplate timescale=\"%u\" initialization=\"%s\" "
+                 "media=\"seg-$Number%%05d$.m4s\" startNumber=\"1\">\n          <SegmentTimeline>\n",
+                 main_track.timescale, SEGMENT_INIT_NAME);
+        out += buf;
+        for (auto &s : segments) {
+            snprintf(buf, sizeof(buf), "            <S t=\"%lld\" d=\"%lld\"/>\n", (long long) s.start, (long long) s.duration);
+            out += buf;
+        }
+        out += "          </SegmentTimeline>\n        </SegmentTemplate>\n      </Representation>\n"
+               "    </AdaptationSet>\n  </Period>\n</MPD>\n";
+        return out;
+    }
+
+    void print_stats() {
+        if (segments.empty()) {
+            return;
+        }
+        size_t parts = 0;
+        for (auto &s : segments) {
+            parts += s.parts.size();
+        }
+        logging("[INFO] segmenter %s: %d segments, %d fragments, %.1f MB", dir.c_str(), (int) segments.size(),
+                (int) parts, total_bytes / 1e6);
+        logging("[INFO] publish lag behind the media clock: p50 %.1f ms, p99 %.1f ms, max %.1f ms, "
+                "%lld published ahead of real time; fragment to publish p50 %.3f ms, p99 %.3f ms",
+                publish_lag.quantile_ns(0.5) / 1e6, publish_lag.quantile_ns(0.99) / 1e6, publish_lag.get_max_ns() / 1e6,
+                (long long) ahead_of_real_time, flush_to_publish.quantile_ns(0.5) / 1e6, flush_to_publish.quantile_ns(0.99) / 1e6);
+    }
+
+    std::string dir;
+    std::string hls_name;
+    std::string dash_name;
+    std::string codecs;
+    int width = 0;
+    int height = 0;
+
+    uint8_t header[16];
+    size_t header_have = 0;
+    int64_t box_left = 0;
+    uint32_t current_type = 0;
+    std::vector<uint8_t> box_data;
+
+    std::vector<uint8_t> init;
+    std::vector<SegmentTrack> tracks;
+    SegmentTrack main_track = {1, 90000, 0, 0};
+    bool next_independent = true;
+
+    FILE *segment_file = NULL;
+    Segment current = {};
+    SegmentPart part = {};
+    int64_t segment_end = 0;
+    int64_t first_start = AV_NOPTS_VALUE;
+    std::vector<Segment> segments;
+    size_t hls_formatted = 0;
+    std::string hls_history;
+    int64_t total_bytes = 0;
+    bool done = false;
+    int error = 0;
+
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point fragment_arrived;
+    std::chrono::system_clock::time_point first_fragment_wallclock;
+    LatencyHistogram publish_lag;
+    LatencyHistogram flush_to_publish;
+    int64_t ahead_of_real_time = 0;
+};
+
+int segment_write_packet(void *opaque, uint8_t *buf, int buf_size) {
+    return ((SegmentWriter*) opaque)->write(buf, buf_size, AVIO_DATA_MARKER_UNKNOWN);
+}
+
+int segment_write_data_type(void *opaque, uint8_t *buf, int buf_size, enum AVIODataMarkerType type, int64_t time) {
+    return ((SegmentWriter*) opaque)->write(buf, buf_size, type);
+}
+
+/*
+ * Opens avfc->pb for a segmented output, called once the streams exist and
+ * before avformat_write_header. avfc must be an mp4 muxer, the fragmenting
+ * movflags are set here and options given to avformat_write_header win.
+ */
+int open_segment_output(AVFormatContext *avfc, const char *target) {
+    if (strcmp(avfc->oformat->name, "mp4") != 0) {
+        logging("[ERROR] %s: segmented outputs are fragmented mp4, not %s", target, avfc->oformat->name);
+        return AVERROR(EINVAL);
+    }
+    SegmentWriter *writer = new SegmentWriter();
+    writer->open_dir(target, avfc);
+
+    uint8_t *buffer = (uint8_t*) av_malloc(SEGMENT_AVIO_BUFFER_SIZE);
+    avfc->pb = buffer ? avio_alloc_context(buffer, SEGMENT_AVIO_BUFFER_SIZE, 1, writer, NULL, segment_write_packet, NULL) : NULL;
+    if (!avfc->pb) {
+        av_free(buffer);
+        delete writer;
+        return AVERROR(ENOMEM);
+    }
+    avfc->pb->write_data_type = segment_write_data_type;
+    avfc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    // a fragment per keyframe, and per part for LL-HLS, handed over as soon as the muxer has it
+    av_opt_set(avfc->priv_data, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    if (writer->options.part_seconds > 0) {
+        av_opt_set_int(avfc->priv_data, "frag_duration", (int64_t) (writer->options.part_seconds * AV_TIME_BASE), 0);
+    }
+    avfc->flush_packets = 1;
+    return 0;
+}
+
+#endif //LEARN_LIBAV_SEGMENTER_H
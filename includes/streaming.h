@@ -0,0 +1,733 @@
+#ifndef LEARN_LIBAV_STREAMING_H
+#define LEARN_LIBAV_STREAMING_H
+
+#include <string>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/timestamp.h>
+    #include <libavutil/opt.h>
+}
+
+#include "audio_stage.h"
+#include "checkpoint.h"
+#include "dedup.h"
+#include "handles.h"
+#include "helpers.h"
+#include "input.h"
+#include "live.h"
+#include "log.h"
+#include "metrics.h"
+#include "output.h"
+#include "pool.h"
+#include "probe_cache.h"
+#include "quality.h"
+#include "scaler.h"
+#include "scene_detect.h"
+#include "segmenter.h"
+#include "thread_budget.h"
+
+typedef struct {
+    char copy_video;
+    char copy_audio;
+    char *output_extension;
+    char *muxer_opt_key;
+    char *muxer_opt_value;
+    char *video_codec;
+    char *audio_codec;
+    char *codec_priv_key;
+    char *codec_priv_value;
+    // target video bit rate in bit/s, 0 keeps the default of 2 Mbit/s
+    int64_t video_bit_rate;
+    // output size, 0 keeps the input's, one of them 0 keeps the aspect ratio
+    int width;
+    int height;
+    // encoder pixel format name, NULL picks the supported one closest to the input's
+    char *pix_fmt;
+    // threads converting frames when size or pixel format change, 0 takes them from the thread budget
+    int scale_threads;
+    // longest video GOP in frames, 0 leaves it to the encoder
+    int keyint;
+    // scene cut score that forces a video keyframe, 0 disables scene detection (see scene_detect.h)
+    double scene_threshold;
+    // decode the encoded video again and compare it with the source, see quality.h
+    char measure_quality;
+    // drop video frames that repeat the last one kept, see dedup.h
+    char drop_duplicates;
+    // mean absolute difference per pixel a repeat may have in every block, 0 only drops identical frames
+    double duplicate_threshold;
+} StreamingParams;
+
+typedef struct StreamingContext {
+    // declared first so the threads go back to the budget after the codecs are closed
+    ThreadLease video_threads;
+    ThreadLease audio_threads;
+    ThreadLease scaler_threads;
+    FormatContextPtr avfc;
+    AVCodec *video_avc = NULL;
+    AVCodec *audio_avc = NULL;
+    AVStream *video_avs = NULL;
+    AVStream *audio_avs = NULL;
+    CodecContextPtr video_avcc;
+    CodecContextPtr audio_avcc;
+    int video_index = 0;
+    int audio_index = 0;
+    char *filename = NULL;
+    // video frames encoded, or video packets copied
+    int64_t video_frames = 0;
+    // set when decoded frames need a new size or pixel format before encoding
+    std::unique_ptr<VideoScaler> scaler;
+    // places video keyframes at scene cuts, the keyint and segment boundaries
+    std::unique_ptr<SceneDetector> scene_detector;
+    // PSNR and SSIM of the encoded video against the frames sent to the encoder
+    std::unique_ptr<QualityStage> quality;
+    // drops repeated frames before they are scaled and encoded
+    std::unique_ptr<FrameDeduplicator> dedup;
+    // reframes and resamples decoded audio for the encoder
+    std::unique_ptr<AudioStage> audio_stage;
+    // commits the output at video keyframes and continues it after a restart
+    std::unique_ptr<Checkpointer> checkpoint;
+    // when set, encoded packets are handed to the sink instead of being muxed directly
+    int (*packet_sink)(void *opaque, AVPacket *pkt) = NULL;
+    void *packet_sink_opaque = NULL;
+} StreamingContext;
+
+int open_media(const char* in_filename, FormatContextPtr &avfc) {
+    debug("Calling open_media, filename: %s", in_filename);
+    if (live_options().enabled) {
+        return open_live_input(in_filename, avfc);
+    }
+
+    AVFormatContext *ctx = avformat_alloc_context();
+    if (!ctx) {
+        logging("[ERROR] failed to alloc memory for format");
+        return -1;
+    }
+
+    // avformat_open_input frees the context on failure
+    int rc = open_input(in_filename, &ctx, NULL);
+    if (rc != 0) {
+        logging("[ERROR] failed to open file %s", in_filename);
+        logging("[ERROR] reason: %s", av_err2string(rc).c_str());
+        return -1;
+    }
+    avfc.reset(ctx);
+
+    if (probe_stream_info(avfc.get(), in_filename) < 0) {
+        logging("[ERROR] failed to get stream info");
+        return -1;
+    }
+
+    return 0;
+}
+
+int fill_stream_info(AVStream *avs, AVCodec **avc, CodecContextPtr &avcc, ThreadLease *lease) {
+    *avc = avcodec_find_decoder(avs->codecpar->codec_id);
+
+    if (!*avc) {
+        logging("[ERROR] failed to find the codec");
+        return -1;
+    }
+
+    avcc.reset(avcodec_alloc_context3(*avc));
+    if (!avcc) {
+        logging("[ERROR] failed to alloc memory for codec context");
+        return -1;
+    }
+
+    if (avcodec_parameters_to_context(avcc.get(), avs->codecpar) < 0) {
+        logging("[ERROR] failed to fill codec context");
+        return -1;
+    }
+
+    assign_codec_threads(avcc.get(), *avc, THREAD_ROLE_DECODER, THREAD_WEIGHT_DECODER, lease);
+    if (live_options().enabled) {
+        apply_live_decoder_settings(avcc.get());
+    }
+
+    if (avcodec_open2(avcc.get(), *avc, NULL) < 0) {
+        logging("[ERROR] failed to fill codec context");
+        return -1;
+    }
+
+    if (avcodec_open2(avcc.get(), *avc, NULL) < 0)  {
+        logging("failed to open codec");
+        return -1;
+    }
+
+    return 0;
+}
+
+int prepare_decoder(StreamingContext *sc) {
+    debug("calling prepare_decoder");
+    debug("number of streams: %d", sc->avfc->nb_streams);
+    for (int i=0; i< sc->avfc->nb_streams; i++) {
+        auto codec_type = sc->avfc->streams[i]->codecpar->codec_type;
+        if (codec_type == AVMEDIA_TYPE_VIDEO) {
+            debug("[stream index %d] codec type: VIDEO", i);
+            sc->video_avs = sc->avfc->streams[i];
+            sc->video_index = i;
+            if (fill_stream_info(sc->video_avs, &sc->video_avc, sc->video_avcc, &sc->video_threads)) {
+                logging("[ERROR] failed to find video stream info");
+                return -1;
+            }
+        } else if (codec_type == AVMEDIA_TYPE_AUDIO) {
+            debug("[stream index %d] codec type: AUDIO", i);
+            sc->audio_avs = sc->avfc->streams[i];
+            sc->audio_index = i;
+            if (fill_stream_info(sc->audio_avs, &sc->audio_avc, sc->audio_avcc, &sc->audio_threads)) {
+                logging("[ERROR] failed to find audio stream info");
+                return -1;
+            }
+        } else {
+            debug("[stream index %d] codec type: OTHER %d", i, codec_type);
+            logging("[INFO] skipping stream other than audio and video");
+        }
+    }
+    debug("finished call prepare_decoder");
+    return 0;
+}
+
+// sp's size, a missing side follows the input's aspect ratio, both even for 4:2:0
+void output_size(AVCodecContext *decoder_ctx, StreamingParams sp, int *width, int *height) {
+    *width = decoder_ctx->width;
+    *height = decoder_ctx->height;
+    if (sp.width && sp.height) {
+        *width = sp.width;
+        *height = sp.height;
+    } else if (sp.width) {
+        *width = sp.width;
+        *height = (int) av_rescale(sp.width, decoder_ctx->height, decoder_ctx->width) & ~1;
+    } else if (sp.height) {
+        *height = sp.height;
+        *width = (int) av_rescale(sp.height, decoder_ctx->width, decoder_ctx->height) & ~1;
+    }
+}
+
+// sp.pix_fmt when the encoder takes it, otherwise the supported format losing the least of the input
+enum AVPixelFormat output_pix_fmt(AVCodec *codec, enum AVPixelFormat input, StreamingParams sp) {
+    if (sp.pix_fmt) {
+        enum AVPixelFormat wanted = av_get_pix_fmt(sp.pix_fmt);
+        for (const enum AVPixelFormat *p = codec->pix_fmts; p && *p != AV_PIX_FMT_NONE; p++) {
+            if (*p == wanted) {
+                return wanted;
+            }
+        }
+        if (wanted != AV_PIX_FMT_NONE && !codec->pix_fmts) {
+            return wanted;
+        }
+        logging("[ERROR] %s does not encode pixel format %s", codec->name, sp.pix_fmt);
+        return AV_PIX_FMT_NONE;
+    }
+    if (!codec->pix_fmts) {
+        return input;
+    }
+    return avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, input, 0, NULL);
+}
+
+int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVRational input_framerate, StreamingParams sp) {
+    debug("calling prepare_video_encoder");
+    sc->video_avs = avformat_new_stream(sc->avfc.get(), NULL);
+
+    debug("found video codec by name: %s", sp.video_codec);
+    sc->video_avc = avcodec_find_encoder_by_name(sp.video_codec);
+    if (!sc->video_avc) {
+        logging("[ERROR] could not find the proper codec");
+        return -1;
+    }
+
+    debug("allocate memory for video AVCodecContext");
+    sc->video_avcc.reset(avcodec_alloc_context3(sc->video_avc));
+    if (!sc->video_avcc) {
+        logging("[ERROR] could not allocated memory for codec context");
+        return -1;
+    }
+
+    if (!live_options().enabled) {
+        av_opt_set(sc->video_avcc->priv_data, "preset", "fast", 0);
+    }
+
+    if (sp.codec_priv_key && sp.codec_priv_value) {
+        av_opt_set(sc->video_avcc->priv_data, sp.codec_priv_key, sp.codec_priv_value, 0);
+    }
+
+    if (sp.drop_duplicates) {
+        sc->dedup.reset(new FrameDeduplicator());
+        sc->dedup->open(sp.duplicate_threshold);
+    }
+
+    SceneDetectOptions scene_options = {};
+    scene_options.threshold = sp.scene_threshold;
+    scene_options.keyint = sp.keyint;
+    if (is_segment_target(sc->filename)) {
+        scene_options.boundary_seconds = segment_options().segment_seconds;
+    }
+    if (sp.keyint > 0) {
+        sc->video_avcc->gop_size = sp.keyint;
+    }
+    if (scene_options.threshold > 0 || scene_options.keyint > 0 || scene_options.boundary_seconds > 0) {
+        sc->scene_detector.reset(new SceneDetector());
+        sc->scene_detector->open(scene_options);
+        // forced I frames become IDR frames in x264 and x265, the other encoders do not have the option
+        av_opt_set_int(sc->video_avcc->priv_data, "forced-idr", 1, 0);
+    }
+
+    debug("decoder width: %d, height: %d, sar: %d", decoder_ctx->width, decoder_ctx->height, decoder_ctx->sample_aspect_ratio);
+    output_size(decoder_ctx, sp, &sc->video_avcc->width, &sc->video_avcc->height);
+    sc->video_avcc->sample_aspect_ratio = decoder_ctx->sample_aspect_ratio;
+
+    sc->video_avcc->pix_fmt = output_pix_fmt(sc->video_avc, decoder_ctx->pix_fmt, sp);
+    if (sc->video_avcc->pix_fmt == AV_PIX_FMT_NONE) {
+        return -1;
+    }
+
+    if (sp.video_bit_rate) {
+        sc->video_avcc->bit_rate = sp.video_bit_rate;
+        sc->video_avcc->rc_buffer_size = 2 * sp.video_bit_rate;
+        sc->video_avcc->rc_max_rate = sp.video_bit_rate;
+    } else {
+        sc->video_avcc->bit_rate = 2 * 1000 * 1000;
+        sc->video_avcc->rc_buffer_size = 4 * 1000 * 1000;
+        sc->video_avcc->rc_max_rate = 2 * 1000 * 1000;
+        sc->video_avcc->rc_min_rate = 2.5 * 1000 * 1000;
+    }
+    // a scaler that can cut the frame into bands, unless sized by hand, takes its threads out of the encoder's share
+    ScalerFormat scaler_in = {decoder_ctx->width, decoder_ctx->height, decoder_ctx->pix_fmt};
+    ScalerFormat scaler_out = {sc->video_avcc->width, sc->video_avcc->height, sc->video_avcc->pix_fmt};
+    bool scaling = scaler_out.width != scaler_in.width || scaler_out.height != scaler_in.height ||
+                   scaler_out.format != scaler_in.format;
+    int encoder_weight = THREAD_WEIGHT_ENCODER;
+    if (scaling && !sp.scale_threads && scaler_rows_independent(scaler_in, scaler_out)) {
+        sc->scaler_threads = thread_budget().lease(THREAD_ROLE_SCALER, THREAD_WEIGHT_SCALER);
+        encoder_weight -= THREAD_WEIGHT_SCALER;
+    }
+    assign_codec_threads(sc->video_avcc.get(), sc->video_avc, THREAD_ROLE_ENCODER, encoder_weight, &sc->video_threads);
+    if (live_options().enabled) {
+        apply_live_encoder_settings(sc->video_avcc.get(), sc->video_avc);
+    }
+
+    sc->video_avcc->time_base = av_inv_q(input_framerate);
+    sc->video_avs->time_base = sc->video_avcc->time_base;
+
+    if (sc->avfc->oformat->flags & AVFMT_GLOBALHEADER) {
+        sc->video_avcc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    int rc = avcodec_open2(sc->video_avcc.get(), sc->video_avc, NULL);
+    if (rc < 0) {
+        logging("[ERROR] could not open the codec: %s", av_err2string(rc).c_str());
+        return -1;
+    }
+
+    rc = avcodec_parameters_from_context(sc->video_avs->codecpar, sc->video_avcc.get());
+    if (rc < 0) {
+        logging("[ERROR] could create params from context: %s", av_err2string(rc).c_str());
+        return -1;
+    }
+
+    if (sp.measure_quality) {
+        std::string log_path = std::string(sc->filename) + ".quality.csv";
+        sc->quality.reset(new QualityStage());
+        rc = sc->quality->open(sc->video_avcc.get(), sc->video_avs->codecpar, log_path.c_str());
+        if (rc < 0) {
+            return -1;
+        } else if (rc > 0) {
+            sc->quality.reset();
+        }
+    }
+
+    if (scaling) {
+        sc->scaler.reset(new VideoScaler());
+        if (sc->scaler->open(scaler_in, scaler_out, sp.scale_threads ? sp.scale_threads : sc->scaler_threads.threads()) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int prepare_copy(AVFormatContext *avfc, AVStream **avs, AVCodecParameters *decoder_par) {
+    debug("calling prepare copy");
+    *avs = avformat_new_stream(avfc, NULL);
+    debug("avformat_new_stream");
+    avcodec_parameters_copy((*avs)->codecpar, decoder_par);
+    debug("copy params");
+    return 0;
+}
+
+int prepare_audio_encoder(StreamingContext *sc, int sample_rate, StreamingParams sp) {
+    sc->audio_avs = avformat_new_stream(sc->avfc.get(), NULL);
+    sc->audio_avc = avcodec_find_encoder_by_name(sp.audio_codec);
+    if (!sc->audio_avc) {
+        logging("[ERROR] could not find the proper codec");
+        return -1;
+    }
+
+    sc->audio_avcc.reset(avcodec_alloc_context3(sc->audio_avc));
+    if (!sc->audio_avcc) {
+        logging("[ERROR] could not allocated memory for codec context");
+        return -1;
+    }
+
+    int OUTPUT_CHANNELS = 2;
+    int OUTPUT_BIT_RATE = 196000;
+    sc->audio_avcc->channels = OUTPUT_CHANNELS;
+    sc->audio_avcc->channel_layout = av_get_default_channel_layout(OUTPUT_CHANNELS);
+    sc->audio_avcc->sample_rate = sample_rate;
+    sc->audio_avcc->sample_fmt = sc->audio_avc->sample_fmts[0];
+    sc->audio_avcc->bit_rate = OUTPUT_BIT_RATE;
+    sc->audio_avcc->time_base = (AVRational) {1, sample_rate};
+    sc->audio_avcc->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    assign_codec_threads(sc->audio_avcc.get(), sc->audio_avc, THREAD_ROLE_SINGLE, 0, &sc->audio_threads);
+
+    sc->audio_avs->time_base = sc->audio_avcc->time_base;
+
+    if (sc->avfc->oformat->flags & AVFMT_GLOBALHEADER) {
+        sc->audio_avcc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(sc->audio_avcc.get(), sc->audio_avc, NULL) < 0) {
+        logging("[ERROR] could not open the codec");
+        return -1;
+    }
+    avcodec_parameters_from_context(sc->audio_avs->codecpar, sc->audio_avcc.get());
+
+    sc->audio_stage.reset(new AudioStage());
+    if (sc->audio_stage->open(sc->audio_avcc.get()) < 0) {
+        logging("[ERROR] failed to prepare the audio stage");
+        return -1;
+    }
+    return 0;
+}
+
+// the one place packets reach the muxer, live outputs skip interleaving
+int mux_packet(AVFormatContext *avfc, AVPacket *pkt) {
+    if (live_options().enabled) {
+        return live_write_frame(avfc, pkt);
+    }
+    return metrics_write_frame(avfc, pkt);
+}
+
+int remux(AVPacket *pkt, AVFormatContext *avfc, AVRational decoder_tb, AVRational encoder_tb) {
+    av_packet_rescale_ts(pkt, decoder_tb, encoder_tb);
+    if (mux_packet(avfc, pkt) < 0) {
+        logging("[ERROR] error while copying stream packet");
+        return -1;
+    }
+    return 0;
+}
+
+int alloc_output(StreamingContext *encoder) {
+    debug("alloc output context");
+    AVFormatContext *output_format_context = NULL;
+    // playlists name a directory of fragmented mp4 segments, see segmenter.h
+    avformat_alloc_output_context2(&output_format_context, NULL, is_segment_target(encoder->filename) ? "mp4" : NULL,
+                                   encoder->filename);
+    encoder->avfc.reset(output_format_context);
+
+    if (!encoder->avfc) {
+        logging("[ERROR] could not allocate memory for output format");
+        return -1;
+    }
+    return 0;
+}
+
+int prepare_encoders(StreamingContext *decoder, StreamingContext *encoder, StreamingParams sp) {
+    if (alloc_output(encoder)) {
+        return -1;
+    }
+
+    debug("copy video if need: %d", sp.copy_video);
+    if (!sp.copy_video) {
+        AVRational input_framerate = av_guess_frame_rate(decoder->avfc.get(), decoder->video_avs, NULL);
+        debug("guess frame rate: num=%d, den=%d", input_framerate.num, input_framerate.den);
+
+        if (prepare_video_encoder(encoder, decoder->video_avcc.get(), input_framerate, sp)) {
+            return -1;
+        }
+    } else {
+        prepare_copy(encoder->avfc.get(), &encoder->video_avs, decoder->video_avs->codecpar);
+    }
+
+    debug("copy audio if need: %d", sp.copy_audio);
+    debug(">>>> framerate %d; bit rate: %d", decoder->audio_avcc->framerate, decoder->audio_avcc->bit_rate);
+    if (!sp.copy_audio) {
+        if (prepare_audio_encoder(encoder, decoder->audio_avcc->sample_rate, sp)) {
+            return -1;
+        }
+    } else {
+        prepare_copy(encoder->avfc.get(), &encoder->audio_avs, decoder->audio_avs->codecpar);
+    }
+    return 0;
+}
+
+int open_output(StreamingContext *encoder, StreamingParams sp) {
+    debug("encoder->avfc->oformat->flags & AVFMT_NOFILE: %d", encoder->avfc->oformat->flags & AVFMT_NOFILE);
+    // a resumed output is already open, see checkpoint.h
+    if (!encoder->avfc->pb && open_output_io(encoder->avfc.get(), encoder->filename) < 0) {
+        logging("[ERROR] could not open the output file");
+        return -1;
+    }
+
+    if (live_options().enabled) {
+        encoder->avfc->flush_packets = 1;
+    }
+
+    AVDictionary *muxer_opts = NULL;
+
+    debug("sp.muxer_opt_key && sp.muxer_opt_value: %d", sp.muxer_opt_key && sp.muxer_opt_value);
+    if (sp.muxer_opt_key && sp.muxer_opt_value) {
+        av_dict_set(&muxer_opts, sp.muxer_opt_key, sp.muxer_opt_value, 0);
+    }
+
+    debug("avformat_write_header");
+    int rc = avformat_write_header(encoder->avfc.get(), &muxer_opts);
+    av_dict_free(&muxer_opts);
+    if (rc < 0) {
+        logging("[ERROR] an error occurred when opening output file");
+        return -1;
+    }
+    return 0;
+}
+
+int write_packet(StreamingContext *sc, AVPacket *pkt) {
+    if (sc->packet_sink) {
+        return sc->packet_sink(sc->packet_sink_opaque, pkt);
+    }
+    return mux_packet(sc->avfc.get(), pkt);
+}
+
+int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame) {
+    if (input_frame && encoder->checkpoint &&
+        encoder->checkpoint->before_resume(input_frame->pts, decoder->video_avs->time_base)) {
+        return 0;
+    }
+    // decided on the decoded frame, before it is scaled
+    enum AVPictureType pict_type = AV_PICTURE_TYPE_NONE;
+    if (input_frame && encoder->scene_detector) {
+        pict_type = encoder->scene_detector->frame_type(input_frame, decoder->video_avs->time_base);
+    }
+    if (input_frame && encoder->dedup && encoder->dedup->duplicate(input_frame, pict_type == AV_PICTURE_TYPE_I)) {
+        return 0;
+    }
+    if (!input_frame && encoder->dedup) {
+        // the input ended on repeats, the last one is encoded so the video keeps its length
+        FramePtr tail(encoder->dedup->take_tail());
+        if (tail && encode_video(decoder, encoder, tail.get())) {
+            return -1;
+        }
+    }
+    if (input_frame && encoder->scaler) {
+        input_frame = encoder->scaler->convert(input_frame);
+        if (!input_frame) {
+            logging("[ERROR] failed to convert frame for the encoder");
+            return -1;
+        }
+    }
+    int64_t encode_start = metrics_now_ns();
+    if (input_frame) {
+        input_frame->pict_type = pict_type;
+        encoder->video_frames++;
+        if (encoder->quality && encoder->quality->add_source(input_frame) < 0) {
+            logging("[ERROR] failed to hold the frame for the quality stage");
+            return -1;
+        }
+    }
+    // time in the quality stage, not the encoder's
+    int64_t quality_ns = 0;
+    PooledPacket output_packet(packet_pool().acquire());
+    if (!output_packet) {
+        logging("[ERROR] could not allocate memory for output AVPacket");
+        return -1;
+    }
+
+    int64_t start = metrics_clock();
+    int rc = avcodec_send_frame(encoder->video_avcc.get(), input_frame);
+    metrics_record(METRICS_STAGE_SEND_FRAME, AVMEDIA_TYPE_VIDEO, start);
+    if (input_frame) {
+        metrics_add(METRICS_FRAMES_ENCODED, AVMEDIA_TYPE_VIDEO, 1);
+    }
+
+    while (rc >= 0) {
+        start = metrics_clock();
+        rc = avcodec_receive_packet(encoder->video_avcc.get(), output_packet.get());
+        metrics_record(METRICS_STAGE_RECEIVE_PACKET, AVMEDIA_TYPE_VIDEO, start);
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            break;
+        } else if (rc < 0) {
+            logging("[ERROR] Error while receiving packet from encoder: %s", av_err2string(rc).c_str());
+            return -1;
+        }
+
+        if (encoder->quality) {
+            int64_t quality_start = metrics_now_ns();
+            if (encoder->quality->add_packet(output_packet.get()) < 0) {
+                return -1;
+            }
+            quality_ns += metrics_now_ns() - quality_start;
+        }
+
+        output_packet->stream_index = encoder->video_avs->index;
+        output_packet->duration = encoder->video_avs->time_base.den / encoder->video_avs->time_base.num / decoder->video_avs->avg_frame_rate.num * decoder->video_avs->avg_frame_rate.den;
+
+        av_packet_rescale_ts(output_packet.get(), decoder->video_avs->time_base, encoder->video_avs->time_base);
+        rc = write_packet(encoder, output_packet.get());
+        if (rc != 0) {
+            logging("[ERROR] Error %d while receiving packet from decoder: %s", rc, av_err2string(rc).c_str());
+            return -1;
+        }
+
+        av_packet_unref(output_packet.get());
+    }
+
+    int64_t encode_ns = metrics_now_ns() - encode_start - quality_ns;
+    if (encoder->scene_detector) {
+        encoder->scene_detector->add_encode_ns(encode_ns);
+    }
+    if (encoder->dedup) {
+        encoder->dedup->add_encode_ns(encode_ns, input_frame ? 1 : 0);
+    }
+    if (!input_frame && encoder->quality) {
+        return encoder->quality->add_packet(NULL) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+// sends one frame of exactly frame_size samples, NULL drains the encoder
+int encode_audio_frame(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame) {
+    PooledPacket output_packet(packet_pool().acquire());
+    if (!output_packet) {
+        logging("[ERROR] could not allocate memory for output AVPacket");
+        return -1;
+    }
+
+    int64_t start = metrics_clock();
+    int rc = avcodec_send_frame(encoder->audio_avcc.get(), input_frame);
+    metrics_record(METRICS_STAGE_SEND_FRAME, AVMEDIA_TYPE_AUDIO, start);
+    if (rc < 0) {
+        if (input_frame) {
+            debug_pkt(decoder->audio_index, input_frame->pts, "nb_samples: %d; frame_size: %d", input_frame->nb_samples, encoder->audio_avcc->frame_size);
+        }
+        logging("[ERROR] failed to send frame to encoder: %s", av_err2string(rc).c_str());
+        return -1;
+    }
+    if (input_frame) {
+        metrics_add(METRICS_FRAMES_ENCODED, AVMEDIA_TYPE_AUDIO, 1);
+    }
+    while (rc >= 0) {
+        start = metrics_clock();
+        rc = avcodec_receive_packet(encoder->audio_avcc.get(), output_packet.get());
+        metrics_record(METRICS_STAGE_RECEIVE_PACKET, AVMEDIA_TYPE_AUDIO, start);
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            break;
+        } else if (rc < 0) {
+            logging("[ERROR] Error while receiving packet from encoder: %s", av_err2string(rc).c_str());
+            return -1;
+        }
+
+        output_packet->stream_index = encoder->audio_avs->index;
+
+        // the audio stage stamps frames in samples
+        av_packet_rescale_ts(output_packet.get(), encoder->audio_avcc->time_base, encoder->audio_avs->time_base);
+        rc = write_packet(encoder, output_packet.get());
+        if (rc != 0) {
+            logging("[ERROR] Error %d while receiving packet from decoder: %s", rc, av_err2string(rc).c_str());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// NULL flushes the audio stage and then the encoder
+int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame) {
+    AudioStage *stage = encoder->audio_stage.get();
+    int rc = stage->send_frame(input_frame, decoder->audio_avs->time_base);
+    if (rc < 0) {
+        logging("[ERROR] failed to queue audio samples: %s", av_err2string(rc).c_str());
+        return -1;
+    }
+
+    AVFrame *frame = NULL;
+    while ((rc = stage->receive_frame(&frame)) == 0) {
+        if (encode_audio_frame(decoder, encoder, frame)) {
+            return -1;
+        }
+    }
+    if (rc != AVERROR(EAGAIN) && rc != AVERROR_EOF) {
+        logging("[ERROR] failed to take audio frame from the stage: %s", av_err2string(rc).c_str());
+        return -1;
+    }
+
+    if (!input_frame) {
+        return encode_audio_frame(decoder, encoder, NULL);
+    }
+    return 0;
+}
+
+int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPacket *input_packet, AVFrame *input_frame) {
+    int64_t start = metrics_clock();
+    int rc = avcodec_send_packet(decoder->video_avcc.get(), input_packet);
+    metrics_record(METRICS_STAGE_SEND_PACKET, AVMEDIA_TYPE_VIDEO, start);
+    if (rc < 0) {
+        logging("[ERROR] Error while sending packet to decoder: %s", av_err2string(rc).c_str());
+        return rc;
+    }
+
+    while (rc >= 0) {
+        start = metrics_clock();
+        rc = avcodec_receive_frame(decoder->video_avcc.get(), input_frame);
+        metrics_record(METRICS_STAGE_RECEIVE_FRAME, AVMEDIA_TYPE_VIDEO, start);
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            break;
+        } else if (rc < 0) {
+            logging("[ERROR] Error while receiving frame from decocder: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        metrics_add(METRICS_FRAMES_DECODED, AVMEDIA_TYPE_VIDEO, 1);
+
+        if (rc >= 0) {
+            if (encode_video(decoder, encoder, input_frame)) {
+                return -1;
+            }
+        }
+        av_frame_unref(input_frame);
+    }
+    return 0;
+}
+
+int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPacket *input_packet, AVFrame *input_frame) {
+    int64_t start = metrics_clock();
+    int rc = avcodec_send_packet(decoder->audio_avcc.get(), input_packet);
+    metrics_record(METRICS_STAGE_SEND_PACKET, AVMEDIA_TYPE_AUDIO, start);
+    if (rc < 0) {
+        logging("[ERROR] Error while sending packet to decoder: %s", av_err2string(rc).c_str());
+        return rc;
+    }
+
+    while (rc >= 0) {
+        start = metrics_clock();
+        rc = avcodec_receive_frame(decoder->audio_avcc.get(), input_frame);
+        metrics_record(METRICS_STAGE_RECEIVE_FRAME, AVMEDIA_TYPE_AUDIO, start);
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            break;
+        } else if (rc < 0) {
+            logging("[ERROR] Error while receiving frame from decoder: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        metrics_add(METRICS_FRAMES_DECODED, AVMEDIA_TYPE_AUDIO, 1);
+
+        if (rc >= 0) {
+            if (encode_audio(decoder, encoder, input_frame)) {
+                logging("[ERROR] failed to encode audio");
+                return -1;
+            }
+            av_frame_unref(input_frame);
+        }
+    }
+
+    return 0;
+}
+
+#endif //LEARN_LIBAV_STREAMING_H
@@ -0,0 +1,273 @@
+#ifndef LEARN_LIBAV_SYNTHETIC_H
+#define LEARN_LIBAV_SYNTHETIC_H
+
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+
+#define SYNTHETIC_SAMPLE_RATE 48000
+#define SYNTHETIC_GOP 50
+
+typedef struct {
+    int width;
+    int height;
+    int seconds;
+    int fps;
+} SyntheticSpec;
+
+typedef struct {
+    FormatContextPtr avfc;
+    CodecContextPtr video_avcc;
+    CodecContextPtr audio_avcc;
+    AVStream *video_avs;
+    AVStream *audio_avs;
+    FramePtr video_frame;
+    FramePtr audio_frame;
+    PacketPtr packet;
+    int64_t video_pts;
+    int64_t audio_pts;
+    // real time pacing and zero latency encoding, a stand-in for a camera
+    bool paced;
+} SyntheticWriter;
+
+// e.g. synthetic-1280x720-5s.mp4, the name fully describes the content
+std::string synthetic_name(SyntheticSpec spec) {
+    return "synthetic-" + std::to_string(spec.width) + "x" + std::to_string(spec.height) + "-" +
+           std::to_string(spec.seconds) + "s.mp4";
+}
+
+// diagonal gradient scrolling with the frame number and a moving box, so encoders see motion
+void fill_synthetic_picture(AVFrame *frame, int64_t index) {
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++) {
+            row[x] = (uint8_t) (x + y + 3 * index);
+        }
+    }
+    int box = frame->height / 4;
+    int box_x = (int) (index * 7 % (frame->width - box));
+    int box_y = (int) (index * 3 % (frame->height - box));
+    for (int y = box_y; y < box_y + box; y++) {
+        memset(frame->data[0] + y * frame->linesize[0] + box_x, 235, box);
+    }
+    for (int y = 0; y < frame->height / 2; y++) {
+        uint8_t *u = frame->data[1] + y * frame->linesize[1];
+        uint8_t *v = frame->data[2] + y * frame->linesize[2];
+        for (int x = 0; x < frame->width / 2; x++) {
+            u[x] = (uint8_t) (128 + x - index);
+            v[x] = (uint8_t) (64 + y + index);
+        }
+    }
+}
+
+// 440 Hz left, 660 Hz right
+void fill_synthetic_samples(AVFrame *frame, int64_t first_sample) {
+    for (int c = 0; c < frame->channels; c++) {
+        float *samples = (float*) frame->data[c];
+        double hz = c == 0 ? 440 : 660;
+        for (int i = 0; i < frame->nb_samples; i++) {
+            samples[i] = 0.25 * sin(2 * M_PI * hz * (first_sample + i) / frame->sample_rate);
+        }
+    }
+}
+
+int synthetic_encode(SyntheticWriter *w, AVCodecContext *avcc, AVStream *avs, AVFrame *frame) {
+    int rc = avcodec_send_frame(avcc, frame);
+    while (rc >= 0) {
+        rc = avcodec_receive_packet(avcc, w->packet.get());
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            return 0;
+        } else if (rc < 0) {
+            break;
+        }
+        w->packet->stream_index = avs->index;
+        av_packet_rescale_ts(w->packet.get(), avcc->time_base, avs->time_base);
+        // paced streams go out as they are encoded, avcodec_receive_packet drops the reference
+        rc = w->paced ? av_write_frame(w->avfc.get(), w->packet.get())
+                      : av_interleaved_write_frame(w->avfc.get(), w->packet.get());
+    }
+    logging("[ERROR] failed to encode synthetic source: %s", av_err2string(rc).c_str());
+    return -1;
+}
+
+int open_synthetic_video(SyntheticWriter *w, SyntheticSpec spec) {
+    // prefer H.264 like real sources, the built in MPEG-4 part 2 encoder is always there
+    AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    }
+    w->video_avcc.reset(codec ? avcodec_alloc_context3(codec) : NULL);
+    w->video_avs = avformat_new_stream(w->avfc.get(), NULL);
+    if (!w->video_avcc || !w->video_avs) {
+        logging("[ERROR] no video encoder for the synthetic source");
+        return -1;
+    }
+
+    AVCodecContext *avcc = w->video_avcc.get();
+    avcc->width = spec.width;
+    avcc->height = spec.height;
+    avcc->pix_fmt = AV_PIX_FMT_YUV420P;
+    avcc->time_base = AVRational{1, spec.fps};
+    avcc->framerate = AVRational{spec.fps, 1};
+    avcc->gop_size = SYNTHETIC_GOP;
+    avcc->bit_rate = (int64_t) spec.width * spec.height * spec.fps / 8;
+    // one thread keeps the bitstream identical from run to run
+    avcc->thread_count = 1;
+    av_opt_set(avcc->priv_data, "preset", "veryfast", 0);
+    if (w->paced) {
+        avcc->max_b_frames = 0;
+        av_opt_set(avcc->priv_data, "tune", "zerolatency", 0);
+    }
+    if (w->avfc->oformat->flags & AVFMT_GLOBALHEADER) {
+        avcc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(avcc, codec, NULL) < 0 || avcodec_parameters_from_context(w->video_avs->codecpar, avcc) < 0) {
+        logging("[ERROR] failed to open %s for the synthetic source", codec->name);
+        return -1;
+    }
+    w->video_avs->time_base = avcc->time_base;
+
+    w->video_frame.reset(av_frame_alloc());
+    if (!w->video_frame) {
+        return -1;
+    }
+    w->video_frame->format = avcc->pix_fmt;
+    w->video_frame->width = avcc->width;
+    w->video_frame->height = avcc->height;
+    return av_frame_get_buffer(w->video_frame.get(), 0) < 0 ? -1 : 0;
+}
+
+int open_synthetic_audio(SyntheticWriter *w) {
+    AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    w->audio_avcc.reset(codec ? avcodec_alloc_context3(codec) : NULL);
+    w->audio_avs = avformat_new_stream(w->avfc.get(), NULL);
+    if (!w->audio_avcc || !w->audio_avs) {
+        logging("[ERROR] no audio encoder for the synthetic source");
+        return -1;
+    }
+
+    AVCodecContext *avcc = w->audio_avcc.get();
+    avcc->sample_rate = SYNTHETIC_SAMPLE_RATE;
+    avcc->channel_layout = AV_CH_LAYOUT_STEREO;
+    avcc->channels = 2;
+    avcc->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    avcc->bit_rate = 128 * 1000;
+    avcc->time_base = AVRational{1, SYNTHETIC_SAMPLE_RATE};
+    if (w->avfc->oformat->flags & AVFMT_GLOBALHEADER) {
+        avcc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(avcc, codec, NULL) < 0 || avcodec_parameters_from_context(w->audio_avs->codecpar, avcc) < 0) {
+        logging("[ERROR] failed to open %s for the synthetic source", codec->name);
+        return -1;
+    }
+    w->audio_avs->time_base = avcc->time_base;
+
+    w->audio_frame.reset(av_frame_alloc());
+    if (!w->audio_frame) {
+        return -1;
+    }
+    w->audio_frame->format = avcc->sample_fmt;
+    w->audio_frame->channel_layout = avcc->channel_layout;
+    w->audio_frame->channels = avcc->channels;
+    w->audio_frame->sample_rate = avcc->sample_rate;
+    w->audio_frame->nb_samples = avcc->frame_size;
+    return av_frame_get_buffer(w->audio_frame.get(), 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Writes spec.seconds of a test pattern with a stereo tone to filename, in
+ * format or the one its extension names. Paced output leaves every video
+ * frame at its wall clock time and is flushed per packet.
+ */
+int write_synthetic(const char *filename, const char *format, SyntheticSpec spec, bool paced) {
+    SyntheticWriter w = {};
+    w.paced = paced;
+    AVFormatContext *avfc = NULL;
+    avformat_alloc_output_context2(&avfc, NULL, format, filename);
+    w.avfc.reset(avfc);
+    w.packet.reset(av_packet_alloc());
+    if (!w.avfc || !w.packet) {
+        logging("[ERROR] could not allocate the synthetic output %s", filename);
+        return -1;
+    }
+    if (open_synthetic_video(&w, spec) || open_synthetic_audio(&w)) {
+        return -1;
+    }
+    if (avio_open(&w.avfc->pb, filename, AVIO_FLAG_WRITE) < 0 || avformat_write_header(w.avfc.get(), NULL) < 0) {
+        logging("[ERROR] could not write the header of %s", filename);
+        return -1;
+    }
+    w.avfc->flush_packets = paced;
+
+    int64_t nb_frames = (int64_t) spec.seconds * spec.fps;
+    int64_t nb_samples = (int64_t) spec.seconds * SYNTHETIC_SAMPLE_RATE;
+    bool video_done = false;
+    bool audio_done = false;
+    auto start = std::chrono::steady_clock::now();
+    while (!video_done || !audio_done) {
+        bool take_video = !video_done && (audio_done ||
+            av_compare_ts(w.video_pts, w.video_avcc->time_base, w.audio_pts, w.audio_avcc->time_base) <= 0);
+        if (take_video) {
+            if (w.video_pts >= nb_frames) {
+                video_done = true;
+                if (synthetic_encode(&w, w.video_avcc.get(), w.video_avs, NULL)) {
+                    return -1;
+                }
+                continue;
+            }
+            if (paced) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(w.video_pts * 1000000 / spec.fps));
+            }
+            if (av_frame_make_writable(w.video_frame.get()) < 0) {
+                return -1;
+            }
+            fill_synthetic_picture(w.video_frame.get(), w.video_pts);
+            w.video_frame->pts = w.video_pts++;
+            if (synthetic_encode(&w, w.video_avcc.get(), w.video_avs, w.video_frame.get())) {
+                return -1;
+            }
+        } else {
+            if (w.audio_pts >= nb_samples) {
+                audio_done = true;
+                if (synthetic_encode(&w, w.audio_avcc.get(), w.audio_avs, NULL)) {
+                    return -1;
+                }
+                continue;
+            }
+            if (av_frame_make_writable(w.audio_frame.get()) < 0) {
+                return -1;
+            }
+            fill_synthetic_samples(w.audio_frame.get(), w.audio_pts);
+            w.audio_frame->pts = w.audio_pts;
+            w.audio_pts += w.audio_frame->nb_samples;
+            if (synthetic_encode(&w, w.audio_avcc.get(), w.audio_avs, w.audio_frame.get())) {
+                return -1;
+            }
+        }
+    }
+
+    return av_write_trailer(w.avfc.get()) < 0 ? -1 : 0;
+}
+
+// The content only depends on the spec, so every machine benchmarks the same input without shipping media files.
+int generate_synthetic(const char *filename, SyntheticSpec spec) {
+    return write_synthetic(filename, NULL, spec, false);
+}
+
+// MPEG-TS in real time to a FIFO, pipe:N or tcp:// url, the input side of live mode
+int stream_synthetic(const char *url, SyntheticSpec spec) {
+    return write_synthetic(url, "mpegts", spec, true);
+}
+
+#endif //LEARN_LIBAV_SYNTHETIC_H
@@ -0,0 +1,237 @@
+#ifndef LEARN_LIBAV_THREAD_BUDGET_H
+#define LEARN_LIBAV_THREAD_BUDGET_H
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+#include <sys/resource.h>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+}
+
+#include "log.h"
+#include "metrics.h"
+
+typedef enum {
+    THREAD_ROLE_DECODER,
+    THREAD_ROLE_ENCODER,
+    THREAD_ROLE_SCALER,
+    // reconstruction decoder and comparison tiles of the quality stage
+    THREAD_ROLE_QUALITY,
+    // audio and other codecs without threading, one thread whatever the budget
+    THREAD_ROLE_SINGLE,
+    THREAD_ROLE_NB,
+} ThreadRole;
+
+const char *thread_role_names[THREAD_ROLE_NB] = {"decoder", "encoder", "scaler", "quality", "single threaded"};
+
+// parts of a job's cores per role, encoding is where the time goes
+#define THREAD_WEIGHT_DECODER 1
+#define THREAD_WEIGHT_ENCODER 3
+// taken out of the encoder's part when the job scales
+#define THREAD_WEIGHT_SCALER 1
+#define THREAD_WEIGHT_JOB (THREAD_WEIGHT_DECODER + THREAD_WEIGHT_ENCODER)
+// measuring quality is extra work on top of the job's parts
+#define THREAD_WEIGHT_QUALITY 1
+
+typedef struct {
+    int cores;
+    int64_t leases[THREAD_ROLE_NB];
+    int64_t threads[THREAD_ROLE_NB];
+    // leases granted a single thread because the budget was used up
+    int64_t starved;
+    int peak_in_use;
+    // integral of leased threads over time, for the average
+    int64_t leased_thread_ns;
+    int64_t wall_ns;
+    // user + system CPU time of the process over the same span
+    int64_t cpu_ns;
+} ThreadBudgetStats;
+
+class ThreadBudget;
+
+// threads held by one codec context or scaler, returned to the budget when destroyed
+class ThreadLease {
+public:
+    ThreadLease() {}
+    ThreadLease(ThreadBudget *budget, int threads) : budget(budget), count(threads) {}
+    ThreadLease(const ThreadLease &) = delete;
+    ThreadLease &operator=(const ThreadLease &) = delete;
+    ThreadLease(ThreadLease &&other) : budget(other.budget), count(other.count) {
+        other.budget = NULL;
+        other.count = 0;
+    }
+    ThreadLease &operator=(ThreadLease &&other) {
+        if (this != &other) {
+            release();
+            budget = other.budget;
+            count = other.count;
+            other.budget = NULL;
+            other.count = 0;
+        }
+        return *this;
+    }
+    ~ThreadLease() {
+        release();
+    }
+
+    int threads() const {
+        return count;
+    }
+
+    void release();
+
+private:
+    ThreadBudget *budget = NULL;
+    int count = 0;
+};
+
+int64_t process_cpu_ns() {
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+           (int64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+/*
+ * Owns the machine's cores for every codec context of the process. Thread
+ * counts are fixed when a codec is opened, so each context leases its share
+ * then: a job's cores are split by role weight, a job's being the budget
+ * divided by the jobs expected to run at the same time. A lease never gets
+ * more than what is free, so a job starting while others still hold their
+ * threads gets less instead of oversubscribing, and threads handed back by
+ * a finished job go to the next one. Every lease gets at least one thread.
+ */
+class ThreadBudget {
+public:
+    // 0 cores uses every core of the machine
+    void configure(int cores) {
+        std::lock_guard<std::mutex> guard(lock);
+        total = cores > 0 ? cores : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // jobs expected to run concurrently from now on, sizes the leases taken after the call
+    void set_jobs(int nb_jobs) {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs = std::max(1, nb_jobs);
+    }
+
+    ThreadLease lease(ThreadRole role, int weight) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (total == 0) {
+            total = std::max(1u, std::thread::hardware_concurrency());
+        }
+        int64_t now = metrics_now_ns();
+        if (start_ns < 0) {
+            start_ns = now;
+            start_cpu_ns = process_cpu_ns();
+        }
+        advance(now);
+
+        int threads = 1;
+        if (role != THREAD_ROLE_SINGLE) {
+            int fair = std::max(1, total * weight / (THREAD_WEIGHT_JOB * jobs));
+            int free = total - in_use;
+            if (free < 1) {
+                stats.starved++;
+            }
+            threads = std::max(1, std::min(fair, free));
+        }
+        in_use += threads;
+        stats.leases[role]++;
+        stats.threads[role] += threads;
+        stats.peak_in_use = std::max(stats.peak_in_use, in_use);
+        debug("leased %d %s threads, %d of %d in use", threads, thread_role_names[role], in_use, total);
+        return ThreadLease(this, threads);
+    }
+
+    void give_back(int threads) {
+        std::lock_guard<std::mutex> guard(lock);
+        advance(metrics_now_ns());
+        in_use -= threads;
+    }
+
+    ThreadBudgetStats get_stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        int64_t now = metrics_now_ns();
+        advance(now);
+        ThreadBudgetStats s = stats;
+        s.cores = total;
+        if (start_ns >= 0) {
+            s.wall_ns = now - start_ns;
+            s.cpu_ns = process_cpu_ns() - start_cpu_ns;
+        }
+        return s;
+    }
+
+private:
+    void advance(int64_t now) {
+        if (last_change_ns >= 0) {
+            stats.leased_thread_ns += in_use * (now - last_change_ns);
+        }
+        last_change_ns = now;
+    }
+
+    std::mutex lock;
+    int total = 0;
+    int jobs = 1;
+    int in_use = 0;
+    int64_t start_ns = -1;
+    int64_t start_cpu_ns = 0;
+    int64_t last_change_ns = -1;
+    ThreadBudgetStats stats = {};
+};
+
+void ThreadLease::release() {
+    if (budget) {
+        budget->give_back(count);
+        budget = NULL;
+        count = 0;
+    }
+}
+
+ThreadBudget &thread_budget() {
+    static ThreadBudget budget;
+    return budget;
+}
+
+/*
+ * Sets thread_count and thread_type of a codec context before avcodec_open2
+ * from a lease of the budget. Codecs without threading take one thread.
+ * Live mode narrows thread_type to slices afterwards.
+ */
+void assign_codec_threads(AVCodecContext *avcc, const AVCodec *codec, ThreadRole role, int weight, ThreadLease *lease) {
+    int caps = AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS | AV_CODEC_CAP_AUTO_THREADS;
+    if (avcc->codec_type == AVMEDIA_TYPE_AUDIO || !(codec->capabilities & caps)) {
+        role = THREAD_ROLE_SINGLE;
+    }
+    *lease = thread_budget().lease(role, weight);
+    avcc->thread_count = lease->threads();
+    avcc->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+void print_thread_budget_stats() {
+    ThreadBudgetStats s = thread_budget().get_stats();
+    int64_t total_leases = 0;
+    for (int i = 0; i < THREAD_ROLE_NB; i++) {
+        total_leases += s.leases[i];
+    }
+    if (total_leases == 0 || s.wall_ns <= 0) {
+        return;
+    }
+    for (int i = 0; i < THREAD_ROLE_NB; i++) {
+        if (s.leases[i]) {
+            logging("[INFO] thread budget: %lld %s leases, %.1f threads each", (long long) s.leases[i],
+                    thread_role_names[i], (double) s.threads[i] / s.leases[i]);
+        }
+    }
+    double core_ns = (double) s.wall_ns * s.cores;
+    logging("[INFO] thread budget: %d cores, peak %d threads leased, %.0f%% leased on average, "
+            "process CPU %.0f%% of the cores, %lld leases over budget",
+            s.cores, s.peak_in_use, 100.0 * s.leased_thread_ns / core_ns, 100.0 * s.cpu_ns / core_ns,
+            (long long) s.starved);
+}
+
+#endif //LEARN_LIBAV_THREAD_BUDGET_H
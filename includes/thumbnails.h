@@ -0,0 +1,389 @@
+#ifndef LEARN_LIBAV_THUMBNAILS_H
+#define LEARN_LIBAV_THUMBNAILS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "input.h"
+#include "log.h"
+#include "packet_index.h"
+#include "probe_cache.h"
+
+/*
+ * Thumbnail sampling: one picture every `interval` seconds.
+ *
+ * THUMBNAIL_KEYFRAMES reads the file front to back but only hands keyframe
+ * packets to a decoder told to discard everything else, each thumbnail is
+ * the first keyframe at or after its timestamp.
+ * THUMBNAIL_SEEK seeks to the keyframe before each timestamp and decodes
+ * forward only up to the first frame at or after it, so the thumbnail is
+ * exact and the packets between samples are never read.
+ * THUMBNAIL_FULL decodes every frame, it is the baseline for the speedup.
+ */
+enum ThumbnailMode {
+    THUMBNAIL_KEYFRAMES,
+    THUMBNAIL_SEEK,
+    THUMBNAIL_FULL,
+};
+
+typedef struct {
+    enum ThumbnailMode mode;
+    double interval;
+    bool save;
+} ThumbnailOptions;
+
+typedef struct {
+    std::string filename;
+    int64_t thumbnails;
+    int64_t packets_read;
+    int64_t frames_decoded;
+    // frames in the video stream, from the container or estimated from the duration
+    int64_t stream_frames;
+    double seconds;
+    int rc;
+} ThumbnailJob;
+
+const char *thumbnail_mode_name(enum ThumbnailMode mode) {
+    switch (mode) {
+        case THUMBNAIL_KEYFRAMES:
+            return "keyframes";
+        case THUMBNAIL_SEEK:
+            return "seek";
+        default:
+            return "full";
+    }
+}
+
+int parse_thumbnail_mode(const char *name, enum ThumbnailMode *mode) {
+    if (strcmp(name, "keyframes") == 0) {
+        *mode = THUMBNAIL_KEYFRAMES;
+    } else if (strcmp(name, "seek") == 0) {
+        *mode = THUMBNAIL_SEEK;
+    } else if (strcmp(name, "full") == 0) {
+        *mode = THUMBNAIL_FULL;
+    } else {
+        logging("[ERROR] unknown thumbnail mode %s, expected keyframes, seek or full", name);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    FormatContextPtr avfc;
+    CodecContextPtr avcc;
+    AVStream *stream;
+    PacketPtr packet;
+    FramePtr frame;
+    // <input>.idx when index_media has been run on the input
+    std::unique_ptr<PacketIndex> index;
+} ThumbnailSource;
+
+int open_thumbnail_source(const char *filename, ThumbnailSource *src, enum ThumbnailMode mode) {
+    AVFormatContext *avfc = NULL;
+    if (open_input(filename, &avfc, NULL) < 0) {
+        logging("[ERROR] can not open input file: %s", filename);
+        return -1;
+    }
+    src->avfc.reset(avfc);
+    if (probe_stream_info(avfc, filename) < 0) {
+        logging("[ERROR] can not find stream info of %s", filename);
+        return -1;
+    }
+
+    AVCodec *codec = NULL;
+    int index = av_find_best_stream(avfc, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (index < 0 || !codec) {
+        logging("[ERROR] %s has no decodable video stream", filename);
+        return -1;
+    }
+    src->stream = avfc->streams[index];
+    for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+        if ((int) i != index) {
+            avfc->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    src->avcc.reset(avcodec_alloc_context3(codec));
+    if (!src->avcc || avcodec_parameters_to_context(src->avcc.get(), src->stream->codecpar) < 0) {
+        logging("[ERROR] failed to prepare the decoder for %s", filename);
+        return -1;
+    }
+    if (mode == THUMBNAIL_KEYFRAMES) {
+        src->avcc->skip_frame = AVDISCARD_NONKEY;
+    }
+    if (avcodec_open2(src->avcc.get(), codec, NULL) < 0) {
+        logging("[ERROR] failed to open the decoder for %s", filename);
+        return -1;
+    }
+
+    src->packet.reset(av_packet_alloc());
+    src->frame.reset(av_frame_alloc());
+    return src->packet && src->frame ? 0 : -1;
+}
+
+int64_t thumbnail_stream_frames(ThumbnailSource *src) {
+    AVStream *st = src->stream;
+    if (st->nb_frames > 0) {
+        return st->nb_frames;
+    }
+    double seconds = st->duration != AV_NOPTS_VALUE ? st->duration * av_q2d(st->time_base)
+                                                   : src->avfc->duration / (double) AV_TIME_BASE;
+    return (int64_t) (seconds * av_q2d(st->avg_frame_rate));
+}
+
+void save_thumbnail(ThumbnailJob *job, AVFrame *frame, const ThumbnailOptions &options) {
+    job->thumbnails++;
+    if (!options.save) {
+        return;
+    }
+    std::string base = job->filename.substr(job->filename.rfind('/') + 1);
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s-thumb-%04lld.pgm", base.c_str(), (long long) job->thumbnails);
+    save_grey_frame(frame->data[0], frame->linesize[0], frame->width, frame->height, filename);
+}
+
+// sends packet (NULL flushes) and calls on_frame for every frame that comes out, until it returns false
+template <typename F>
+int thumbnail_decode(ThumbnailJob *job, ThumbnailSource *src, AVPacket *packet, F on_frame) {
+    int rc = avcodec_send_packet(src->avcc.get(), packet);
+    if (rc < 0 && rc != AVERROR_EOF) {
+        logging("[ERROR] failed to send packet to decoder: %s", av_err2string(rc).c_str());
+        return rc;
+    }
+    while (true) {
+        rc = avcodec_receive_frame(src->avcc.get(), src->frame.get());
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+            return 0;
+        } else if (rc < 0) {
+            logging("[ERROR] failed to receive frame from decoder: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        job->frames_decoded++;
+        bool more = on_frame(src->frame.get());
+        av_frame_unref(src->frame.get());
+        if (!more) {
+            return 1;
+        }
+    }
+}
+
+// keyframes and full modes: one pass over the file, keeping the first frame at or after each target
+int sample_sequential(ThumbnailJob *job, ThumbnailSource *src, const ThumbnailOptions &options) {
+    AVStream *st = src->stream;
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    int64_t step = std::max<int64_t>(1, av_rescale_q((int64_t) (options.interval * AV_TIME_BASE), AV_TIME_BASE_Q, st->time_base));
+    int64_t next = start;
+    auto on_frame = [&](AVFrame *frame) {
+        int64_t pts = frame->best_effort_timestamp;
+        if (pts != AV_NOPTS_VALUE && pts >= next) {
+            save_thumbnail(job, frame, options);
+            next = std::max(next + step, pts - (pts - start) % step + step);
+        }
+        return true;
+    };
+
+    while (av_read_frame(src->avfc.get(), src->packet.get()) >= 0) {
+        AVPacket *pkt = src->packet.get();
+        bool wanted = pkt->stream_index == st->index &&
+                      (options.mode != THUMBNAIL_KEYFRAMES || (pkt->flags & AV_PKT_FLAG_KEY));
+        if (wanted) {
+            job->packets_read++;
+            if (thumbnail_decode(job, src, pkt, on_frame) < 0) {
+                av_packet_unref(pkt);
+                return -1;
+            }
+        }
+        av_packet_unref(pkt);
+    }
+    return thumbnail_decode(job, src, NULL, on_frame) < 0 ? -1 : 0;
+}
+
+// seek mode: seek to the keyframe before every target and decode up to it
+int sample_seek(ThumbnailJob *job, ThumbnailSource *src, const ThumbnailOptions &options) {
+    AVStream *st = src->stream;
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    int64_t duration = st->duration != AV_NOPTS_VALUE ? st->duration
+                                                      : av_rescale_q(src->avfc->duration, AV_TIME_BASE_Q, st->time_base);
+    int64_t step = std::max<int64_t>(1, av_rescale_q((int64_t) (options.interval * AV_TIME_BASE), AV_TIME_BASE_Q, st->time_base));
+    // last decoded pts, a target inside the GOP being decoded is reached without seeking
+    int64_t position = AV_NOPTS_VALUE;
+    /*
+     * Without an index: the keyframe the decoder is in, the widest spacing
+     * of consecutive keyframes read so far and, until there is one, the
+     * closest keyframes two seeks landed on. Spacings too wide only cost
+     * reading on instead of seeking, never a wrong thumbnail.
+     */
+    int64_t last_key = AV_NOPTS_VALUE;
+    int64_t seeked_from = AV_NOPTS_VALUE;
+    int64_t gop = 0;
+    int64_t seek_gop = 0;
+
+    for (int64_t target = start; target < start + duration; target += step) {
+        // only seek when a keyframe lies between the decoder and the target
+        bool seek;
+        if (src->index) {
+            const PacketIndexEntry *key = src->index->keyframe_before(st->index, target);
+            seek = position == AV_NOPTS_VALUE || (key && key->pts > position);
+        } else {
+            int64_t spacing = gop ? gop : seek_gop;
+            if (position == AV_NOPTS_VALUE || last_key == AV_NOPTS_VALUE) {
+                seek = true;
+            } else if (spacing) {
+                seek = target >= last_key + spacing;
+            } else {
+                // no spacing yet: a seek back into this GOP decodes again what reading on would skip
+                seek = target - position > position - last_key;
+            }
+        }
+        if (seek) {
+            int rc = src->index ? index_seek(src->avfc.get(), src->index.get(), st->index, target)
+                                : av_seek_frame(src->avfc.get(), st->index, target, AVSEEK_FLAG_BACKWARD);
+            if (rc < 0) {
+                logging("[ERROR] failed to seek %s to %lld", job->filename.c_str(), (long long) target);
+                return -1;
+            }
+            avcodec_flush_buffers(src->avcc.get());
+            seeked_from = last_key;
+            last_key = AV_NOPTS_VALUE;
+        }
+
+        bool found = false;
+        auto on_frame = [&](AVFrame *frame) {
+            position = frame->best_effort_timestamp;
+            if (position != AV_NOPTS_VALUE && position >= target) {
+                save_thumbnail(job, frame, options);
+                found = true;
+                return false;
+            }
+            return true;
+        };
+        while (!found && av_read_frame(src->avfc.get(), src->packet.get()) >= 0) {
+            AVPacket *pkt = src->packet.get();
+            int rc = 0;
+            if (pkt->stream_index == st->index) {
+                job->packets_read++;
+                int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+                if ((pkt->flags & AV_PKT_FLAG_KEY) && pts != AV_NOPTS_VALUE) {
+                    if (last_key != AV_NOPTS_VALUE && pts > last_key) {
+                        gop = std::max(gop, pts - last_key);
+                    } else if (last_key == AV_NOPTS_VALUE && seeked_from != AV_NOPTS_VALUE && pts > seeked_from) {
+                        seek_gop = seek_gop ? std::min(seek_gop, pts - seeked_from) : pts - seeked_from;
+                    }
+                    last_key = pts;
+                }
+                rc = thumbnail_decode(job, src, pkt, on_frame);
+            }
+            av_packet_unref(pkt);
+            if (rc < 0) {
+                return -1;
+            }
+        }
+        if (!found) {
+            // end of file: whatever the decoder still holds, then stop
+            thumbnail_decode(job, src, NULL, on_frame);
+            break;
+        }
+    }
+    return 0;
+}
+
+void extract_thumbnails(ThumbnailJob *job, const ThumbnailOptions &options) {
+    auto start = std::chrono::steady_clock::now();
+    ThumbnailSource src = {};
+    job->rc = open_thumbnail_source(job->filename.c_str(), &src, options.mode);
+    if (job->rc == 0) {
+        if (options.mode == THUMBNAIL_SEEK) {
+            src.index = load_packet_index(job->filename.c_str());
+        }
+        job->stream_frames = thumbnail_stream_frames(&src);
+        job->rc = options.mode == THUMBNAIL_SEEK ? sample_seek(job, &src, options) : sample_sequential(job, &src, options);
+    }
+    job->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// runs every file on a pool of nb_workers threads, returns the wall time
+double run_thumbnail_jobs(std::vector<ThumbnailJob> &jobs, const ThumbnailOptions &options, int nb_workers) {
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> next_job{0};
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nb_workers; i++) {
+        workers.emplace_back([&] {
+            size_t index;
+            while ((index = next_job++) < jobs.size()) {
+                extract_thumbnails(&jobs[index], options);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::vector<ThumbnailJob> thumbnail_jobs(std::vector<std::string> &files) {
+    std::vector<ThumbnailJob> jobs;
+    for (auto &file : files) {
+        ThumbnailJob job = {};
+        job.filename = file;
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+/*
+ * Samples every file with options.mode, files in parallel. With
+ * compare_full the same files are then fully decoded, so the speedup is
+ * measured in wall time as well as in decoded frames.
+ */
+int run_thumbnails(std::vector<std::string> &files, ThumbnailOptions options, int nb_workers, bool compare_full) {
+    if (nb_workers <= 0) {
+        nb_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    nb_workers = std::min<int>(nb_workers, files.size());
+
+    std::vector<ThumbnailJob> jobs = thumbnail_jobs(files);
+    double seconds = run_thumbnail_jobs(jobs, options, nb_workers);
+
+    int failed = 0;
+    int64_t decoded = 0;
+    int64_t total_frames = 0;
+    for (auto &job : jobs) {
+        if (job.rc) {
+            failed++;
+            logging("[ERROR] thumbnails failed for %s", job.filename.c_str());
+            continue;
+        }
+        decoded += job.frames_decoded;
+        total_frames += job.stream_frames;
+        logging("[INFO] %s: %lld thumbnails, %lld packets read, %lld of ~%lld frames decoded in %.2fs",
+                job.filename.c_str(), (long long) job.thumbnails, (long long) job.packets_read,
+                (long long) job.frames_decoded, (long long) job.stream_frames, job.seconds);
+    }
+    logging("[INFO] %s sampling: %d files on %d workers in %.2fs, decoded %lld of ~%lld frames (%.1fx less decode work)",
+            thumbnail_mode_name(options.mode), (int) jobs.size(), nb_workers, seconds, (long long) decoded, (long long) total_frames,
+            decoded > 0 ? (double) total_frames / decoded : 0.0);
+
+    if (compare_full && options.mode != THUMBNAIL_FULL) {
+        ThumbnailOptions full = options;
+        full.mode = THUMBNAIL_FULL;
+        full.save = false;
+        std::vector<ThumbnailJob> full_jobs = thumbnail_jobs(files);
+        double full_seconds = run_thumbnail_jobs(full_jobs, full, nb_workers);
+        logging("[INFO] full decode: %.2fs, %s sampling is %.1fx faster",
+                full_seconds, thumbnail_mode_name(options.mode), seconds > 0 ? full_seconds / seconds : 0.0);
+    }
+    return failed ? -1 : 0;
+}
+
+#endif //LEARN_LIBAV_THUMBNAILS_H
@@ -0,0 +1,222 @@
+#ifndef LEARN_LIBAV_TRANSCODE_H
+#define LEARN_LIBAV_TRANSCODE_H
+
+#include <chrono>
+#include <memory>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "checkpoint.h"
+#include "log.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "streaming.h"
+
+typedef struct {
+    int64_t frames;
+    int64_t input_bytes;
+    int64_t output_bytes;
+    double seconds;
+} TranscodeStats;
+
+// remux() through the encoder's packet sink, when there is one
+int copy_packet(StreamingContext *encoder, AVPacket *pkt, AVRational decoder_tb, AVRational encoder_tb) {
+    av_packet_rescale_ts(pkt, decoder_tb, encoder_tb);
+    if (write_packet(encoder, pkt) < 0) {
+        logging("[ERROR] error while copying stream packet");
+        return -1;
+    }
+    return 0;
+}
+
+int transcode_packets(StreamingContext *decoder, StreamingContext *encoder, StreamingParams sp) {
+    debug("allocate memory for input frame");
+    PooledFrame input_frame(frame_pool().acquire());
+    if (!input_frame) {
+        logging("[ERROR] failed to allocated memory for AVFrame");
+        return -1;
+    }
+
+    debug("allocate memory for input packet");
+    PooledPacket input_packet(packet_pool().acquire());
+    if (!input_packet) {
+        logging("[ERROR] failed to allocated memory for AVPacket");
+        return -1;
+    }
+
+    debug("loop for read frame");
+    int times = 0;
+    while(metrics_read_frame(decoder->avfc.get(), input_packet.get()) >= 0) {
+        debug_pkt(input_packet->stream_index, input_packet->pts, "read packet %d", times);
+        live_packet_read(decoder->avfc.get(), input_packet.get());
+        times += 1;
+        if (decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (!sp.copy_video) {
+                if (transcode_video(decoder, encoder, input_packet.get(), input_frame.get())) {
+                    return -1;
+                }
+                av_packet_unref(input_packet.get());
+            } else {
+                input_packet->stream_index = encoder->video_avs->index;
+                encoder->video_frames++;
+                if (copy_packet(encoder, input_packet.get(), decoder->video_avs->time_base, encoder->video_avs->time_base)) {
+                    return -1;
+                }
+            }
+        } else if (decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            if (!sp.copy_audio) {
+                if (transcode_audio(decoder, encoder, input_packet.get(), input_frame.get())) {
+                    return -1;
+                }
+                av_packet_unref(input_packet.get());
+            } else {
+                input_packet->stream_index = encoder->audio_avs->index;
+                if (copy_packet(encoder, input_packet.get(), decoder->audio_avs->time_base, encoder->audio_avs->time_base)) {
+                    return -1;
+                }
+            }
+        } else {
+            debug_pkt(input_packet->stream_index, input_packet->pts, "ignoring non video or audio packet");
+            av_packet_unref(input_packet.get());
+        }
+    }
+
+    // frame threaded decoders still hold up to thread_count frames at EOF
+    if (!sp.copy_video && transcode_video(decoder, encoder, NULL, input_frame.get())) {
+        return -1;
+    }
+    if (encode_video(decoder, encoder, NULL)) {
+        return -1;
+    }
+
+    if (!sp.copy_audio && decoder->audio_avcc) {
+        // drain the decoder, then the samples short of a whole encoder frame
+        if (transcode_audio(decoder, encoder, NULL, input_frame.get()) || encode_audio(decoder, encoder, NULL)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// sets up checkpoints of the output, which may then resume an interrupted run
+int open_checkpoint(StreamingContext *decoder, StreamingContext *encoder, StreamingParams sp, bool use_pipeline) {
+    if (use_pipeline || live_options().enabled || output_options().use_async_io) {
+        logging("[WARN] checkpoints are only taken without --pipeline, --live and --async-io");
+        return 0;
+    }
+    encoder->checkpoint.reset(new Checkpointer());
+    int rc = encoder->checkpoint->open(decoder->filename, encoder->filename, encoder->avfc.get(), encoder->video_avs->index,
+                                       !sp.copy_video, encoder->audio_stage.get());
+    if (rc < 0) {
+        return -1;
+    }
+    if (rc > 0) {
+        encoder->checkpoint.reset();
+        return 0;
+    }
+    encoder->video_frames = encoder->checkpoint->committed_video_packets();
+    if (encoder->video_frames && encoder->quality) {
+        logging("[WARN] quality is only measured on the resumed part of %s", encoder->filename);
+    }
+    encoder->packet_sink = checkpoint_packet_sink;
+    encoder->packet_sink_opaque = encoder->checkpoint.get();
+    return 0;
+}
+
+// runs one input through the whole open/prepare/transcode/trailer sequence
+int transcode_file(const char *input, const char *output, StreamingParams sp, bool use_pipeline, TranscodeStats *stats) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::unique_ptr<StreamingContext> decoder(new StreamingContext());
+    decoder->filename = (char*) input;
+    debug("Decoder filename: %s", decoder->filename);
+
+    std::unique_ptr<StreamingContext> encoder(new StreamingContext());
+    encoder->filename = (char*) output;
+    debug("Encoder filename: %s", encoder->filename);
+
+    if (open_media(decoder->filename, decoder->avfc)) {
+        return -1;
+    }
+
+    if (prepare_decoder(decoder.get())) {
+        return -1;
+    }
+
+    if (prepare_encoders(decoder.get(), encoder.get(), sp)) {
+        return -1;
+    }
+
+    if (checkpoint_options().enabled && open_checkpoint(decoder.get(), encoder.get(), sp, use_pipeline)) {
+        return -1;
+    }
+
+    if (open_output(encoder.get(), sp)) {
+        return -1;
+    }
+
+    if (encoder->checkpoint && encoder->checkpoint->seek_input(decoder->avfc.get(), decoder->video_index)) {
+        return -1;
+    }
+
+    if (use_pipeline) {
+        if (run_pipeline(decoder.get(), encoder.get(), sp)) {
+            return -1;
+        }
+    } else if (transcode_packets(decoder.get(), encoder.get(), sp)) {
+        return -1;
+    }
+
+    int rc = av_write_trailer(encoder->avfc.get());
+    if (rc >= 0) {
+        rc = finish_output_io(encoder->avfc.get());
+    }
+    if (rc < 0) {
+        logging("[ERROR] failed to finish %s: %s", output, av_err2string(rc).c_str());
+        return -1;
+    }
+    if (encoder->checkpoint) {
+        encoder->checkpoint->finish();
+        print_checkpoint_stats(output, encoder->checkpoint->get_stats());
+    }
+    if (encoder->scaler) {
+        print_scaler_stats(output, encoder->scaler->get_stats());
+    }
+    if (encoder->scene_detector) {
+        print_scene_detect_stats(output, encoder->scene_detector->get_stats());
+    }
+    if (encoder->dedup) {
+        print_dedup_stats(output, encoder->dedup->get_stats());
+    }
+    if (encoder->quality) {
+        print_quality_stats(output, encoder->quality->get_stats());
+    }
+    if (encoder->audio_stage) {
+        print_audio_stage_stats(output, encoder->audio_stage->get_stats());
+    }
+
+    if (stats) {
+        stats->frames = encoder->video_frames;
+        stats->input_bytes = decoder->avfc->pb ? avio_size(decoder->avfc->pb) : 0;
+        if (stats->input_bytes < 0) {
+            // pipes and sockets have no size, count what was read
+            stats->input_bytes = avio_tell(decoder->avfc->pb);
+        }
+        stats->output_bytes = encoder->avfc->pb ? avio_tell(encoder->avfc->pb) : 0;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return 0;
+}
+
+void print_transcode_stats(const char *name, TranscodeStats stats) {
+    double seconds = stats.seconds > 0 ? stats.seconds : 1e-9;
+    logging("[INFO] %s: %lld frames in %.2fs, %.1f fps, %.2f MB/s in, %.2f MB/s out",
+            name, stats.frames, stats.seconds, stats.frames / seconds,
+            stats.input_bytes / seconds / 1e6, stats.output_bytes / seconds / 1e6);
+}
+
+#endif //LEARN_LIBAV_TRANSCODE_H
@@ -0,0 +1,664 @@
+#ifndef LEARN_LIBAV_TRIM_H
+#define LEARN_LIBAV_TRIM_H
+
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/intreadwrite.h>
+}
+
+#include "handles.h"
+#include "helpers.h"
+#include "log.h"
+#include "packet_index.h"
+#include "pool.h"
+#include "streaming.h"
+#include "thread_budget.h"
+
+// re-encoded pieces are at most a GOP long, they get one keyframe at their start
+#define TRIM_ENCODER_GOP_SIZE 1000
+
+/*
+ * NAL length field size of a length prefixed (avcC / hvcC) H.264 or HEVC
+ * stream, 0 when its packets are Annex B or the codec has no NAL units,
+ * -1 when the extradata can not be read.
+ */
+int nal_length_size(const AVCodecParameters *par) {
+    const uint8_t *extra = par->extradata;
+    int size = par->extradata_size;
+    if (par->codec_id == AV_CODEC_ID_H264) {
+        if (size < 1 || extra[0] != 1) {
+            return 0;
+        }
+        return size >= 7 ? (extra[4] & 3) + 1 : -1;
+    }
+    if (par->codec_id == AV_CODEC_ID_HEVC) {
+        // same test as libavcodec's hevc decoder, Annex B extradata starts with a start code
+        if (size < 3 || (!extra[0] && !extra[1] && extra[2] <= 1)) {
+            return 0;
+        }
+        return size >= 23 ? (extra[21] & 3) + 1 : -1;
+    }
+    return 0;
+}
+
+/*
+ * Rewrites an Annex B packet with length_size byte NAL lengths. Parameter
+ * sets stay in the sample. Packets not starting with a start code are left
+ * as they are.
+ */
+int annexb_to_length_prefixed(AVPacket *pkt, int length_size) {
+    const uint8_t *data = pkt->data;
+    int size = pkt->size;
+    bool annexb = (size >= 3 && !data[0] && !data[1] && data[2] == 1) ||
+                  (size >= 4 && !data[0] && !data[1] && !data[2] && data[3] == 1);
+    if (!annexb) {
+        return 0;
+    }
+
+    // NAL unit spans between start codes, trailing zero bytes belong to the next start code
+    std::vector<std::pair<int, int>> nals;
+    int64_t total = 0;
+    int i = 0;
+    while (i + 3 <= size) {
+        if (data[i] || data[i + 1] || data[i + 2] != 1) {
+            i++;
+            continue;
+        }
+        int begin = i + 3;
+        int next = begin;
+        while (next + 3 <= size && (data[next] || data[next + 1] || data[next + 2] != 1)) {
+            next++;
+        }
+        int end = next + 3 <= size ? next : size;
+        while (end > begin && !data[end - 1]) {
+            end--;
+        }
+        if (end > begin) {
+            if (length_size < 4 && (int64_t) (end - begin) >> (8 * length_size)) {
+                logging("[ERROR] a %d byte NAL unit does not fit a %d byte length", end - begin, length_size);
+                return AVERROR(EINVAL);
+            }
+            nals.push_back({begin, end - begin});
+            total += length_size + end - begin;
+        }
+        i = next;
+    }
+    if (total > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE) {
+        return AVERROR(EINVAL);
+    }
+
+    AVBufferRef *buf = av_buffer_alloc(total + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf) {
+        return AVERROR(ENOMEM);
+    }
+    uint8_t *out = buf->data;
+    for (auto &nal : nals) {
+        for (int b = length_size - 1; b >= 0; b--) {
+            *out++ = (uint8_t) (nal.second >> (8 * b));
+        }
+        memcpy(out, data + nal.first, nal.second);
+        out += nal.second;
+    }
+    memset(out, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    pkt->size = total;
+    return 0;
+}
+
+/*
+ * The SPS/PPS (and VPS) of the stream's extradata as a sample prefix: NAL
+ * units with length_size byte lengths read from avcC / hvcC, or the Annex B
+ * extradata as it is when length_size is 0. Empty for other codecs.
+ */
+int source_parameter_sets(const AVCodecParameters *par, int length_size, std::vector<uint8_t> *out) {
+    const uint8_t *extra = par->extradata;
+    int size = par->extradata_size;
+    out->clear();
+    if (par->codec_id != AV_CODEC_ID_H264 && par->codec_id != AV_CODEC_ID_HEVC) {
+        return 0;
+    }
+    if (length_size == 0) {
+        out->assign(extra, extra + size);
+        return 0;
+    }
+
+    // H.264: SPS count and units, then PPS count and units; HEVC: arrays of one NAL type each
+    int pos = par->codec_id == AV_CODEC_ID_H264 ? 5 : 22;
+    int nb_arrays = par->codec_id == AV_CODEC_ID_H264 ? 2 : (pos < size ? extra[pos++] : 0);
+    for (int a = 0; a < nb_arrays; a++) {
+        int nb_nals;
+        if (par->codec_id == AV_CODEC_ID_H264) {
+            if (pos >= size) {
+                return AVERROR_INVALIDDATA;
+            }
+            nb_nals = a == 0 ? extra[pos++] & 0x1f : extra[pos++];
+        } else {
+            if (pos + 3 > size) {
+                return AVERROR_INVALIDDATA;
+            }
+            nb_nals = AV_RB16(extra + pos + 1);
+            pos += 3;
+        }
+        for (int n = 0; n < nb_nals; n++) {
+            if (pos + 2 > size || pos + 2 + AV_RB16(extra + pos) > size) {
+                return AVERROR_INVALIDDATA;
+            }
+            int nal_size = AV_RB16(extra + pos);
+            pos += 2;
+            if (length_size < 4 && nal_size >> (8 * length_size)) {
+                return AVERROR_INVALIDDATA;
+            }
+            for (int b = length_size - 1; b >= 0; b--) {
+                out->push_back((uint8_t) (nal_size >> (8 * b)));
+            }
+            out->insert(out->end(), extra + pos, extra + pos + nal_size);
+            pos += nal_size;
+        }
+    }
+    return 0;
+}
+
+// prefix is inserted before the packet's data, in a new buffer
+int prepend_to_packet(AVPacket *pkt, const std::vector<uint8_t> &prefix) {
+    if (prefix.empty()) {
+        return 0;
+    }
+    if (pkt->size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE - (int64_t) prefix.size()) {
+        return AVERROR(EINVAL);
+    }
+    int size = prefix.size() + pkt->size;
+    AVBufferRef *buf = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf) {
+        return AVERROR(ENOMEM);
+    }
+    memcpy(buf->data, prefix.data(), prefix.size());
+    if (pkt->size) {
+        memcpy(buf->data + prefix.size(), pkt->data, pkt->size);
+    }
+    memset(buf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    pkt->size = size;
+    return 0;
+}
+
+typedef struct {
+    int64_t head_frames;
+    int64_t tail_frames;
+    int64_t copied_gops;
+    int64_t copied_packets;
+    int64_t audio_packets;
+    double seconds;
+} TrimStats;
+
+/*
+ * Frame accurate cut of [start, end) without re-encoding the whole range.
+ * Video packets are buffered one GOP at a time: a GOP whose every frame
+ * falls inside the range is stream copied through remux(), the partial
+ * GOPs at the cut points are decoded and only their frames inside the range
+ * re-encoded. The encoder is the source codec's with its size, pixel
+ * format, profile, level, colour properties and bit rate, without B-frames
+ * so each piece joins the copied packets without a reordering delay.
+ *
+ * Re-encoded pieces carry their parameter sets in band (no global header),
+ * the stream's extradata stays the source's. The encoder's sets use the
+ * same ids as the source's and replace them in the decoder, so the first
+ * copied keyframe after a piece gets the source's sets from the extradata
+ * in band again before its own NAL units. When the source is length
+ * prefixed (H.264 or HEVC from MP4 or Matroska) the encoder's Annex B
+ * packets are rewritten with the source's NAL length size. Re-encoded
+ * pieces have no reordering, their dts are moved back by the source's
+ * decode delay (a keyframe's pts minus its dts) so they line up with the
+ * copied GOPs; presentation timestamps are never changed. Audio packets
+ * are copied from the first one starting at the cut. The output starts at
+ * timestamp 0.
+ */
+class Trimmer {
+public:
+    Trimmer(StreamingContext *decoder, StreamingContext *output, int64_t start, int64_t end)
+        : decoder(decoder), output(output), start(start), end(end) {
+        video_tb = decoder->video_avs->time_base;
+        length_size = nal_length_size(decoder->video_avs->codecpar);
+        if (output->audio_avs) {
+            audio_start = av_rescale_q(start, video_tb, decoder->audio_avs->time_base);
+            audio_end = av_rescale_q(end, video_tb, decoder->audio_avs->time_base);
+        }
+    }
+
+    ~Trimmer() {
+        release_gop();
+    }
+
+    // takes the packet's reference
+    int video_packet(AVPacket *pkt) {
+        if (video_finished) {
+            av_packet_unref(pkt);
+            return 0;
+        }
+        if ((pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE) {
+            if (pkt->dts != AV_NOPTS_VALUE) {
+                dts_delay = pkt->pts - pkt->dts;
+            }
+            if (flush_gop() < 0) {
+                av_packet_unref(pkt);
+                return -1;
+            }
+            if (pkt->pts >= end) {
+                av_packet_unref(pkt);
+                return finish_video();
+            }
+            buffering = pkt->pts >= start;
+        }
+        if (!buffering) {
+            // part of the GOP the range starts in
+            int rc = decode(pkt);
+            av_packet_unref(pkt);
+            return rc;
+        }
+        AVPacket *buffered = packet_pool().acquire();
+        if (!buffered) {
+            av_packet_unref(pkt);
+            return AVERROR(ENOMEM);
+        }
+        av_packet_move_ref(buffered, pkt);
+        gop.push_back(buffered);
+        return 0;
+    }
+
+    int audio_packet(AVPacket *pkt) {
+        int rc = 0;
+        if (pkt->pts != AV_NOPTS_VALUE && pkt->pts >= audio_end) {
+            audio_finished = true;
+        } else if (output->audio_avs && pkt->pts != AV_NOPTS_VALUE && pkt->pts >= audio_start) {
+            pkt->stream_index = output->audio_avs->index;
+            pkt->pos = -1;
+            pkt->pts -= audio_start;
+            if (pkt->dts != AV_NOPTS_VALUE) {
+                pkt->dts -= audio_start;
+            }
+            rc = remux(pkt, output->avfc.get(), decoder->audio_avs->time_base, output->audio_avs->time_base);
+            stats.audio_packets++;
+        }
+        av_packet_unref(pkt);
+        return rc;
+    }
+
+    bool done() const {
+        return video_finished && (!output->audio_avs || audio_finished);
+    }
+
+    // at the end of the input, or once done()
+    int finish() {
+        return video_finished ? 0 : finish_video();
+    }
+
+    TrimStats get_stats() const {
+        return stats;
+    }
+
+private:
+    int finish_video() {
+        video_finished = true;
+        if (flush_gop() < 0 || decode(NULL) < 0) {
+            return -1;
+        }
+        return encode(NULL);
+    }
+
+    // copies the buffered GOP when it lies inside the range, decodes it otherwise
+    int flush_gop() {
+        if (gop.empty()) {
+            return 0;
+        }
+        bool inside = true;
+        bool leading = false;
+        for (AVPacket *p : gop) {
+            if (p->pts == AV_NOPTS_VALUE || p->pts < start || p->pts >= end) {
+                inside = false;
+            }
+            // leading pictures of an open GOP reference the previous one
+            if (p->pts != AV_NOPTS_VALUE && p->pts < gop[0]->pts) {
+                leading = true;
+            }
+        }
+
+        int rc = 0;
+        if (inside && (!leading || previous_copied)) {
+            // the re-encoded start of the range goes out first
+            rc = decode(NULL);
+            if (rc >= 0) {
+                rc = encode(NULL);
+            }
+            if (rc >= 0 && piece_written) {
+                rc = restore_parameter_sets(gop[0]);
+                piece_written = false;
+            }
+            for (size_t i = 0; rc >= 0 && i < gop.size(); i++) {
+                rc = write_video(gop[i]);
+                stats.copied_packets++;
+            }
+            stats.copied_gops++;
+            previous_copied = true;
+        } else {
+            for (size_t i = 0; rc >= 0 && i < gop.size(); i++) {
+                rc = decode(gop[i]);
+            }
+            previous_copied = false;
+        }
+        release_gop();
+        return rc < 0 ? -1 : 0;
+    }
+
+    int restore_parameter_sets(AVPacket *keyframe) {
+        std::vector<uint8_t> sets;
+        int rc = source_parameter_sets(decoder->video_avs->codecpar, length_size, &sets);
+        if (rc >= 0) {
+            rc = prepend_to_packet(keyframe, sets);
+        }
+        if (rc < 0) {
+            logging("[ERROR] failed to repeat the source's parameter sets after a re-encoded piece: %s",
+                    av_err2string(rc).c_str());
+        }
+        return rc;
+    }
+
+    void release_gop() {
+        for (AVPacket *&p : gop) {
+            release_packet(&p);
+        }
+        gop.clear();
+    }
+
+    // NULL drains the decoder and makes it ready for the next keyframe
+    int decode(AVPacket *pkt) {
+        if (!pkt && !decoding) {
+            return 0;
+        }
+        AVCodecContext *avcc = decoder->video_avcc.get();
+        int rc = avcodec_send_packet(avcc, pkt);
+        if (rc < 0) {
+            logging("[ERROR] Error while sending packet to decoder: %s", av_err2string(rc).c_str());
+            return rc;
+        }
+        decoding = pkt != NULL;
+
+        PooledFrame frame(frame_pool().acquire());
+        if (!frame) {
+            return AVERROR(ENOMEM);
+        }
+        while (true) {
+            rc = avcodec_receive_frame(avcc, frame.get());
+            if (rc == AVERROR(EAGAIN)) {
+                return 0;
+            } else if (rc == AVERROR_EOF) {
+                avcodec_flush_buffers(avcc);
+                return 0;
+            } else if (rc < 0) {
+                logging("[ERROR] Error while receiving frame from decoder: %s", av_err2string(rc).c_str());
+                return rc;
+            }
+            rc = encode(frame.get());
+            av_frame_unref(frame.get());
+            if (rc < 0) {
+                return rc;
+            }
+        }
+    }
+
+    // frames outside the range are dropped, NULL flushes and closes the encoder
+    int encode(AVFrame *frame) {
+        if (frame) {
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts == AV_NOPTS_VALUE || pts < start || pts >= end) {
+                return 0;
+            }
+            if (!encoder && open_encoder() < 0) {
+                return -1;
+            }
+            frame->pts = pts;
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            if (stats.copied_gops) {
+                stats.tail_frames++;
+            } else {
+                stats.head_frames++;
+            }
+        } else if (!encoder) {
+            return 0;
+        }
+
+        int rc = avcodec_send_frame(encoder.get(), frame);
+        if (rc < 0) {
+            logging("[ERROR] failed to send frame to encoder: %s", av_err2string(rc).c_str());
+            return -1;
+        }
+        PooledPacket pkt(packet_pool().acquire());
+        if (!pkt) {
+            return AVERROR(ENOMEM);
+        }
+        while (true) {
+            rc = avcodec_receive_packet(encoder.get(), pkt.get());
+            if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
+                break;
+            } else if (rc < 0) {
+                logging("[ERROR] Error while receiving packet from encoder: %s", av_err2string(rc).c_str());
+                return -1;
+            }
+            if (length_size > 0 && annexb_to_length_prefixed(pkt.get(), length_size) < 0) {
+                logging("[ERROR] failed to convert the re-encoded video to the source's NAL units");
+                return -1;
+            }
+            // no reordering in the piece, its dts move back to the copied GOPs' decode delay
+            if (pkt->dts != AV_NOPTS_VALUE) {
+                pkt->dts -= piece_dts_delay;
+            }
+            if (write_video(pkt.get()) < 0) {
+                return -1;
+            }
+            piece_written = true;
+        }
+        if (!frame) {
+            encoder.reset();
+            encoder_threads.release();
+        }
+        return 0;
+    }
+
+    int open_encoder() {
+        AVCodecParameters *par = decoder->video_avs->codecpar;
+        AVCodecContext *source = decoder->video_avcc.get();
+        AVCodec *codec = avcodec_find_encoder(par->codec_id);
+        if (!codec) {
+            logging("[ERROR] no encoder for %s, the cut points can not be re-encoded", avcodec_get_name(par->codec_id));
+            return -1;
+        }
+        bool supported = !codec->pix_fmts;
+        for (const enum AVPixelFormat *f = codec->pix_fmts; f && *f != AV_PIX_FMT_NONE; f++) {
+            supported = supported || *f == source->pix_fmt;
+        }
+        if (!supported) {
+            logging("[ERROR] %s can not encode %s", codec->name, av_get_pix_fmt_name(source->pix_fmt));
+            return -1;
+        }
+
+        encoder.reset(avcodec_alloc_context3(codec));
+        if (!encoder) {
+            return AVERROR(ENOMEM);
+        }
+        AVCodecContext *avcc = encoder.get();
+        avcc->width = source->width;
+        avcc->height = source->height;
+        avcc->pix_fmt = source->pix_fmt;
+        avcc->sample_aspect_ratio = source->sample_aspect_ratio;
+        avcc->time_base = video_tb;
+        avcc->framerate = av_guess_frame_rate(decoder->avfc.get(), decoder->video_avs, NULL);
+        avcc->profile = par->profile;
+        avcc->level = par->level;
+        avcc->color_range = par->color_range;
+        avcc->color_primaries = par->color_primaries;
+        avcc->color_trc = par->color_trc;
+        avcc->colorspace = par->color_space;
+        avcc->chroma_sample_location = par->chroma_location;
+        avcc->bit_rate = par->bit_rate > 0 ? par->bit_rate : decoder->avfc->bit_rate;
+        avcc->max_b_frames = 0;
+        avcc->gop_size = TRIM_ENCODER_GOP_SIZE;
+        assign_codec_threads(avcc, codec, THREAD_ROLE_ENCODER, THREAD_WEIGHT_ENCODER, &encoder_threads);
+
+        int rc = avcodec_open2(avcc, codec, NULL);
+        if (rc < 0) {
+            logging("[ERROR] could not open %s for the cut points: %s", codec->name, av_err2string(rc).c_str());
+            return -1;
+        }
+        // the delay of the GOP the piece joins, the one just copied or, for the head, the one it starts in
+        piece_dts_delay = dts_delay;
+        debug("re-encoding with %s at %lld bit/s, dts %lld before pts", codec->name, (long long) avcc->bit_rate,
+              (long long) piece_dts_delay);
+        return 0;
+    }
+
+    // packets are in the source time base, both the copied and the re-encoded ones
+    int write_video(AVPacket *pkt) {
+        pkt->stream_index = output->video_avs->index;
+        pkt->pos = -1;
+        if (pkt->pts != AV_NOPTS_VALUE) {
+            pkt->pts -= start;
+        }
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            pkt->dts -= start;
+            if (last_dts != AV_NOPTS_VALUE && pkt->dts <= last_dts) {
+                logging("[ERROR] video dts %lld does not increase after %lld where a re-encoded piece joins the copied GOPs",
+                        (long long) pkt->dts, (long long) last_dts);
+                return -1;
+            }
+            last_dts = pkt->dts;
+        }
+        return remux(pkt, output->avfc.get(), video_tb, output->video_avs->time_base);
+    }
+
+    StreamingContext *decoder;
+    StreamingContext *output;
+    AVRational video_tb;
+    // range in the video stream time base
+    int64_t start;
+    int64_t end;
+    int64_t audio_start = 0;
+    int64_t audio_end = 0;
+
+    std::vector<AVPacket*> gop;
+    bool buffering = false;
+    bool previous_copied = false;
+    bool decoding = false;
+    // encoder packets went out since the last copied GOP, their parameter sets are the active ones
+    bool piece_written = false;
+    bool video_finished = false;
+    bool audio_finished = false;
+    ThreadLease encoder_threads;
+    CodecContextPtr encoder;
+    // NAL length size of the source, 0 when packets are written as the encoder produces them
+    int length_size = 0;
+    // pts minus dts of the latest source keyframe, and of the piece being encoded
+    int64_t dts_delay = 0;
+    int64_t piece_dts_delay = 0;
+    int64_t last_dts = AV_NOPTS_VALUE;
+    TrimStats stats = {};
+};
+
+// seconds from the start of the input
+int trim_file(const char *input, const char *output, double start_seconds, double end_seconds, TrimStats *stats) {
+    if (start_seconds < 0 || end_seconds <= start_seconds) {
+        logging("[ERROR] invalid trim range %.3f:%.3f", start_seconds, end_seconds);
+        return -1;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+
+    StreamingContext decoder;
+    decoder.filename = (char*) input;
+    if (open_media(input, decoder.avfc) || prepare_decoder(&decoder)) {
+        return -1;
+    }
+    if (!decoder.video_avs) {
+        logging("[ERROR] %s has no video stream to trim", input);
+        return -1;
+    }
+    if (nal_length_size(decoder.video_avs->codecpar) < 0) {
+        logging("[ERROR] can not read the %s parameter sets of %s, its cut points could not be re-encoded in the same format",
+                avcodec_get_name(decoder.video_avs->codecpar->codec_id), input);
+        return -1;
+    }
+
+    StreamingContext encoder;
+    encoder.filename = (char*) output;
+    if (alloc_output(&encoder)) {
+        return -1;
+    }
+    prepare_copy(encoder.avfc.get(), &encoder.video_avs, decoder.video_avs->codecpar);
+    encoder.video_avs->time_base = decoder.video_avs->time_base;
+    if (decoder.audio_avs) {
+        prepare_copy(encoder.avfc.get(), &encoder.audio_avs, decoder.audio_avs->codecpar);
+        encoder.audio_avs->time_base = decoder.audio_avs->time_base;
+    }
+    StreamingParams sp = {};
+    if (open_output(&encoder, sp)) {
+        return -1;
+    }
+
+    int64_t offset_us = decoder.avfc->start_time != AV_NOPTS_VALUE ? decoder.avfc->start_time : 0;
+    AVRational tb = decoder.video_avs->time_base;
+    int64_t start = av_rescale_q(offset_us + llrint(start_seconds * AV_TIME_BASE), AV_TIME_BASE_Q, tb);
+    int64_t end = av_rescale_q(offset_us + llrint(end_seconds * AV_TIME_BASE), AV_TIME_BASE_Q, tb);
+
+    std::unique_ptr<PacketIndex> index = load_packet_index(input);
+    int rc = index ? index_seek(decoder.avfc.get(), index.get(), decoder.video_index, start)
+                   : av_seek_frame(decoder.avfc.get(), decoder.video_index, start, AVSEEK_FLAG_BACKWARD);
+    if (rc < 0) {
+        logging("[ERROR] failed to seek to %.3fs: %s", start_seconds, av_err2string(rc).c_str());
+        return -1;
+    }
+
+    Trimmer trimmer(&decoder, &encoder, start, end);
+    PooledPacket packet(packet_pool().acquire());
+    if (!packet) {
+        return -1;
+    }
+    rc = 0;
+    while (rc >= 0 && !trimmer.done() && av_read_frame(decoder.avfc.get(), packet.get()) >= 0) {
+        if (packet->stream_index == decoder.video_index) {
+            rc = trimmer.video_packet(packet.get());
+        } else if (decoder.audio_avs && packet->stream_index == decoder.audio_index) {
+            rc = trimmer.audio_packet(packet.get());
+        } else {
+            av_packet_unref(packet.get());
+        }
+    }
+    if (rc < 0 || trimmer.finish() < 0) {
+        logging("[ERROR] failed to trim %s", input);
+        return -1;
+    }
+    av_write_trailer(encoder.avfc.get());
+
+    if (stats) {
+        *stats = trimmer.get_stats();
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    }
+    return 0;
+}
+
+void print_trim_stats(const char *name, TrimStats stats) {
+    logging("[INFO] %s: re-encoded %lld frames at the start and %lld at the end, copied %lld GOPs (%lld video packets) "
+            "and %lld audio packets in %.2fs", name, (long long) stats.head_frames, (long long) stats.tail_frames,
+            (long long) stats.copied_gops, (long long) stats.copied_packets, (long long) stats.audio_packets,
+            stats.seconds);
+}
+
+#endif //LEARN_LIBAV_TRIM_H
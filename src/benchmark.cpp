@@ -0,0 +1,388 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+#include "log.h"
+#include "presets.h"
+#include "synthetic.h"
+
+/*
+ * Benchmark driver: generates synthetic sources, runs parse_video,
+ * decode_encode and every transcoding preset on them as child processes
+ * and reports wall time, fps, MB/s, CPU time and peak RSS as JSON, one
+ * result per line so two runs can be compared with --baseline.
+ */
+typedef struct {
+    std::string name;
+    std::string flow;
+    SyntheticSpec source;
+    std::vector<std::string> args;
+    // args[1] is a FIFO fed in real time by a paced synthetic source
+    bool live;
+} BenchCase;
+
+typedef struct {
+    int exit_code;
+    double wall_seconds;
+    double user_seconds;
+    double sys_seconds;
+    long peak_rss_kb;
+    // live cases only, from the tool's latency report
+    double latency_p50_ms;
+    double latency_p99_ms;
+} BenchRun;
+
+// this benchmark binary, empty when /proc is not there
+std::string self_path() {
+    char path[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (n <= 0) {
+        return "";
+    }
+    path[n] = '\0';
+    return path;
+}
+
+std::string tool_dir() {
+    std::string path = self_path();
+    if (path.empty()) {
+        return ".";
+    }
+    return path.substr(0, path.rfind('/'));
+}
+
+/*
+ * Starts args in workdir with its output in log_path. The child execs right
+ * away: after fork only the calling thread exists, so nothing of ours that
+ * relies on threads, like the log ring's drain thread, may run in it.
+ */
+pid_t spawn_tool(std::vector<std::string> &args, const std::string &workdir, const std::string &log_path) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        logging("[ERROR] fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        int fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        if (chdir(workdir.c_str()) != 0) {
+            _exit(126);
+        }
+        std::vector<char*> argv;
+        for (auto &arg : args) {
+            argv.push_back((char*) arg.c_str());
+        }
+        argv.push_back(NULL);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+// runs args in workdir with its output in log_path, resource usage comes from wait4
+BenchRun run_tool(std::vector<std::string> &args, const std::string &workdir, const std::string &log_path) {
+    BenchRun run = {};
+    run.exit_code = -1;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = spawn_tool(args, workdir, log_path);
+    if (pid < 0) {
+        return run;
+    }
+
+    int status = 0;
+    struct rusage usage = {};
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        logging("[ERROR] wait4 failed");
+        return run;
+    }
+    run.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    run.user_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    run.sys_seconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    run.peak_rss_kb = usage.ru_maxrss;
+    return run;
+}
+
+// the paced source is this binary's --live-source mode writing into the FIFO fifo of workdir
+pid_t start_live_source(const std::string &workdir, const std::string &fifo, SyntheticSpec spec, const std::string &log_path) {
+    std::string path = workdir + "/" + fifo;
+    if (mkfifo(path.c_str(), 0644) < 0 && errno != EEXIST) {
+        logging("[ERROR] failed to create FIFO %s", path.c_str());
+        return -1;
+    }
+    std::string self = self_path();
+    if (self.empty()) {
+        logging("[ERROR] failed to find the benchmark binary for the live source");
+        return -1;
+    }
+    char size[64];
+    snprintf(size, sizeof(size), "%dx%d:%d", spec.width, spec.height, spec.seconds);
+    std::vector<std::string> args = {self, "--live-source", size, fifo};
+    return spawn_tool(args, workdir, log_path);
+}
+
+// a source killed while the tool was done with it is fine, one that exited with an error is not
+void stop_live_source(pid_t pid, const std::string &log_path) {
+    int status = 0;
+    kill(pid, SIGTERM);
+    if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        logging("[WARN] live source failed with exit code %d, see %s", WEXITSTATUS(status), log_path.c_str());
+    }
+}
+
+// latency percentiles from the "[INFO] live latency" line of a transcoding log
+void read_live_latency(const std::string &log_path, BenchRun *run) {
+    std::ifstream log(log_path);
+    std::string line;
+    while (std::getline(log, line)) {
+        size_t at = line.find("read to write p50 ");
+        double p90;
+        if (at != std::string::npos) {
+            sscanf(line.c_str() + at, "read to write p50 %lf ms, p90 %lf ms, p99 %lf ms",
+                   &run->latency_p50_ms, &p90, &run->latency_p99_ms);
+        }
+    }
+}
+
+std::vector<BenchCase> plan_cases(std::vector<SyntheticSpec> &sources, const std::string &bin, bool live) {
+    std::vector<BenchCase> cases;
+    for (auto &source : sources) {
+        std::string input = synthetic_name(source);
+        std::string label = input.substr(strlen("synthetic-"), input.size() - strlen("synthetic-") - strlen(".mp4"));
+
+        cases.push_back({"parse_video/" + label, "parse_video", source,
+                         {bin + "/parse_video", input, "--packets", "0", "--no-save"}});
+        cases.push_back({"decode_encode/" + label, "decode_encode", source,
+                         {bin + "/decode_encode", input}});
+        cases.push_back({"decode_encode-multi/" + label, "decode_encode", source,
+                         {bin + "/decode_encode", input, "-o", "ts:output.ts", "-o", "fmp4:output.mp4", "-o", "mkv:output.mkv"}});
+        for (int i = 0; preset_names[i]; i++) {
+            cases.push_back({std::string("transcode-") + preset_names[i] + "/" + label, "transcoding", source,
+                             {bin + "/transcoding", input, "--preset", preset_names[i]}});
+        }
+        if (live) {
+            cases.push_back({"live-h264-ts/" + label, "transcoding", source,
+                             {bin + "/transcoding", "live-" + label + ".fifo", "--live", "--input-format", "mpegts",
+                              "--preset", "h264-ts", "-o", "live.ts"}, true});
+        }
+    }
+    return cases;
+}
+
+std::string result_json(BenchCase &c, BenchRun &run, int64_t input_bytes) {
+    int64_t frames = (int64_t) c.source.seconds * c.source.fps;
+    double wall = run.wall_seconds > 0 ? run.wall_seconds : 1e-9;
+    char line[1024];
+    snprintf(line, sizeof(line),
+             "{\"name\": \"%s\", \"flow\": \"%s\", \"width\": %d, \"height\": %d, \"seconds\": %d, \"frames\": %lld, "
+             "\"input_bytes\": %lld, \"exit_code\": %d, \"wall_seconds\": %.4f, \"user_seconds\": %.4f, "
+             "\"sys_seconds\": %.4f, \"cpu_seconds\": %.4f, \"fps\": %.2f, \"mb_per_second\": %.3f, \"peak_rss_kb\": %ld}",
+             c.name.c_str(), c.flow.c_str(), c.source.width, c.source.height, c.source.seconds, (long long) frames,
+             (long long) input_bytes, run.exit_code, run.wall_seconds, run.user_seconds, run.sys_seconds,
+             run.user_seconds + run.sys_seconds, frames / wall, input_bytes / wall / 1e6, run.peak_rss_kb);
+    if (c.live) {
+        // wall time is the source's duration, the latency is the number that matters
+        snprintf(line + strlen(line) - 1, sizeof(line) - strlen(line) + 1,
+                 ", \"latency_p50_ms\": %.2f, \"latency_p99_ms\": %.2f}", run.latency_p50_ms, run.latency_p99_ms);
+    }
+    return line;
+}
+
+// pulls "key": value out of one result line, enough for the files written above
+std::string json_field(const std::string &line, const std::string &key) {
+    size_t at = line.find("\"" + key + "\": ");
+    if (at == std::string::npos) {
+        return "";
+    }
+    at += key.size() + 4;
+    if (line[at] == '"') {
+        return line.substr(at + 1, line.find('"', at + 1) - at - 1);
+    }
+    return line.substr(at, line.find_first_of(",}", at) - at);
+}
+
+// compares fps against an earlier result file, returns the number of regressions
+int compare_baseline(const char *path, std::vector<std::string> &results, double tolerance) {
+    std::ifstream baseline(path);
+    if (!baseline) {
+        logging("[ERROR] failed to open baseline %s", path);
+        return -1;
+    }
+    std::map<std::string, double> before;
+    std::string line;
+    while (std::getline(baseline, line)) {
+        std::string name = json_field(line, "name");
+        if (!name.empty() && json_field(line, "exit_code") == "0") {
+            before[name] = atof(json_field(line, "fps").c_str());
+        }
+    }
+
+    int regressions = 0;
+    for (auto &result : results) {
+        std::string name = json_field(result, "name");
+        auto it = before.find(name);
+        if (it == before.end() || it->second <= 0 || json_field(result, "exit_code") != "0") {
+            continue;
+        }
+        double fps = atof(json_field(result, "fps").c_str());
+        double change = fps / it->second - 1;
+        bool regressed = change < -tolerance;
+        regressions += regressed;
+        logging("%s %-40s %9.2f -> %9.2f fps (%+.1f%%)", regressed ? "[WARN]" : "[INFO]",
+                name.c_str(), it->second, fps, change * 100);
+    }
+    return regressions;
+}
+
+int parse_source(const char *arg, SyntheticSpec *spec) {
+    spec->fps = 25;
+    if (sscanf(arg, "%dx%d:%d", &spec->width, &spec->height, &spec->seconds) != 3 ||
+            spec->width < 16 || spec->height < 16 || spec->seconds <= 0) {
+        logging("[ERROR] invalid source %s, expected <width>x<height>:<seconds>", arg);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    std::string bin = tool_dir();
+    std::string workdir = ".";
+    const char *output = "bench.json";
+    const char *baseline = NULL;
+    const char *filter = NULL;
+    double tolerance = 0.10;
+    int runs = 3;
+    bool live = false;
+    std::vector<SyntheticSpec> sources;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            bin = argv[++i];
+        } else if (strcmp(argv[i], "--work-dir") == 0 && i + 1 < argc) {
+            workdir = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--source") == 0 && i + 1 < argc) {
+            SyntheticSpec spec;
+            if (parse_source(argv[++i], &spec)) {
+                return -1;
+            }
+            sources.push_back(spec);
+        } else if (strcmp(argv[i], "--live") == 0) {
+            live = true;
+        } else if (strcmp(argv[i], "--live-source") == 0 && i + 2 < argc) {
+            // only be the stand-in source, e.g. for transcoding --live on a FIFO or tcp://...?listen
+            SyntheticSpec spec;
+            if (parse_source(argv[i + 1], &spec)) {
+                return -1;
+            }
+            return stream_synthetic(argv[i + 2], spec) ? -1 : 0;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]) / 100;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            logging("[ERROR] unknown option: %s", argv[i]);
+            return -1;
+        }
+    }
+    if (sources.empty()) {
+        sources = {{640, 360, 10, 25}, {1280, 720, 5, 25}, {1280, 720, 20, 25}, {1920, 1080, 5, 25}};
+    }
+
+    mkdir(workdir.c_str(), 0755);
+    for (auto &source : sources) {
+        std::string path = workdir + "/" + synthetic_name(source);
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && st.st_size > 0) {
+            continue;
+        }
+        logging("[INFO] generating %s", path.c_str());
+        if (generate_synthetic(path.c_str(), source)) {
+            remove(path.c_str());
+            return -1;
+        }
+    }
+
+    std::vector<BenchCase> cases = plan_cases(sources, bin, live);
+    std::vector<std::string> results;
+    int failed = 0;
+    for (auto &c : cases) {
+        if (filter && c.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        struct stat st = {};
+        stat((workdir + "/" + c.args[1]).c_str(), &st);
+
+        // the median run by wall time is reported, the first run also warms the page cache
+        std::vector<BenchRun> measured;
+        for (int r = 0; r < runs; r++) {
+            std::string log_path = workdir + "/" + c.flow + ".log";
+            std::string source_log_path = workdir + "/live-source.log";
+            pid_t source = c.live ? start_live_source(workdir, c.args[1], c.source, source_log_path) : 0;
+            measured.push_back(run_tool(c.args, workdir, log_path));
+            if (source > 0) {
+                // a source still blocked on opening the FIFO means the tool never read it
+                stop_live_source(source, source_log_path);
+                read_live_latency(log_path, &measured.back());
+            }
+        }
+        std::sort(measured.begin(), measured.end(), [](const BenchRun &a, const BenchRun &b) {
+            return a.wall_seconds < b.wall_seconds;
+        });
+        BenchRun &median = measured[measured.size() / 2];
+        if (median.exit_code != 0) {
+            failed++;
+        }
+        results.push_back(result_json(c, median, st.st_size));
+        logging("[INFO] %-40s %s, %.2fs wall, %.2fs cpu, %ld KiB peak rss", c.name.c_str(),
+                median.exit_code ? "FAILED" : "ok", median.wall_seconds,
+                median.user_seconds + median.sys_seconds, median.peak_rss_kb);
+    }
+
+    FILE *f = fopen(output, "w");
+    if (!f) {
+        logging("[ERROR] failed to open %s", output);
+        return -1;
+    }
+    fprintf(f, "{\"runs\": %d, \"cpus\": %ld, \"results\": [\n", runs, sysconf(_SC_NPROCESSORS_ONLN));
+    for (size_t i = 0; i < results.size(); i++) {
+        fprintf(f, "%s%s\n", results[i].c_str(), i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+    logging("[INFO] wrote %d results to %s, %d failed", (int) results.size(), output, failed);
+
+    if (baseline) {
+        int regressions = compare_baseline(baseline, results, tolerance);
+        if (regressions != 0) {
+            logging("[ERROR] %d benchmarks regressed by more than %.0f%%", regressions, tolerance * 100);
+            return -1;
+        }
+    }
+    return failed ? -1 : 0;
+}
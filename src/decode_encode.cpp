@@ -1,4 +1,5 @@
 #include <string>
+#include <vector>
 
 extern "C" {
     #include <libavformat/avformat.h>
@@ -6,27 +7,58 @@ extern "C" {
 }
 
 #include "helpers.h"
+#include "input.h"
 #include "log.h"
+#include "multi_output.h"
+#include "output.h"
+#include "probe_cache.h"
+#include "segmenter.h"
 
-int main() {
-    int rc, nb_streams, stream_index, loop_times;
-    int *streams_list = NULL;
-    AVDictionary *opts = NULL;
+int main(int argc, char *argv[]) {
+    int rc, loop_times;
     AVPacket packet;
     AVFormatContext *input_format_context = NULL;
-    AVFormatContext *output_format_context = NULL;
+    std::vector<RemuxOutput> outputs;
 
     std::string input_filename("./demo.mp4");
-    std::string output_filename("./output.ts");
+    std::vector<std::string> output_specs;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            input_options().use_mmap = true;
+        } else if (strcmp(argv[i], "--fast-probe") == 0) {
+            input_options().fast_probe = true;
+        } else if (strcmp(argv[i], "--probe-cache") == 0 && i + 1 < argc) {
+            input_options().probe_cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--async-io") == 0) {
+            output_options().use_async_io = true;
+        } else if (strcmp(argv[i], "--segment-duration") == 0 && i + 1 < argc) {
+            segment_options().segment_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ll-parts") == 0 && i + 1 < argc) {
+            segment_options().part_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--cmaf") == 0) {
+            segment_options().both_playlists = true;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_specs.push_back(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            input_filename = argv[i];
+        } else {
+            logging("[ERROR] unknown option: %s", argv[i]);
+            return -1;
+        }
+    }
+    if (output_specs.empty()) {
+        output_specs.push_back("./output.ts");
+    }
 
-    rc = avformat_open_input(&input_format_context, input_filename.c_str(), NULL, NULL);
+    rc = open_input(input_filename.c_str(), &input_format_context, NULL);
     if (rc < 0) {
         logging("[ERROR] failed to open file %s", input_filename.c_str());
         goto end;
     }
     debug("opened input file %s. input_format_context: %d", input_filename.c_str(), &input_format_context);
 
-    rc = avformat_find_stream_info(input_format_context, NULL);
+    rc = probe_stream_info(input_format_context, input_filename.c_str());
     if (rc < 0) {
         logging("[ERROR] failed to find stream info");
         goto end;
@@ -35,120 +67,64 @@ int main() {
           input_format_context->iformat->long_name,
           input_format_context->duration,
           input_format_context->bit_rate);
+    debug("number of input streams: %d", input_format_context->nb_streams);
 
-    avformat_alloc_output_context2(&output_format_context, NULL, NULL, output_filename.c_str());
-    if (!output_format_context) {
-        logging("[ERROR] Could not create output context\n");
-        rc = AVERROR_UNKNOWN;
-        goto end;
-    }
-    debug("allocated output context: %d", &output_format_context);
-
-    nb_streams = input_format_context->nb_streams;
-    streams_list = static_cast<int *>(av_mallocz_array(nb_streams, sizeof(*streams_list)));
-
-    if(!streams_list) {
-        rc = AVERROR(ENOMEM);
-        goto end;
-    }
-    debug("number of input streams: %d", nb_streams);
-
-    stream_index = 0;
-    for (int i=0; i<nb_streams; i++) {
-        AVStream *out_stream;
-        AVStream *in_stream = input_format_context->streams[i];
-
-        AVCodecParameters *in_codec_params = in_stream->codecpar;
-
-        debug("[%d] codec type %d", i, in_codec_params->codec_type);
-
-        if (in_codec_params->codec_type != AVMEDIA_TYPE_AUDIO &&
-                in_codec_params->codec_type != AVMEDIA_TYPE_VIDEO &&
-                in_codec_params->codec_type != AVMEDIA_TYPE_SUBTITLE) {
-            streams_list[i] = -1;
-            continue;
-        }
-
-        streams_list[i] = stream_index++;
-        out_stream = avformat_new_stream(output_format_context, NULL);
-        if (!out_stream) {
-            logging("[ERROR] failed to allocating output stream");
-            rc = AVERROR_UNKNOWN;
-            goto end;
-        }
-        debug("[%d] allocated output stream", i);
-
-        rc = avcodec_parameters_copy(out_stream->codecpar, in_codec_params);
+    // every output is set up before the first packet is read
+    outputs.resize(output_specs.size());
+    for (size_t i = 0; i < output_specs.size(); i++) {
+        rc = parse_output_spec(output_specs[i].c_str(), &outputs[i]);
         if (rc < 0) {
-            logging("[ERROR] failed to copy parameter from input stream");
             goto end;
         }
-        debug("[%d] copied codec params", i);
-    }
-
-    av_dump_format(output_format_context, 0, output_filename.c_str(), 1);
-
-    if(!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        rc = avio_open(&output_format_context->pb, output_filename.c_str(), AVIO_FLAG_WRITE);
+        rc = open_remux_output(&outputs[i], input_format_context);
         if (rc < 0) {
-            logging("Could not open output file '%s'", output_filename.c_str());
             goto end;
         }
+        av_dump_format(outputs[i].avfc.get(), i, outputs[i].filename.c_str(), 1);
     }
 
-    debug("open io file: %s", output_filename.c_str());
-
-    rc = avformat_write_header(output_format_context, &opts);
-    if (rc < 0) {
-        logging("[ERROR] Error occurred when writing header");
-        goto end;
-    }
-    debug("wrote headers: %s", output_filename.c_str());
-
     loop_times = 1;
     while (loop_times++) {
-        AVStream *in_stream, *out_stream;
         rc = av_read_frame(input_format_context, &packet);
         if (rc < 0) break;
-        in_stream = input_format_context->streams[packet.stream_index];
 
-        if (packet.stream_index >= nb_streams || streams_list[packet.stream_index] < 0) {
+        if (packet.stream_index >= (int) input_format_context->nb_streams) {
             av_packet_unref(&packet);
             continue;
         }
 
-        packet.stream_index = streams_list[packet.stream_index];
-        out_stream = output_format_context->streams[packet.stream_index];
-
-        packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base,
-                                      static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-        packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base,
-                                      static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-        packet.duration = av_rescale_q(packet.duration,  in_stream->time_base, out_stream->time_base);
-        packet.pos = -1;
-
-        debug("[%d] wrote packet, pts: %d; dts: %d; duration: %d", loop_times, packet.pts, packet.dts, packet.duration);
-        rc = av_interleaved_write_frame(output_format_context, &packet);
+        // each output takes its own reference to the packet data, nothing is copied
+        debug_pkt(packet.stream_index, packet.pts, "[%d] read packet, dts: %lld; duration: %lld", loop_times, packet.dts, packet.duration);
+        for (auto &output : outputs) {
+            rc = remux_to_output(&output, input_format_context, packet.stream_index, &packet);
+            if (rc < 0) {
+                break;
+            }
+        }
+        av_packet_unref(&packet);
         if (rc < 0) {
-            logging("[ERROR] Error muxing packet");
             break;
         }
-
-        av_packet_unref(&packet);
     }
 
-    av_write_trailer(output_format_context);
-    debug("wrote trailer: %s", output_filename.c_str());
+    if (rc == AVERROR_EOF) {
+        for (auto &output : outputs) {
+            rc = finish_remux_output(&output, input_format_context);
+            if (rc < 0) {
+                break;
+            }
+            logging("[INFO] %s: %lld packets, %.1f MB", output.filename.c_str(),
+                    (long long) output.packets, output.bytes / 1e6);
+        }
+    }
 
 end:
-    avformat_close_input(&input_format_context);
-
-    if (output_format_context && ! (output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&output_format_context->pb);
+    outputs.clear();
+    close_format_context(&input_format_context);
+    print_probe_stats(probe_stats());
+    if (output_options().use_async_io) {
+        print_async_write_stats(async_write_totals());
     }
-
-    avformat_free_context(output_format_context);
-    av_freep(&streams_list);
     if (rc < 0 && rc != AVERROR_EOF) {
         logging("[ERROR] Error occurred: %s", av_err2string(rc).c_str());
         return -1;
@@ -0,0 +1,60 @@
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "input.h"
+#include "log.h"
+#include "packet_index.h"
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> filenames;
+    bool show = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            input_options().use_mmap = true;
+        } else if (strcmp(argv[i], "--show") == 0) {
+            show = true;
+        } else if (argv[i][0] != '-') {
+            filenames.push_back(argv[i]);
+        } else {
+            logging("[ERROR] unknown option: %s", argv[i]);
+            return -1;
+        }
+    }
+    if (filenames.empty()) {
+        filenames.push_back("demo.mp4");
+    }
+
+    int failed = 0;
+    for (auto &filename : filenames) {
+        if (show) {
+            std::unique_ptr<PacketIndex> index = load_packet_index(filename.c_str());
+            if (!index) {
+                logging("[ERROR] %s has no up to date index", filename.c_str());
+                failed++;
+                continue;
+            }
+            for (int i = 0; i < index->nb_streams(); i++) {
+                const PacketIndexStream *s = index->stream(i);
+                logging("[INFO] %s stream %d: %s, time base %d/%d, %lld packets, %lld keyframes",
+                        filename.c_str(), i, av_get_media_type_string((enum AVMediaType) s->codec_type),
+                        s->time_base_num, s->time_base_den, (long long) s->nb_entries, (long long) s->nb_keyframes);
+            }
+            continue;
+        }
+
+        PacketIndexStats stats = {};
+        if (build_packet_index(filename.c_str(), &stats)) {
+            failed++;
+            continue;
+        }
+        logging("[INFO] indexed %s: %lld packets, %lld keyframes, %.1f MB in %.2fs (%.0f MB/s)",
+                filename.c_str(), (long long) stats.packets, (long long) stats.keyframes, stats.bytes / 1e6,
+                stats.seconds, stats.seconds > 0 ? stats.bytes / 1e6 / stats.seconds : 0.0);
+    }
+    return failed ? -1 : 0;
+}
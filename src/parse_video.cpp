@@ -1,16 +1,102 @@
 #include <string>
+#include <vector>
 
 extern "C" {
     #include <libavformat/avformat.h>
     #include <libavcodec/avcodec.h>
 }
 
+#include "frame_sink.h"
 #include "helpers.h"
+#include "input.h"
 #include "log.h"
+#include "mmap_io.h"
+#include "probe_cache.h"
+#include "thumbnails.h"
 
-int main() {
+int main(int argc, char *argv[]) {
     int rc;
-    std::string filename("demo.mp4");
+    std::vector<std::string> filenames;
+    int io_bench_rounds = 0;
+    int probe_bench_rounds = 0;
+    int how_many_packets_to_process = 8;
+    bool save_frames = true;
+    bool thumbnails = false;
+    bool compare_full = false;
+    int jobs = 0;
+    ThumbnailOptions thumbnail_options = {THUMBNAIL_KEYFRAMES, 10, true};
+    FrameSinkOptions sink_options = {};
+    sink_options.dump = FRAME_DUMP_Y4M;
+    sink_options.image_every = 1;
+    sink_options.image_prefix = "frame";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            input_options().use_mmap = true;
+        } else if (strcmp(argv[i], "--fast-probe") == 0) {
+            input_options().fast_probe = true;
+        } else if (strcmp(argv[i], "--probe-cache") == 0 && i + 1 < argc) {
+            input_options().probe_cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--probe-bench") == 0) {
+            probe_bench_rounds = 5;
+        } else if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc) {
+            how_many_packets_to_process = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-save") == 0) {
+            save_frames = false;
+        } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+            if (parse_frame_dump_format(argv[++i], &sink_options.dump)) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--dump-file") == 0 && i + 1 < argc) {
+            sink_options.filename = argv[++i];
+        } else if (strcmp(argv[i], "--images") == 0 && i + 1 < argc) {
+            if (parse_image_format(argv[++i], &sink_options.images)) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--image-every") == 0 && i + 1 < argc) {
+            sink_options.image_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--image-jobs") == 0 && i + 1 < argc) {
+            sink_options.image_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io-bench") == 0) {
+            io_bench_rounds = 3;
+        } else if (strcmp(argv[i], "--thumbnails") == 0 && i + 1 < argc) {
+            if (parse_thumbnail_mode(argv[++i], &thumbnail_options.mode)) {
+                return -1;
+            }
+            thumbnails = true;
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            thumbnail_options.interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compare-full") == 0) {
+            compare_full = true;
+        } else if (argv[i][0] != '-') {
+            filenames.push_back(argv[i]);
+        } else {
+            logging("[ERROR] unknown option: %s", argv[i]);
+            return -1;
+        }
+    }
+
+    if (filenames.empty()) {
+        filenames.push_back("demo.mp4");
+    }
+    if (thumbnails) {
+        if (thumbnail_options.interval <= 0) {
+            logging("[ERROR] --interval must be positive");
+            return -1;
+        }
+        thumbnail_options.save = save_frames;
+        return run_thumbnails(filenames, thumbnail_options, jobs, compare_full);
+    }
+    std::string filename = filenames[0];
+
+    if (io_bench_rounds) {
+        return benchmark_input_io(filename.c_str(), io_bench_rounds);
+    }
+    if (probe_bench_rounds) {
+        return benchmark_probe(filename.c_str(), probe_bench_rounds);
+    }
 
     logging("init containers");
     AVFormatContext *pFormatContext = avformat_alloc_context();
@@ -20,13 +106,13 @@ int main() {
         return -1;
     }
 
-    rc = avformat_open_input(&pFormatContext, filename.c_str(), NULL, NULL);
+    rc = open_input(filename.c_str(), &pFormatContext, NULL);
     if (rc != 0) {
         logging("[ERROR] can not open input file: %s, return code: %d", filename.c_str(), rc);
         return -1;
     }
 
-    rc = avformat_find_stream_info(pFormatContext, NULL);
+    rc = probe_stream_info(pFormatContext, filename.c_str());
     if (rc != 0) {
         logging("[ERROR] can not find stream info, return code: %d", rc);
         return -1;
@@ -86,6 +172,17 @@ int main() {
         return -1;
     }
 
+    FrameSink sink;
+    if (save_frames) {
+        if (sink_options.filename.empty()) {
+            sink_options.filename = sink_options.dump == FRAME_DUMP_RAW ? "frames.raw" : "frames.y4m";
+        }
+        sink_options.frame_rate = av_guess_frame_rate(pFormatContext, pFormatContext->streams[video_stream_index], NULL);
+        if (sink.open(sink_options) < 0) {
+            return -1;
+        }
+    }
+
     AVFrame *pFrame = av_frame_alloc();
     if (!pFrame) {
         logging("[ERROR] failed to allocate memory for AVFrame");
@@ -98,20 +195,26 @@ int main() {
         return -1;
     }
 
-    int how_many_packets_to_process = 8;
-
     while (av_read_frame(pFormatContext, pPacket) >= 0) {
         if (pPacket->stream_index == video_stream_index) {
-            logging("AVPacket->pts %" PRId64, pPacket->pts);
-            rc = Decode(pCodecContext, pPacket, pFrame);
+            debug_pkt(pPacket->stream_index, pPacket->pts, "AVPacket read");
+            rc = Decode(pCodecContext, pPacket, pFrame, save_frames ? &sink : NULL);
             if (rc < 0) {
                 logging("[ERROR] failed to decode");
                 break;
             }
-            if (--how_many_packets_to_process <= 0) break;
+            // 0 decodes the whole file
+            if (--how_many_packets_to_process == 0) break;
         }
         av_packet_unref(pPacket);
 
     }
+    sink.close();
+
+    av_packet_free(&pPacket);
+    av_frame_free(&pFrame);
+    avcodec_free_context(&pCodecContext);
+    close_format_context(&pFormatContext);
+    print_probe_stats(probe_stats());
     return 0;
 }